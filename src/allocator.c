@@ -17,36 +17,81 @@
 
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <setjmp.h>
 
 #include "hammer.h"
 #include "internal.h"
 
+/* Arena layout
+ *
+ * Ordinary blocks are power-of-two sized, starting from the block size
+ * given to h_new_arena and doubling up to ARENA_MAX_BLOCK. Allocations are
+ * carved from the newest block by bumping a pointer; the arena itself lives
+ * at the start of its first block. Requests for more than half the initial
+ * block size get a dedicated block of their own, on a doubly linked list,
+ * so that they can be given back individually.
+ *
+ * Small allocations freed with h_arena_free_sized go on per-size free lists
+ * and are handed out again by h_arena_malloc. Memory is never zeroed,
+ * except by h_arena_malloc0.
+ *
+ * A mark remembers the head block, the bump pointer and how many dedicated
+ * blocks there have been; rewinding frees the dedicated blocks made since,
+ * and puts the ordinary ones on the spare list. The free lists survive a
+ * rewind only if nothing was put on them in between, as they could now
+ * point into the memory given back.
+ *
+ * Blocks from arenas on the system allocator are not freed when the arena
+ * is deleted, but kept in a global cache for the next arena.
+ */
+
+#define ARENA_ALIGN 8
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_NCLASSES 8            // free lists for 8, 16, ..., 64 bytes
+#define ARENA_MIN_SHIFT 10
+#define ARENA_MAX_SHIFT 20
+#define ARENA_MAX_BLOCK ((size_t)1 << ARENA_MAX_SHIFT)
+#define ARENA_CACHE_MAX ((size_t)8 << 20)   // bytes kept in the block cache
 
 struct arena_link {
-  // TODO:
-  // For efficiency, we should probably allocate the arena links in 
-  // their own slice, and link to a block directly. That can be
-  // implemented later, though, with no change in interface.
-  struct arena_link *next; // It is crucial that this be the first item; so that 
-                           // any arena link can be casted to struct arena_link**.
-
-  size_t free;
-  size_t used;
+  struct arena_link *next; // older blocks
+  size_t size;             // of the whole block, including this header
   uint8_t rest[];
-} ;
+};
+
+struct arena_large {
+  struct arena_large *next;
+  struct arena_large *prev;
+  size_t size;             // of the whole block, including this header
+  size_t seq;              // the arena's nlarge when it was made
+};
 
 struct HArena_ {
-  struct arena_link *head;
+  uint8_t *cur;             // free space in the head block
+  uint8_t *end;
+  struct arena_link *head;  // newest block first; the last one holds the arena
+  struct arena_link *spare; // blocks kept by h_arena_reset, ready for reuse
+  struct arena_large *large; // dedicated blocks for oversized allocations
+  void *free_list[ARENA_NCLASSES];
   struct HAllocator_ *mm__;
-  size_t block_size;
+  size_t next_size;         // of the next ordinary block
+  size_t large_size;        // allocations above this get their own block
+  size_t nlarge;            // dedicated blocks made so far
+  size_t nfreed;            // chunks put on the free lists so far
   size_t used;
-  size_t wasted;
+  size_t held;              // bytes obtained from mm__
 
   jmp_buf *except;
 };
 
+static struct {
+  struct HMutex lock;
+  struct arena_link *bins[ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1];
+  size_t bytes;
+} block_cache = { H_MUTEX_INIT, {NULL}, 0 };
+
 void* h_alloc(HAllocator* mm__, size_t size) {
   void *p = mm__->alloc(mm__, size);
   if(!p)
@@ -54,22 +99,107 @@ void* h_alloc(HAllocator* mm__, size_t size) {
   return p;
 }
 
+// the cache bin for blocks of the given size, or -1 if they aren't cached
+static int cache_bin(HAllocator *mm__, size_t size) {
+  if (mm__ != &system_allocator)
+    return -1;
+  for (int i = 0; i <= ARENA_MAX_SHIFT - ARENA_MIN_SHIFT; i++) {
+    if (size == (size_t)1 << (i + ARENA_MIN_SHIFT))
+      return i;
+  }
+  return -1;
+}
+
+static void *alloc_block(HAllocator *mm__, jmp_buf *except, size_t size)
+{
+  void *block = mm__->alloc(mm__, size);
+  if (!block) {
+    if (except)
+      longjmp(*except, 1);
+    h_platform_errx(1, "memory allocation failed (%uB requested)\n", (unsigned int)size);
+  }
+  return block;
+}
+
+static struct arena_link *take_block(HAllocator *mm__, jmp_buf *except, size_t size) {
+  struct arena_link *link = NULL;
+  int bin = cache_bin(mm__, size);
+  if (bin >= 0) {
+    h_platform_mutex_lock(&block_cache.lock);
+    link = block_cache.bins[bin];
+    if (link) {
+      block_cache.bins[bin] = link->next;
+      block_cache.bytes -= size;
+    }
+    h_platform_mutex_unlock(&block_cache.lock);
+  }
+  if (!link)
+    link = alloc_block(mm__, except, size);
+  link->next = NULL;
+  link->size = size;
+  return link;
+}
+
+static void release_block(HAllocator *mm__, struct arena_link *link) {
+  int bin = cache_bin(mm__, link->size);
+  if (bin >= 0) {
+    h_platform_mutex_lock(&block_cache.lock);
+    bool keep = (block_cache.bytes + link->size <= ARENA_CACHE_MAX);
+    if (keep) {
+      link->next = block_cache.bins[bin];
+      block_cache.bins[bin] = link;
+      block_cache.bytes += link->size;
+    }
+    h_platform_mutex_unlock(&block_cache.lock);
+    if (keep)
+      return;
+  }
+  h_free(link);
+}
+
+static void release_blocks(HAllocator *mm__, struct arena_link *link) {
+  while (link) {
+    struct arena_link *next = link->next;
+    release_block(mm__, link);
+    link = next;
+  }
+}
+
+static void free_large(HAllocator *mm__, struct arena_large *large) {
+  while (large) {
+    struct arena_large *next = large->next;
+    h_free(large);
+    large = next;
+  }
+}
+
+// the block the arena itself lives in
+static inline struct arena_link *first_block(HArena *arena) {
+  return (struct arena_link *)((uint8_t *)arena - offsetof(struct arena_link, rest));
+}
+
 HArena *h_new_arena(HAllocator* mm__, size_t block_size) {
   if (block_size == 0)
     block_size = 4096;
-  struct HArena_ *ret = h_new(struct HArena_, 1);
-  struct arena_link *link = (struct arena_link*)h_alloc(mm__, sizeof(struct arena_link) + block_size);
-  assert(ret != NULL);
-  assert(link != NULL);
-  memset(link, 0, sizeof(struct arena_link) + block_size);
-  link->free = block_size;
-  link->used = 0;
-  link->next = NULL;
+  size_t size = (size_t)1 << ARENA_MIN_SHIFT;
+  while (size < block_size && size < ARENA_MAX_BLOCK)
+    size *= 2;
+
+  struct arena_link *link = take_block(mm__, NULL, size);
+  struct HArena_ *ret = (struct HArena_ *)link->rest;
+  ret->cur = link->rest + ARENA_ROUND(sizeof(struct HArena_));
+  ret->end = (uint8_t *)link + size;
   ret->head = link;
-  ret->block_size = block_size;
-  ret->used = 0;
+  ret->spare = NULL;
+  ret->large = NULL;
+  memset(ret->free_list, 0, sizeof(ret->free_list));
   ret->mm__ = mm__;
-  ret->wasted = sizeof(struct arena_link) + sizeof(struct HArena_) + block_size;
+  ret->next_size = size < ARENA_MAX_BLOCK ? 2 * size : size;
+  ret->large_size = size / 2;
+  ret->nlarge = 0;
+  ret->nfreed = 0;
+  ret->used = 0;
+  ret->held = size;
   ret->except = NULL;
   return ret;
 }
@@ -79,71 +209,177 @@ void h_arena_set_except(HArena *arena, jmp_buf *except)
   arena->except = except;
 }
 
-static void *alloc_block(HArena *arena, size_t size)
-{
-  void *block = arena->mm__->alloc(arena->mm__, size);
-  if (!block) {
-    if (arena->except)
-      longjmp(*arena->except, 1);
-    h_platform_errx(1, "memory allocation failed (%uB requested)\n", (unsigned int)size);
+static void *arena_malloc_slow(HArena *arena, size_t size) {
+  if (size > arena->large_size) {
+    // a dedicated block, because it won't fit in a standard sized one.
+    size_t total = sizeof(struct arena_large) + size;
+    struct arena_large *large = alloc_block(arena->mm__, arena->except, total);
+    large->size = total;
+    large->seq = arena->nlarge++;
+    large->prev = NULL;
+    large->next = arena->large;
+    if (arena->large)
+      arena->large->prev = large;
+    arena->large = large;
+    arena->used += size;
+    arena->held += total;
+    return large + 1;
   }
-  return block;
+
+  // start a new ordinary block; the rest of the current one is lost.
+  struct arena_link *link = arena->spare;
+  if (link) {
+    // reuse a block retained by h_arena_reset
+    arena->spare = link->next;
+  } else {
+    link = take_block(arena->mm__, arena->except, arena->next_size);
+    arena->held += link->size;
+    if (arena->next_size < ARENA_MAX_BLOCK)
+      arena->next_size *= 2;
+  }
+  link->next = arena->head;
+  arena->head = link;
+  arena->cur = link->rest + size;
+  arena->end = (uint8_t *)link + link->size;
+  arena->used += size;
+  return link->rest;
 }
 
 void* h_arena_malloc(HArena *arena, size_t size) {
-  if (size <= arena->head->free) {
+  size = ARENA_ROUND(size);
+  if (size - 1 < ARENA_NCLASSES * ARENA_ALIGN) {
+    void **p = arena->free_list[(size - 1) / ARENA_ALIGN];
+    if (p) {
+      arena->free_list[(size - 1) / ARENA_ALIGN] = *p;
+      arena->used += size;
+      return p;
+    }
+  }
+  if (size <= (size_t)(arena->end - arena->cur) && size <= arena->large_size) {
     // fast path..
-    void* ret = arena->head->rest + arena->head->used;
+    void *ret = arena->cur;
+    arena->cur += size;
     arena->used += size;
-    arena->wasted -= size;
-    arena->head->used += size;
-    arena->head->free -= size;
     return ret;
-  } else if (size > arena->block_size) {
-    // We need a new, dedicated block for it, because it won't fit in a standard sized one.
-    // This involves some annoying casting...
-    arena->used += size;
-    arena->wasted += sizeof(struct arena_link*);
-    void* link = alloc_block(arena, size + sizeof(struct arena_link*));
-    assert(link != NULL);
-    memset(link, 0, size + sizeof(struct arena_link*));
-    *(struct arena_link**)link = arena->head->next;
-    arena->head->next = (struct arena_link*)link;
-    return (void*)(((uint8_t*)link) + sizeof(struct arena_link*));
-  } else {
-    // we just need to allocate an ordinary new block.
-    struct arena_link *link = alloc_block(arena, sizeof(struct arena_link) + arena->block_size);
-    assert(link != NULL);
-    memset(link, 0, sizeof(struct arena_link) + arena->block_size);
-    link->free = arena->block_size - size;
-    link->used = size;
-    link->next = arena->head;
-    arena->head = link;
-    arena->used += size;
-    arena->wasted += sizeof(struct arena_link) + arena->block_size - size;
-    return link->rest;
   }
+  return arena_malloc_slow(arena, size);
+}
+
+void* h_arena_malloc0(HArena *arena, size_t size) {
+  void *ret = h_arena_malloc(arena, size);
+  memset(ret, 0, size);
+  return ret;
 }
 
 void h_arena_free(HArena *arena, void* ptr) {
-  // To be used later...
+  // without the size, there is nothing we can do. see h_arena_free_sized.
+}
+
+void h_arena_free_sized(HArena *arena, void *ptr, size_t size) {
+  if (!ptr)
+    return;
+  size = ARENA_ROUND(size);
+  arena->used -= size;
+
+  if (size > arena->large_size) {
+    struct arena_large *large = (struct arena_large *)ptr - 1;
+    if (large->prev)
+      large->prev->next = large->next;
+    else
+      arena->large = large->next;
+    if (large->next)
+      large->next->prev = large->prev;
+    arena->held -= large->size;
+    HAllocator *mm__ = arena->mm__;
+    h_free(large);
+  } else if ((uint8_t *)ptr + size == arena->cur) {
+    // the latest allocation; just take it back
+    arena->cur = ptr;
+  } else if (size - 1 < ARENA_NCLASSES * ARENA_ALIGN) {
+    *(void **)ptr = arena->free_list[(size - 1) / ARENA_ALIGN];
+    arena->free_list[(size - 1) / ARENA_ALIGN] = ptr;
+    arena->nfreed++;
+  }
+  // anything else stays lost until the arena is reset or deleted.
 }
 
 void h_delete_arena(HArena *arena) {
   HAllocator *mm__ = arena->mm__;
+  struct arena_link *first = first_block(arena);
   struct arena_link *link = arena->head;
-  while (link) {
-    struct arena_link *next = link->next; 
-    // Even in the case of a special block, without the full arena
-    // header, this is correct, because the next pointer is the first
-    // in the structure.
-    h_free(link);
+  struct arena_link *spare = arena->spare;
+  free_large(mm__, arena->large);
+  while (link != first) {
+    struct arena_link *next = link->next;
+    release_block(mm__, link);
+    link = next;
+  }
+  release_blocks(mm__, spare);
+  release_block(mm__, first);  // the arena goes with it
+}
+
+void h_arena_reset(HArena *arena) {
+  // oversized blocks are unlikely to fit the next round; give them back.
+  HAllocator *mm__ = arena->mm__;
+  for (struct arena_large *large = arena->large; large; large = large->next)
+    arena->held -= large->size;
+  free_large(mm__, arena->large);
+  arena->large = NULL;
+
+  // keep all ordinary blocks but the first for reuse.
+  struct arena_link *first = first_block(arena);
+  struct arena_link *link = arena->head;
+  while (link != first) {
+    struct arena_link *next = link->next;
+    link->next = arena->spare;
+    arena->spare = link;
+    link = next;
+  }
+  arena->head = first;
+  arena->cur = first->rest + ARENA_ROUND(sizeof(struct HArena_));
+  arena->end = (uint8_t *)first + first->size;
+  memset(arena->free_list, 0, sizeof(arena->free_list));
+  arena->used = 0;
+}
+
+void h_arena_mark(HArena *arena, HArenaMark *mark) {
+  mark->block = arena->head;
+  mark->cur = arena->cur;
+  mark->nlarge = arena->nlarge;
+  mark->nfreed = arena->nfreed;
+  mark->used = arena->used;
+}
+
+void h_arena_rewind(HArena *arena, const HArenaMark *mark) {
+  HAllocator *mm__ = arena->mm__;
+  while (arena->large && arena->large->seq >= mark->nlarge) {
+    struct arena_large *large = arena->large;
+    arena->large = large->next;
+    arena->held -= large->size;
+    h_free(large);
+  }
+  if (arena->large)
+    arena->large->prev = NULL;
+
+  struct arena_link *link = arena->head;
+  while (link != mark->block) {
+    struct arena_link *next = link->next;
+    link->next = arena->spare;
+    arena->spare = link;
     link = next;
   }
-  h_free(arena);
+  arena->head = link;
+  arena->cur = mark->cur;
+  arena->end = (uint8_t *)link + link->size;
+
+  if (arena->nfreed != mark->nfreed)
+    memset(arena->free_list, 0, sizeof(arena->free_list));
+  // chunks freed in between that were older than the mark are not
+  // accounted for; they count as used until the arena is reset.
+  arena->used = mark->used;
 }
 
 void h_allocator_stats(HArena *arena, HArenaStats *stats) {
   stats->used = arena->used;
-  stats->wasted = arena->wasted;
+  stats->wasted = arena->held > arena->used ? arena->held - arena->used : 0;
 }
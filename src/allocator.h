@@ -51,10 +51,28 @@ typedef struct HArena_ HArena ; // hidden implementation
 
 HArena *h_new_arena(HAllocator* allocator, size_t block_size); // pass 0 for default...
 
-void* h_arena_malloc(HArena *arena, size_t count) ATTR_MALLOC(2);
-void h_arena_free(HArena *arena, void* ptr); // For future expansion, with alternate memory managers.
+void* h_arena_malloc(HArena *arena, size_t count) ATTR_MALLOC(2); // not zeroed
+void* h_arena_malloc0(HArena *arena, size_t count) ATTR_MALLOC(2); // zeroed
+void h_arena_free_sized(HArena *arena, void* ptr, size_t count); // count as passed to h_arena_malloc
+void h_arena_free(HArena *arena, void* ptr); // a no-op; the arena needs the size to reuse memory
 void h_delete_arena(HArena *arena);
 void h_arena_set_except(HArena *arena, jmp_buf *except);
+void h_arena_reset(HArena *arena); // drops all allocations but keeps the blocks for reuse
+
+/* A point in an arena's history to go back to. h_arena_rewind drops
+ * everything allocated since the matching h_arena_mark; marks are rewound
+ * innermost first, and h_arena_reset invalidates them all.
+ */
+typedef struct HArenaMark_ {
+  void *block;
+  void *cur;
+  size_t nlarge;
+  size_t nfreed;
+  size_t used;
+} HArenaMark;
+
+void h_arena_mark(HArena *arena, HArenaMark *mark);
+void h_arena_rewind(HArena *arena, const HArenaMark *mark);
 
 typedef struct {
   size_t used;
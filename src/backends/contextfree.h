@@ -77,6 +77,7 @@ static inline HCFChoice* h_cfstack_new_choice_raw(HAllocator *mm__, HCFStack *st
   ret->reshape = NULL;
   ret->action = NULL;
   ret->pred = NULL;
+  ret->user_data = NULL;
   ret->type = ~0; // invalid type
   // Add it to the current sequence...
   if (stk__->count > 0) {
@@ -0,0 +1,493 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../internal.h"
+#include "../platform.h"
+#include "../parsers/parser_internal.h"
+
+// Generated C: h_emit_c writes a parser out as C, a function per
+// combinator, and the PB_GENERATED backend runs that code once it has
+// been compiled.
+//
+// The generated file stands alone; it makes tokens through the functions
+// in an HGeneratedRuntime, which the backend hands it, so it needs
+// neither hammer's headers nor its symbols. Its preamble below must be
+// kept in step with the definitions here, and H_GENERATED_VERSION bumped
+// when either changes.
+
+#define H_GENERATED_VERSION 1
+#define H_GENERATED_FAIL ((size_t)-1)
+#define H_GENERATED_BAIL ((size_t)-2)   // the code can't tell; ask packrat
+
+struct HGeneratedRuntime_ {
+  void *(*uint)(void *arena, uint64_t v);
+  void *(*sint)(void *arena, int64_t v);
+  void *(*bytes)(void *arena, const uint8_t *str, size_t len);
+  void *(*none)(void *arena);
+  void *(*seq)(void *arena, size_t size);
+  void (*append)(void *seq, void *ast);
+  void *(*uints)(void *arena, const uint8_t *in, size_t n);
+  void *(*action)(void *arena, const void *env, void *ast, size_t len);
+  int (*predicate)(void *arena, const void *env, void *ast, size_t len);
+  int (*in_range)(const void *ast, int64_t lower, int64_t upper);
+  int (*uint_value)(const void *ast, uint64_t *v);
+};
+
+static const char preamble[] =
+  "#include <stddef.h>\n"
+  "#include <stdint.h>\n"
+  "#include <string.h>\n"
+  "\n"
+  "#define HG_FAIL ((size_t)-1)\n"
+  "#define HG_BAIL ((size_t)-2)\n"
+  "#define HG_IN(t, c) ((t)[(c) >> 3] & 1 << ((c) & 7))\n"
+  "\n"
+  "struct HGeneratedRuntime_ {\n"
+  "  void *(*uint)(void *arena, uint64_t v);\n"
+  "  void *(*sint)(void *arena, int64_t v);\n"
+  "  void *(*bytes)(void *arena, const uint8_t *str, size_t len);\n"
+  "  void *(*none)(void *arena);\n"
+  "  void *(*seq)(void *arena, size_t size);\n"
+  "  void (*append)(void *seq, void *ast);\n"
+  "  void *(*uints)(void *arena, const uint8_t *in, size_t n);\n"
+  "  void *(*action)(void *arena, const void *env, void *ast, size_t len);\n"
+  "  int (*predicate)(void *arena, const void *env, void *ast, size_t len);\n"
+  "  int (*in_range)(const void *ast, int64_t lower, int64_t upper);\n"
+  "  int (*uint_value)(const void *ast, uint64_t *v);\n"
+  "};\n"
+  "\n"
+  "struct HGeneratedParser_ {\n"
+  "  uint32_t version;\n"
+  "  uint64_t fingerprint;\n"
+  "  size_t nrefs;\n"
+  "  size_t (*parse)(const struct HGeneratedRuntime_ *rt, void *arena, const void *const *refs,\n"
+  "                  const uint8_t *input, size_t length, void **ast);\n"
+  "};\n"
+  "\n"
+  "typedef struct {\n"
+  "  size_t pos, end;\n"
+  "  void *ast;\n"
+  "  int busy;\n"
+  "} hg_memo;\n"
+  "\n"
+  "typedef struct {\n"
+  "  const uint8_t *in;\n"
+  "  size_t len;\n"
+  "  void *arena;\n"
+  "  const struct HGeneratedRuntime_ *rt;\n"
+  "  const void *const *refs;\n"
+  "  hg_memo *memo;\n"
+  "  int bail;\n"
+  "} hg_state;\n"
+  "\n";
+
+/* Writing C */
+
+static void emit_v(HEmitC *e, struct result_buf *buf, const char *fmt, va_list ap) {
+  char *str;
+  int len = h_platform_vasprintf(&str, fmt, ap);
+  if (len < 0) {
+    e->ok = false;
+    return;
+  }
+  if (!h_append_buf(buf, str, len))
+    e->ok = false;
+  free(str);
+}
+
+void h_emit_c_printf(HEmitC *e, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  emit_v(e, &e->body, fmt, ap);
+  va_end(ap);
+}
+
+static void emit_decl(HEmitC *e, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  emit_v(e, &e->decls, fmt, ap);
+  va_end(ap);
+}
+
+size_t h_emit_c_parser(HEmitC *e, const HParser *p) {
+  uintptr_t n = (uintptr_t)h_hashtable_get(e->nodes, p);
+  if (n)
+    return n - 1;
+  n = e->nnodes++;
+  h_hashtable_put(e->nodes, p, (void *)(n + 1));
+  h_slist_push(e->pending, (void *)p);
+  return n;
+}
+
+size_t h_emit_c_ref(HEmitC *e, const void *ptr) {
+  if ((e->nrefs & (e->nrefs - 1)) == 0) {
+    // grows at powers of two
+    HAllocator *mm__ = e->mm__;
+    const void **refs = h_new(const void *, e->nrefs ? 2 * e->nrefs : 1);
+    if (e->nrefs)
+      memcpy(refs, e->refs, e->nrefs * sizeof(void *));
+    h_free(e->refs);
+    e->refs = refs;
+  }
+  e->refs[e->nrefs] = ptr;
+  return e->nrefs++;
+}
+
+size_t h_emit_c_charset(HEmitC *e, HCharset cs) {
+  size_t n = e->ntables++;
+  emit_decl(e, "static const uint8_t hg_t%zu[32] = {", n);
+  for (int i = 0; i < 32; i++) {
+    uint8_t bits = 0;
+    for (int b = 0; b < 8; b++)
+      if (charset_isset(cs, i * 8 + b))
+        bits |= 1 << b;
+    emit_decl(e, "%s0x%02x", i ? "," : "", bits);
+  }
+  emit_decl(e, "};\n");
+  return n;
+}
+
+size_t h_emit_c_rule(HEmitC *e) {
+  return e->nrules++;
+}
+
+static HEmitC *emitter_new(HAllocator *mm__) {
+  HEmitC *e = h_new(HEmitC, 1);
+  memset(e, 0, sizeof(*e));
+  e->mm__ = mm__;
+  e->arena = h_new_arena(mm__, 0);
+  e->nodes = h_hashtable_new(e->arena, h_eq_ptr, h_hash_ptr);
+  e->pending = h_slist_new(e->arena);
+  e->ok = true;
+  return e;
+}
+
+static void emitter_free(HEmitC *e) {
+  HAllocator *mm__ = e->mm__;
+  system_allocator.free(&system_allocator, e->decls.output);
+  system_allocator.free(&system_allocator, e->body.output);
+  h_free(e->refs);
+  h_delete_arena(e->arena);
+  h_free(e);
+}
+
+static uint64_t fnv1a(uint64_t h, const char *s, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)s[i]) * UINT64_C(0x100000001b3);
+  return h;
+}
+
+// Writes the functions for parser and everything under it. They don't
+// depend on anything but the shape of the grammar, so a hash of them
+// tells whether compiled code fits a parser.
+static bool emit_parsers(HEmitC *e, const HParser *parser, uint64_t *fingerprint) {
+  h_emit_c_parser(e, parser);
+  while (e->ok && !h_slist_empty(e->pending)) {
+    const HParser *p = h_slist_pop(e->pending);
+    size_t n = (uintptr_t)h_hashtable_get(e->nodes, p) - 1;
+    emit_decl(e, "static size_t hg_p%zu(hg_state *s, size_t pos, void **ast);\n", n);
+    h_emit_c_printf(e, "static size_t hg_p%zu(hg_state *s, size_t pos, void **ast) {\n", n);
+    if (!p->vtable->emit_c || !p->vtable->emit_c(e, p->env))
+      e->ok = false;
+    h_emit_c_printf(e, "}\n\n");
+  }
+  if (!e->ok)
+    return false;
+  *fingerprint = fnv1a(fnv1a(UINT64_C(0xcbf29ce484222325), e->decls.output, e->decls.len),
+                       e->body.output, e->body.len);
+  return true;
+}
+
+static void emit_entry(HEmitC *e, const char *name, uint64_t fingerprint) {
+  h_emit_c_printf(e,
+    "static size_t hg_parse(const struct HGeneratedRuntime_ *rt, void *arena, const void *const *refs,\n"
+    "                       const uint8_t *input, size_t length, void **ast) {\n"
+    "  hg_memo memo[%zu];\n"
+    "  hg_state s = { input, length, arena, rt, refs, memo, 0 };\n"
+    "  for (size_t i = 0; i < sizeof(memo) / sizeof(memo[0]); i++) {\n"
+    "    memo[i].pos = HG_FAIL;\n"
+    "    memo[i].busy = 0;\n"
+    "  }\n"
+    "  size_t end = hg_p0(&s, 0, ast);\n"
+    "  return s.bail ? HG_BAIL : end;\n"
+    "}\n\n"
+    "const struct HGeneratedParser_ %s = {\n"
+    "  %d, UINT64_C(0x%016llx), %zu, hg_parse\n"
+    "};\n",
+    e->nrules ? e->nrules : 1, name,
+    H_GENERATED_VERSION, (unsigned long long)fingerprint, e->nrefs);
+}
+
+// all of the file, for name; NULL if the parser can't be written out
+static char *emit_source(HEmitC *e, const HParser *parser, const char *name,
+                         uint64_t *fingerprint, size_t *length) {
+  if (!emit_parsers(e, parser, fingerprint))
+    return NULL;
+  emit_entry(e, name, *fingerprint);
+  struct result_buf out = { NULL, 0, 0, NULL, false };
+  if (!h_append_buf(&out, preamble, sizeof(preamble) - 1)
+      || !h_append_buf(&out, e->decls.output, e->decls.len)
+      || !h_append_buf(&out, "\n", 1)
+      || !h_append_buf(&out, e->body.output, e->body.len)
+      || !e->ok) {
+    system_allocator.free(&system_allocator, out.output);
+    return NULL;
+  }
+  *length = out.len;
+  return out.output;
+}
+
+int h_emit_c(FILE *out, const HParser* parser, const char *name) {
+  return h_emit_c__m(&system_allocator, out, parser, name);
+}
+int h_emit_c__m(HAllocator* mm__, FILE *out, const HParser* parser, const char *name) {
+  HEmitC *e = emitter_new(mm__);
+  uint64_t fingerprint;
+  size_t length;
+  h_compile_lock();
+  char *source = emit_source(e, parser, name, &fingerprint, &length);
+  h_compile_unlock();
+  emitter_free(e);
+  if (!source)
+    return -1;
+  fwrite(source, 1, length, out);
+  system_allocator.free(&system_allocator, source);
+  return 0;
+}
+
+/* The runtime */
+
+static void *rt_uint(void *arena, uint64_t v) {
+  HParsedToken *tok = a_new0_(arena, HParsedToken, 1);
+  tok->token_type = TT_UINT;
+  tok->uint = v;
+  return tok;
+}
+
+static void *rt_sint(void *arena, int64_t v) {
+  HParsedToken *tok = a_new0_(arena, HParsedToken, 1);
+  tok->token_type = TT_SINT;
+  tok->sint = v;
+  return tok;
+}
+
+static void *rt_bytes(void *arena, const uint8_t *str, size_t len) {
+  HParsedToken *tok = a_new0_(arena, HParsedToken, 1);
+  tok->token_type = TT_BYTES;
+  tok->bytes.token = str;
+  tok->bytes.len = len;
+  return tok;
+}
+
+static void *rt_none(void *arena) {
+  HParsedToken *tok = a_new0_(arena, HParsedToken, 1);
+  tok->token_type = TT_NONE;
+  return tok;
+}
+
+static void *rt_seq(void *arena, size_t size) {
+  HParsedToken *tok = a_new0_(arena, HParsedToken, 1);
+  tok->token_type = TT_SEQUENCE;
+  tok->seq = h_carray_new_sized(arena, size ? size : 4);
+  return tok;
+}
+
+static void rt_append(void *seq, void *ast) {
+  h_carray_append(((HParsedToken *)seq)->seq, ast);
+}
+
+// a run of bytes that each make a TT_UINT, as h_many of a charset does
+static void *rt_uints(void *arena, const uint8_t *in, size_t n) {
+  HParsedToken *tok = rt_seq(arena, n);
+  HParsedToken *elems = a_new0_(arena, HParsedToken, n);
+  for (size_t i = 0; i < n; i++) {
+    elems[i].token_type = TT_UINT;
+    elems[i].uint = in[i];
+    tok->seq->elements[i] = &elems[i];
+  }
+  tok->seq->used = n;
+  return tok;
+}
+
+static void *rt_action(void *arena, const void *env, void *ast, size_t len) {
+  HParseResult res = { ast, len * 8, arena };
+  return h_action_apply(env, &res);
+}
+
+static int rt_predicate(void *arena, const void *env, void *ast, size_t len) {
+  HParseResult res = { ast, len * 8, arena };
+  return h_attr_bool_apply(env, &res);
+}
+
+static int rt_in_range(const void *ast, int64_t lower, int64_t upper) {
+  const HParsedToken *tok = ast;
+  if (!tok)
+    return 0;
+  switch (tok->token_type) {
+  case TT_SINT:
+    return lower <= tok->sint && upper >= tok->sint;
+  case TT_UINT:
+    return (uint64_t)lower <= tok->uint && (uint64_t)upper >= tok->uint;
+  default:
+    return 0;
+  }
+}
+
+static int rt_uint_value(const void *ast, uint64_t *v) {
+  const HParsedToken *tok = ast;
+  if (!tok || tok->token_type != TT_UINT)
+    return 0;
+  *v = tok->uint;
+  return 1;
+}
+
+static const struct HGeneratedRuntime_ runtime = {
+  .uint = rt_uint,
+  .sint = rt_sint,
+  .bytes = rt_bytes,
+  .none = rt_none,
+  .seq = rt_seq,
+  .append = rt_append,
+  .uints = rt_uints,
+  .action = rt_action,
+  .predicate = rt_predicate,
+  .in_range = rt_in_range,
+  .uint_value = rt_uint_value,
+};
+
+/* The backend */
+
+typedef struct HGeneratedBackend_ {
+  HAllocator *mm__;
+  const HGeneratedParser *code;
+  void *handle;                 // what the code was loaded from, if it was
+  const void **refs;
+  unsigned generation;          // see HParserBackendVTable
+} HGeneratedBackend;
+
+// the code to compile with: given, or built and loaded by prepare
+typedef struct HGeneratedCode_ {
+  const HGeneratedParser *code;
+  void *handle;
+  bool given;
+} HGeneratedCode;
+
+// Building the C takes a while, so it's done before h_compile takes its
+// lock; only writing it out needs it. compile checks the code against the
+// grammar again, which catches any change in between.
+static void *h_generated_prepare(HAllocator* mm__, const HParser* parser, const void* params) {
+  HGeneratedCode *c = h_new(HGeneratedCode, 1);
+  c->code = params;
+  c->handle = NULL;
+  c->given = params != NULL;
+  if (!c->given) {
+    HEmitC *e = emitter_new(mm__);
+    uint64_t fingerprint;
+    size_t length;
+    h_compile_lock();
+    char *source = emit_source(e, parser, "hg_parser", &fingerprint, &length);
+    h_compile_unlock();
+    emitter_free(e);
+    if (source)
+      c->code = h_platform_load_c(source, length, "hg_parser", &c->handle);
+    system_allocator.free(&system_allocator, source);
+  }
+  if (!c->code) {
+    h_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+static int h_generated_compile(HAllocator* mm__, HParser* parser, const void* params) {
+  HGeneratedCode *c = (HGeneratedCode *)params;
+  const HGeneratedParser *code = c->code;
+  void *handle = c->handle;
+  bool given = c->given;
+  h_free(c);
+
+  HEmitC *e = emitter_new(mm__);
+  uint64_t fingerprint;
+  size_t length;
+  char *source = emit_source(e, parser, "hg_parser", &fingerprint, &length);
+  bool emitted = source != NULL;
+  system_allocator.free(&system_allocator, source);
+  if (!emitted || code->version != H_GENERATED_VERSION
+      || code->fingerprint != fingerprint || code->nrefs != e->nrefs) {
+    emitter_free(e);
+    h_platform_unload_c(handle);
+    return -1;
+  }
+
+  HGeneratedBackend *g = h_new(HGeneratedBackend, 1);
+  g->mm__ = mm__;
+  g->code = code;
+  g->handle = handle;
+  g->refs = e->refs;
+  g->generation = given ? 0 : h_grammar_generation();
+  e->refs = NULL;
+  emitter_free(e);
+  parser->backend_data = g;
+  return 0;
+}
+
+static unsigned h_generated_generation(const HParser *parser) {
+  return ((const HGeneratedBackend *)parser->backend_data)->generation;
+}
+
+static void h_generated_free(HParser *parser) {
+  HGeneratedBackend *g = parser->backend_data;
+  HAllocator *mm__ = g->mm__;
+  h_platform_unload_c(g->handle);
+  h_free(g->refs);
+  h_free(g);
+  parser->backend_data = NULL;
+  parser->backend = PB_PACKRAT;
+}
+
+static HParseResult *h_generated_parse(HAllocator* mm__, const HParser* parser, HInputStream *input_stream) {
+  const HGeneratedBackend *g = parser->backend_data;
+  // the code only knows whole bytes, most significant bit first
+  if (input_stream->bit_offset != 0
+      || input_stream->endianness != (BIT_BIG_ENDIAN | BYTE_BIG_ENDIAN))
+    return h__packrat_backend_vtable.parse(mm__, parser, input_stream);
+
+  HArena *arena = h_new_arena(mm__, 0);
+  jmp_buf except;
+  h_arena_set_except(arena, &except);
+  if (setjmp(except)) {
+    h_delete_arena(arena);
+    return NULL;
+  }
+
+  void *ast = NULL;
+  size_t end = g->code->parse(&runtime, arena, g->refs,
+                              input_stream->input + input_stream->index,
+                              input_stream->length - input_stream->index, &ast);
+  if (end == H_GENERATED_BAIL) {
+    // left recursion, or a length that isn't one: packrat knows what to do
+    h_delete_arena(arena);
+    return h__packrat_backend_vtable.parse(mm__, parser, input_stream);
+  }
+  if (end == H_GENERATED_FAIL) {
+    h_delete_arena(arena);
+    return NULL;
+  }
+  h_arena_set_except(arena, NULL);
+  input_stream->index += end;
+  HParseResult *res = a_new_(arena, HParseResult, 1);
+  res->ast = ast;
+  res->bit_length = end * 8;
+  res->arena = arena;
+  return res;
+}
+
+HParserBackendVTable h__generated_backend_vtable = {
+  .prepare = h_generated_prepare,
+  .compile = h_generated_compile,
+  .parse = h_generated_parse,
+  .free = h_generated_free,
+  .generation = h_generated_generation,
+};
@@ -1,9 +1,8 @@
 #include <assert.h>
+#include <string.h>
+#include "../parsers/parser_internal.h"
 #include "lr.h"
 
-static bool glr_step(HParseResult **result, HSlist *engines,
-                     HLREngine *engine, const HLRAction *action);
-
 
 /* GLR compilation (LALR w/o failing on conflict) */
 
@@ -28,223 +27,458 @@ void h_glr_free(HParser *parser)
 }
 
 
-/* Merging engines (when they converge on the same state) */
-
-static HLREngine *lrengine_merge(HLREngine *old, HLREngine *new)
+/* The graph-structured stack
+ *
+ * Instead of a set of whole LR stacks, all live parses share one stack graph
+ * (Tomita). Nodes are (state, level) pairs where the level is the number of
+ * input tokens consumed; at most one node exists per state and level, so
+ * parses that converge on the same state are merged simply by looking up the
+ * node for that state in the frontier. Edges point down the stack and carry
+ * the semantic value of the symbol between their endpoints.
+ *
+ * When several derivations yield the same edge, the extra ones are packed
+ * onto it as alternatives instead of being parsed on separately, so that
+ * every ambiguity costs one forest node. The parse result is read off the
+ * first derivation found for each symbol.
+ */
+
+typedef struct HGLRPacked_ {
+  HParsedToken *value;          // semantic value of an alternative derivation
+  struct HGLRPacked_ *next;
+} HGLRPacked;
+
+typedef struct HGLREdge_ {
+  struct HGLRNode_ *from;
+  struct HGLRNode_ *to;
+  HParsedToken *value;          // semantic value of the first derivation
+  HGLRPacked *packed;           // other derivations of the same symbol/span
+  size_t seq;                   // creation order, see glr_walk
+  struct HGLREdge_ *next;       // in from->edges
+  struct HGLREdge_ *next_in;    // in to->in
+} HGLREdge;
+
+typedef struct HGLRNode_ {
+  size_t state;
+  size_t level;
+  const HLRAction *action;      // action(s) on the lookahead at 'level'
+  HGLREdge *edges;              // down the stack
+  HGLREdge *in;                 // up the stack
+  size_t nedges, nin;
+} HGLRNode;
+
+// a pending reduction on the paths from 'node' that go through edge 'via'.
+// if 'first' is set, the paths all start with 'via'.
+typedef struct HGLRReduction_ {
+  HGLRNode *node;
+  const HLRAction *action;
+  HGLREdge *via;                // NULL for epsilon productions
+  bool first;
+} HGLRReduction;
+
+typedef struct HGLRParser_ {
+  const HLRTable *table;
+  HArena *arena;                // semantic values and result
+  HArena *tarena;               // the stack graph
+  HInputStream input;           // position at the current level
+  size_t level;
+  size_t nedges;
+
+  // the frontier, indexed by state; an entry is valid iff its level matches.
+  // two of them alternate between the current and the next level, so they
+  // never need clearing.
+  HGLRNode **frontier;
+  HGLRNode **nextfront;
+  HGLRNode **active;            // nodes of the current level
+  size_t nactive;
+  HGLRNode **shifted;           // nodes of the next level
+  size_t nshifted;
+  bool sublevel;                // edges within the current level exist
+
+  HGLRReduction *queue;         // reductions to be performed on this level
+  size_t nqueue, queuecap;
+
+  HParsedToken **values;        // scratch space for the symbols of a path
+  size_t valuecap;
+
+  HParseResult *result;
+} HGLRParser;
+
+static void queue_reduction(HGLRParser *p, HGLRNode *node,
+                            const HLRAction *action, HGLREdge *via, bool first)
 {
-  HArena *arena = old->arena;
-
-  HLREngine *ret = h_arena_malloc(arena, sizeof(HLREngine));
-
-  assert(old->state == new->state);
-  assert(old->input.input == new->input.input);
-
-  *ret = *old;
-  ret->stack = h_slist_new(arena);
-  ret->merged[0] = old;
-  ret->merged[1] = new;
-
-  return ret;
+  if(action->type != HLR_REDUCE)
+    return;
+  if((action->production.length == 0) != (via == NULL))
+    return;
+
+  if(p->nqueue == p->queuecap) {
+    size_t cap = p->queuecap * 2;
+    HGLRReduction *q = h_arena_malloc(p->tarena, cap * sizeof(HGLRReduction));
+    memcpy(q, p->queue, p->nqueue * sizeof(HGLRReduction));
+    h_arena_free_sized(p->tarena, p->queue, p->queuecap * sizeof(HGLRReduction));
+    p->queue = q;
+    p->queuecap = cap;
+  }
+  HGLRReduction *r = &p->queue[p->nqueue++];
+  r->node = node;
+  r->action = action;
+  r->via = via;
+  r->first = first;
 }
 
-static HSlist *demerge_stack(HSlistNode *bottom, HSlist *stack)
+// queue all reductions of 'node' along paths through 'via'.
+// if 'via' is NULL, queue the epsilon reductions.
+static void queue_reductions(HGLRParser *p, HGLRNode *node, HGLREdge *via,
+                             bool first)
 {
-  HArena *arena = stack->arena;
-
-  HSlist *ret = h_slist_new(arena);
-
-  // copy the stack from the top
-  HSlistNode **y = &ret->head;
-  for(HSlistNode *x=stack->head; x; x=x->next) {
-    HSlistNode *node = h_arena_malloc(arena, sizeof(HSlistNode));
-    node->elem = x->elem;
-    node->next = NULL;
-    *y = node;
-    y = &node->next;
+  const HLRAction *action = node->action;
+
+  if(action == NULL)
+    return;
+  if(action->type == HLR_CONFLICT) {
+    for(HSlistNode *x=action->branches->head; x; x=x->next)
+      queue_reduction(p, node, x->elem, via, first);
+  } else {
+    queue_reduction(p, node, action, via, first);
   }
-  *y = bottom;  // attach the ancestor stack
+}
 
-  return ret;
+static HGLRNode *glr_node(HGLRParser *p, size_t state, size_t level)
+{
+  HGLRNode *node = h_arena_malloc(p->tarena, sizeof(HGLRNode));
+  node->state = state;
+  node->level = level;
+  node->action = NULL;
+  node->edges = NULL;
+  node->in = NULL;
+  node->nedges = node->nin = 0;
+  return node;
 }
 
-static inline HLREngine *respawn(HLREngine *eng, HSlist *stack)
+static HGLREdge *glr_edge(HGLRParser *p, HGLRNode *from, HGLRNode *to,
+                          HParsedToken *value)
 {
-  // NB: this can be a destructive update because an engine is not used for
-  // anything after it is merged.
-  eng->stack = demerge_stack(eng->stack->head, stack);
-  return eng;
+  HGLREdge *edge = h_arena_malloc(p->tarena, sizeof(HGLREdge));
+  edge->from = from;
+  edge->to = to;
+  edge->value = value;
+  edge->packed = NULL;
+  edge->seq = p->nedges++;
+  edge->next = from->edges;
+  from->edges = edge;
+  from->nedges++;
+  edge->next_in = to->in;
+  to->in = edge;
+  to->nin++;
+  return edge;
 }
 
-static HLREngine *
-demerge(HParseResult **result, HSlist *engines,
-        HLREngine *engine, const HLRAction *action, size_t depth)
+// the edge from 'from' to 'to', if any. either end may have many edges
+// (a right-recursive rule unwinding merges the whole stack into one
+// node), so search from the end that has fewer.
+static HGLREdge *glr_find_edge(HGLRNode *from, HGLRNode *to)
 {
-  // no-op on engines that are not merged
-  if(!engine->merged[0])
-    return engine;
-
-  HSlistNode *p = engine->stack->head;
-  for(size_t i=0; i<depth; i++) {
-    // if stack hits bottom, respawn ancestors
-    if(p == NULL) {
-      HLREngine *a = respawn(engine->merged[0], engine->stack);
-      HLREngine *b = respawn(engine->merged[1], engine->stack);
-
-      // continue demerge until final depth reached
-      a = demerge(result, engines, a, action, depth-i);
-      b = demerge(result, engines, b, action, depth-i);
-      
-      // step and stow one ancestor...
-      glr_step(result, engines, a, action);
-
-      // ...and return the other
-      return b;
+  if(from->nedges <= to->nin) {
+    for(HGLREdge *e=from->edges; e; e=e->next)
+      if(e->to == to)
+        return e;
+  } else {
+    for(HGLREdge *e=to->in; e; e=e->next_in)
+      if(e->from == from)
+        return e;
+  }
+  return NULL;
+}
+
+static void glr_reduce_path(HGLRParser *p, const HGLRReduction *r,
+                            HGLRNode *bottom)
+{
+  HArena *arena = p->arena;
+  size_t len = r->action->production.length;
+  HCFChoice *symbol = r->action->production.lhs;
+
+  // semantic value of the reduction result
+  HParsedToken *value = h_arena_malloc0(arena, sizeof(HParsedToken));
+  value->token_type = TT_SEQUENCE;
+  value->seq = h_carray_new_sized(arena, len);
+  for(size_t i=0; i<len; i++)
+    value->seq->elements[i] = p->values[i];
+  value->seq->used = len;
+  if(len > 0 && p->values[0]) {
+    // result position equals position of left-most symbol
+    value->index = p->values[0]->index;
+    value->bit_offset = p->values[0]->bit_offset;
+  } else {
+    // result position is current input position
+    value->index = p->input.pos + p->input.index;
+    value->bit_offset = p->input.bit_offset;
+  }
+
+  // perform token reshape, validation and semantic action
+  if(!h_lr_reduce_value(arena, p->tarena, symbol, &value))
+    return;     // validation failed -> this derivation is dead
+
+  const HLRAction *shift = h_lrtable_goto(p->table, bottom->state, symbol);
+  if(shift == NULL)
+    return;     // parse error on this path
+  assert(shift->type == HLR_SHIFT);
+
+  // check for success
+  if(shift->nextstate == HLR_SUCCESS) {
+    assert(symbol == p->table->start);
+    if(!p->result) {
+      p->result = make_result(arena, value);
+      p->result->bit_length = (p->input.pos + p->input.index) * 8;
     }
-    p = p->next;
+    return;
   }
 
-  return engine;    // there is enough stack before the merge point
-}
+  HGLRNode *node = p->frontier[shift->nextstate];
+  if(node && node->level == p->level) {
+    // merge with the existing node
+    HGLREdge *e = glr_find_edge(node, bottom);
+    if(e) {
+      // same symbol over the same span: an ambiguity
+      HGLRPacked *alt = h_arena_malloc(p->tarena, sizeof(HGLRPacked));
+      alt->value = value;
+      alt->next = e->packed;
+      e->packed = alt;
+      return;
+    }
 
+    // a new edge into an old node opens new paths for reductions that
+    // were already done. those from 'node' itself start with the edge;
+    // other nodes of this level can only reach it through sublevel edges.
+    HGLREdge *edge = glr_edge(p, node, bottom, value);
+    queue_reductions(p, node, edge, true);
+    if(p->sublevel) {
+      for(size_t i=0; i<p->nactive; i++) {
+        if(p->active[i] != node)
+          queue_reductions(p, p->active[i], edge, false);
+      }
+    }
+  } else {
+    node = glr_node(p, shift->nextstate, p->level);
+    node->action = h_lrtable_action(p->table, node->state, &p->input);
+    p->frontier[node->state] = node;
+    p->active[p->nactive++] = node;
+
+    HGLREdge *edge = glr_edge(p, node, bottom, value);
+    queue_reductions(p, node, NULL, true);
+    queue_reductions(p, node, edge, true);
+  }
 
-/* Forking engines (on conflicts */
+  if(bottom->level == p->level)
+    p->sublevel = true;
+}
 
-HLREngine *fork_engine(const HLREngine *engine)
+// enumerate the paths of length k down from 'node' for reduction 'r'.
+//
+// every path is reduced exactly once, by the reduction queued for the
+// newest edge on it; hence edges newer than 'via' are not followed.
+static void glr_walk(HGLRParser *p, const HGLRReduction *r, HGLRNode *node,
+                     size_t k, bool through)
 {
-  HLREngine *eng2 = h_arena_malloc(engine->tarena, sizeof(HLREngine));
-  eng2->table = engine->table;
-  eng2->state = engine->state;
-  eng2->input = engine->input;
-
-  // shallow-copy the stack
-  // this works because h_slist_push and h_slist_drop never modify
-  // the underlying structure of HSlistNodes, only the head pointer.
-  // in fact, this gives us prefix sharing for free.
-  eng2->stack = h_arena_malloc(engine->tarena, sizeof(HSlist));
-  *eng2->stack = *engine->stack;
-
-  eng2->arena = engine->arena;
-  eng2->tarena = engine->tarena;
-  return eng2;
+  if(k == 0) {
+    if(through)
+      glr_reduce_path(p, r, node);
+    return;
+  }
+  for(HGLREdge *e=node->edges; e; e=e->next) {
+    if(e->seq > r->via->seq)
+      continue;
+    p->values[k-1] = e->value;
+    glr_walk(p, r, e->to, k-1, through || e == r->via);
+  }
 }
 
-static const HLRAction *
-handle_conflict(HParseResult **result, HSlist *engines,
-                const HLREngine *engine, const HSlist *branches)
+static void glr_reduce(HGLRParser *p, const HGLRReduction *r)
 {
-  // there should be at least two conflicting actions
-  assert(branches->head);
-  assert(branches->head->next);     // this is just a consistency check
-
-  // fork a new engine for all but the first action
-  for(HSlistNode *x=branches->head->next; x; x=x->next) {
-    HLRAction *act = x->elem; 
-    HLREngine *eng = fork_engine(engine);
+  size_t len = r->action->production.length;
 
-    // perform one step and add to engines
-    glr_step(result, engines, eng, act);
-  } 
+  if(len > p->valuecap) {
+    p->valuecap = len * 2;
+    p->values = h_arena_malloc(p->tarena, p->valuecap * sizeof(HParsedToken *));
+  }
 
-  // return first action for use with original engine
-  return branches->head->elem;
+  if(len == 0) {
+    glr_reduce_path(p, r, r->node);
+  } else if(r->first) {
+    p->values[len-1] = r->via->value;
+    glr_walk(p, r, r->via->to, len-1, true);
+  } else {
+    glr_walk(p, r, r->node, len, false);
+  }
 }
 
-
-/* GLR driver */
-
-static bool glr_step(HParseResult **result, HSlist *engines,
-                     HLREngine *engine, const HLRAction *action)
+// shift the next input token from all nodes of the current level.
+// returns false if there is nothing to shift.
+static bool glr_shift(HGLRParser *p)
 {
-  // handle forks and demerges (~> spawn engines)
-  if(action) {
-    if(action->type == HLR_CONFLICT) {
-      // fork engine on conflicts
-      action = handle_conflict(result, engines, engine, action->branches);
-    } else if(action->type == HLR_REDUCE) {
-      // demerge/respawn as needed
-      size_t depth = action->production.length;
-      engine = demerge(result, engines, engine, action, depth);
+  HInputStream input = p->input;
+  HParsedToken *token = NULL;
+  bool consumed = false;
+
+  p->nshifted = 0;
+  for(size_t i=0; i<p->nactive; i++) {
+    HGLRNode *node = p->active[i];
+    const HLRAction *action = node->action;
+    HSlistNode *x = NULL;
+
+    if(action && action->type == HLR_CONFLICT) {
+      x = action->branches->head;
+      action = x->elem;
     }
-  }
-
-  bool run = h_lrengine_step(engine, action);
-  
-  if(run) {
-    // store engine in the list, merge if necessary
-    HSlistNode *x;
-    for(x=engines->head; x; x=x->next) {
-      HLREngine *eng = x->elem;
-      if(eng->state == engine->state) {
-        x->elem = lrengine_merge(eng, engine);
-        break;
+    while(action) {
+      if(action->type == HLR_SHIFT) {
+        if(!consumed) {
+          token = h_lr_consume_input(p->arena, &input);
+          consumed = true;
+        }
+
+        HGLRNode *next = p->nextfront[action->nextstate];
+        if(!next || next->level != p->level + 1) {
+          next = glr_node(p, action->nextstate, p->level + 1);
+          p->nextfront[next->state] = next;
+          p->shifted[p->nshifted++] = next;
+        }
+        glr_edge(p, next, node, token);
       }
+
+      x = x ? x->next : NULL;
+      action = x ? x->elem : NULL;
     }
-    if(!x)  // no merge happened
-      h_slist_push(engines, engine);
-  } else if(engine->state == HLR_SUCCESS) {
-    // save the result
-    *result = h_lrengine_result(engine);
   }
 
-  return run;
+  if(p->nshifted == 0)
+    return false;
+
+  // advance to the next level
+  HGLRNode **tmp = p->frontier;
+  p->frontier = p->nextfront;
+  p->nextfront = tmp;
+  tmp = p->active;
+  p->active = p->shifted;
+  p->shifted = tmp;
+  p->nactive = p->nshifted;
+  p->input = input;
+  p->level++;
+  p->sublevel = false;
+
+  for(size_t i=0; i<p->nactive; i++) {
+    HGLRNode *node = p->active[i];
+    node->action = h_lrtable_action(p->table, node->state, &p->input);
+    queue_reductions(p, node, NULL, true);
+    for(HGLREdge *e=node->edges; e; e=e->next)
+      queue_reductions(p, node, e, true);
+  }
+
+  return true;
 }
 
-HParseResult *h_glr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream)
+static HParseResult *glr_run(HArena *arena, HArena *tarena,
+                             const HLRTable *table, HInputStream *stream)
 {
-  HLRTable *table = parser->backend_data;
-  if(!table)
-    return NULL;
+  HGLRParser *p = h_arena_malloc(tarena, sizeof(HGLRParser));
+  size_t n = table->nrows;
+
+  p->table = table;
+  p->arena = arena;
+  p->tarena = tarena;
+  p->input = *stream;
+  p->level = 0;
+  p->nedges = 0;
+  p->frontier = h_arena_malloc(tarena, n * sizeof(HGLRNode *));
+  p->nextfront = h_arena_malloc(tarena, n * sizeof(HGLRNode *));
+  memset(p->frontier, 0, n * sizeof(HGLRNode *));
+  memset(p->nextfront, 0, n * sizeof(HGLRNode *));
+  p->active = h_arena_malloc(tarena, n * sizeof(HGLRNode *));
+  p->shifted = h_arena_malloc(tarena, n * sizeof(HGLRNode *));
+  p->nshifted = 0;
+  p->sublevel = false;
+  p->queuecap = 16;
+  p->queue = h_arena_malloc(tarena, p->queuecap * sizeof(HGLRReduction));
+  p->nqueue = 0;
+  p->valuecap = 0;
+  p->values = NULL;
+  p->result = NULL;
+
+  // initial node
+  HGLRNode *start = glr_node(p, 0, 0);
+  start->action = h_lrtable_action(table, 0, &p->input);
+  p->frontier[0] = start;
+  p->active[0] = start;
+  p->nactive = 1;
+  queue_reductions(p, start, NULL, true);
+
+  do {
+    // reduce until all nodes of this level are present
+    while(p->nqueue > 0 && !p->result) {
+      HGLRReduction r = p->queue[--p->nqueue];
+      glr_reduce(p, &r);
+    }
+  } while(!p->result && glr_shift(p));
+
+  return p->result;
+}
 
-  HArena *arena  = h_new_arena(mm__, 0);    // will hold the results
-  HArena *tarena = h_new_arena(mm__, 0);    // tmp, deleted after parse
 
+/* GLR driver */
+
+// on failure, arena is left for the caller to delete or rewind.
+static HParseResult *glr_parse_(HArena *arena, HArena *tarena,
+                                HLRTable *table, HInputStream *stream)
+{
   // out-of-memory handling
   jmp_buf except;
   h_arena_set_except(arena, &except);
   h_arena_set_except(tarena, &except);
   if(setjmp(except)) {
-    h_delete_arena(arena);
-    h_delete_arena(tarena);
+    h_arena_set_except(arena, NULL);
+    h_arena_set_except(tarena, NULL);
     return NULL;
   }
 
-  // allocate engine lists (will hold one engine per state)
-  // these are swapped each iteration
-  HSlist *engines = h_slist_new(tarena);
-  HSlist *engback = h_slist_new(tarena);
+  HParseResult *result = glr_run(arena, tarena, table, stream);
 
-  // create initial engine
-  h_slist_push(engines, h_lrengine_new(arena, tarena, table, stream));
-
-  HParseResult *result = NULL;
-  while(result == NULL && !h_slist_empty(engines)) {
-    assert(h_slist_empty(engback));
-
-    // step all engines
-    while(!h_slist_empty(engines)) {
-      HLREngine *engine = h_slist_pop(engines);
-      const HLRAction *action = h_lrengine_action(engine);
-      glr_step(&result, engback, engine, action);
-    }
+  h_arena_set_except(arena, NULL);
+  h_arena_set_except(tarena, NULL);
+  return result;
+}
 
-    // swap the lists
-    HSlist *tmp = engines;
-    engines = engback;
-    engback = tmp;
-  }
+HParseResult *h_glr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream)
+{
+  HLRTable *table = parser->backend_data;
+  if(!table)
+    return NULL;
 
+  HArena *arena  = h_new_arena(mm__, 0);    // will hold the results
+  HArena *tarena = h_new_arena(mm__, 0);    // tmp, deleted after parse
+  HParseResult *result = glr_parse_(arena, tarena, table, stream);
   if(!result)
     h_delete_arena(arena);
   h_delete_arena(tarena);
   return result;
 }
 
+HParseResult *h_glr_parse_context(HParseContext *ctx, HInputStream *stream)
+{
+  HLRTable *table = ctx->parser->backend_data;
+  if(!table)
+    return NULL;
+
+  return glr_parse_(ctx->arena, ctx->tarena, table, stream);
+}
+
 
 
 HParserBackendVTable h__glr_backend_vtable = {
   .compile = h_glr_compile,
   .parse = h_glr_parse,
-  .free = h_glr_free
+  .free = h_glr_free,
+
+  .parse_context = h_glr_parse_context,
+  .generation = h_lalr_generation
 };
 
 
@@ -252,6 +252,10 @@ static bool match_any_production(const HLRTable *table, HLREnhGrammar *eg,
 // this guarantees that the start symbol will not occur in any productions
 HCFChoice *h_desugar_augmented(HAllocator *mm__, HParser *parser)
 {
+  // desugar the parser on its own first (under the lock), so that the
+  // augmented grammar below only refers to its memoized form
+  h_desugar(mm__, NULL, parser);
+
   HCFChoice *augmented = h_new(HCFChoice, 1);
 
   HCFStack *stk__ = h_cfstack_new(mm__);
@@ -347,11 +351,18 @@ int h_lalr_compile(HAllocator* mm__, HParser* parser, const void* params)
     }
   }
 
+  h_lrtable_finalize(table, g);
   h_cfgrammar_free(g);
+  table->generation = params ? 0 : h_grammar_generation();
   parser->backend_data = table;
   return has_conflicts(table)? -1 : 0;
 }
 
+unsigned h_lalr_generation(const HParser *parser)
+{
+  return ((HLRTable *)parser->backend_data)->generation;
+}
+
 void h_lalr_free(HParser *parser)
 {
   HLRTable *table = parser->backend_data;
@@ -368,7 +379,10 @@ HParserBackendVTable h__lalr_backend_vtable = {
   .free = h_lalr_free,
   .parse_start = h_lr_parse_start,
   .parse_chunk = h_lr_parse_chunk,
-  .parse_finish = h_lr_parse_finish
+  .parse_finish = h_lr_parse_finish,
+
+  .parse_context = h_lr_parse_context,
+  .generation = h_lalr_generation
 };
 
 
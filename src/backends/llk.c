@@ -15,22 +15,50 @@ typedef struct HLLkTable_ {
   size_t     kmax;
   HHashTable *rows;
   HCFChoice  *start;    // start symbol
+  HHashTable *special;  // symbols made by the grammar transforms -> HLLkSpecial
+                        // NULL if the grammar was used as is
+  HLookaheadTable *lookahead; // flat form of the rows, see finalize_table
+  HHashTable *roots;    // nonterminal -> root node of its row in lookahead
+  unsigned   generation; // see HParserBackendVTable
   HArena     *arena;
   HAllocator *mm__;
 } HLLkTable;
 
+/* Symbols the grammar transforms (see below) add to tell the driver how to
+ * build the original parse tree from the transformed derivation.
+ */
+typedef enum HLLkSpecialKind_ {
+  LLK_SPLICE,   // nonterminal whose production goes into the enclosing result
+  LLK_OPEN,     // start a result for nt, taking the last n tokens along
+  LLK_CLOSE,    // finish the result for nt and add it to the enclosing one
+  LLK_FOLD      // finish the current result as nt and start over with it as
+                // the first element, nested in fresh results for opens
+} HLLkSpecialKind;
+
+typedef struct HLLkSpecial_ {
+  HLLkSpecialKind kind;
+  const HCFChoice *nt;
+  size_t n;
+  const HCFChoice **opens;  // NULL-terminated
+} HLLkSpecial;
+
+static inline const HLLkSpecial *special(const HLLkTable *table,
+                                         const HCFChoice *x)
+{
+  if(!table->special || x->type != HCF_CHOICE)
+    return NULL;
+  return h_hashtable_get(table->special, x);
+}
+
 
 /* Interface to look up an entry in the parse table. */
 const HCFSequence *h_llk_lookup(const HLLkTable *table, const HCFChoice *x,
                                 const HInputStream *stream)
 {
-  const HStringMap *row = h_hashtable_get(table->rows, x);
-  assert(row != NULL);  // the table should have one row for each nonterminal
+  uint32_t root = (uintptr_t)h_hashtable_get(table->roots, x);
+  assert(root != 0);    // the table should have one row for each nonterminal
 
-  assert(!row->epsilon_branch); // would match without looking at the input
-                                // XXX cases where this could be useful?
-
-  return h_stringmap_get_lookahead(row, *stream);
+  return h_lookahead_get(table->lookahead, root, *stream);
 }
 
 /* Allocate a new parse table. */
@@ -48,6 +76,10 @@ HLLkTable *h_llktable_new(HAllocator *mm__)
   table->mm__  = mm__;
   table->arena = arena;
   table->rows  = rows;
+  table->special = NULL;
+  table->lookahead = NULL;
+  table->roots = NULL;
+  table->generation = 0;
 
   return table;
 }
@@ -109,22 +141,21 @@ static void stringmap_merge(HHashSet *workset, HStringMap *dst, HStringMap *src)
   // iterate over src->char_branches
   const HHashTable *ht = src->char_branches;
   for(size_t i=0; i < ht->capacity; i++) {
-    for(HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
+    HHashTableEntry *hte = &ht->contents[i];
+    if(hte->key == NULL)
+      continue;
 
-      HCharKey c = (HCharKey)hte->key;
-      HStringMap *src_ = hte->value;
+    HCharKey c = (HCharKey)hte->key;
+    HStringMap *src_ = hte->value;
 
-      if(src_) {
-        HStringMap *dst_ = h_hashtable_get(dst->char_branches, (void *)c);
-        if(dst_) {
-          stringmap_merge(workset, dst_, src_);
-        } else {
-          if(src_->arena != dst->arena)
-            src_ = h_stringmap_copy(dst->arena, src_);
-          h_hashtable_put(dst->char_branches, (void *)c, src_);
-        }
+    if(src_) {
+      HStringMap *dst_ = h_hashtable_get(dst->char_branches, (void *)c);
+      if(dst_) {
+        stringmap_merge(workset, dst_, src_);
+      } else {
+        if(src_->arena != dst->arena)
+          src_ = h_stringmap_copy(dst->arena, src_);
+        h_hashtable_put(dst->char_branches, (void *)c, src_);
       }
     }
   }
@@ -150,22 +181,21 @@ static int fill_table_row(size_t kmax, HCFGrammar *g, HStringMap *row,
     // iterate over the productions in workset...
     const HHashTable *ht = workset;
     for(size_t i=0; i < ht->capacity; i++) {
-      for(HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-        if(hte->key == NULL)
-          continue;
+      HHashTableEntry *hte = &ht->contents[i];
+      if(hte->key == NULL)
+        continue;
 
-        HCFSequence *rhs = (void *)hte->key;
-        assert(rhs != NULL);
-        assert(rhs != CONFLICT);  // just to be sure there's no mixup
+      HCFSequence *rhs = (void *)hte->key;
+      assert(rhs != NULL);
+      assert(rhs != CONFLICT);  // just to be sure there's no mixup
 
-        // calculate predict set; let values map to rhs
-        HStringMap *pred = h_predict(k, g, A, rhs);
-        h_stringmap_replace(pred, NULL, rhs);
+      // calculate predict set; let values map to rhs
+      HStringMap *pred = h_predict(k, g, A, rhs);
+      h_stringmap_replace(pred, NULL, rhs);
 
-        // merge predict set into the row
-        // accumulates conflicts in new workset
-        stringmap_merge(nextset, row, pred);
-      }
+      // merge predict set into the row
+      // accumulates conflicts in new workset
+      stringmap_merge(nextset, row, pred);
     }
 
     // switch to the updated workset
@@ -186,9 +216,13 @@ static int fill_table_row(size_t kmax, HCFGrammar *g, HStringMap *row,
 
 /* Generate the LL(k) parse table from the given grammar.
  * Returns -1 on error, 0 on success.
+ * If failed is given, carries on after a conflict and collects the
+ * nonterminals whose rows have them.
  */
-static int fill_table(size_t kmax, HCFGrammar *g, HLLkTable *table)
+static int fill_table(size_t kmax, HCFGrammar *g, HLLkTable *table,
+                      HHashSet *failed)
 {
+  int ret = 0;
   table->kmax = kmax;
   table->start = g->start;
 
@@ -196,26 +230,684 @@ static int fill_table(size_t kmax, HCFGrammar *g, HLLkTable *table)
   size_t i;
   HHashTableEntry *hte;
   for(i=0; i < g->nts->capacity; i++) {
-    for(hte = &g->nts->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
+    hte = &g->nts->contents[i];
+    if(hte->key == NULL)
+      continue;
+    const HCFChoice *a = hte->key;        // production's left-hand symbol
+    assert(a->type == HCF_CHOICE);
+
+    // create table row for this nonterminal
+    HStringMap *row = h_stringmap_new(table->arena);
+    h_hashtable_put(table->rows, a, row);
+
+    if(fill_table_row(kmax, g, row, a) < 0) {
+      // unresolvable conflicts in row
+      // NB we don't worry about deallocating anything, h_llk_compile will
+      //    delete the whole arena for us.
+      if(!failed)
+        return -1;
+      h_hashset_put(failed, a);
+      ret = -1;
+    }
+  }
+  
+  return ret;
+}
+
+
+/* Lower the rows into the flat form used by h_llk_lookup.
+ * g is the grammar the table was made for; its terminals determine the
+ * byte classes.
+ */
+static void finalize_table(HLLkTable *table, const HCFGrammar *g)
+{
+  uint8_t classes[256];
+  size_t n = h_cfgrammar_byte_classes(g, classes);
+
+  table->lookahead = h_lookahead_new(table->arena, classes, n);
+  table->roots = h_hashtable_new(table->arena, h_eq_ptr, h_hash_ptr);
+
+  const HHashTable *ht = table->rows;
+  for(size_t i=0; i < ht->capacity; i++) {
+    HHashTableEntry *hte = &ht->contents[i];
+    if(hte->key == NULL)
+      continue;
+    const HStringMap *row = hte->value;
+
+    assert(!row->epsilon_branch); // would match without looking at the input
+                                  // XXX cases where this could be useful?
+
+    uintptr_t root = h_lookahead_add(table->lookahead, row);
+    h_hashtable_put(table->roots, hte->key, (void *)root);
+  }
+}
+
+
+/* Grammar transformations
+ *
+ * Grammars that are not LL(k) as desugared can often be made so by removing
+ * left recursion, by left factoring, or by giving a nonterminal a separate
+ * copy for each place it is used (so each copy gets its own, smaller follow
+ * set). The first two change the shape of the derivation, so the
+ * transformed grammar carries the HLLkSpecial symbols that let the driver
+ * build the parse tree of the original one. Apart from splices, these are
+ * nonterminals with a single empty production, which is all the grammar
+ * analysis needs to know about them.
+ *
+ * The transformed grammar is a copy living in the table arena; the
+ * desugared forms of the parsers are left alone.
+ */
+
+#define MAX_TRANSFORM_ROUNDS 16
+#define MAX_INLINE_PRODUCTIONS 256
+
+typedef struct HLLkTransform_ {
+  HLLkTable *table;
+  HArena *arena;            // table arena, for the new grammar
+  HArena *tmp;              // scratch, deleted after the transform
+  HCFSequence **epsilon;    // productions of marker symbols
+} HLLkTransform;
+
+static inline bool is_marker(const HLLkTransform *t, const HCFChoice *x)
+{
+  const HLLkSpecial *sp = special(t->table, x);
+  return sp && sp->kind != LLK_SPLICE;
+}
+
+// plain symbols (terminals and ordinary nonterminals) add exactly one
+// element to the enclosing result
+static inline bool is_plain(const HLLkTransform *t, const HCFChoice *x)
+{
+  return !special(t->table, x);
+}
+
+static size_t nitems(HCFChoice **items)
+{
+  size_t n;
+  for(n=0; items[n]; n++);
+  return n;
+}
+
+static void append_items(HCountedArray *b, HCFChoice **items,
+                         size_t from, size_t to)
+{
+  for(size_t i=from; i<to; i++)
+    h_carray_append(b, items[i]);
+}
+
+// turn an array of symbols into a production
+static HCFSequence *make_seq(HLLkTransform *t, HCountedArray *b)
+{
+  h_carray_append(b, NULL);
+  HCFSequence *seq = h_arena_malloc(t->arena, sizeof(HCFSequence));
+  seq->items = (HCFChoice **)b->elements;
+  return seq;
+}
+
+// turn an array of productions into the NULL-terminated list HCFChoice wants
+static HCFSequence **make_seqlist(HCountedArray *b)
+{
+  h_carray_append(b, NULL);
+  return (HCFSequence **)b->elements;
+}
+
+static HCFChoice *new_nt(HLLkTransform *t, HCFSequence **seq)
+{
+  HCFChoice *x = h_arena_malloc(t->arena, sizeof(HCFChoice));
+  memset(x, 0, sizeof(HCFChoice));
+  x->type = HCF_CHOICE;
+  x->seq = seq;
+  return x;
+}
+
+static HCFChoice *new_special(HLLkTransform *t, HLLkSpecialKind kind,
+                              const HCFChoice *nt, size_t n,
+                              const HCFChoice **opens)
+{
+  HLLkSpecial *sp = h_arena_malloc(t->arena, sizeof(HLLkSpecial));
+  sp->kind = kind;
+  sp->nt = nt;
+  sp->n = n;
+  sp->opens = opens;
+
+  HCFChoice *x = new_nt(t, kind == LLK_SPLICE ? NULL : t->epsilon);
+  h_hashtable_put(t->table->special, x, sp);
+  return x;
+}
+
+// a copy of x that shares its productions
+static HCFChoice *copy_nt(HLLkTransform *t, const HCFChoice *x)
+{
+  HCFChoice *c = h_arena_malloc(t->arena, sizeof(HCFChoice));
+  *c = *x;
+  const HLLkSpecial *sp = special(t->table, x);
+  if(sp)
+    h_hashtable_put(t->table->special, c, (void *)sp);
+  return c;
+}
+
+// deep copy of the grammar below x; terminals are shared
+static HCFChoice *clone_grammar(HLLkTransform *t, HHashTable *clones,
+                                const HCFChoice *x)
+{
+  if(x->type != HCF_CHOICE)
+    return (HCFChoice *)x;
+
+  HCFChoice *c = h_hashtable_get(clones, x);
+  if(c)
+    return c;
+  c = copy_nt(t, x);
+  h_hashtable_put(clones, x, c);
+
+  HCountedArray *seq = h_carray_new(t->arena);
+  for(HCFSequence **p = x->seq; *p; p++) {
+    HCountedArray *b = h_carray_new(t->arena);
+    for(HCFChoice **y = (*p)->items; *y; y++)
+      h_carray_append(b, clone_grammar(t, clones, *y));
+    h_carray_append(seq, make_seq(t, b));
+  }
+  c->seq = make_seqlist(seq);
+  return c;
+}
+
+// do a and b stand for the same thing?
+static bool symbol_eq(const HLLkTransform *t,
+                      const HCFChoice *a, const HCFChoice *b)
+{
+  if(a == b)
+    return true;
+  if(a->type != b->type || a->reshape != b->reshape || a->action != b->action
+     || a->pred != b->pred || a->user_data != b->user_data)
+    return false;
+
+  switch(a->type) {
+  case HCF_END:
+    return true;
+  case HCF_CHAR:
+    return a->chr == b->chr;
+  case HCF_CHARSET:
+    return memcmp(a->charset, b->charset, 256/8) == 0;
+  case HCF_CHOICE: {
+    const HLLkSpecial *sa = special(t->table, a);
+    const HLLkSpecial *sb = special(t->table, b);
+    if(!sa || !sb || sa->kind != sb->kind || sa->kind == LLK_SPLICE)
+      return false;
+    if(sa->nt != sb->nt || sa->n != sb->n)
+      return false;
+    if(sa->kind == LLK_FOLD) {
+      size_t i;
+      for(i=0; sa->opens[i] && sa->opens[i] == sb->opens[i]; i++);
+      return sa->opens[i] == sb->opens[i];
+    }
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+// the first symbol of items that isn't a marker, and its index
+static HCFChoice *leading(const HLLkTransform *t, HCFChoice **items,
+                          size_t *pos)
+{
+  size_t i;
+  for(i=0; items[i] && is_marker(t, items[i]); i++);
+  if(pos)
+    *pos = i;
+  return items[i];
+}
+
+static bool left_reaches_(const HLLkTransform *t, HHashSet *seen,
+                          const HCFChoice *x, const HCFChoice *target)
+{
+  for(HCFSequence **p = x->seq; *p; p++) {
+    const HCFChoice *y = leading(t, (*p)->items, NULL);
+    if(!y)
+      continue;
+    if(symbol_eq(t, y, target))
+      return true;
+    if(y->type != HCF_CHOICE)
+      continue;
+    if(h_hashset_present(seen, y))
+      continue;
+    h_hashset_put(seen, y);
+    if(left_reaches_(t, seen, y, target))
+      return true;
+  }
+  return false;
+}
+
+// can x derive a sentential form starting with target (or a terminal like
+// it)?
+// NB: only looks through markers, not other nullable symbols.
+static bool left_reaches(const HLLkTransform *t,
+                         const HCFChoice *x, const HCFChoice *target)
+{
+  if(x->type != HCF_CHOICE)
+    return false;
+  HHashSet *seen = h_hashset_new(t->tmp, h_eq_ptr, h_hash_ptr);
+  bool ret = left_reaches_(t, seen, x, target);
+  h_hashset_free(seen);
+  return ret;
+}
+
+// append to out the productions p becomes when the nonterminal at p[at] is
+// replaced by each of its own productions
+static void inline_at(HLLkTransform *t, HCountedArray *out,
+                      HCFChoice **p, size_t at)
+{
+  HCFChoice *x = p[at];
+  HCFChoice *open = NULL, *close = NULL;
+  if(is_plain(t, x)) {    // splices need no bookkeeping
+    open = new_special(t, LLK_OPEN, x, 0, NULL);
+    close = new_special(t, LLK_CLOSE, x, 0, NULL);
+  }
+
+  size_t n = nitems(p);
+  for(HCFSequence **q = x->seq; *q; q++) {
+    HCountedArray *b = h_carray_new(t->arena);
+    append_items(b, p, 0, at);
+    if(open)
+      h_carray_append(b, open);
+    append_items(b, (*q)->items, 0, nitems((*q)->items));
+    if(close)
+      h_carray_append(b, close);
+    append_items(b, p, at+1, n);
+    h_carray_append(out, make_seq(t, b));
+  }
+}
+
+/* Replace A -> O1..Om A alpha | beta (the Oi being opens, as inlining leaves
+ * them) by A -> beta A', A' -> fold alpha A' | epsilon, where the fold turns
+ * what has been parsed of A so far into the first element of the next round.
+ */
+static bool remove_left_recursion(HLLkTransform *t, HCFChoice *A)
+{
+  HCountedArray *base = h_carray_new(t->tmp);
+  HCountedArray *rec = h_carray_new(t->tmp);
+  bool dropped = false;
+
+  for(HCFSequence **p = A->seq; *p; p++) {
+    HCFChoice **items = (*p)->items;
+    size_t j;
+    if(leading(t, items, &j) != A) {
+      h_carray_append(base, *p);
+      continue;
+    }
+    if(j == 0 && !items[1]) {   // A -> A adds nothing
+      dropped = true;
+      continue;
+    }
+
+    HCountedArray *opens = h_carray_new(t->arena);
+    for(size_t i=0; i<j; i++) {
+      const HLLkSpecial *sp = special(t->table, items[i]);
+      if(sp->kind != LLK_OPEN || sp->n != 0)
+        return false;
+      h_carray_append(opens, (void *)sp->nt);
+    }
+    h_carray_append(opens, NULL);
+
+    HCountedArray *b = h_carray_new(t->arena);
+    h_carray_append(b, new_special(t, LLK_FOLD, A, 0,
+                                   (const HCFChoice **)opens->elements));
+    append_items(b, items, j+1, nitems(items));
+    h_carray_append(rec, b);
+  }
+  if(base->used == 0)
+    return false;   // A is unproductive; leave it to the table to reject
+  if(rec->used == 0 && !dropped)
+    return false;
+
+  HCFChoice *tail = new_special(t, LLK_SPLICE, NULL, 0, NULL);
+
+  HCountedArray *seq = h_carray_new(t->arena);
+  for(size_t i=0; i<base->used; i++) {
+    HCFSequence *beta = (void *)base->elements[i];
+    HCountedArray *b = h_carray_new(t->arena);
+    append_items(b, beta->items, 0, nitems(beta->items));
+    if(rec->used > 0)
+      h_carray_append(b, tail);
+    h_carray_append(seq, make_seq(t, b));
+  }
+  A->seq = make_seqlist(seq);
+
+  seq = h_carray_new(t->arena);
+  for(size_t i=0; i<rec->used; i++) {
+    HCountedArray *b = (void *)rec->elements[i];
+    h_carray_append(b, tail);
+    h_carray_append(seq, make_seq(t, b));
+  }
+  h_carray_append(seq, make_seq(t, h_carray_new(t->arena)));
+  tail->seq = make_seqlist(seq);
+
+  return true;
+}
+
+static size_t nt_index(HCountedArray *nts, const HCFChoice *x)
+{
+  size_t i;
+  for(i=0; i<nts->used && (void *)nts->elements[i] != x; i++);
+  return i;
+}
+
+/* Paull's algorithm, restricted to the nonterminals that are actually left
+ * recursive: going through them in order, inline the earlier ones where
+ * they lead back to the current one, then remove the direct left recursion
+ * that leaves.
+ */
+static void eliminate_left_recursion(HLLkTransform *t, HCFGrammar *g)
+{
+  // the grammar numbers its nonterminals in the order it found them
+  size_t n = g->nts->used;
+  HCFChoice **order = h_arena_malloc(t->tmp, n * sizeof(HCFChoice *));
+  for(size_t i=0; i < g->nts->capacity; i++) {
+    HHashTableEntry *hte = &g->nts->contents[i];
+    if(hte->key == NULL)
+      continue;
+    order[(uintptr_t)hte->value] = (HCFChoice *)hte->key;
+  }
+
+  // take the ones with a single production (sequences, mostly) first, so
+  // that they are inlined into the choices that use them. E -> E '+' T |
+  // E '*' T | T then reads E -> [E '+' T] | [E '*' T] | T, which is
+  // directly left recursive, rather than the other way around.
+  HCountedArray *lr = h_carray_new(t->tmp);
+  for(int single=1; single>=0; single--) {
+    for(size_t i=0; i<n; i++) {
+      bool one = order[i]->seq[0] && !order[i]->seq[1];
+      if(one == single && left_reaches(t, order[i], order[i]))
+        h_carray_append(lr, order[i]);
+    }
+  }
+
+  for(size_t i=0; i<lr->used; i++) {
+    HCFChoice *A = (void *)lr->elements[i];
+
+    for(size_t round=0; round < MAX_TRANSFORM_ROUNDS; round++) {
+      HCountedArray *seq = h_carray_new(t->arena);
+      bool changed = false;
+      for(HCFSequence **p = A->seq; *p; p++) {
+        size_t j;
+        HCFChoice *B = leading(t, (*p)->items, &j);
+        if(B && B != A && B->type == HCF_CHOICE && nt_index(lr, B) < i
+           && left_reaches(t, B, A)) {
+          inline_at(t, seq, (*p)->items, j);
+          changed = true;
+        } else {
+          h_carray_append(seq, *p);
+        }
+      }
+      if(!changed)
+        break;
+      A->seq = make_seqlist(seq);
+    }
+
+    remove_left_recursion(t, A);
+  }
+}
+
+// move opens right, past plain symbols, so that productions which differ
+// only in where a result begins get a common prefix
+static bool sink_opens(HLLkTransform *t, HCFChoice *A)
+{
+  HCountedArray *seq = h_carray_new(t->arena);
+  bool changed = false;
+
+  for(HCFSequence **p = A->seq; *p; p++) {
+    size_t n = nitems((*p)->items);
+    HCFChoice **items = NULL;
+    bool moved;
+    do {
+      moved = false;
+      for(size_t i=n-1; n > 1 && i-- > 0; ) {
+        HCFChoice **cur = items ? items : (*p)->items;
+        const HLLkSpecial *sp = special(t->table, cur[i]);
+        if(!sp || sp->kind != LLK_OPEN || !is_plain(t, cur[i+1]))
+          continue;
+        if(!items) {
+          items = h_arena_malloc(t->arena, (n+1) * sizeof(HCFChoice *));
+          memcpy(items, (*p)->items, (n+1) * sizeof(HCFChoice *));
+        }
+        items[i] = items[i+1];
+        items[i+1] = new_special(t, LLK_OPEN, sp->nt, sp->n + 1, NULL);
+        moved = true;
+      }
+    } while(moved);
+
+    if(items) {
+      HCFSequence *s = h_arena_malloc(t->arena, sizeof(HCFSequence));
+      s->items = items;
+      h_carray_append(seq, s);
+      changed = true;
+    } else {
+      h_carray_append(seq, *p);
+    }
+  }
+
+  if(changed)
+    A->seq = make_seqlist(seq);
+  return changed;
+}
+
+/* Replace A -> x y1 | x y2 | ... by A -> x A', A' -> y1 | y2 | ...
+ * with A' spliced into A's result.
+ */
+static bool left_factor(HLLkTransform *t, HCFChoice *A)
+{
+  size_t n;
+  for(n=0; A->seq[n]; n++);
+  bool *done = h_arena_malloc(t->tmp, n * sizeof(bool));
+  memset(done, 0, n * sizeof(bool));
+
+  HCountedArray *seq = h_carray_new(t->arena);
+  bool changed = false;
+
+  for(size_t i=0; i<n; i++) {
+    if(done[i])
+      continue;
+    HCFChoice **first = A->seq[i]->items;
+
+    // find the others that start like this one, and the common prefix
+    HCountedArray *group = h_carray_new(t->tmp);
+    h_carray_append(group, A->seq[i]);
+    size_t len = nitems(first);
+    for(size_t j=i+1; first[0] && j<n; j++) {
+      HCFChoice **other = A->seq[j]->items;
+      if(done[j] || !other[0] || !symbol_eq(t, first[0], other[0]))
         continue;
-      const HCFChoice *a = hte->key;        // production's left-hand symbol
-      assert(a->type == HCF_CHOICE);
+      size_t k;
+      for(k=0; k<len && other[k] && symbol_eq(t, first[k], other[k]); k++);
+      len = k;
+      done[j] = true;
+      h_carray_append(group, A->seq[j]);
+    }
+    if(group->used == 1) {
+      h_carray_append(seq, A->seq[i]);
+      continue;
+    }
+
+    HCountedArray *rest = h_carray_new(t->arena);
+    for(size_t j=0; j<group->used; j++) {
+      HCFSequence *p = (void *)group->elements[j];
+      HCountedArray *b = h_carray_new(t->arena);
+      append_items(b, p->items, len, nitems(p->items));
+      h_carray_append(rest, make_seq(t, b));
+    }
+    HCFChoice *tail = new_special(t, LLK_SPLICE, NULL, 0, NULL);
+    tail->seq = make_seqlist(rest);
+
+    HCountedArray *b = h_carray_new(t->arena);
+    append_items(b, first, 0, len);
+    h_carray_append(b, tail);
+    h_carray_append(seq, make_seq(t, b));
+    changed = true;
+  }
 
-      // create table row for this nonterminal
-      HStringMap *row = h_stringmap_new(table->arena);
-      h_hashtable_put(table->rows, a, row);
+  if(changed)
+    A->seq = make_seqlist(seq);
+  return changed;
+}
 
-      if(fill_table_row(kmax, g, row, a) < 0) {
-        // unresolvable conflicts in row
-        // NB we don't worry about deallocating anything, h_llk_compile will
-        //    delete the whole arena for us.
-        return -1;
+// inline the nonterminals that A's productions start with, where another
+// production starts with something they might derive, until the starts
+// line up. a production is left alone if all the others start with things
+// that derive it anyway, and so will come down to it in turn.
+static bool expand_leading(HLLkTransform *t, HCFChoice *A)
+{
+  bool changed = false;
+
+  for(size_t round=0; round < MAX_TRANSFORM_ROUNDS; round++) {
+    HCountedArray *seq = h_carray_new(t->arena);
+    bool expanded = false;
+
+    for(HCFSequence **p = A->seq; *p; p++) {
+      size_t j;
+      HCFChoice *X = leading(t, (*p)->items, &j);
+      bool expand = false;
+      if(X && X != A && X->type == HCF_CHOICE && !left_reaches(t, X, A)) {
+        for(HCFSequence **q = A->seq; *q && !expand; q++) {
+          HCFChoice *Y = leading(t, (*q)->items, NULL);
+          expand = (Y && !symbol_eq(t, X, Y) && !left_reaches(t, Y, X));
+        }
+      }
+
+      if(expand) {
+        inline_at(t, seq, (*p)->items, j);
+        expanded = true;
+      } else {
+        h_carray_append(seq, *p);
       }
+      if(seq->used > MAX_INLINE_PRODUCTIONS)
+        return false;
     }
+
+    if(!expanded)
+      break;
+    A->seq = make_seqlist(seq);
+    changed = true;
   }
-  
-  return 0;
+
+  return changed;
+}
+
+static bool factor_nt(HLLkTransform *t, HCFChoice *A)
+{
+  HCFSequence **orig = A->seq;
+
+  sink_opens(t, A);
+  if(left_factor(t, A))
+    return true;
+
+  // look one level deeper for common prefixes
+  if(expand_leading(t, A)) {
+    sink_opens(t, A);
+    if(left_factor(t, A))
+      return true;
+  }
+
+  A->seq = orig;
+  return false;
+}
+
+// give every use of A after the first its own copy of A
+static bool split_uses(HLLkTransform *t, HCFGrammar *g, const HCFChoice *A)
+{
+  bool first = true;
+  bool changed = false;
+
+  for(size_t i=0; i < g->nts->capacity; i++) {
+    HHashTableEntry *hte = &g->nts->contents[i];
+    if(hte->key == NULL)
+      continue;
+    HCFChoice *X = (HCFChoice *)hte->key;
+
+    HCountedArray *seq = h_carray_new(t->arena);
+    bool changed_x = false;
+    for(HCFSequence **p = X->seq; *p; p++) {
+      HCFChoice **items = (*p)->items;
+      HCountedArray *b = NULL;
+      for(size_t j=0; items[j]; j++) {
+        if(items[j] != A)
+          continue;
+        if(first) {
+          first = false;
+          continue;
+        }
+        if(!b) {
+          b = h_carray_new(t->arena);
+          append_items(b, items, 0, nitems(items));
+        }
+        b->elements[j] = (void *)copy_nt(t, A);
+      }
+      if(b) {
+        h_carray_append(seq, make_seq(t, b));
+        changed_x = true;
+      } else {
+        h_carray_append(seq, *p);
+      }
+    }
+    if(changed_x) {
+      X->seq = make_seqlist(seq);
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+/* Transform a copy of g until its table can be filled without conflicts.
+ * Returns -1 if that doesn't happen, 0 on success.
+ */
+static int fill_table_transformed(size_t kmax, HCFGrammar *g0,
+                                  HLLkTable *table)
+{
+  HAllocator *mm__ = g0->mm__;
+  HLLkTransform t;
+  t.table = table;
+  t.arena = table->arena;
+  t.tmp = h_new_arena(mm__, 0);
+  t.epsilon = h_arena_malloc(t.arena, 2 * sizeof(HCFSequence *));
+  t.epsilon[0] = make_seq(&t, h_carray_new(t.arena));
+  t.epsilon[1] = NULL;
+  table->special = h_hashtable_new(table->arena, h_eq_ptr, h_hash_ptr);
+
+  HHashTable *clones = h_hashtable_new(t.tmp, h_eq_ptr, h_hash_ptr);
+  HCFChoice *start = clone_grammar(&t, clones, g0->start);
+
+  HCFGrammar *g = h_cfgrammar_(mm__, start);
+  eliminate_left_recursion(&t, g);
+
+  int ret = -1;
+  for(size_t round=0; round < MAX_TRANSFORM_ROUNDS; round++) {
+    h_cfgrammar_free(g);
+    g = h_cfgrammar_(mm__, start);
+
+    HHashSet *failed = h_hashset_new(t.tmp, h_eq_ptr, h_hash_ptr);
+    table->rows = h_hashtable_new(table->arena, h_eq_ptr, h_hash_ptr);
+    if(fill_table(kmax, g, table, failed) == 0) {
+      ret = 0;
+      break;
+    }
+
+    bool changed = false;
+    for(size_t i=0; i < failed->capacity; i++) {
+      HHashTableEntry *hte = &failed->contents[i];
+      if(hte->key && factor_nt(&t, (HCFChoice *)hte->key))
+        changed = true;
+    }
+    for(size_t i=0; !changed && i < failed->capacity; i++) {
+      HHashTableEntry *hte = &failed->contents[i];
+      if(hte->key && split_uses(&t, g, hte->key))
+        changed = true;
+    }
+    if(!changed)
+      break;
+  }
+
+  h_cfgrammar_free(g);
+  h_delete_arena(t.tmp);
+  return ret;
 }
 
 int h_llk_compile(HAllocator* mm__, HParser* parser, const void* params)
@@ -228,18 +920,18 @@ int h_llk_compile(HAllocator* mm__, HParser* parser, const void* params)
   if(grammar == NULL)
     return -1;                  // -> Backend unsuitable for this parser.
 
-  // TODO: eliminate common prefixes
-  // TODO: eliminate left recursion
-  // TODO: avoid conflicts by splitting occurances?
-
   // generate table and store in parser->backend_data.
+  // if the grammar isn't LL(k) as it stands, try to make it so.
   HLLkTable *table = h_llktable_new(mm__);
-  if(fill_table(kmax, grammar, table) < 0) {
+  if(fill_table(kmax, grammar, table, NULL) < 0
+     && fill_table_transformed(kmax, grammar, table) < 0) {
     // the table was ambiguous
     h_cfgrammar_free(grammar);
     h_llktable_free(table);
     return -1;
   }
+  finalize_table(table, grammar);
+  table->generation = params ? 0 : h_grammar_generation();
   parser->backend_data = table;
 
   // free grammar and its arena.
@@ -249,6 +941,11 @@ int h_llk_compile(HAllocator* mm__, HParser* parser, const void* params)
   return 0;
 }
 
+static unsigned h_llk_generation(const HParser *parser)
+{
+  return ((HLLkTable *)parser->backend_data)->generation;
+}
+
 void h_llk_free(HParser *parser)
 {
   HLLkTable *table = parser->backend_data;
@@ -266,6 +963,7 @@ typedef struct {
   HArena *tarena;       // tmp, deleted after parse
   HSlist *stack;
   HCountedArray *seq;   // accumulates current parse result
+  HSlist *frames;       // enclosing results of LLK_OPEN markers
 
   uint8_t *buf;         // for lookahead across chunk boundaries
                         // allocated to size 2*kmax
@@ -287,16 +985,14 @@ typedef struct {
 // value for the surrounding production.
 static void const * const MARK = &MARK; // stack frame delimiter
 
-static HLLkState *llk_parse_start_(HAllocator* mm__, const HParser* parser)
+static void llk_state_init_(HLLkState *s, const HLLkTable *table,
+                            HArena *arena, HArena *tarena)
 {
-  const HLLkTable *table = parser->backend_data;
-  assert(table != NULL);
-
-  HLLkState *s = h_new(HLLkState, 1);
-  s->arena  = h_new_arena(mm__, 0);
-  s->tarena = h_new_arena(mm__, 0);
+  s->arena  = arena;
+  s->tarena = tarena;
   s->stack  = h_slist_new(s->tarena);
   s->seq    = h_carray_new(s->arena);
+  s->frames = h_slist_new(s->tarena);
   s->buf    = h_arena_malloc(s->tarena, 2 * table->kmax);
 
   s->win.input  = s->buf;
@@ -304,6 +1000,15 @@ static HLLkState *llk_parse_start_(HAllocator* mm__, const HParser* parser)
 
   // initialize with the start symbol on the stack.
   h_slist_push(s->stack, table->start);
+}
+
+static HLLkState *llk_parse_start_(HAllocator* mm__, const HParser* parser)
+{
+  const HLLkTable *table = parser->backend_data;
+  assert(table != NULL);
+
+  HLLkState *s = h_new(HLLkState, 1);
+  llk_state_init_(s, table, h_new_arena(mm__, 0), h_new_arena(mm__, 0));
 
   return s;
 }
@@ -372,6 +1077,7 @@ static HCountedArray *llk_parse_chunk_(HLLkState *s, const HParser* parser,
 {
   HParsedToken *tok = NULL;   // will hold result token
   HCFChoice *x = NULL;        // current symbol (from top of stack)
+  const HLLkSpecial *sp = NULL;
   HInputStream *stream;
 
   assert(chunk->index == 0);
@@ -412,7 +1118,22 @@ static HCountedArray *llk_parse_chunk_(HLLkState *s, const HParser* parser,
     x = h_slist_pop(stack);
     assert(x != NULL);
 
-    if(x != MARK && x->type == HCF_CHOICE) {
+    sp = (x != MARK)? special(table, x) : NULL;
+
+    if(sp && sp->kind == LLK_OPEN) {
+      // begin an inlined nonterminal's result, taking along its first
+      // sp->n elements, which have already been parsed
+      HCountedArray *inner = h_carray_new(arena);
+      for(size_t i = seq->used - sp->n; i < seq->used; i++)
+        h_carray_append(inner, seq->elements[i]);
+      seq->used -= sp->n;
+      h_slist_push(s->frames, seq);
+      seq = inner;
+      continue;
+    }
+
+    if(x != MARK && x->type == HCF_CHOICE
+       && (!sp || sp->kind == LLK_SPLICE)) {
       // x is a nonterminal; apply the appropriate production and continue
 
       // look up applicable production in parse table
@@ -427,13 +1148,16 @@ static HCountedArray *llk_parse_chunk_(HLLkState *s, const HParser* parser,
       // an infinite loop case that shouldn't happen
       assert(!p->items[0] || p->items[0] != x);
 
-      // push stack frame
-      h_slist_push(stack, seq);           // save current partial value
-      h_slist_push(stack, x);             // save the nonterminal
-      h_slist_push(stack, (void *)MARK);  // frame delimiter
+      // splices add to the current result rather than making their own
+      if(!sp) {
+        // push stack frame
+        h_slist_push(stack, seq);           // save current partial value
+        h_slist_push(stack, x);             // save the nonterminal
+        h_slist_push(stack, (void *)MARK);  // frame delimiter
 
-      // open a fresh result sequence
-      seq = h_carray_new(arena);
+        // open a fresh result sequence
+        seq = h_carray_new(arena);
+      }
 
       // push production's rhs onto the stack (in reverse order)
       HCFChoice **s;
@@ -445,7 +1169,7 @@ static HCountedArray *llk_parse_chunk_(HLLkState *s, const HParser* parser,
     }
 
     // the top of stack is such that there will be a result...
-    tok = h_arena_malloc(arena, sizeof(HParsedToken));
+    tok = h_arena_malloc0(arena, sizeof(HParsedToken));
     if(x == MARK) {
       // hit stack frame boundary...
       // wrap the accumulated parse result, this sequence is finished
@@ -458,6 +1182,23 @@ static HCountedArray *llk_parse_chunk_(HLLkState *s, const HParser* parser,
       seq = h_slist_pop(stack);
       // tok becomes next left-most element of higher-level sequence
     }
+    else if(sp) {
+      // end of an inlined nonterminal (LLK_CLOSE), or of a round of a
+      // formerly left-recursive one (LLK_FOLD)
+      tok->token_type = TT_SEQUENCE;
+      tok->seq = seq;
+      x = (HCFChoice *)sp->nt;
+
+      if(sp->kind == LLK_CLOSE) {
+        seq = h_slist_pop(s->frames);
+      } else {
+        seq = h_carray_new(arena);
+        for(const HCFChoice **o = sp->opens; *o; o++) {
+          h_slist_push(s->frames, seq);
+          seq = h_carray_new(arena);
+        }
+      }
+    }
     else {
       // x is a terminal or simple charset; match against input
 
@@ -465,7 +1206,7 @@ static HCountedArray *llk_parse_chunk_(HLLkState *s, const HParser* parser,
       tok->bit_offset = stream->bit_offset;
 
       // consume the input token
-      uint8_t input = h_read_bits(stream, 8, false);
+      uint8_t input = h_read_byte(stream);
 
       // when old chunk consumed from window, switch to new chunk
       if(s->win.length > 0 && s->win.index >= kmax) {
@@ -479,7 +1220,7 @@ static HCountedArray *llk_parse_chunk_(HLLkState *s, const HParser* parser,
           goto no_parse;
         if(!stream->last_chunk)
           goto need_input;
-        h_arena_free(arena, tok);
+        h_arena_free_sized(arena, tok, sizeof(HParsedToken));
         tok = NULL;
         break;
 
@@ -516,7 +1257,7 @@ static HCountedArray *llk_parse_chunk_(HLLkState *s, const HParser* parser,
         t->index = tok->index;
         t->bit_offset = tok->bit_offset;
       } else {
-        h_arena_free(arena, tok);
+        h_arena_free_sized(arena, tok, sizeof(HParsedToken));
       }
       tok = t;
     }
@@ -549,7 +1290,7 @@ static HCountedArray *llk_parse_chunk_(HLLkState *s, const HParser* parser,
   if(stream->last_chunk)
     goto no_parse;
   if(tok)
-    h_arena_free(arena, tok);   // no result, yet
+    h_arena_free_sized(arena, tok, sizeof(HParsedToken));   // no result, yet
   h_slist_push(stack, x);       // try this symbol again next time
   goto end;
 }
@@ -584,6 +1325,25 @@ HParseResult *h_llk_parse(HAllocator* mm__, const HParser* parser, HInputStream*
   return res;
 }
 
+HParseResult *h_llk_parse_context(HParseContext *ctx, HInputStream *stream)
+{
+  const HLLkTable *table = ctx->parser->backend_data;
+  assert(table != NULL);
+
+  HLLkState s;
+  llk_state_init_(&s, table, ctx->arena, ctx->tarena);
+
+  assert(stream->last_chunk);
+  s.seq = llk_parse_chunk_(&s, ctx->parser, stream);
+  if(!s.seq)
+    return NULL;
+
+  assert(s.seq->used == 1);
+  HParseResult *res = make_result(s.arena, s.seq->elements[0]);
+  res->bit_length = stream->index * 8 + stream->bit_offset;
+  return res;
+}
+
 void h_llk_parse_start(HSuspendedParser *s)
 {
   s->backend_state = llk_parse_start_(s->mm__, s->parser);
@@ -614,7 +1374,10 @@ HParserBackendVTable h__llk_backend_vtable = {
 
   .parse_start = h_llk_parse_start,
   .parse_chunk = h_llk_parse_chunk,
-  .parse_finish = h_llk_parse_finish
+  .parse_finish = h_llk_parse_finish,
+
+  .parse_context = h_llk_parse_context,
+  .generation = h_llk_generation
 };
 
 
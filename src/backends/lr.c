@@ -123,8 +123,11 @@ HLRTable *h_lrtable_new(HAllocator *mm__, size_t nrows)
   ret->tmap = h_arena_malloc(arena, nrows * sizeof(HStringMap *));
   ret->forall = h_arena_malloc(arena, nrows * sizeof(HLRAction *));
   ret->inadeq = h_slist_new(arena);
+  ret->lookahead = NULL;
+  ret->troot = NULL;
   ret->arena = arena;
   ret->mm__ = mm__;
+  ret->generation = 0;
 
   for(size_t i=0; i<nrows; i++) {
     ret->ntmap[i] = h_hashtable_new(arena, h_eq_symbol, h_hash_symbol);
@@ -142,6 +145,21 @@ void h_lrtable_free(HLRTable *table)
   h_free(table);
 }
 
+/* Lower the terminal lookahead maps into the flat form used by the parse
+ * loop. Done once the table for grammar g is complete; tmap stays valid but
+ * is not consulted anymore.
+ */
+void h_lrtable_finalize(HLRTable *table, const HCFGrammar *g)
+{
+  uint8_t classes[256];
+  size_t n = h_cfgrammar_byte_classes(g, classes);
+
+  table->lookahead = h_lookahead_new(table->arena, classes, n);
+  table->troot = h_arena_malloc(table->arena, table->nrows * sizeof(uint32_t));
+  for(size_t i=0; i<table->nrows; i++)
+    table->troot[i] = h_lookahead_add(table->lookahead, table->tmap[i]);
+}
+
 HLRAction *h_shift_action(HArena *arena, size_t nextstate)
 {
   HLRAction *action = h_arena_malloc(arena, sizeof(HLRAction));
@@ -207,8 +225,6 @@ HLREngine *h_lrengine_new_(HArena *arena, HArena *tarena, const HLRTable *table)
   engine->table = table;
   engine->state = 0;
   engine->stack = h_slist_new(tarena);
-  engine->merged[0] = NULL;
-  engine->merged[1] = NULL;
   engine->arena = arena;
   engine->tarena = tarena;
 
@@ -223,27 +239,23 @@ HLREngine *h_lrengine_new(HArena *arena, HArena *tarena, const HLRTable *table,
   return engine;
 }
 
-static const HLRAction *
-terminal_lookup(const HLREngine *engine, const HInputStream *stream)
+const HLRAction *h_lrtable_action(const HLRTable *table, size_t state,
+                                  const HInputStream *stream)
 {
-  const HLRTable *table = engine->table;
-  size_t state = engine->state;
-
   assert(state < table->nrows);
   if(table->forall[state]) {
     assert(h_lrtable_row_empty(table, state));  // that would be a conflict
     return table->forall[state];
   } else {
+    if(table->lookahead)
+      return h_lookahead_get(table->lookahead, table->troot[state], *stream);
     return h_stringmap_get_lookahead(table->tmap[state], *stream);
   }
 }
 
-static const HLRAction *
-nonterminal_lookup(const HLREngine *engine, const HCFChoice *symbol)
+const HLRAction *h_lrtable_goto(const HLRTable *table, size_t state,
+                                const HCFChoice *symbol)
 {
-  const HLRTable *table = engine->table;
-  size_t state = engine->state;
-
   assert(state < table->nrows);
   assert(!table->forall[state]);    // contains only reduce entries
                                     // we are only looking for shifts
@@ -252,28 +264,55 @@ nonterminal_lookup(const HLREngine *engine, const HCFChoice *symbol)
 
 const HLRAction *h_lrengine_action(const HLREngine *engine)
 {
-  return terminal_lookup(engine, &engine->input);
+  return h_lrtable_action(engine->table, engine->state, &engine->input);
 }
 
-static HParsedToken *consume_input(HLREngine *engine)
+HParsedToken *h_lr_consume_input(HArena *arena, HInputStream *input)
 {
   HParsedToken *v;
 
-  uint8_t c = h_read_bits(&engine->input, 8, false);
+  uint8_t c = h_read_byte(input);
 
-  if(engine->input.overrun) {     // end of input
+  if(input->overrun) {     // end of input
     v = NULL;
   } else {
-    v = h_arena_malloc(engine->arena, sizeof(HParsedToken));
+    v = h_arena_malloc0(arena, sizeof(HParsedToken));
     v->token_type = TT_UINT;
     v->uint = c;
-    v->index = engine->input.pos + engine->input.index - 1;
-    v->bit_offset = engine->input.bit_offset;
+    v->index = input->pos + input->index - 1;
+    v->bit_offset = input->bit_offset;
   }
 
   return v;
 }
 
+bool h_lr_reduce_value(HArena *arena, HArena *tarena,
+                       const HCFChoice *symbol, HParsedToken **value)
+{
+  HParsedToken *v = *value;
+
+  // perform token reshape if indicated
+  if(symbol->reshape) {
+    HParsedToken *r = symbol->reshape(make_result(arena, v), symbol->user_data);
+    if(r) {
+      r->index = v->index;
+      r->bit_offset = v->bit_offset;
+    } else {
+      h_arena_free_sized(arena, v, sizeof(HParsedToken));
+    }
+    v = r;
+  }
+
+  // call validation and semantic action, if present
+  if(symbol->pred && !symbol->pred(make_result(tarena, v), symbol->user_data))
+    return false;
+  if(symbol->action)
+    v = symbol->action(make_result(arena, v), symbol->user_data);
+
+  *value = v;
+  return true;
+}
+
 // run LR parser for one round; returns false when finished
 bool h_lrengine_step(HLREngine *engine, const HLRAction *action)
 {
@@ -292,7 +331,7 @@ bool h_lrengine_step(HLREngine *engine, const HLRAction *action)
     HCFChoice *symbol = action->production.lhs;
 
     // semantic value of the reduction result
-    HParsedToken *value = h_arena_malloc(arena, sizeof(HParsedToken));
+    HParsedToken *value = h_arena_malloc0(arena, sizeof(HParsedToken));
     value->token_type = TT_SEQUENCE;
     value->seq = h_carray_new_sized(arena, len);
     
@@ -316,28 +355,14 @@ bool h_lrengine_step(HLREngine *engine, const HLRAction *action)
       value->bit_offset = engine->input.bit_offset;
     }
 
-    // perform token reshape if indicated
-    if(symbol->reshape) {
-      v = symbol->reshape(make_result(arena, value), symbol->user_data);
-      if(v) {
-        v->index = value->index;
-        v->bit_offset = value->bit_offset;
-      } else {
-        h_arena_free(arena, value);
-      }
-      value = v;
-    }
-
-    // call validation and semantic action, if present
-    if(symbol->pred && !symbol->pred(make_result(tarena, value), symbol->user_data))
+    // perform token reshape, validation and semantic action
+    if(!h_lr_reduce_value(arena, tarena, symbol, &value))
       return false;     // validation failed -> no parse; terminate
-    if(symbol->action)
-      value = symbol->action(make_result(arena, value), symbol->user_data);
 
     // this is LR, building a right-most derivation bottom-up, so no reduce can
     // follow a reduce. we can also assume no conflict follows for GLR if we
     // use LALR tables, because only terminal symbols (lookahead) get reduces.
-    const HLRAction *shift = nonterminal_lookup(engine, symbol);
+    const HLRAction *shift = h_lrtable_goto(engine->table, engine->state, symbol);
     if(shift == NULL)
       return false;     // parse error
     assert(shift->type == HLR_SHIFT);
@@ -354,7 +379,7 @@ bool h_lrengine_step(HLREngine *engine, const HLRAction *action)
     }
   } else {
     assert(action->type == HLR_SHIFT);
-    HParsedToken *value = consume_input(engine);
+    HParsedToken *value = h_lr_consume_input(arena, &engine->input);
     h_slist_push(stack, (void *)(uintptr_t)engine->state);
     h_slist_push(stack, value);
     engine->state = action->nextstate;
@@ -378,14 +403,11 @@ HParseResult *h_lrengine_result(HLREngine *engine)
   }
 }
 
-HParseResult *h_lr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream)
+// runs the engine to completion. on failure, arena is left for the caller
+// to delete or rewind.
+static HParseResult *lr_parse_(HArena *arena, HArena *tarena,
+                               HLRTable *table, HInputStream *stream)
 {
-  HLRTable *table = parser->backend_data;
-  if(!table)
-    return NULL;
-
-  HArena *arena  = h_new_arena(mm__, 0);    // will hold the results
-  HArena *tarena = h_new_arena(mm__, 0);    // tmp, deleted after parse
   HLREngine *engine = h_lrengine_new(arena, tarena, table, stream);
 
   // out-of-memory handling
@@ -393,8 +415,8 @@ HParseResult *h_lr_parse(HAllocator* mm__, const HParser* parser, HInputStream*
   h_arena_set_except(arena, &except);
   h_arena_set_except(tarena, &except);
   if(setjmp(except)) {
-    h_delete_arena(arena);
-    h_delete_arena(tarena);
+    h_arena_set_except(arena, NULL);
+    h_arena_set_except(tarena, NULL);
     return NULL;
   }
 
@@ -402,12 +424,35 @@ HParseResult *h_lr_parse(HAllocator* mm__, const HParser* parser, HInputStream*
   while(h_lrengine_step(engine, h_lrengine_action(engine)));
 
   HParseResult *result = h_lrengine_result(engine);
+  h_arena_set_except(arena, NULL);
+  h_arena_set_except(tarena, NULL);
+  return result;
+}
+
+HParseResult *h_lr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream)
+{
+  HLRTable *table = parser->backend_data;
+  if(!table)
+    return NULL;
+
+  HArena *arena  = h_new_arena(mm__, 0);    // will hold the results
+  HArena *tarena = h_new_arena(mm__, 0);    // tmp, deleted after parse
+  HParseResult *result = lr_parse_(arena, tarena, table, stream);
   if(!result)
     h_delete_arena(arena);
   h_delete_arena(tarena);
   return result;
 }
 
+HParseResult *h_lr_parse_context(HParseContext *ctx, HInputStream *stream)
+{
+  HLRTable *table = ctx->parser->backend_data;
+  if(!table)
+    return NULL;
+
+  return lr_parse_(ctx->arena, ctx->tarena, table, stream);
+}
+
 void h_lr_parse_start(HSuspendedParser *s)
 {
   HLRTable *table = s->parser->backend_data;
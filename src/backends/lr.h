@@ -51,11 +51,14 @@ typedef struct HLRTable_ {
   size_t     nrows;     // dimension of the pointer arrays below
   HHashTable **ntmap;   // map nonterminal symbols to HLRActions, per row
   HStringMap **tmap;    // map lookahead strings to HLRActions, per row
+  HLookaheadTable *lookahead; // flat form of tmap, see h_lrtable_finalize
+  uint32_t   *troot;    // root node in lookahead, per row
   HLRAction  **forall;  // shortcut to set an action for an entire row
   HCFChoice  *start;    // start symbol
   HSlist     *inadeq;   // indices of any inadequate states
   HArena     *arena;
   HAllocator *mm__;
+  unsigned   generation; // see HParserBackendVTable
 } HLRTable;
 
 typedef struct HLREnhGrammar_ {
@@ -73,8 +76,6 @@ typedef struct HLREngine_ {
   HSlist *stack;        // holds pairs: (saved state, semantic value)
   HInputStream input;
 
-  struct HLREngine_ *merged[2]; // ancestors merged into this engine
-
   HArena *arena;        // will hold the results
   HArena *tarena;       // tmp, deleted after parse
 } HLREngine;
@@ -87,19 +88,16 @@ typedef struct HLREngine_ {
 #define H_FOREACH_(HT) {                                                    \
     const HHashTable *ht__ = HT;                                            \
     for(size_t i__=0; i__ < ht__->capacity; i__++) {                        \
-      for(HHashTableEntry *hte__ = &ht__->contents[i__];                    \
-          hte__;                                                            \
-          hte__ = hte__->next) {                                            \
-        if(hte__->key == NULL) continue;
+      HHashTableEntry *hte__ = &ht__->contents[i__];                        \
+      if(hte__->key == NULL) continue;
 
 #define H_FOREACH_KEY(HT, KEYVAR) H_FOREACH_(HT)                            \
-        const KEYVAR = hte__->key;
+      const KEYVAR = hte__->key;
 
 #define H_FOREACH(HT, KEYVAR, VALVAR) H_FOREACH_KEY(HT, KEYVAR)             \
-        VALVAR = hte__->value;
+      VALVAR = hte__->value;
 
 #define H_END_FOREACH                                                       \
-      }                                                                     \
     }                                                                       \
   }
 
@@ -109,6 +107,7 @@ HLRItem *h_lritem_new(HArena *a, HCFChoice *lhs, HCFChoice **rhs, size_t mark);
 HLRState *h_lrstate_new(HArena *arena);
 HLRTable *h_lrtable_new(HAllocator *mm__, size_t nrows);
 void h_lrtable_free(HLRTable *table);
+void h_lrtable_finalize(HLRTable *table, const HCFGrammar *g);
 HLREngine *h_lrengine_new(HArena *arena, HArena *tarena, const HLRTable *table,
                           const HInputStream *stream);
 HLRAction *h_reduce_action(HArena *arena, const HLRItem *item);
@@ -129,15 +128,26 @@ HLRTable *h_lr0_table(HCFGrammar *g, const HLRDFA *dfa);
 HCFChoice *h_desugar_augmented(HAllocator *mm__, HParser *parser);
 int h_lalr_compile(HAllocator* mm__, HParser* parser, const void* params);
 void h_lalr_free(HParser *parser);
+unsigned h_lalr_generation(const HParser *parser);
+
+const HLRAction *h_lrtable_action(const HLRTable *table, size_t state,
+                                  const HInputStream *stream);
+const HLRAction *h_lrtable_goto(const HLRTable *table, size_t state,
+                                const HCFChoice *symbol);
+HParsedToken *h_lr_consume_input(HArena *arena, HInputStream *input);
+bool h_lr_reduce_value(HArena *arena, HArena *tarena,
+                       const HCFChoice *symbol, HParsedToken **value);
 
 const HLRAction *h_lrengine_action(const HLREngine *engine);
 bool h_lrengine_step(HLREngine *engine, const HLRAction *action);
 HParseResult *h_lrengine_result(HLREngine *engine);
 HParseResult *h_lr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream);
+HParseResult *h_lr_parse_context(HParseContext *ctx, HInputStream *stream);
 void h_lr_parse_start(HSuspendedParser *s);
 bool h_lr_parse_chunk(HSuspendedParser* s, HInputStream *stream);
 HParseResult *h_lr_parse_finish(HSuspendedParser *s);
 HParseResult *h_glr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream);
+HParseResult *h_glr_parse_context(HParseContext *ctx, HInputStream *stream);
 
 void h_pprint_lritem(FILE *f, const HCFGrammar *g, const HLRItem *item);
 void h_pprint_lrstate(FILE *f, const HCFGrammar *g,
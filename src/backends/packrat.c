@@ -3,30 +3,234 @@
 #include "../internal.h"
 #include "../parsers/parser_internal.h"
 
+// reuses the values of evicted memo entries, if there are any
+static inline HParserCacheValue *new_cache_value(HParseState *state) {
+  HParserCacheValue *ret = state->memo->spare_values;
+  if (ret)
+    state->memo->spare_values = ret->next;
+  else
+    ret = a_new(HParserCacheValue, 1);
+  return ret;
+}
+
 // short-hand for creating lowlevel parse cache values (parse result case)
 static
 HParserCacheValue * cached_result(HParseState *state, HParseResult *result) {
-  HParserCacheValue *ret = a_new(HParserCacheValue, 1);
+  HParserCacheValue *ret = new_cache_value(state);
   ret->value_type = PC_RIGHT;
   ret->right = result;
   ret->input_stream = state->input_stream;
+  ret->starved_in = 0;
   return ret;
 }
 
 // short-hand for creating lowlevel parse cache values (left recursion case)
 static
 HParserCacheValue *cached_lr(HParseState *state, HLeftRec *lr) {
-  HParserCacheValue *ret = a_new(HParserCacheValue, 1);
+  HParserCacheValue *ret = new_cache_value(state);
   ret->value_type = PC_LEFT;
   ret->left = lr;
   ret->input_stream = state->input_stream;
+  ret->starved_in = 0;
   return ret;
 }
 
+// the parts of an input position that can differ between two memo
+// entries at the same byte index
+static inline uint32_t memo_subpos(const HInputStream *pos) {
+  return ((uint32_t)(uint8_t)pos->bit_offset
+          | (uint32_t)(uint8_t)pos->margin << 8
+          | (uint32_t)(uint8_t)pos->endianness << 16
+          | (uint32_t)pos->overrun << 24);
+}
+
+// forget the finished results on one page. results still being grown by
+// left recursion stay. returns true if the page ended up empty.
+static bool memo_sweep(HMemoTable *m, HMemoSlab *page) {
+  bool empty = true;
+  for (size_t i = 0; i < H_MEMO_PAGE_SIZE; i++) {
+    HMemoSlab *slab = &page[i];
+    uint32_t kept = 0;
+    for (uint32_t j = 0; j < slab->used; j++) {
+      HMemoEntry *e = &slab->entries[j];
+      HParserCacheValue *v = e->value;
+      if (e->parser && PC_RIGHT == v->value_type) {
+        v->next = m->spare_values;
+        m->spare_values = v;
+      } else {
+        slab->entries[kept++] = *e;
+      }
+    }
+    slab->used = kept;
+    if (kept)
+      empty = false;
+  }
+  return empty;
+}
+
+// sweep the pages that have fallen out of the window. nothing is swept
+// while left recursion is being grown, as that revisits old positions
+// and holds on to their entries.
+static void memo_evict(HMemoTable *m) {
+  if (m->nheads || m->hi_page < m->window_pages)
+    return;
+  size_t end = m->hi_page - m->window_pages;
+  for (size_t p = m->lo_page; p < end; p++) {
+    HMemoSlab *page = m->pages[p];
+    if (page && memo_sweep(m, page)) {
+      m->pages[p] = NULL;
+      h_slist_push(m->spare_pages, page);
+    }
+  }
+  if (end > m->lo_page)
+    m->lo_page = end;
+}
+
+// find the slab for a byte index, allocating it if create is set
+static HMemoSlab *memo_slab(HMemoTable *m, size_t index, bool create) {
+  size_t p = index / H_MEMO_PAGE_SIZE;
+  if (p >= m->npages) {
+    if (!create)
+      return NULL;
+    size_t npages = m->npages * 2 > p ? m->npages * 2 : p + 1;
+    HMemoSlab **pages = h_arena_malloc(m->arena, npages * sizeof(HMemoSlab*));
+    memcpy(pages, m->pages, m->npages * sizeof(HMemoSlab*));
+    memset(pages + m->npages, 0, (npages - m->npages) * sizeof(HMemoSlab*));
+    h_arena_free_sized(m->arena, m->pages, m->npages * sizeof(HMemoSlab*));
+    m->pages = pages;
+    m->npages = npages;
+  }
+  HMemoSlab *page = m->pages[p];
+  if (!page) {
+    if (!create)
+      return NULL;
+    page = h_slist_pop(m->spare_pages);
+    if (!page) {
+      page = h_arena_malloc(m->arena, H_MEMO_PAGE_SIZE * sizeof(HMemoSlab));
+      memset(page, 0, H_MEMO_PAGE_SIZE * sizeof(HMemoSlab));
+    }
+    m->pages[p] = page;
+    if (p < m->lo_page) // backtracked behind the window
+      m->lo_page = p;
+  }
+  if (create && p > m->hi_page) {
+    m->hi_page = p;
+    if (m->window_pages)
+      memo_evict(m);
+  }
+  return &page[index % H_MEMO_PAGE_SIZE];
+}
+
+static inline HMemoEntry *memo_find(HMemoSlab *slab, const HParser *parser,
+                                    uint32_t subpos) {
+  if (!slab)
+    return NULL;
+  for (uint32_t i = 0; i < slab->used; i++) {
+    HMemoEntry *e = &slab->entries[i];
+    if (e->parser == parser && e->subpos == subpos)
+      return e;
+  }
+  return NULL;
+}
+
+static void *memo_lookup(HMemoTable *m, const HParser *parser,
+                         const HInputStream *pos) {
+  HMemoEntry *e = memo_find(memo_slab(m, pos->index, false), parser,
+                            memo_subpos(pos));
+  return e ? e->value : NULL;
+}
+
+// returns true if a new entry was made, false if one was overwritten
+static bool memo_store(HMemoTable *m, const HParser *parser,
+                       const HInputStream *pos, void *value) {
+  HMemoSlab *slab = memo_slab(m, pos->index, true);
+  uint32_t subpos = memo_subpos(pos);
+  HMemoEntry *e = memo_find(slab, parser, subpos);
+  if (e) {
+    e->value = value;
+    return false;
+  }
+  if (slab->used == slab->capacity) {
+    uint32_t capacity = slab->capacity ? slab->capacity * 2 : 4;
+    HMemoEntry *entries = h_arena_malloc(m->arena, capacity * sizeof(HMemoEntry));
+    if (slab->used)
+      memcpy(entries, slab->entries, slab->used * sizeof(HMemoEntry));
+    h_arena_free_sized(m->arena, slab->entries, slab->capacity * sizeof(HMemoEntry));
+    slab->entries = entries;
+    slab->capacity = capacity;
+  }
+  e = &slab->entries[slab->used++];
+  e->parser = parser;
+  e->subpos = subpos;
+  e->value = value;
+  return true;
+}
+
+// returns true if there was an entry to remove
+static bool memo_remove(HMemoTable *m, const HParser *parser,
+                        const HInputStream *pos) {
+  HMemoSlab *slab = memo_slab(m, pos->index, false);
+  HMemoEntry *e = memo_find(slab, parser, memo_subpos(pos));
+  if (!e)
+    return false;
+  *e = slab->entries[--slab->used];
+  return true;
+}
+
+static inline HParserCacheValue *memo_get(HParseState *state, HParserCacheKey *k) {
+  return memo_lookup(state->memo, k->parser, &k->input_pos);
+}
+
+static inline void memo_put(HParseState *state, HParserCacheKey *k, HParserCacheValue *v) {
+  memo_store(state->memo, k->parser, &k->input_pos, v);
+  state->retained++;
+}
+
+// recursion heads are memo entries without a parser. there usually are
+// none at all, in which case we don't need to look.
+static inline HRecursionHead *heads_get(HParseState *state, const HInputStream *pos) {
+  if (!state->memo->nheads)
+    return NULL;
+  return memo_lookup(state->memo, NULL, pos);
+}
+
+static inline void heads_put(HParseState *state, const HInputStream *pos, HRecursionHead *head) {
+  if (memo_store(state->memo, NULL, pos, head))
+    state->memo->nheads++;
+  state->retained++;
+}
+
+static inline void heads_del(HParseState *state, const HInputStream *pos) {
+  if (memo_remove(state->memo, NULL, pos))
+    state->memo->nheads--;
+  state->retained++;
+}
+
+// go back to a position from the memo table. a chunked parse may have
+// stored it with an earlier, shorter buffer, so only the position counts.
+static inline void restore_pos(HParseState *state, const HInputStream *pos) {
+  HInputStream *in = &state->input_stream;
+  const uint8_t *input = in->input;
+  size_t length = in->length;
+  bool last_chunk = in->last_chunk;
+  *in = *pos;
+  in->input = input;
+  in->length = length;
+  in->last_chunk = last_chunk;
+}
+
 // Really library-internal tool to perform an uncached parse, and handle any common error-handling.
+// If the parse fails without having memoized anything, whatever it
+// allocated is given back right away. That's only safe if what's already
+// in the memo table is left as it was: anything that changes a memo entry,
+// or an object one can reach, or points one at something new, must count
+// itself in state->retained.
 static inline HParseResult* perform_lowlevel_parse(HParseState *state, const HParser *parser) {
   // TODO(thequux): these nested conditions are ugly. Factor this appropriately, so that it is clear which codes is executed when.
   HParseResult *tmp_res;
+  HArenaMark mark;
+  size_t retained = state->retained;
+  h_arena_mark(state->arena, &mark);
   if (parser) {
     HInputStream bak = state->input_stream;
     tmp_res = parser->vtable->parse(parser->env, state);
@@ -45,20 +249,26 @@ static inline HParseResult* perform_lowlevel_parse(HParseState *state, const HPa
     }
   } else
     tmp_res = NULL;
-  if (state->input_stream.overrun)
-    return NULL; // overrun is always failure.
+  if (state->input_stream.overrun) {
+    if (!state->input_stream.last_chunk)
+      state->starved = true;
+    tmp_res = NULL; // overrun is always failure.
+  }
 #ifdef CONSISTENCY_CHECK
   if (!tmp_res) {
     state->input_stream = INVALID;
     state->input_stream.input = key->input_pos.input;
   }
 #endif
+  // nothing memoized and nothing memoized changed, so nothing is lost
+  if (!tmp_res && state->retained == retained)
+    h_arena_rewind(state->arena, &mark);
   return tmp_res;
 }
 
 HParserCacheValue* recall(HParserCacheKey *k, HParseState *state) {
-  HParserCacheValue *cached = h_hashtable_get(state->cache, k);
-  HRecursionHead *head = h_hashtable_get(state->recursion_heads, &k->input_pos);
+  HParserCacheValue *cached = memo_get(state, k);
+  HRecursionHead *head = heads_get(state, &k->input_pos);
   if (!head) { // No heads found
     return cached;
   } else { // Some heads found
@@ -74,11 +284,12 @@ HParserCacheValue* recall(HParserCacheKey *k, HParseState *state) {
       // update the cache
       if (!cached) {
 	cached = cached_result(state, tmp_res);
-	h_hashtable_put(state->cache, k, cached);
+	memo_put(state, k, cached);
       } else {
 	cached->value_type = PC_RIGHT;
 	cached->right = tmp_res;
 	cached->input_stream = state->input_stream;
+	state->retained++;
       }
     }
     return cached;
@@ -91,6 +302,8 @@ HParserCacheValue* recall(HParserCacheKey *k, HParseState *state) {
  */
 
 void setupLR(const HParser *p, HParseState *state, HLeftRec *rec_detect) {
+  state->retained++;
+  state->memo->recursed = true;
   if (!rec_detect->head) {
     HRecursionHead *some = a_new(HRecursionHead, 1);
     some->head_parser = p;
@@ -123,14 +336,14 @@ static inline bool pos_lt(HInputStream pos1, HInputStream pos2) {
 
 HParseResult* grow(HParserCacheKey *k, HParseState *state, HRecursionHead *head) {
   // Store the head into the recursion_heads
-  h_hashtable_put(state->recursion_heads, &k->input_pos, head);
-  HParserCacheValue *old_cached = h_hashtable_get(state->cache, k);
+  heads_put(state, &k->input_pos, head);
+  HParserCacheValue *old_cached = memo_get(state, k);
   if (!old_cached || PC_LEFT == old_cached->value_type)
     h_platform_errx(1, "impossible match");
   HParseResult *old_res = old_cached->right;
 
   // rewind the input
-  state->input_stream = k->input_pos;
+  restore_pos(state, &k->input_pos);
   
   // reset the eval_set of the head of the recursion at each beginning of growth
   head->eval_set = h_slist_copy(head->involved_set);
@@ -138,22 +351,22 @@ HParseResult* grow(HParserCacheKey *k, HParseState *state, HRecursionHead *head)
 
   if (tmp_res) {
     if (pos_lt(old_cached->input_stream, state->input_stream)) {
-      h_hashtable_put(state->cache, k, cached_result(state, tmp_res));
+      memo_put(state, k, cached_result(state, tmp_res));
       return grow(k, state, head);
     } else {
       // we're done with growing, we can remove data from the recursion head
-      h_hashtable_del(state->recursion_heads, &k->input_pos);
-      HParserCacheValue *cached = h_hashtable_get(state->cache, k);
+      heads_del(state, &k->input_pos);
+      HParserCacheValue *cached = memo_get(state, k);
       if (cached && PC_RIGHT == cached->value_type) {
-        state->input_stream = cached->input_stream;
+        restore_pos(state, &cached->input_stream);
 	return cached->right;
       } else {
 	h_platform_errx(1, "impossible match");
       }
     }
   } else {
-    h_hashtable_del(state->recursion_heads, &k->input_pos);
-    state->input_stream = old_cached->input_stream;
+    heads_del(state, &k->input_pos);
+    restore_pos(state, &old_cached->input_stream);
     return old_res;
   }
 }
@@ -166,7 +379,7 @@ HParseResult* lr_answer(HParserCacheKey *k, HParseState *state, HLeftRec *growab
     }
     else {
       // update cache
-      h_hashtable_put(state->cache, k, cached_result(state, growable->seed));
+      memo_put(state, k, cached_result(state, growable->seed));
       if (!growable->seed)
 	return NULL;
       else
@@ -177,38 +390,117 @@ HParseResult* lr_answer(HParserCacheKey *k, HParseState *state, HLeftRec *growab
   }
 }
 
-/* Warth's recursion. Hi Alessandro! */
+static inline bool memoized(HParseState *state, const HParser *parser) {
+  // primitive parsers can't grow, so there's nothing to gain by caching them
+  if (!parser->vtable->higher)
+    return false;
+  switch (state->memo->select) {
+  case H_PACKRAT_MEMO_ALL:       return true;
+  case H_PACKRAT_MEMO_RECURSIVE: return parser->vtable->rule;
+  default:                       return false;
+  }
+}
+
+// the LR of parser if it's already being parsed here, i.e. we got back to
+// it by left recursion. sets *in_rule if a rule is being parsed here.
+// what's on the stack started at or before where the parsers above it
+// did, so only the top needs looking at.
+static HLeftRec *lr_active(HParseState *state, const HParser *parser, bool *in_rule) {
+  size_t index = state->input_stream.index;
+  uint32_t subpos = memo_subpos(&state->input_stream);
+  *in_rule = false;
+  for (HSlistNode *it = state->lr_stack->head; it; it = it->next) {
+    HLeftRec *lr = it->elem;
+    if (lr->index < index)
+      break;
+    if (lr->subpos != subpos)
+      continue;
+    if (lr->rule == parser)
+      return lr;
+    if (lr->rule->vtable->rule)
+      *in_rule = true;
+  }
+  return NULL;
+}
+
+/* Warth's recursion. Hi Alessandro!
+ *
+ * With H_PACKRAT_MEMO_RECURSIVE, a parser that isn't a rule is only
+ * remembered if it is parsed within a rule at the same position, or where
+ * a left recursion is growing, or turns out to be part of one. Left
+ * recursion is still caught where it would be with everything memoized,
+ * by finding the parser on the LR stack, so it gets the same head.
+ */
 HParseResult* h_do_parse(const HParser* parser, HParseState *state) {
-  HParserCacheKey *key = a_new(HParserCacheKey, 1);
-  key->input_pos = state->input_stream; key->parser = parser;
+  if (!parser->vtable->higher || state->memo->select == H_PACKRAT_MEMO_NONE)
+    return perform_lowlevel_parse(state, parser);
+
+  HParserCacheKey k = { .input_pos = state->input_stream, .parser = parser };
+  HParserCacheKey *key = &k;
   HParserCacheValue *m = NULL;
-  if (parser->vtable->higher) {
+  bool remember = memoized(state, parser);
+  if (remember || memo_get(state, key)) {
+    remember = true;
     m = recall(key, state);
+  } else {
+    bool in_rule;
+    HLeftRec *lr = lr_active(state, parser, &in_rule);
+    if (lr) {
+      setupLR(parser, state, lr);
+      return lr->seed;
+    }
+    if (in_rule || heads_get(state, &key->input_pos)) {
+      remember = true;
+      m = recall(key, state);
+    }
   }
+  // an entry that ran out of input in an earlier try of a chunked parse
+  // may come out differently now there is more
+  if (m && m->starved_in && m->starved_in != state->attempt)
+    m = NULL;
   // check to see if there is already a result for this object...
   if (!m) {
-    // It doesn't exist, so create a dummy result to cache
-    HLeftRec *base = a_new(HLeftRec, 1);
-    // But only cache it now if there's some chance it could grow; primitive parsers can't
-    if (parser->vtable->higher) {
-      base->seed = NULL; base->rule = parser; base->head = NULL;
-      h_slist_push(state->lr_stack, base);
-      // cache it
-      h_hashtable_put(state->cache, key, cached_lr(state, base));
-      // parse the input
-    }
+    // It doesn't exist, so create a dummy result to cache. unless it
+    // turns out to be part of a left recursion, it's only needed while we
+    // parse, so it starts out on the stack.
+    HLeftRec lr = { .seed = NULL, .rule = parser, .head = NULL,
+                    .index = key->input_pos.index,
+                    .subpos = memo_subpos(&key->input_pos) };
+    HLeftRec *base = &lr;
+    h_slist_push(state->lr_stack, base);
+    // cache it
+    if (remember)
+      memo_put(state, key, cached_lr(state, base));
+    // parse the input, noting whether this parser ran out of it
+    bool starved = state->starved;
+    state->starved = false;
     HParseResult *tmp_res = perform_lowlevel_parse(state, parser);
-    if (parser->vtable->higher) {
-      // the base variable has passed equality tests with the cache
-      h_slist_pop(state->lr_stack);
-      // update the cached value to our new position
-      HParserCacheValue *cached = h_hashtable_get(state->cache, key);
-      assert(cached != NULL);
-      cached->input_stream = state->input_stream;
+    // the base variable has passed equality tests with the cache
+    h_slist_pop(state->lr_stack);
+    if (!base->head && !remember) {
+      state->starved |= starved;
+      return tmp_res;
+    }
+    if (base->head) {
+      // part of a left recursion, so the memo table holds on to it
+      base = a_new(HLeftRec, 1);
+      *base = lr;
+      if (!remember)
+        memo_put(state, key, cached_lr(state, base));
     }
+    // update the cached value to our new position
+    HParserCacheValue *cached = memo_get(state, key);
+    assert(cached != NULL);
+    if (PC_LEFT == cached->value_type && cached->left == &lr)
+      cached->left = base;
+    cached->input_stream = state->input_stream;
+    cached->starved_in = state->starved ? state->attempt : 0;
+    state->starved |= starved;
+    state->retained++;
     // setupLR, used below, mutates the LR to have a head if appropriate, so we check to see if we have one
     if (NULL == base->head) {
-      h_hashtable_put(state->cache, key, cached_result(state, tmp_res));
+      cached->value_type = PC_RIGHT;
+      cached->right = tmp_res;
       return tmp_res;
     } else {
       base->seed = tmp_res;
@@ -217,7 +509,9 @@ HParseResult* h_do_parse(const HParser* parser, HParseState *state) {
     }
   } else {
     // it exists!
-    state->input_stream = m->input_stream;
+    restore_pos(state, &m->input_stream);
+    if (m->starved_in)
+      state->starved = true;
     if (PC_LEFT == m->value_type) {
       setupLR(parser, state, m->left);
       return m->left->seed;
@@ -227,29 +521,167 @@ HParseResult* h_do_parse(const HParser* parser, HParseState *state) {
   }
 }
 
+/* Deferred actions.
+ *
+ * A deferred action costs one token and one record. Memoized results may
+ * share them, and resolving rewrites the token in place, so every
+ * reference sees the outcome and the action runs at most once. As that
+ * changes the memo table, it counts in state->retained.
+ */
+
+HParsedToken *h_defer_action(HParseState *state, HAction action, void *user_data,
+                             const HParseResult *inner) {
+  HArena *arena = state->arena;
+  HDeferredAction *d = a_new(HDeferredAction, 1);
+  d->action = action;
+  d->user_data = user_data;
+  d->inner = *inner;
+  d->dropped = false;
+  HParsedToken *tok = a_new0(HParsedToken, 1);
+  tok->token_type = TT_DEFERRED;
+  tok->user = d;
+  tok->bit_length = 1;      // nonzero, so perform_lowlevel_parse fills it in
+  state->actions_deferred++;
+  return tok;
+}
+
+static HParsedToken *resolve(HParseState *state, HParsedToken *tok) {
+  if (!tok)
+    return NULL;
+  if (tok->token_type == TT_SEQUENCE) {
+    // an action that returns NULL leaves nothing in the sequence
+    HCountedArray *seq = tok->seq;
+    size_t used = 0;
+    for (size_t i = 0; i < seq->used; i++) {
+      HParsedToken *elem = seq->elements[i];
+      bool deferred = elem && elem->token_type == TT_DEFERRED;
+      elem = resolve(state, elem);
+      if (elem || !deferred)
+        seq->elements[used++] = elem;
+    }
+    seq->used = used;
+    return tok;
+  }
+  if (tok->token_type != TT_DEFERRED)
+    return tok;
+
+  HDeferredAction *d = tok->user;
+  if (d->dropped)
+    return NULL;
+  // the token may be in the memo table, and is about to change to point
+  // at what the action allocates
+  state->retained++;
+  d->inner.ast = resolve(state, (HParsedToken *)d->inner.ast);
+  HParsedToken *res = d->action(&d->inner, d->user_data);
+  state->actions_run++;
+  if (!res) {
+    d->dropped = true;
+    return NULL;
+  }
+  // as perform_lowlevel_parse would have done to it
+  if (res->bit_length != 0)
+    res->bit_length = tok->bit_length;
+  *tok = *res;
+  return tok;
+}
+
+const HParsedToken *h_resolve_deferred(HParseState *state, const HParsedToken *tok) {
+  if (!state->defer_actions)
+    return tok;
+  return resolve(state, (HParsedToken *)tok);
+}
+
+// run what's left of the actions, and account for them
+static void finish_parse(HParseState *state, HParseResult *res, const HPackratParams *params) {
+  if (res)
+    res->ast = h_resolve_deferred(state, res->ast);
+  if (params->stats) {
+    H_ATOMIC_FETCH_ADD(&params->stats->actions_deferred, state->actions_deferred);
+    H_ATOMIC_FETCH_ADD(&params->stats->actions_run, state->actions_run);
+  }
+}
+
+// params given to h_packrat_compile, and the allocator to free them with
+typedef struct HPackratConfig_ {
+  const HParserBackendVTable *owner; // us, to tell it from other backends' data
+  HAllocator *mm__;
+  HPackratParams params;
+} HPackratConfig;
+
+// the parser's packrat config; NULL if it has none
+static HPackratConfig *packrat_config(const HParser *parser) {
+  HPackratConfig *config = parser->backend_data;
+  if (parser->backend != PB_PACKRAT || !config
+      || config->owner != &h__packrat_backend_vtable)
+    return NULL;
+  return config;
+}
+
+static const HPackratParams default_params = { H_PACKRAT_MEMO_ALL, 0, false, NULL };
+
 int h_packrat_compile(HAllocator* mm__, HParser* parser, const void* params) {
   parser->backend = PB_PACKRAT;
+  if (params) {
+    HPackratConfig *config = h_new(HPackratConfig, 1);
+    config->owner = &h__packrat_backend_vtable;
+    config->mm__ = mm__;
+    config->params = *(const HPackratParams*)params;
+    parser->backend_data = config;
+  }
   return 0; // No compilation necessary, and everything should work
 	    // out of the box.
 }
 
 void h_packrat_free(HParser *parser) {
+  HPackratConfig *config = packrat_config(parser);
+  if (config) {
+    HAllocator *mm__ = config->mm__;
+    h_free(config);
+    parser->backend_data = NULL;
+  }
   parser->backend = PB_PACKRAT; // revert to default, oh that's us
 }
 
-static uint32_t cache_key_hash(const void* key) {
-  return h_djbhash(key, sizeof(HParserCacheKey));
-}
-static bool cache_key_equal(const void* key1, const void* key2) {
-  return memcmp(key1, key2, sizeof(HParserCacheKey)) == 0;
+// the grammar is read as the parse goes, so only params can go stale
+static unsigned h_packrat_generation(const HParser *parser) {
+  return packrat_config(parser) ? 0 : h_grammar_generation();
 }
 
-static uint32_t pos_hash(const void* key) {
-  return h_djbhash(key, sizeof(HInputStream));
+static const HPackratParams *packrat_params(const HParser *parser) {
+  HPackratConfig *config = packrat_config(parser);
+  if (!config)
+    return &default_params;
+  return &config->params;
 }
 
-static bool pos_equal(const void* key1, const void* key2) {
-  return memcmp(key1, key2, sizeof(HInputStream)) == 0;
+static HParseState *packrat_state_new(HArena *arena, HInputStream *input_stream,
+                                      const HPackratParams *params) {
+  HParseState *parse_state = a_new_(arena, HParseState, 1);
+  HMemoTable *memo = a_new_(arena, HMemoTable, 1);
+  memo->npages = input_stream->length / H_MEMO_PAGE_SIZE + 1;
+  memo->pages = a_new_(arena, HMemoSlab*, memo->npages);
+  memset(memo->pages, 0, memo->npages * sizeof(HMemoSlab*));
+  memo->nheads = 0;
+  memo->recursed = false;
+  memo->arena = arena;
+  memo->select = params->memo;
+  memo->window_pages = (params->memo_window + H_MEMO_PAGE_SIZE - 1) / H_MEMO_PAGE_SIZE;
+  memo->lo_page = 0;
+  memo->hi_page = 0;
+  memo->spare_pages = h_slist_new(arena);
+  memo->spare_values = NULL;
+  parse_state->memo = memo;
+  parse_state->input_stream = *input_stream;
+  parse_state->lr_stack = h_slist_new(arena);
+  parse_state->arena = arena;
+  parse_state->symbol_table = NULL;
+  parse_state->starved = false;
+  parse_state->attempt = 1;
+  parse_state->retained = 0;
+  parse_state->defer_actions = params->defer_actions;
+  parse_state->actions_deferred = 0;
+  parse_state->actions_run = 0;
+  return parse_state;
 }
 
 HParseResult *h_packrat_parse(HAllocator* mm__, const HParser* parser, HInputStream *input_stream) {
@@ -263,26 +695,182 @@ HParseResult *h_packrat_parse(HAllocator* mm__, const HParser* parser, HInputStr
     return NULL;
   }
 
-  HParseState *parse_state = a_new_(arena, HParseState, 1);
-  parse_state->cache = h_hashtable_new(arena, cache_key_equal, // key_equal_func
-				       cache_key_hash); // hash_func
-  parse_state->input_stream = *input_stream;
-  parse_state->lr_stack = h_slist_new(arena);
-  parse_state->recursion_heads = h_hashtable_new(arena, pos_equal, pos_hash);
-  parse_state->arena = arena;
+  const HPackratParams *params = packrat_params(parser);
+  HParseState *parse_state = packrat_state_new(arena, input_stream, params);
   HParseResult *res = h_do_parse(parser, parse_state);
+  finish_parse(parse_state, res, params);
   h_slist_free(parse_state->lr_stack);
-  h_hashtable_free(parse_state->recursion_heads);
-  // tear down the parse state
-  h_hashtable_free(parse_state->cache);
   if (!res)
     h_delete_arena(parse_state->arena);
 
   return res;
 }
 
+HParseResult *h_packrat_parse_context(HParseContext *ctx, HInputStream *input_stream) {
+  // out-of-memory handling
+  jmp_buf except;
+  h_arena_set_except(ctx->arena, &except);
+  if(setjmp(except)) {
+    h_arena_set_except(ctx->arena, NULL);
+    return NULL;
+  }
+
+  const HPackratParams *params = packrat_params(ctx->parser);
+  HParseState *parse_state = packrat_state_new(ctx->arena, input_stream, params);
+  HParseResult *res = h_do_parse(ctx->parser, parse_state);
+  finish_parse(parse_state, res, params);
+
+  h_arena_set_except(ctx->arena, NULL);
+  return res;
+}
+
+/* Chunked parsing.
+ *
+ * Until the parse returns, it may backtrack as far as the start, so the
+ * input since h_parse_start is kept. The memo table is kept as well, and
+ * each chunk the parse is tried again on all the input so far. Entries
+ * that didn't run into the end of the last try stand; the ones that did
+ * are computed again, so a try only redoes the parsers that were waiting
+ * on more input. If the parse ran into the end of what's there this time,
+ * more input could change the outcome and it waits for the next chunk.
+ *
+ * Left recursion grows its seeds without noting what they read, so once
+ * it has come up, each try starts over on a fresh table.
+ */
+
+typedef struct HPackratSuspended_ {
+  HArena *arena;                // holds the input, the memo table and the result
+  HParseState *state;
+  uint8_t *buf;
+  size_t len, capacity;
+  HParseResult *result;
+} HPackratSuspended;
+
+static void h_packrat_parse_start(HSuspendedParser *s) {
+  HAllocator *mm__ = s->mm__;
+  HPackratSuspended *st = h_new(HPackratSuspended, 1);
+  st->arena = NULL;
+  st->state = NULL;
+  st->buf = NULL;
+  st->len = st->capacity = 0;
+  st->result = NULL;
+  s->backend_state = st;
+}
+
+// the arena for the next try: the last one's, unless it has to start over
+static HArena *chunk_arena(HAllocator *mm__, HPackratSuspended *st) {
+  if (st->arena && !(st->state && st->state->memo->recursed))
+    return st->arena;
+  return h_new_arena(mm__, 0);
+}
+
+static bool h_packrat_parse_chunk(HSuspendedParser *s, HInputStream *input) {
+  HAllocator *mm__ = s->mm__;
+  HPackratSuspended *st = s->backend_state;
+  const HPackratParams *params = packrat_params(s->parser);
+
+  HArena *arena = chunk_arena(mm__, st);
+  if (!arena)
+    return true;                // fails the parse
+
+  // out-of-memory handling
+  jmp_buf except;
+  h_arena_set_except(arena, &except);
+  if(setjmp(except)) {
+    if (st->arena && st->arena != arena)
+      h_delete_arena(st->arena);
+    h_delete_arena(arena);
+    st->arena = NULL;
+    st->state = NULL;
+    return true;
+  }
+
+  // results point into the input, so a buffer that's outgrown stays in
+  // the arena with them
+  size_t len = st->len + input->length;
+  uint8_t *buf = st->buf;
+  if (arena != st->arena || len > st->capacity) {
+    size_t capacity = len > st->capacity ? 2 * len + 1 : st->capacity;
+    buf = h_arena_malloc(arena, capacity);
+    if (st->len)
+      memcpy(buf, st->buf, st->len);
+    st->capacity = capacity;
+  }
+  if (input->length)
+    memcpy(buf + st->len, input->input, input->length);
+  if (arena != st->arena) {
+    if (st->arena)
+      h_delete_arena(st->arena);
+    st->arena = arena;
+    st->state = NULL;
+  }
+  st->buf = buf;
+  st->len = len;
+  input->index = input->length;
+
+  HInputStream input_stream = {
+    .pos = 0,
+    .index = 0,
+    .bit_offset = 0,
+    .overrun = 0,
+    .endianness = input->endianness,
+    .length = len,
+    .input = buf,
+    .last_chunk = input->last_chunk
+  };
+  HParseState *parse_state = st->state;
+  if (!parse_state) {
+    parse_state = st->state = packrat_state_new(arena, &input_stream, params);
+  } else {
+    parse_state->attempt++;
+    parse_state->input_stream = input_stream;
+    parse_state->lr_stack = h_slist_new(arena);
+    parse_state->symbol_table = NULL;
+    parse_state->starved = false;
+  }
+  HParseResult *res = h_do_parse(s->parser, parse_state);
+  bool starved = parse_state->starved;
+  if (!starved)
+    finish_parse(parse_state, res, params);
+  h_slist_free(parse_state->lr_stack);
+  h_arena_set_except(arena, NULL);
+
+  if (starved)
+    return false;
+  if (!res) {
+    h_delete_arena(arena);
+    st->arena = NULL;
+    st->state = NULL;
+  }
+  st->result = res;
+  return true;
+}
+
+static HParseResult *h_packrat_parse_finish(HSuspendedParser *s) {
+  HAllocator *mm__ = s->mm__;
+  HPackratSuspended *st = s->backend_state;
+  HParseResult *res = st->result;
+
+  // the parse may have ended before the last chunk
+  if (res) {
+    s->pos = res->bit_length / 8;
+    s->bit_offset = res->bit_length % 8;
+  } else if (st->arena) {
+    h_delete_arena(st->arena);
+  }
+  h_free(st);
+  return res;
+}
+
 HParserBackendVTable h__packrat_backend_vtable = {
   .compile = h_packrat_compile,
   .parse = h_packrat_parse,
-  .free = h_packrat_free
+  .free = h_packrat_free,
+
+  .parse_start = h_packrat_parse_start,
+  .parse_chunk = h_packrat_parse_chunk,
+  .parse_finish = h_packrat_parse_finish,
+
+  .parse_context = h_packrat_parse_context,
+  .generation = h_packrat_generation,
 };
@@ -3,9 +3,11 @@
 #endif
 
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 #include "../internal.h"
 #include "../parsers/parser_internal.h"
+#include "../cfgrammar.h"
 #include "regex.h"
 
 #define a_new_regex(typ, count) a_new_(arena, typ, count)
@@ -34,7 +36,7 @@ typedef struct HRVMThread_ {
   uint16_t ip;
 } HRVMThread;
 
-HParseResult *run_trace(HAllocator *mm__, HRVMProg *orig_prog, HRVMTrace *trace, const uint8_t *input, int len);
+HParseResult *run_trace(HAllocator *mm__, HRVMProg *orig_prog, HRVMTrace *trace, const uint8_t *input, int len, HArena *arena);
 
 HRVMTrace *invert_trace(HRVMTrace *trace) {
   HRVMTrace *last = NULL;
@@ -53,43 +55,457 @@ HRVMTrace *invert_trace(HRVMTrace *trace) {
   return last;
 }
 
-void* h_rvm_run__m(HAllocator *mm__, HRVMProg *prog, const uint8_t* input, size_t len) {
-  HArena *arena = h_new_arena(mm__, 0);
-  HSArray *heads_a = h_sarray_new(mm__, prog->length), // Both of these contain HRVMTrace*'s
-          *heads_b = h_sarray_new(mm__, prog->length);
+/* Lazy DFA
+ *
+ * The NFA simulation below keeps a trace for every thread, which is what
+ * it takes to build the AST, but it costs time in proportion to the
+ * program for every input byte. Whether the input matches, and where the
+ * match ends, only depends on the set of live threads. So a DFA whose
+ * states are such sets answers that with one table lookup per byte. Its
+ * states are made when the input first reaches them and are kept with the
+ * program, up to a limit.
+ */
 
-  HRVMTrace *ret_trace = NULL;
-  HParseResult *ret = NULL;
-  
-  // out of memory handling
-  if(!arena || !heads_a || !heads_b)
-    goto end;
+#define RVM_DFA_DEFAULT_STATES 1024
+#define RVM_DFA_MAX_STATES (1 << 20)
+
+// Transitions are stored as the offset of the target's row in the table,
+// shifted left to make room for these flags:
+#define DFA_ACCEPT 1    // the step reached RVM_ACCEPT
+#define DFA_DEAD   2    // no threads are left
+#define DFA_NEW    4    // the transition has not been made yet
+#define DFA_FLAGS  7
+
+typedef struct HRVMDState_ {
+  size_t row;           // offset of the state's row in the table
+  int8_t eof;           // accepts at end of input: 1, 0, or -1 if unknown
+  bool accept;          // the step into this state reached RVM_ACCEPT
+  size_t n;
+  uint16_t ips[];       // the threads, i.e. ips just after an RVM_STEP; sorted
+} HRVMDState;
+
+typedef struct HRVMDFA_ {
+  uint8_t classes[256]; // bytes no RVM_MATCH tells apart share a class
+  size_t nclasses;
+  uint32_t *table;      // nclasses transitions per state
+  HRVMDState **states;  // by row number
+  size_t nstates;       // including the unused row 0
+  size_t capacity;
+  size_t max_states;
+  HHashTable *index;    // interns states
+  HArena *arena;
+  // scratch space for dfa_step
+  uint8_t *seen;
+  uint16_t *stack;
+  HRVMDState *tmp;
+} HRVMDFA;
+
+enum { DFA_FAIL, DFA_MATCH, DFA_UNKNOWN };
+
+static bool dstate_eq(const void *p, const void *q) {
+  const HRVMDState *a = p, *b = q;
+  return (a->accept == b->accept && a->n == b->n
+          && memcmp(a->ips, b->ips, a->n * sizeof(uint16_t)) == 0);
+}
+
+static HHashValue dstate_hash(const void *p) {
+  const HRVMDState *a = p;
+  return h_djbhash((const uint8_t *)a->ips, a->n * sizeof(uint16_t)) + a->accept;
+}
+
+static int cmp_ip(const void *p, const void *q) {
+  return (int)*(const uint16_t *)p - (int)*(const uint16_t *)q;
+}
+
+// Run the threads of s over ch like h_rvm_run__m does, but without
+// traces. The threads left go to t; returns whether RVM_ACCEPT was reached.
+static bool dfa_step(const HRVMProg *prog, HRVMDFA *dfa, const HRVMDState *s,
+                     uint8_t ch, bool eof, HRVMDState *t) {
+  uint8_t *seen = dfa->seen;
+  uint16_t *stack = dfa->stack;
+  size_t top = 0;
+  bool accept = false;
+
+#define VISIT(ip_) do {	     \
+    if (!seen[ip_]) {	     \
+      seen[ip_] = 1;	     \
+      stack[top++] = (ip_); \
+    }			     \
+  } while(0)
+
+  memset(seen, 0, prog->length);
+  t->n = 0;
+  for (size_t i = 0; i < s->n; i++) {
+    VISIT(s->ips[i]);
+    while (top > 0) {
+      uint16_t ip = stack[--top];
+      uint16_t arg = prog->insns[ip].arg;
+      switch(prog->insns[ip].op) {
+      case RVM_ACCEPT:
+	accept = true;
+	break;
+      case RVM_MATCH:
+	if (ch >= (arg & 0xff) && ch <= ((arg >> 8) & 0xff))
+	  VISIT(ip+1);
+	break;
+      case RVM_GOTO:
+	VISIT(arg);
+	break;
+      case RVM_FORK:
+	VISIT(ip+1);
+	VISIT(arg);
+	break;
+      case RVM_PUSH:
+      case RVM_ACTION:
+      case RVM_CAPTURE:
+	VISIT(ip+1);
+	break;
+      case RVM_EOF:
+	if (eof)
+	  VISIT(ip+1);
+	break;
+      case RVM_STEP:
+	t->ips[t->n++] = ip+1;	// each RVM_STEP is only visited once
+	break;
+      }
+    }
+  }
+#undef VISIT
+
+  qsort(t->ips, t->n, sizeof(uint16_t), cmp_ip);
+  return accept;
+}
+
+// find or make the state equal to t. returns NULL if there is no room.
+static HRVMDState *dfa_state(HRVMDFA *dfa, const HRVMDState *t) {
+  HRVMDState *s = h_hashtable_get(dfa->index, t);
+  if (s)
+    return s;
+  if (dfa->nstates > dfa->max_states)
+    return NULL;
+
+  if (dfa->nstates == dfa->capacity) {
+    size_t n = dfa->nclasses, cap = dfa->capacity * 2;
+    uint32_t *table = h_arena_malloc(dfa->arena, cap * n * sizeof(uint32_t));
+    HRVMDState **states = h_arena_malloc(dfa->arena, cap * sizeof(HRVMDState *));
+    memcpy(table, dfa->table, dfa->nstates * n * sizeof(uint32_t));
+    memcpy(states, dfa->states, dfa->nstates * sizeof(HRVMDState *));
+    h_arena_free_sized(dfa->arena, dfa->table, dfa->capacity * n * sizeof(uint32_t));
+    h_arena_free_sized(dfa->arena, dfa->states, dfa->capacity * sizeof(HRVMDState *));
+    dfa->table = table;
+    dfa->states = states;
+    dfa->capacity = cap;
+  }
+
+  s = h_arena_malloc(dfa->arena, sizeof(HRVMDState) + t->n * sizeof(uint16_t));
+  s->row = dfa->nstates * dfa->nclasses;
+  s->eof = -1;
+  s->accept = t->accept;
+  s->n = t->n;
+  memcpy(s->ips, t->ips, t->n * sizeof(uint16_t));
+  for (size_t i = 0; i < dfa->nclasses; i++)
+    dfa->table[s->row + i] = DFA_NEW;
+  dfa->states[dfa->nstates++] = s;
+  h_hashtable_put(dfa->index, s, s);
+  return s;
+}
+
+static HRVMDFA *rvm_dfa_new(HRVMProg *prog, size_t max_states) {
+  HArena *arena = h_new_arena(prog->allocator, 0);
+  if (!arena)
+    return NULL;
   jmp_buf except;
   h_arena_set_except(arena, &except);
-  if(setjmp(except))
-    goto end;
+  if (setjmp(except)) {
+    h_delete_arena(arena);
+    return NULL;
+  }
+
+  HRVMDFA *dfa = a_new_regex(HRVMDFA, 1);
+  dfa->arena = arena;
+  dfa->max_states = (max_states < RVM_DFA_MAX_STATES)? max_states
+                                                      : RVM_DFA_MAX_STATES;
+
+  // byte classes from the ranges of all RVM_MATCHes
+  unsigned int set[256 / (sizeof(unsigned int) * 8)];
+  h_byte_classes_init(dfa->classes);
+  dfa->nclasses = 1;
+  for (size_t ip = 0; ip < prog->length; ip++) {
+    if (prog->insns[ip].op != RVM_MATCH)
+      continue;
+    uint16_t arg = prog->insns[ip].arg;
+    memset(set, 0, sizeof(set));
+    for (unsigned int c = arg & 0xff; c <= ((arg >> 8) & 0xff); c++)
+      charset_set(set, c, 1);
+    dfa->nclasses = h_byte_classes_refine(dfa->classes, dfa->nclasses, set);
+  }
+
+  dfa->capacity = 16;
+  dfa->table = a_new_regex(uint32_t, dfa->capacity * dfa->nclasses);
+  dfa->states = a_new_regex(HRVMDState *, dfa->capacity);
+  dfa->states[0] = NULL;        // row 0 is unused, so no offset is 0
+  dfa->nstates = 1;
+  dfa->index = h_hashtable_new(arena, dstate_eq, dstate_hash);
+
+  dfa->seen = a_new_regex(uint8_t, prog->length);
+  dfa->stack = a_new_regex(uint16_t, prog->length);
+  dfa->tmp = h_arena_malloc(arena, sizeof(HRVMDState)
+                                   + prog->length * sizeof(uint16_t));
+
+  // the initial thread starts at ip 0; its row is the first one
+  dfa->tmp->accept = false;
+  dfa->tmp->n = 1;
+  dfa->tmp->ips[0] = 0;
+  dfa_state(dfa, dfa->tmp);
 
-  HSArray *heads_n = heads_a, *heads_p = heads_b;
-  uint8_t *insn_seen = a_new_regex(uint8_t, prog->length); // 0 -> not seen, 1->processed, 2->queued
-  HRVMThread *ip_queue = a_new_regex(HRVMThread, prog->length);
+  h_arena_set_except(arena, NULL);
+  return dfa;
+}
+
+// make the transition from the state at row on ch; 0 if out of states
+static uint32_t dfa_transition(const HRVMProg *prog, HRVMDFA *dfa,
+                               size_t row, uint8_t ch) {
+  HRVMDState *t = dfa->tmp;
+  t->accept = dfa_step(prog, dfa, dfa->states[row / dfa->nclasses], ch,
+                       false, t);
+  HRVMDState *s = dfa_state(dfa, t);
+  if (!s)
+    return 0;
+
+  uint32_t e = (uint32_t)s->row << 3;
+  if (s->accept)
+    e |= DFA_ACCEPT;
+  if (s->n == 0)
+    e |= DFA_DEAD;
+  dfa->table[row + dfa->classes[ch]] = e;
+  return e;
+}
+
+// Where a scan through the input is: the DFA state or NFA threads to
+// resume with, and the last match found.
+typedef struct HRVMCursor_ {
+  size_t off;           // position of the next byte
+  size_t end;           // where the last match ended
+  bool matched;
+} HRVMCursor;
+
+// Run the DFA from the state at *row over the bytes of input, which
+// start at position base. Returns DFA_FAIL when no threads are left,
+// DFA_UNKNOWN when out of states, DFA_MATCH when the input ran out.
+static int dfa_scan(const HRVMProg *prog, HRVMDFA *dfa, size_t *row,
+                    HRVMCursor *cur, const uint8_t *input, size_t base,
+                    size_t len) {
+  const uint32_t *table = dfa->table;
+  const uint8_t *classes = dfa->classes;
+  size_t r = *row;
+  int ret = DFA_MATCH;
+
+  for (size_t i = cur->off - base; i < len; i++) {
+    uint32_t e = table[r + classes[input[i]]];
+    if (e & DFA_FLAGS) {
+      if (e & DFA_NEW) {
+	if (!(e = dfa_transition(prog, dfa, r, input[i]))) {
+	  cur->off = base + i;
+	  ret = DFA_UNKNOWN;	// out of states
+	  break;
+	}
+	table = dfa->table;	// may have moved
+      }
+      if (e & DFA_ACCEPT) {
+	cur->matched = true;
+	cur->end = base + i;
+      }
+      if (e & DFA_DEAD) {
+	cur->off = base + i + 1;
+	ret = DFA_FAIL;
+	break;
+      }
+    }
+    r = e >> 3;
+  }
+  if (ret == DFA_MATCH)
+    cur->off = base + len;
+  *row = r;
+  return ret;
+}
+
+// the end of input, as seen from the state at row.
+// NB the NFA reads a 0 at the end of input
+static void dfa_eof(const HRVMProg *prog, HRVMDFA *dfa, size_t row,
+                    HRVMCursor *cur) {
+  HRVMDState *s = dfa->states[row / dfa->nclasses];
+  if (s->eof < 0)
+    s->eof = dfa_step(prog, dfa, s, 0, true, dfa->tmp);
+  if (s->eof) {
+    cur->matched = true;
+    cur->end = cur->off;
+  }
+}
+
+// Determine whether the program matches input, and if so, where the match
+// ends (like the last RVM_ACCEPT the NFA would reach).
+static int dfa_match(const HRVMProg *prog, HRVMDFA *dfa,
+                     const uint8_t *input, size_t len, size_t *end) {
+  HRVMCursor cur = { 0, 0, false };
+  size_t row = dfa->nclasses;	// the initial state
+  int ret = dfa_scan(prog, dfa, &row, &cur, input, 0, len);
+  if (ret == DFA_UNKNOWN)
+    return ret;
+  if (ret == DFA_MATCH)
+    dfa_eof(prog, dfa, row, &cur);
+  *end = cur.end;
+  return cur.matched? DFA_MATCH : DFA_FAIL;
+}
+
+static int rvm_dfa_run(const HRVMProg *prog, HRVMDFA *dfa,
+                       const uint8_t *input, size_t len, size_t *end) {
+  jmp_buf except;
+  h_arena_set_except(dfa->arena, &except);
+  if (setjmp(except)) {
+    dfa->max_states = 0;	// leave the DFA as it is from now on
+    h_arena_set_except(dfa->arena, NULL);
+    return DFA_UNKNOWN;
+  }
+  int ret = dfa_match(prog, dfa, input, len, end);
+  h_arena_set_except(dfa->arena, NULL);
+  return ret;
+}
+
+// the result of a match whose AST is not wanted (or empty).
+// NB not inlined into h_rvm_run__m, which calls setjmp.
+static H_GCC_ATTRIBUTE((noinline))
+HParseResult *rvm_match_result(HAllocator *mm__, size_t end) {
+  HArena *arena = h_new_arena(mm__, 0);
+  if (!arena)
+    return NULL;
+  HParseResult *res = a_new_regex(HParseResult, 1);
+  res->ast = NULL;
+  res->bit_length = end * 8;
+  res->arena = arena;
+  return res;
+}
+
+/* The NFA simulation, for one parse. Without tracing, only the end of
+ * the match is kept; with it, the trace of the thread that made it.
+ */
+typedef struct HRVMRun_ {
+  HArena *arena;        // traces; NULL until rvm_run_init
+  HSArray *heads_a, *heads_b; // Both of these contain HRVMTrace*'s
+  HSArray *heads_n;     // threads for the next step, by ip
+  uint8_t *insn_seen;   // 0 -> not seen, 1->processed
+  HRVMThread *ip_queue; // threads left by FORK
+  HRVMTrace *ret_trace;
+  HRVMCursor cur;
+  bool tracing;
+  int live_threads;
+} HRVMRun;
+
+// the arena must have an except handler set by the caller
+static void rvm_run_start(const HRVMProg *prog, HRVMRun *r) {
+  HArena *arena = r->arena;
+  r->insn_seen = a_new_regex(uint8_t, prog->length);
+  r->ip_queue = a_new_regex(HRVMThread, prog->length);
+  r->heads_n = r->heads_a;
+  h_sarray_clear(r->heads_n);
+  r->ret_trace = NULL;
+  r->cur.off = r->cur.end = 0;
+  r->cur.matched = false;
+  r->live_threads = 1; // May be redundant
+  HRVMTrace *init = NULL;
+  if (r->tracing) {
+    init = a_new_regex(HRVMTrace, 1);
+    init->opcode = SVM_NOP;
+    init->next = NULL;
+    init->input_pos = 0;
+  }
+  h_sarray_set(r->heads_n, 0, init); // Initial thread
+}
+
+static bool rvm_run_init(HAllocator *mm__, const HRVMProg *prog, HRVMRun *r,
+                         bool tracing) {
+  r->arena = h_new_arena(mm__, 0);
+  r->heads_a = h_sarray_new(mm__, prog->length);
+  r->heads_b = h_sarray_new(mm__, prog->length);
+  r->tracing = tracing;
+  return r->arena && r->heads_a && r->heads_b;
+}
+
+static void rvm_run_free(HRVMRun *r) {
+  if (r->arena)   h_delete_arena(r->arena);
+  if (r->heads_a) h_sarray_free(r->heads_a);
+  if (r->heads_b) h_sarray_free(r->heads_b);
+}
+
+// Step the threads of r over the bytes of input, which start at position
+// base, up to position stop; at the end of input, also over the 0 the
+// NFA reads there. Returns false once no threads are left.
+static bool rvm_run_steps(const HRVMProg *prog, HRVMRun *r,
+                          const uint8_t *input, size_t base, size_t stop,
+                          bool eof) {
+  HArena *arena = r->arena;
+  HSArray *heads_n = r->heads_n;
+  HSArray *heads_p = (heads_n == r->heads_a)? r->heads_b : r->heads_a;
+  const HRVMCode *code = prog->code;
+  uint8_t *insn_seen = r->insn_seen;
+  HRVMThread *ip_queue = r->ip_queue;
   size_t ipq_top;
+  uint16_t ip;
+  HRVMTrace *trace;
+  size_t off = r->cur.off;
+  int live_threads = r->live_threads;
+  const bool tracing = r->tracing;
 
-#define THREAD ip_queue[ipq_top-1]
 #define PUSH_SVM(op_, arg_) do { \
+	  if (!tracing)			       \
+	    break;			       \
 	  HRVMTrace *nt = a_new_regex(HRVMTrace, 1); \
 	  nt->arg = (arg_);		       \
 	  nt->opcode = (op_);		       \
-	  nt->next = THREAD.trace;	       \
+	  nt->next = trace;		       \
 	  nt->input_pos = off;		       \
-	  THREAD.trace = nt;		       \
+	  trace = nt;			       \
   } while(0)
 
-  ((HRVMTrace*)h_sarray_set(heads_n, 0, a_new_regex(HRVMTrace, 1)))->opcode = SVM_NOP; // Initial thread
-  
-  size_t off = 0;
-  int live_threads = 1; // May be redundant
-  for (off = 0; off <= len; off++) {
-    uint8_t ch = ((off == len) ? 0 : input[off]);
+  // Dispatch to the code at ip. Where the compiler can take the address
+  // of a label, each op jumps straight to the next one's; otherwise a
+  // switch does it.
+#if defined(H_HAVE_COMPUTED_GOTO) && !defined(H_RVM_SWITCH_DISPATCH)
+  static const void *const dispatch[RVM_OPCOUNT] = {
+    [RVM_ACCEPT] = &&op_accept,
+    [RVM_GOTO] = &&op_goto,
+    [RVM_FORK] = &&op_fork,
+    [RVM_PUSH] = &&op_push,
+    [RVM_ACTION] = &&op_action,
+    [RVM_CAPTURE] = &&op_capture,
+    [RVM_EOF] = &&op_eof,
+    [RVM_MATCH] = &&op_match,
+    [RVM_STEP] = &&op_step,
+  };
+#define DISPATCH() goto *dispatch[code[ip].op]
+#else
+#define DISPATCH() do {				\
+    switch(code[ip].op) {			\
+    case RVM_ACCEPT:  goto op_accept;		\
+    case RVM_GOTO:    goto op_goto;		\
+    case RVM_FORK:    goto op_fork;		\
+    case RVM_PUSH:    goto op_push;		\
+    case RVM_ACTION:  goto op_action;		\
+    case RVM_CAPTURE: goto op_capture;		\
+    case RVM_EOF:     goto op_eof;		\
+    case RVM_MATCH:   goto op_match;		\
+    default:          goto op_step;		\
+    }						\
+  } while(0)
+#endif
+#define NEXT() do {				\
+    if (insn_seen[ip] == 1)			\
+      goto kill; /* another thread got here first */ \
+    insn_seen[ip] = 1;				\
+    DISPATCH();					\
+  } while(0)
+
+  for (; off < stop || (eof && off == stop); off++) {
+    uint8_t ch = ((off == stop) ? 0 : input[off - base]);
     /* scope */ {
       HSArray *heads_t;
       heads_t = heads_n;
@@ -99,101 +515,136 @@ void* h_rvm_run__m(HAllocator *mm__, HRVMProg *prog, const uint8_t* input, size_
     }
     memset(insn_seen, 0, prog->length); // no insns seen yet
     if (!live_threads) {
-      goto match_fail;
+      break;
     }
     live_threads = 0;
     HRVMTrace *tr_head;
     H_SARRAY_FOREACH_KV(tr_head,ip_s,heads_p) {
-      ipq_top = 1;
-      // TODO: Write this as a threaded VM
-      THREAD.ip = ip_s;
-      THREAD.trace = tr_head;
-      uint8_t hi, lo;
-      uint16_t arg;
-      while(ipq_top > 0) {
-	if (insn_seen[THREAD.ip] == 1) {
-	  ipq_top--; // Kill thread.
-	  continue;
-	}
-	insn_seen[THREAD.ip] = 1;
-	arg = prog->insns[THREAD.ip].arg;
-	switch(prog->insns[THREAD.ip].op) {
-	case RVM_ACCEPT:
-	  PUSH_SVM(SVM_ACCEPT, 0);
-	  ret_trace = THREAD.trace;
-	  ipq_top--;
-	  goto next_insn;
-	case RVM_MATCH:
-	  hi = (arg >> 8) & 0xff;
-	  lo = arg & 0xff;
-	  THREAD.ip++;
-	  if (ch < lo || ch > hi) {
-	    ipq_top--; // terminate thread 
-	  }
-	  goto next_insn;
-	case RVM_GOTO:
-	  THREAD.ip = arg;
-	  goto next_insn;
-	case RVM_FORK:
-	  THREAD.ip++;
-	  if (!insn_seen[arg]) {
-	    insn_seen[THREAD.ip] = 2;
-	    HRVMTrace* tr = THREAD.trace;
-	    ipq_top++;
-	    THREAD.ip = arg;
-	    THREAD.trace = tr;
-	  }
-	  goto next_insn;
-	case RVM_PUSH:
-	  PUSH_SVM(SVM_PUSH, 0);
-	  THREAD.ip++;
-	  goto next_insn;
-	case RVM_ACTION:
-	  PUSH_SVM(SVM_ACTION, arg);
-	  THREAD.ip++;
-	  goto next_insn;
-	case RVM_CAPTURE:
-	  PUSH_SVM(SVM_CAPTURE, 0);
-	  THREAD.ip++;
-	  goto next_insn;
-	case RVM_EOF:
-	  THREAD.ip++;
-	  if (off != len) {
-	    ipq_top--; // Terminate thread
-	  }
-	  goto next_insn;
-	case RVM_STEP:
-	  // save thread
-	  live_threads++;
-	  h_sarray_set(heads_n, ++THREAD.ip, THREAD.trace);
-	  ipq_top--;
-	  goto next_insn;
-	}
-      next_insn:
-	;
-	
+      ipq_top = 0;
+      ip = ip_s;
+      trace = tr_head;
+      NEXT();
+
+    op_accept:
+      PUSH_SVM(SVM_ACCEPT, 0);
+      r->ret_trace = trace;
+      r->cur.matched = true;
+      r->cur.end = off;
+      goto kill;
+    op_match:
+      if (!(code[ip].set[ch >> 5] & (1u << (ch & 31))))
+	goto kill;
+      ip = code[ip].arg;
+      NEXT();
+    op_goto:
+      ip = code[ip].arg;
+      NEXT();
+    op_fork:
+      if (!insn_seen[code[ip].arg]) {
+	// run the target first; come back for ip+1
+	ip_queue[ipq_top].ip = ip + 1;
+	ip_queue[ipq_top].trace = trace;
+	ipq_top++;
+	ip = code[ip].arg;
+      } else {
+	ip++;
+      }
+      NEXT();
+    op_push:
+      PUSH_SVM(SVM_PUSH, 0);
+      ip++;
+      NEXT();
+    op_action:
+      PUSH_SVM(SVM_ACTION, code[ip].arg);
+      ip++;
+      NEXT();
+    op_capture:
+      PUSH_SVM(SVM_CAPTURE, 0);
+      ip++;
+      NEXT();
+    op_eof:
+      if (!eof || off != stop)
+	goto kill;
+      ip++;
+      NEXT();
+    op_step:
+      // save thread
+      live_threads++;
+      h_sarray_set(heads_n, ip + 1, trace);
+      goto kill;
+
+    kill:
+      if (ipq_top > 0) {
+	ipq_top--;
+	ip = ip_queue[ipq_top].ip;
+	trace = ip_queue[ipq_top].trace;
+	NEXT();
       }
     }
   }
-  // No accept was reached.
- match_fail:
+#undef NEXT
+#undef DISPATCH
+#undef PUSH_SVM
 
-  h_arena_set_except(arena, NULL);  // there should be no more allocs from this
-  if (ret_trace) {
-    // Invert the direction of the trace linked list.
-    ret_trace = invert_trace(ret_trace);
-    ret = run_trace(mm__, prog, ret_trace, input, len);
-    // NB: ret is in its own arena
+  r->heads_n = heads_n;
+  r->cur.off = off;
+  r->live_threads = live_threads;
+  return live_threads > 0;
+}
+
+// the result of the NFA; see run_trace for arena
+static HParseResult *rvm_run_result(HAllocator *mm__, const HRVMProg *prog,
+                                    HRVMRun *r, const uint8_t *input,
+                                    size_t len, HArena *arena) {
+  if (!r->cur.matched)
+    return NULL;
+  if (!r->tracing)
+    return rvm_match_result(mm__, r->cur.end);
+  // Invert the direction of the trace linked list.
+  HRVMTrace *ret_trace = invert_trace(r->ret_trace);
+  return run_trace(mm__, (HRVMProg *)prog, ret_trace, input, len, arena);
+  // NB: ret is in its own arena
+}
+
+void* h_rvm_run__m(HAllocator *mm__, HRVMProg *prog, const uint8_t* input, size_t len) {
+  // let the DFA say whether there is a match, and where it ends.
+  // if another parse is using the DFA, go without.
+  size_t stop = len;
+  HRVMDFA *dfa = H_ATOMIC_XCHG_PTR(&prog->dfa, (HRVMDFA *)NULL);
+  if (dfa) {
+    int m = rvm_dfa_run(prog, dfa, input, len, &stop);
+    (void)H_ATOMIC_XCHG_PTR(&prog->dfa, dfa);
+    if (m == DFA_FAIL)
+      return NULL;
+    if (m == DFA_MATCH && (prog->recognize || !prog->builds_ast))
+      return rvm_match_result(mm__, stop);
   }
-  
+
+  HRVMRun r;
+  HParseResult *ret = NULL;
+
+  // out of memory handling
+  if (!rvm_run_init(mm__, prog, &r, !prog->recognize && prog->builds_ast))
+    goto end;
+  jmp_buf except;
+  h_arena_set_except(r.arena, &except);
+  if(setjmp(except))
+    goto end;
+
+  // no ACCEPT is reached after stop
+  rvm_run_start(prog, &r);
+  if (stop < len)
+    rvm_run_steps(prog, &r, input, 0, stop + 1, false);
+  else
+    rvm_run_steps(prog, &r, input, 0, len, true);
+
+  h_arena_set_except(r.arena, NULL);  // there should be no more allocs from this
+  ret = rvm_run_result(mm__, prog, &r, input, len, NULL);
+
  end:
-  if (arena)   h_delete_arena(arena);
-  if (heads_a) h_sarray_free(heads_a);
-  if (heads_b) h_sarray_free(heads_b);
+  rvm_run_free(&r);
   return ret;
 }
-#undef PUSH_SVM
-#undef THREAD
 
 
 
@@ -231,10 +682,12 @@ bool svm_stack_ensure_cap(HAllocator *mm__, HSVMContext *ctx, size_t addl) {
 #pragma GCC diagnostic ignored "-Wunknown-pragmas"
 #pragma GCC diagnostic ignored "-Wclobbered"
 #endif
-HParseResult *run_trace(HAllocator *mm__, HRVMProg *orig_prog, HRVMTrace *trace, const uint8_t *input, int len) {
+HParseResult *run_trace(HAllocator *mm__, HRVMProg *orig_prog, HRVMTrace *trace, const uint8_t *input, int len, HArena *arena) {
   // orig_prog is only used for the action table
+  // the result goes in arena, if given; it is deleted if this fails
   HSVMContext *ctx = NULL;
-  HArena *arena = h_new_arena(mm__, 0);
+  if (arena == NULL)
+    arena = h_new_arena(mm__, 0);
   if (arena == NULL) {
     return NULL;
   }
@@ -411,11 +864,85 @@ bool h_compile_regex(HRVMProg *prog, const HParser *parser) {
   return parser->vtable->compile_to_rvm(prog, parser->env);
 }
 
+// the bytes an RVM_MATCH insn matches, added to set
+static void match_set(uint32_t *set, uint16_t arg) {
+  for (unsigned int c = arg & 0xff; c <= ((arg >> 8) & 0xff); c++)
+    set[c >> 5] |= 1u << (c & 31);
+}
+
+// follow a chain of GOTOs
+static uint16_t goto_target(const HRVMProg *prog, uint16_t ip) {
+  for (size_t n = 0; n < prog->length && prog->insns[ip].op == RVM_GOTO; n++)
+    ip = prog->insns[ip].arg;
+  return ip;
+}
+
+// Lower prog->insns to prog->code.
+static void rvm_decode(HAllocator *mm__, HRVMProg *prog) {
+  size_t nsets = 0;
+  for (size_t ip = 0; ip < prog->length; ip++)
+    if (prog->insns[ip].op == RVM_MATCH || prog->insns[ip].op == RVM_FORK)
+      nsets++;
+  prog->code = h_new(HRVMCode, prog->length);
+  prog->sets = h_new(uint32_t, 8 * (nsets + 1));
+  memset(prog->sets, 0, 8 * (nsets + 1) * sizeof(uint32_t));
+  uint32_t *set = prog->sets;
+
+  for (size_t ip = 0; ip < prog->length; ip++) {
+    const HRVMInsn *insn = &prog->insns[ip];
+    HRVMCode *c = &prog->code[ip];
+    c->op = insn->op;
+    c->arg = insn->arg;
+    c->set = NULL;
+    switch (insn->op) {
+    case RVM_MATCH:
+      match_set(set, insn->arg);
+      c->set = set;
+      c->arg = ip + 1;
+      set += 8;
+      break;
+    case RVM_GOTO:
+    case RVM_FORK:
+      c->arg = goto_target(prog, insn->arg);
+      break;
+    }
+  }
+
+  // A charset compiles to one branch per range, all ending up at the same
+  // RVM_STEP:
+  //   FORK a; MATCH r1; GOTO j; a: FORK b; MATCH r2; GOTO j; b: ...; MATCH rn; j:
+  // Where a run of these starts, one MATCH of the union does the same.
+  for (size_t ip = 0; ip < prog->length; ip++) {
+    size_t i = ip, j = 0;
+    while (i + 3 < prog->length
+	   && prog->insns[i].op == RVM_FORK && prog->insns[i].arg == i + 3
+	   && prog->insns[i+1].op == RVM_MATCH
+	   && prog->insns[i+2].op == RVM_GOTO
+	   && (i == ip || prog->insns[i+2].arg == j)) {
+      j = prog->insns[i+2].arg;
+      i += 3;
+    }
+    if (i == ip || prog->insns[i].op != RVM_MATCH || i + 1 != j)
+      continue;
+    for (size_t k = ip; k < i; k += 3)
+      match_set(set, prog->insns[k+1].arg);
+    match_set(set, prog->insns[i].arg);
+    prog->code[ip].op = RVM_MATCH;
+    prog->code[ip].arg = j;
+    prog->code[ip].set = set;
+    set += 8;
+  }
+}
+
 static void h_regex_free(HParser *parser) {
   HRVMProg *prog = (HRVMProg*)parser->backend_data;
   HAllocator *mm__ = prog->allocator;
+  if (prog->dfa)
+    h_delete_arena(prog->dfa->arena);
   h_free(prog->insns);
   h_free(prog->actions);
+  h_free(prog->code);
+  h_free(prog->sets);
   h_free(prog);
   parser->backend_data = NULL;
   parser->backend = PB_PACKRAT;
@@ -426,6 +953,9 @@ static int h_regex_compile(HAllocator *mm__, HParser* parser, const void* params
     return -1;
   }
   HRVMProg *prog = h_new(HRVMProg, 1);
+  prog->dfa = NULL;
+  prog->code = NULL;
+  prog->sets = NULL;
   prog->length = prog->action_count = 0;
   prog->insns = NULL;
   prog->actions = NULL;
@@ -441,18 +971,216 @@ static int h_regex_compile(HAllocator *mm__, HParser* parser, const void* params
   }
   memset(prog->except, 0, sizeof(prog->except));
   h_rvm_insert_insn(prog, RVM_ACCEPT, 0);
+  rvm_decode(mm__, prog);
+
+  const HRegexParams *rp = params;
+  prog->recognize = rp && rp->recognize;
+  prog->builds_ast = false;
+  for (size_t ip = 0; ip < prog->length; ip++) {
+    uint8_t op = prog->insns[ip].op;
+    if (op == RVM_PUSH || op == RVM_ACTION || op == RVM_CAPTURE)
+      prog->builds_ast = true;
+  }
+  prog->dfa = rvm_dfa_new(prog, (rp && rp->dfa_states)? rp->dfa_states
+                                                      : RVM_DFA_DEFAULT_STATES);
+  prog->generation = params ? 0 : h_grammar_generation();
   parser->backend_data = prog;
   return 0;
 }
 
+static unsigned h_regex_generation(const HParser *parser) {
+  return ((HRVMProg*)parser->backend_data)->generation;
+}
+
 static HParseResult *h_regex_parse(HAllocator* mm__, const HParser* parser, HInputStream *input_stream) {
   return h_rvm_run__m(mm__, (HRVMProg*)parser->backend_data, input_stream->input, input_stream->length);
 }
 
+/* Chunked parsing.
+ *
+ * The scan suspends between chunks: as a DFA state where that will do,
+ * else as the NFA's threads. Only when an AST is wanted does the input
+ * have to be kept, for the captures; it goes in the arena that ends up
+ * holding the result.
+ */
+
+typedef struct HRVMSuspended_ {
+  HRVMProg *prog;
+  HRVMDFA *dfa;         // held until the match is known, if there's no AST
+  size_t row;           // the DFA's state
+  HRVMRun run;          // the NFA, once started; run.cur is used throughout
+  bool nfa;
+  bool done;
+  bool failed;          // out of memory
+  HArena *arena;        // the input so far, if tracing
+  uint8_t *buf;
+  size_t len, capacity;
+} HRVMSuspended;
+
+static void h_regex_parse_start(HSuspendedParser *s) {
+  HAllocator *mm__ = s->mm__;
+  HRVMProg *prog = s->parser->backend_data;
+  HRVMSuspended *st = h_new(HRVMSuspended, 1);
+  memset(st, 0, sizeof(*st));
+  st->prog = prog;
+  st->run.tracing = !prog->recognize && prog->builds_ast;
+  if (st->run.tracing) {
+    st->arena = h_new_arena(mm__, 0);
+    st->failed = !st->arena;
+  } else {
+    st->dfa = H_ATOMIC_XCHG_PTR(&prog->dfa, (HRVMDFA *)NULL);
+    if (st->dfa)
+      st->row = st->dfa->nclasses;	// the initial state
+  }
+  s->backend_state = st;
+}
+
+static void rvm_give_back_dfa(HRVMSuspended *st) {
+  if (st->dfa)
+    (void)H_ATOMIC_XCHG_PTR(&st->prog->dfa, st->dfa);
+  st->dfa = NULL;
+}
+
+// Run the DFA over a chunk; sets st->done if the match is known. If it
+// runs out of states, the NFA takes over where it stopped, with the
+// threads of its state.
+static void rvm_suspended_dfa(HAllocator *mm__, HRVMSuspended *st,
+                              const HInputStream *input, jmp_buf *except) {
+  HRVMDFA *dfa = st->dfa;
+  HRVMCursor *cur = &st->run.cur;
+  int ret = dfa_scan(st->prog, dfa, &st->row, cur, input->input, input->pos,
+                     input->length);
+  if (ret == DFA_FAIL) {
+    st->done = true;
+  } else if (ret == DFA_MATCH) {
+    if (input->last_chunk) {
+      dfa_eof(st->prog, dfa, st->row, cur);
+      st->done = true;
+    }
+  } else {
+    HRVMCursor saved = *cur;
+    const HRVMDState *ds = dfa->states[st->row / dfa->nclasses];
+    if (!rvm_run_init(mm__, st->prog, &st->run, false)) {
+      st->failed = true;
+      return;
+    }
+    h_arena_set_except(st->run.arena, except);
+    rvm_run_start(st->prog, &st->run);
+    h_sarray_clear(st->run.heads_n);
+    for (size_t i = 0; i < ds->n; i++)
+      h_sarray_set(st->run.heads_n, ds->ips[i], NULL);
+    st->run.live_threads = ds->n;
+    st->run.cur = saved;
+    st->nfa = true;
+  }
+}
+
+static bool h_regex_parse_chunk(HSuspendedParser *s, HInputStream *input) {
+  HAllocator *mm__ = s->mm__;
+  HRVMSuspended *st = s->backend_state;
+  HRVMProg *prog = st->prog;
+  jmp_buf except;
+  input->index = input->length;  // taken in, whether used or not
+
+  if (st->failed)
+    return true;
+  if (st->dfa)
+    h_arena_set_except(st->dfa->arena, &except);
+  if (st->arena)
+    h_arena_set_except(st->arena, &except);
+  if (st->run.arena)
+    h_arena_set_except(st->run.arena, &except);
+  if (setjmp(except)) {
+    if (st->dfa)
+      st->dfa->max_states = 0;	// see rvm_dfa_run
+    st->failed = true;
+    goto end;
+  }
+
+  if (st->arena && input->length) {
+    if (st->len + input->length > st->capacity) {
+      size_t capacity = 2 * (st->len + input->length);
+      uint8_t *buf = h_arena_malloc(st->arena, capacity);
+      if (st->len)
+	memcpy(buf, st->buf, st->len);
+      h_arena_free_sized(st->arena, st->buf, st->capacity);
+      st->buf = buf;
+      st->capacity = capacity;
+    }
+    memcpy(st->buf + st->len, input->input, input->length);
+    st->len += input->length;
+  }
+
+  if (st->dfa) {
+    rvm_suspended_dfa(mm__, st, input, &except);
+    if (!st->nfa)
+      goto end;
+    rvm_give_back_dfa(st);
+  } else if (!st->nfa) {
+    if (!rvm_run_init(mm__, prog, &st->run, st->run.tracing)) {
+      st->failed = true;
+      goto end;
+    }
+    h_arena_set_except(st->run.arena, &except);
+    rvm_run_start(prog, &st->run);
+    st->nfa = true;
+  }
+
+  if (!rvm_run_steps(prog, &st->run, input->input, input->pos,
+		     input->pos + input->length, input->last_chunk)
+      || input->last_chunk)
+    st->done = true;
+
+ end:
+  if (st->dfa)
+    h_arena_set_except(st->dfa->arena, NULL);
+  if (st->arena)
+    h_arena_set_except(st->arena, NULL);
+  if (st->run.arena)
+    h_arena_set_except(st->run.arena, NULL);
+  return st->done || st->failed;
+}
+
+static HParseResult *h_regex_parse_finish(HSuspendedParser *s) {
+  HAllocator *mm__ = s->mm__;
+  HRVMSuspended *st = s->backend_state;
+  HParseResult *res = NULL;
+
+  if (!st->failed) {
+    if (!st->nfa) {
+      if (st->run.cur.matched)
+	res = rvm_match_result(mm__, st->run.cur.end);
+    } else if (st->run.tracing && st->run.cur.matched) {
+      res = rvm_run_result(mm__, st->prog, &st->run, st->buf, st->len,
+			   st->arena);
+      st->arena = NULL;	// kept by res, or deleted
+    } else {
+      res = rvm_run_result(mm__, st->prog, &st->run, NULL, 0, NULL);
+    }
+  }
+  // the match may have ended before the last chunk
+  if (res) {
+    s->pos = st->run.cur.end;
+    s->bit_offset = 0;
+  }
+
+  rvm_give_back_dfa(st);
+  rvm_run_free(&st->run);
+  if (st->arena)
+    h_delete_arena(st->arena);
+  h_free(st);
+  return res;
+}
+
 HParserBackendVTable h__regex_backend_vtable = {
   .compile = h_regex_compile,
   .parse = h_regex_parse,
-  .free = h_regex_free
+  .free = h_regex_free,
+
+  .parse_start = h_regex_parse_start,
+  .parse_chunk = h_regex_parse_chunk,
+  .parse_finish = h_regex_parse_finish,
+  .generation = h_regex_generation,
 };
 
 #ifndef NDEBUG
@@ -37,6 +37,15 @@ typedef struct HRVMInsn_{
   uint16_t arg;
 } HRVMInsn;
 
+// The form h_rvm_run__m executes: a MATCH tests its byte against a
+// bitmap and continues at arg; GOTOs and FORKs point past chains of
+// GOTOs. The other ops are as in the HRVMInsn they come from.
+typedef struct HRVMCode_ {
+  uint8_t op;
+  uint16_t arg;
+  const uint32_t *set;   // RVM_MATCH: the bytes matched, 256 bits
+} HRVMCode;
+
 #define TT_MARK TT_RESERVED_1
 
 typedef struct HSVMContext_ {
@@ -59,7 +68,13 @@ struct HRVMProg_ {
   size_t action_count;
   HRVMInsn *insns;
   HSVMAction *actions;
+  HRVMCode *code;          // insns, decoded by h_regex_compile
+  uint32_t *sets;          // the bitmaps of the RVM_MATCHes in code
   jmp_buf except;
+  bool recognize;          // see HRegexParams
+  bool builds_ast;         // false if the program has no PUSH/ACTION/CAPTURE
+  struct HRVMDFA_ *dfa;    // built as needed; NULL while a parse is using it
+  unsigned generation;     // see HParserBackendVTable
 };
 
 // Returns true IFF the provided parser could be compiled.
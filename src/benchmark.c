@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,7 +12,8 @@ static const char* HParserBackendNames[] = {
   "Regular",
   "LL(k)",
   "LALR",
-  "GLR"
+  "GLR",
+  "Generated C"
 };
 
 /*
@@ -31,6 +33,10 @@ static const char* HParserBackendNames[] = {
 
 */
 
+// the backends h_benchmark tries. PB_GENERATED runs the system's C
+// compiler, so it is only used when asked for by name.
+#define BENCHMARK_MAX PB_GLR
+
 HBenchmarkResults *h_benchmark(HParser* parser, HParserTestcase* testcases) {
   return h_benchmark__m(&system_allocator, parser, testcases);
 }
@@ -40,10 +46,11 @@ HBenchmarkResults *h_benchmark__m(HAllocator* mm__, HParser* parser, HParserTest
   HParserTestcase* tc = testcases;
   HParserBackend backend = PB_MIN;
   HBenchmarkResults *ret = h_new(HBenchmarkResults, 1);
-  ret->len = PB_MAX-PB_MIN+1;
+  ret->len = BENCHMARK_MAX-PB_MIN+1;
   ret->results = h_new(HBackendResults, ret->len);
+  ret->parser = parser;
 
-  for (backend = PB_MIN; backend <= PB_MAX; backend++) {
+  for (backend = PB_MIN; backend <= BENCHMARK_MAX; backend++) {
     ret->results[backend].backend = backend;
     // Step 1: Compile grammar for given parser...
     if (h_compile(parser, backend, NULL) == -1) {
@@ -61,14 +68,16 @@ HBenchmarkResults *h_benchmark__m(HAllocator* mm__, HParser* parser, HParserTest
     // Step 1: verify all test cases.
     ret->results[backend].n_testcases = 0;
     ret->results[backend].failed_testcases = 0;
+    struct result_buf buf = { NULL, 0, 0, NULL, false };
     for (tc = testcases; tc->input != NULL; tc++) {
       ret->results[backend].n_testcases++;
       HParseResult *res = h_parse(parser, tc->input, tc->length);
-      char* res_unamb;
+      char* res_unamb = NULL;
       if (res != NULL) {
-        res_unamb = h_write_result_unamb(res->ast);
-      } else
-        res_unamb = NULL;
+        buf.len = 0;
+        if (h_append_result_unamb(&buf, res->ast))
+          res_unamb = buf.output;
+      }
       if ((res_unamb == NULL && tc->output_unambiguous != NULL)
           || (res_unamb != NULL && strcmp(res_unamb, tc->output_unambiguous) != 0)) {
         // test case failed...
@@ -80,8 +89,8 @@ HBenchmarkResults *h_benchmark__m(HAllocator* mm__, HParser* parser, HParserTest
         ret->results[backend].failed_testcases++;
       }
       h_parse_result_free(res);
-      (&system_allocator)->free(&system_allocator, res_unamb);
     }
+    (&system_allocator)->free(&system_allocator, buf.output);
 
     if (tc_failed > 0) {
       // Can't use this parser; skip to the next
@@ -116,15 +125,52 @@ HBenchmarkResults *h_benchmark__m(HAllocator* mm__, HParser* parser, HParserTest
 void h_benchmark_report(FILE* stream, HBenchmarkResults* result) {
   for (size_t i=0; i<result->len; ++i) {
     if (result->results[i].cases == NULL) {
-      fprintf(stream, "Skipping %s because grammar did not compile for it\n", HParserBackendNames[i]);
+      fprintf(stream, "Skipping %s because grammar did not compile for it\n", HParserBackendNames[result->results[i].backend]);
     } else {
-      fprintf(stream, "Backend %zd (%s) ... \n", i, HParserBackendNames[i]);
+      fprintf(stream, "Backend %zd (%s) ... \n", i, HParserBackendNames[result->results[i].backend]);
     }
     for (size_t j=0; j<result->results[i].n_testcases; ++j) {
       if (result->results[i].cases == NULL) {
         continue;
       }
+      if (result->results[i].cases[j].length == 0) {
+        fprintf(stream, "Case %zd: %zd ns/parse\n", j,  result->results[i].cases[j].parse_time);
+        continue;
+      }
       fprintf(stream, "Case %zd: %zd ns/parse, %zd ns/byte\n", j,  result->results[i].cases[j].parse_time, result->results[i].cases[j].parse_time / result->results[i].cases[j].length);
     }
   }
 }
+
+// the time for one run of all the cases; -1 if the backend didn't run them
+static int64_t total_parse_time(const HBackendResults *r) {
+  if (r->cases == NULL)
+    return -1;
+  int64_t total = 0;
+  for (size_t j=0; j<r->n_testcases; ++j)
+    total += r->cases[j].parse_time;
+  return total;
+}
+
+void h_benchmark_dump_optimized_code(FILE* stream, HBenchmarkResults* results) {
+  bool done[PB_MAX + 1] = { false };
+  fprintf(stream, "/* Backends, fastest first:\n");
+  for (size_t n=0; n<results->len; ++n) {
+    size_t best = results->len;
+    for (size_t i=0; i<results->len; ++i) {
+      if (done[i] || total_parse_time(&results->results[i]) < 0)
+        continue;
+      if (best == results->len
+          || total_parse_time(&results->results[i]) < total_parse_time(&results->results[best]))
+        best = i;
+    }
+    if (best == results->len)
+      break;
+    done[best] = true;
+    fprintf(stream, " *   %-12s %" PRId64 " ns\n", HParserBackendNames[results->results[best].backend],
+            total_parse_time(&results->results[best]));
+  }
+  fprintf(stream, " */\n");
+  if (results->parser && h_emit_c(stream, results->parser, "hg_parser") != 0)
+    fprintf(stream, "/* the parser can't be written as C */\n");
+}
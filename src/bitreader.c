@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "internal.h"
 #include "hammer.h"
 #include "test_suite.h"
@@ -26,7 +27,9 @@
 #define LDB(range,i) (((i)>>LSB(range))&((1<<(MSB(range)-LSB(range)+1))-1))
 
 
-int64_t h_read_bits(HInputStream* state, int count, char signed_p) {
+// the general case: any width, alignment, endianness and margin, and
+// running out of input
+static int64_t read_bits_slow(HInputStream* state, int count, char signed_p) {
   // BUG: Does not 
   int64_t out = 0;
   int offset = 0;
@@ -108,3 +111,77 @@ int64_t h_read_bits(HInputStream* state, int count, char signed_p) {
   out <<= final_shift;
   return (out ^ msb) - msb; // perform sign extension
 }
+
+/* Fast paths.
+ *
+ * Byte-aligned reads of whole bytes take the bytes in one load and swap
+ * them into host order if need be. Other reads of up to 57 bits, if the
+ * bit and byte orders agree, take the 8 bytes from the current one on as
+ * a single bit string and cut the value out of it; 57 bits is what's
+ * sure to fit after a partial first byte.
+ */
+
+#define READ_ALIGNED(N)							\
+  int64_t h_read_bits_##N(HInputStream* state, int count, char signed_p) { \
+    if (state->bit_offset || state->margin || state->length - state->index < N/8) \
+      return read_bits_slow(state, N, signed_p);			\
+    uint##N##_t w;							\
+    memcpy(&w, state->input + state->index, N/8);			\
+    if (((state->endianness & BYTE_BIG_ENDIAN) != 0) == H_HOST_LITTLE_ENDIAN) \
+      w = H_BSWAP##N(w);						\
+    state->index += N/8;						\
+    return signed_p ? (int64_t)(int##N##_t)w : (int64_t)w;		\
+  }
+
+int64_t h_read_bits_8(HInputStream* state, int count, char signed_p) {
+  if (state->bit_offset || state->margin || state->index >= state->length)
+    return read_bits_slow(state, 8, signed_p);
+  uint8_t c = state->input[state->index++];
+  return signed_p ? (int64_t)(int8_t)c : (int64_t)c;
+}
+READ_ALIGNED(16)
+READ_ALIGNED(32)
+READ_ALIGNED(64)
+
+int64_t h_read_bits_window(HInputStream* state, int count, char signed_p) {
+  if (state->margin || count < 1 || count > 57 || state->length - state->index < 8)
+    return read_bits_slow(state, count, signed_p);
+
+  int offset = state->bit_offset;
+  uint64_t w, out;
+  memcpy(&w, state->input + state->index, 8);
+  switch (state->endianness) {
+  case BIT_BIG_ENDIAN | BYTE_BIG_ENDIAN:
+    if (H_HOST_LITTLE_ENDIAN)
+      w = H_BSWAP64(w);
+    out = (w << offset) >> (64 - count);
+    break;
+  case BIT_LITTLE_ENDIAN | BYTE_LITTLE_ENDIAN:
+    if (!H_HOST_LITTLE_ENDIAN)
+      w = H_BSWAP64(w);
+    out = (w >> offset) & ((UINT64_C(1) << count) - 1);
+    break;
+  default:
+    return read_bits_slow(state, count, signed_p);
+  }
+  offset += count;
+  state->index += offset >> 3;
+  state->bit_offset = offset & 7;
+
+  uint64_t msb = (uint64_t)(signed_p ? 1 : 0) << (count - 1);
+  return (int64_t)((out ^ msb) - msb);
+}
+
+HBitReader h_bit_reader(int count) {
+  switch (count) {
+  case 8:  return h_read_bits_8;
+  case 16: return h_read_bits_16;
+  case 32: return h_read_bits_32;
+  case 64: return h_read_bits_64;
+  default: return h_read_bits_window;
+  }
+}
+
+int64_t h_read_bits(HInputStream* state, int count, char signed_p) {
+  return h_bit_reader(count)(state, count, signed_p);
+}
@@ -22,39 +22,148 @@ HBitWriter *h_bit_writer_new(HAllocator* mm__) {
   return writer;
 }
 
+HBitWriter *h_bit_writer_new_buffer(HAllocator* mm__, uint8_t *buf, size_t capacity) {
+  HBitWriter *writer = h_new(HBitWriter, 1);
+  memset(writer, 0, sizeof(*writer));
+  writer->buf = buf;
+  writer->capacity = capacity;
+  writer->mm__ = mm__;
+  writer->flags = BYTE_BIG_ENDIAN | BIT_BIG_ENDIAN;
+  writer->fixed = 1;
+  return writer;
+}
+
+static bool h_bit_writer_grow(HBitWriter* w, size_t nbytes) {
+  if (w->fixed) {
+    w->error = 1;
+    return false;
+  }
+  size_t capacity = w->capacity;
+  while (w->index + nbytes + 8 > capacity)
+    capacity *= 2;
+  uint8_t *buf = w->mm__->realloc(w->mm__, w->buf, capacity);
+  if (!buf) {
+    w->error = 1;
+    return false;
+  }
+  w->buf = buf;
+  w->capacity = capacity;
+  return true;
+}
+
 /**
- * Ensure there are at least [nbits] bits available at the end of the
- * buffer. If the buffer is expanded, the added bits should be zeroed.
+ * Ensure there is room for [nbits] more bits, on top of those pending in
+ * the accumulator. Growing buffers keep a word to spare, so that the
+ * accumulator can always be stored whole; nothing relies on the new
+ * space being zeroed, as every byte is overwritten before it counts.
  */
-static void h_bit_writer_reserve(HBitWriter* w, size_t nbits) {
-  // As is, this may overshoot by a byte, e.g., nbits=9, bit_offset=1.
-  // This will assume that the last partial byte is full, and reserve
-  // 2 bytes at the end, whereas only one is necessary.
-  //
-  // That said, this guarantees the postcondition that w->buf[w->index]
-  // is valid.
-
-  // Round up to bytes
-  int nbytes = (nbits + 7) / 8 + ((w->bit_offset != 0) ? 1 : 0);
-  size_t old_capacity = w->capacity;
-  while (w->index + nbytes >= w->capacity) {
-    w->buf = w->mm__->realloc(w->mm__, w->buf, w->capacity *= 2);
-    if (!w->buf) {
-      w->error = 1;
-      return;
-    }
+static inline bool h_bit_writer_reserve(HBitWriter* w, size_t nbits) {
+  size_t nbytes = (w->bit_offset + w->acc_bits + nbits + 7) / 8;
+  if (w->error)
+    return false;
+  if (nbytes + (w->fixed ? 0 : 8) > w->capacity - w->index)
+    return h_bit_writer_grow(w, nbytes);
+  return true;
+}
+
+static inline uint64_t low_bits(uint64_t data, size_t nbits) {
+  return nbits < 64 ? data & ((UINT64_C(1) << nbits) - 1) : data;
+}
+
+// The accumulator only serves writers whose bit and byte orders agree:
+// then the output is a plain stream of bits, MSB or LSB first, and whole
+// words of it can be stored at once.
+#define ACC_BE (BYTE_BIG_ENDIAN | BIT_BIG_ENDIAN)
+static inline bool acc_usable(const HBitWriter *w) {
+  return (w->flags & ACC_BE) == 0 || (w->flags & ACC_BE) == ACC_BE;
+}
+
+static inline void store_word(HBitWriter *w, uint64_t word) {
+  if ((w->flags & BYTE_BIG_ENDIAN) ? H_HOST_LITTLE_ENDIAN : !H_HOST_LITTLE_ENDIAN)
+    word = H_BSWAP64(word);
+  memcpy(w->buf + w->index, &word, 8);
+  w->index += 8;
+}
+
+// Move the accumulator into buf, leaving any partial byte the way the
+// bytewise path keeps it: the bits so far at the bottom of buf[index]
+// for big-endian bit order, at the top for little-endian.
+static void acc_flush(HBitWriter *w) {
+  int nbits = w->acc_bits;
+  if (!nbits)
+    return;
+  if (w->acc_flags & BIT_BIG_ENDIAN) {
+    for (; nbits >= 8; nbits -= 8)
+      w->buf[w->index++] = w->acc >> (nbits - 8);
+    if (nbits)
+      w->buf[w->index] = w->acc & ((1 << nbits) - 1);
+  } else {
+    uint64_t acc = w->acc;
+    for (; nbits >= 8; nbits -= 8, acc >>= 8)
+      w->buf[w->index++] = acc;
+    if (nbits)
+      w->buf[w->index] = acc << (8 - nbits);
   }
+  w->bit_offset = nbits;
+  w->acc = 0;
+  w->acc_bits = 0;
+}
 
-  if (old_capacity != w->capacity)
-    memset(w->buf + old_capacity, 0, w->capacity - old_capacity);
+// ...and the reverse, picking up a partial byte left by the bytewise path
+static void acc_load(HBitWriter *w) {
+  if (!w->bit_offset)
+    return;
+  if (w->flags & BIT_BIG_ENDIAN)
+    w->acc = w->buf[w->index] & ((1 << w->bit_offset) - 1);
+  else
+    w->acc = w->buf[w->index] >> (8 - w->bit_offset);
+  w->acc_bits = w->bit_offset;
+  w->bit_offset = 0;
 }
 
+static void acc_put(HBitWriter* w, uint64_t data, size_t nbits) {
+  size_t room = 64 - w->acc_bits;
+  data = low_bits(data, nbits);
+  if (w->flags & BIT_BIG_ENDIAN) {
+    // newest bits at the bottom
+    if (nbits < room) {
+      w->acc = w->acc << nbits | data;
+      w->acc_bits += nbits;
+      return;
+    }
+    nbits -= room;
+    store_word(w, room < 64 ? w->acc << room | data >> nbits : data);
+    w->acc = low_bits(data, nbits);
+  } else {
+    // newest bits at the top
+    if (nbits < room) {
+      w->acc |= data << w->acc_bits;
+      w->acc_bits += nbits;
+      return;
+    }
+    nbits -= room;
+    store_word(w, w->acc | data << w->acc_bits);
+    w->acc = room < 64 ? data >> room : 0;
+  }
+  w->acc_bits = nbits;
+}
 
 void h_bit_writer_put(HBitWriter* w, uint64_t data, size_t nbits) {
   assert(nbits > 0); // Less than or equal to zero makes complete nonsense
 
   // expand size...
-  h_bit_writer_reserve(w, nbits);
+  if (!h_bit_writer_reserve(w, nbits))
+    return;
+
+  if (w->acc_bits && w->acc_flags != w->flags)
+    acc_flush(w);
+  if (acc_usable(w)) {
+    acc_load(w);
+    w->acc_flags = w->flags;
+    acc_put(w, data, nbits);
+    return;
+  }
+  acc_flush(w);
 
   while (nbits) {
     size_t count = MIN((size_t)(8 - w->bit_offset), nbits);
@@ -89,10 +198,27 @@ void h_bit_writer_put(HBitWriter* w, uint64_t data, size_t nbits) {
 
 }
 
+void h_bit_writer_put_bytes(HBitWriter* w, const uint8_t *data, size_t len) {
+  if (!len || !h_bit_writer_reserve(w, len * 8))
+    return;
+  // on a byte boundary, a byte goes in as it is, whatever the flags
+  if ((w->acc_bits + w->bit_offset) % 8 == 0) {
+    acc_flush(w);
+    memcpy(w->buf + w->index, data, len);
+    w->index += len;
+    return;
+  }
+  for (size_t i = 0; i < len; i++)
+    h_bit_writer_put(w, data[i], 8);
+}
+
 
 const uint8_t *h_bit_writer_get_buffer(HBitWriter* w, size_t *len) {
   assert (len != NULL);
   assert (w != NULL);
+  if (w->error)
+    return NULL;
+  acc_flush(w);
   // Not entirely sure how to handle a non-integral number of bytes... make it an error for now
   assert (w->bit_offset == 0); // BUG: change this to some sane behaviour
 
@@ -102,6 +228,7 @@ const uint8_t *h_bit_writer_get_buffer(HBitWriter* w, size_t *len) {
 
 void h_bit_writer_free(HBitWriter* w) {
   HAllocator *mm__ = w->mm__;
-  h_free(w->buf);
+  if (!w->fixed)
+    h_free(w->buf);
   h_free(w);
 }
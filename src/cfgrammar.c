@@ -4,6 +4,7 @@
 #include "allocator.h"
 #include <assert.h>
 #include <ctype.h>
+#include <string.h>
 
 
 // a special map value for use when the map is used to represent a set
@@ -212,20 +213,19 @@ static void collect_geneps(HCFGrammar *g)
     size_t i;
     HHashTableEntry *hte;
     for(i=0; i < g->nts->capacity; i++) {
-      for(hte = &g->nts->contents[i]; hte; hte = hte->next) {
-        if (hte->key == NULL) {
-          continue;
-	}
-        const HCFChoice *symbol = hte->key;
-        assert(symbol->type == HCF_CHOICE);
-
-        // this NT derives epsilon if any one of its productions does.
-        HCFSequence **p;
-        for(p = symbol->seq; *p != NULL; p++) {
-          if (h_derives_epsilon_seq(g, (*p)->items)) {
-            h_hashset_put(g->geneps, symbol);
-            break;
-          }
+      hte = &g->nts->contents[i];
+      if (hte->key == NULL) {
+        continue;
+      }
+      const HCFChoice *symbol = hte->key;
+      assert(symbol->type == HCF_CHOICE);
+
+      // this NT derives epsilon if any one of its productions does.
+      HCFSequence **p;
+      for(p = symbol->seq; *p != NULL; p++) {
+        if (h_derives_epsilon_seq(g, (*p)->items)) {
+          h_hashset_put(g->geneps, symbol);
+          break;
         }
       }
     }
@@ -322,15 +322,14 @@ void h_stringmap_replace(HStringMap *m, void *old, void *new)
   // iterate over m->char_branches
   const HHashTable *ht = m->char_branches;
   for (size_t i=0; i < ht->capacity; i++) {
-    for (HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-      if (hte->key == NULL) {
-        continue;
-      }
+    HHashTableEntry *hte = &ht->contents[i];
+    if (hte->key == NULL) {
+      continue;
+    }
 
-      HStringMap *m_ = hte->value;
-      if (m_) {
-        h_stringmap_replace(m_, old, new);
-      }
+    HStringMap *m_ = hte->value;
+    if (m_) {
+      h_stringmap_replace(m_, old, new);
     }
   }
 }
@@ -361,7 +360,7 @@ void *h_stringmap_get_lookahead(const HStringMap *m, HInputStream lookahead)
 
     // note the lookahead stream is passed by value, i.e. a copy.
     // reading bits from it does not consume them from the real input.
-    uint8_t c = h_read_bits(&lookahead, 8, false);
+    uint8_t c = h_read_byte(&lookahead);
     
     if (lookahead.overrun) {        // end of chunk
       if (lookahead.last_chunk) {   // end of input
@@ -379,6 +378,148 @@ void *h_stringmap_get_lookahead(const HStringMap *m, HInputStream lookahead)
   return NULL;
 }
 
+void h_byte_classes_init(uint8_t classes[256])
+{
+  memset(classes, 0, 256);
+}
+
+size_t h_byte_classes_refine(uint8_t classes[256], size_t nclasses,
+                             const HCharset set)
+{
+  uint16_t size[256] = {0}, inside[256] = {0};
+  int16_t split[256];
+
+  for (unsigned int c=0; c<256; c++) {
+    size[classes[c]]++;
+    if (charset_isset(set, c)) {
+      inside[classes[c]]++;
+    }
+  }
+  // the members of a class that is cut by set move to a new class
+  for (size_t k=0; k<nclasses; k++) {
+    split[k] = (inside[k] && inside[k] < size[k])? (int16_t)nclasses++ : -1;
+  }
+  for (unsigned int c=0; c<256; c++) {
+    if (charset_isset(set, c) && split[classes[c]] >= 0) {
+      classes[c] = split[classes[c]];
+    }
+  }
+  return nclasses;
+}
+
+size_t h_cfgrammar_byte_classes(const HCFGrammar *g, uint8_t classes[256])
+{
+  unsigned int single[256 / (sizeof(unsigned int) * 8)];
+  size_t n = 1;
+
+  h_byte_classes_init(classes);
+  const HHashTable *ht = g->nts;
+  for (size_t i=0; i < ht->capacity; i++) {
+    HHashTableEntry *hte = &ht->contents[i];
+    if (hte->key == NULL) {
+      continue;
+    }
+    const HCFChoice *a = hte->key;
+    for (HCFSequence **p = a->seq; *p; p++) {
+      for (HCFChoice **x = (*p)->items; *x; x++) {
+        if ((*x)->type == HCF_CHARSET) {
+          n = h_byte_classes_refine(classes, n, (*x)->charset);
+        } else if ((*x)->type == HCF_CHAR) {
+          memset(single, 0, sizeof(single));
+          charset_set(single, (*x)->chr, 1);
+          n = h_byte_classes_refine(classes, n, single);
+        }
+      }
+    }
+  }
+  return n;
+}
+
+HLookaheadTable *h_lookahead_new(HArena *a, const uint8_t *classes,
+                                 size_t nclasses)
+{
+  HLookaheadTable *t = h_arena_malloc(a, sizeof(HLookaheadTable));
+  if (classes) {
+    memcpy(t->classes, classes, 256);
+    t->nclasses = nclasses;
+  } else {
+    for (unsigned int c=0; c<256; c++) {
+      t->classes[c] = c;
+    }
+    t->nclasses = 256;
+  }
+  t->capacity = 16;
+  t->values = h_arena_malloc(a, 2 * t->capacity * sizeof(void *));
+  t->next = h_arena_malloc(a, t->capacity * t->nclasses * sizeof(uint32_t));
+  t->used = 1;                  // node 0 means "no branch"
+  t->done = h_hashtable_new(a, h_eq_ptr, h_hash_ptr);
+  t->leaves = h_hashtable_new(a, h_eq_ptr, h_hash_ptr);
+  t->arena = a;
+  return t;
+}
+
+static uint32_t lookahead_node(HLookaheadTable *t, void *eps, void *end)
+{
+  size_t n = t->nclasses;
+
+  if (t->used == t->capacity) {
+    void **values = h_arena_malloc(t->arena, 4 * t->capacity * sizeof(void *));
+    uint32_t *next =
+      h_arena_malloc(t->arena, 2 * t->capacity * n * sizeof(uint32_t));
+    memcpy(values, t->values, 2 * t->used * sizeof(void *));
+    memcpy(next, t->next, t->used * n * sizeof(uint32_t));
+    h_arena_free_sized(t->arena, t->values, 2 * t->capacity * sizeof(void *));
+    h_arena_free_sized(t->arena, t->next, t->capacity * n * sizeof(uint32_t));
+    t->values = values;
+    t->next = next;
+    t->capacity *= 2;
+  }
+  uint32_t i = t->used++;
+  t->values[2*i] = eps;
+  t->values[2*i+1] = end;
+  memset(&t->next[i * n], 0, n * sizeof(uint32_t));
+  return i;
+}
+
+uint32_t h_lookahead_add(HLookaheadTable *t, const HStringMap *m)
+{
+  uintptr_t i = (uintptr_t)h_hashtable_get(t->done, m);
+  if (i) {
+    return i;
+  }
+
+  // a lookup stops at the epsilon branch, so the rest of such a node is
+  // never looked at. share one node per value.
+  if (m->epsilon_branch) {
+    i = (uintptr_t)h_hashtable_get(t->leaves, m->epsilon_branch);
+    if (!i) {
+      i = lookahead_node(t, m->epsilon_branch, NULL);
+      h_hashtable_put(t->leaves, m->epsilon_branch, (void *)i);
+    }
+    h_hashtable_put(t->done, m, (void *)i);
+    return i;
+  }
+
+  i = lookahead_node(t, NULL, m->end_branch);
+  h_hashtable_put(t->done, m, (void *)i);
+
+  // bytes of one class have equivalent branches; the first one lowered
+  // stands for all of them.
+  const HHashTable *ht = m->char_branches;
+  for (size_t j=0; j < ht->capacity; j++) {
+    HHashTableEntry *hte = &ht->contents[j];
+    if (hte->key == NULL || hte->value == NULL) {
+      continue;
+    }
+    size_t cell = i * t->nclasses + t->classes[key_char((HCharKey)hte->key)];
+    if (t->next[cell] == 0) {
+      uint32_t next = h_lookahead_add(t, hte->value);
+      t->next[cell] = next;     // NB t->next may have moved
+    }
+  }
+  return i;
+}
+
 bool h_stringmap_present(const HStringMap *m, const uint8_t *str, size_t n, bool end)
 {
   return (h_stringmap_get(m, str, n, end) != NULL);
@@ -396,6 +537,71 @@ bool h_stringmap_empty(const HStringMap *m)
           && h_hashtable_empty(m->char_branches));
 }
 
+// number of strings in the set m
+static size_t stringset_size(const HStringMap *m)
+{
+  size_t n = (m->epsilon_branch != NULL) + (m->end_branch != NULL);
+
+  const HHashTable *ht = m->char_branches;
+  for (size_t i=0; i < ht->capacity; i++) {
+    HHashTableEntry *hte = &ht->contents[i];
+    if (hte->key == NULL || hte->value == NULL) {
+      continue;
+    }
+    n += stringset_size(hte->value);
+  }
+  return n;
+}
+
+// allocate empty sets in tab for the nonterminals of g that have none.
+// returns a NULL-terminated array of them.
+static const HCFChoice **pending_nts(HCFGrammar *g, HHashTable *tab)
+{
+  const HCFChoice **pending =
+    h_arena_malloc(g->arena, (g->nts->used + 1) * sizeof(HCFChoice *));
+  size_t n = 0;
+
+  const HHashTable *ht = g->nts;
+  for (size_t i=0; i < ht->capacity; i++) {
+    HHashTableEntry *hte = &ht->contents[i];
+    if (hte->key == NULL || h_hashtable_present(tab, hte->key)) {
+      continue;
+    }
+    h_hashtable_put(tab, hte->key, h_stringmap_new(g->arena));
+    pending[n++] = hte->key;
+  }
+  pending[n] = NULL;
+  return pending;
+}
+
+/* Compute first_k for all nonterminals of g that do not have it yet.
+ *
+ * With left recursion, the first set of a nonterminal is needed to compute
+ * itself, so plain recursion would memoize an incomplete set. Instead, start
+ * from empty sets and grow them until nothing changes.
+ */
+static void first_fixpoint(size_t k, HCFGrammar *g)
+{
+  const HCFChoice **pending = pending_nts(g, g->first[k]);
+  bool changed;
+
+  do {
+    changed = false;
+    for (const HCFChoice **x = pending; *x; x++) {
+      HStringMap *ret = h_hashtable_get(g->first[k], *x);
+      size_t size = stringset_size(ret);
+
+      // the union of the first sets of all productions
+      for (HCFSequence **p = (*x)->seq; *p; ++p) {
+        h_stringmap_update(ret, h_first_seq(k, g, (*p)->items));
+      }
+      if (stringset_size(ret) != size) {
+        changed = true;
+      }
+    }
+  } while (changed);
+}
+
 const HStringMap *h_first(size_t k, HCFGrammar *g, const HCFChoice *x)
 {
   HStringMap *ret;
@@ -412,6 +618,10 @@ const HStringMap *h_first(size_t k, HCFGrammar *g, const HCFChoice *x)
   if (ret != NULL) {
     return ret;
   }
+  if (x->type == HCF_CHOICE && h_hashset_present(g->nts, x)) {
+    first_fixpoint(k, g);
+    return h_hashtable_get(g->first[k], x);
+  }
   ret = h_stringmap_new(g->arena);
   assert(ret != NULL);
   h_hashtable_put(g->first[k], x, ret);
@@ -444,6 +654,25 @@ const HStringMap *h_first(size_t k, HCFGrammar *g, const HCFChoice *x)
   return ret;
 }
 
+bool h_cfgrammar_first_bytes(HAllocator *mm__, const HParser *parser, HCharset set)
+{
+  HCFGrammar *g = h_cfgrammar(mm__, parser);
+  if (g == NULL)
+    return false;
+
+  const HStringMap *first = h_first(1, g, g->start);
+  bool ret = !first->epsilon_branch && !first->end_branch;
+  if (ret) {
+    const HHashTable *ht = first->char_branches;
+    for (size_t i=0; i < ht->capacity; i++) {
+      if (ht->contents[i].key != NULL)
+        charset_set(set, key_char((HCharKey)ht->contents[i].key), 1);
+    }
+  }
+  h_cfgrammar_free(g);
+  return ret;
+}
+
 // helpers for h_first_seq, definitions below
 static bool is_singleton_epsilon(const HStringMap *m);
 static bool any_string_shorter(size_t k, const HStringMap *m);
@@ -506,16 +735,15 @@ static bool any_string_shorter(size_t k, const HStringMap *m)
   // iterate over m->char_branches
   const HHashTable *ht = m->char_branches;
   for (size_t i=0; i < ht->capacity; i++) {
-    for (HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-      if (hte->key == NULL) {
-        continue;
-      }
-      HStringMap *m_ = hte->value;
+    HHashTableEntry *hte = &ht->contents[i];
+    if (hte->key == NULL) {
+      continue;
+    }
+    HStringMap *m_ = hte->value;
 
-      // check subtree for strings shorter than k-1
-      if (any_string_shorter(k-1, m_)) {
-        return true;
-      }
+    // check subtree for strings shorter than k-1
+    if (any_string_shorter(k-1, m_)) {
+      return true;
     }
   }
 
@@ -536,12 +764,11 @@ static void remove_all_shorter(size_t k, HStringMap *m)
   // iterate over m->char_branches
   const HHashTable *ht = m->char_branches;
   for (size_t i=0; i < ht->capacity; i++) {
-    for (HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-      if (hte->key == NULL) {
-        continue;
-      }
-      remove_all_shorter(k-1, hte->value);      // recursion into subtree
+    HHashTableEntry *hte = &ht->contents[i];
+    if (hte->key == NULL) {
+      continue;
     }
+    remove_all_shorter(k-1, hte->value);      // recursion into subtree
   }
 }
 
@@ -552,6 +779,48 @@ const HStringMap *h_follow_(size_t k, HCFGrammar *g, HCFChoice **s)
   return h_follow(k, g, *s);
 }
 
+/* Compute follow_k for all nonterminals of g that do not have it yet.
+ *
+ * Like first sets, follow sets can depend on themselves (e.g. through
+ * "A -> B", "B -> A c"), so this is another fixpoint iteration.
+ */
+static void follow_fixpoint(size_t k, HCFGrammar *g)
+{
+  const HCFChoice **pending = pending_nts(g, g->follow[k]);
+  size_t size = 0, prevsize;
+
+  do {
+    prevsize = size;
+    size = 0;
+    for (const HCFChoice **x = pending; *x; x++) {
+      HStringMap *ret = h_hashtable_get(g->follow[k], *x);
+
+      // if X is the start symbol, the end token is in its follow set
+      if (*x == g->start) {
+        h_stringmap_put_end(ret, INSET);
+      }
+      // given a production "A -> alpha X tail", add first_k(tail follow_k(A))
+      const HHashTable *ht = g->nts;
+      for (size_t i=0; i < ht->capacity; i++) {
+        HHashTableEntry *hte = &ht->contents[i];
+        if (hte->key == NULL) {
+          continue;
+        }
+        HCFChoice *a = (void *)hte->key;
+        for (HCFSequence **p = a->seq; *p; p++) {
+          for (HCFChoice **s = (*p)->items; *s; s++) {
+            if (*s == *x) {
+              const HStringMap *first_tail = h_first_seq(k, g, s+1);
+              stringset_extend(g, ret, k, first_tail, h_follow_, &a);
+            }
+          }
+        }
+      }
+      size += stringset_size(ret);
+    }
+  } while (size != prevsize);
+}
+
 const HStringMap *h_follow(size_t k, HCFGrammar *g, const HCFChoice *x)
 {
   // consider all occurances of X in g
@@ -575,6 +844,10 @@ const HStringMap *h_follow(size_t k, HCFGrammar *g, const HCFChoice *x)
   if (ret != NULL) {
     return ret;
   }
+  if (h_hashset_present(g->nts, x)) {
+    follow_fixpoint(k, g);
+    return h_hashtable_get(g->follow[k], x);
+  }
   ret = h_stringmap_new(g->arena);
   assert(ret != NULL);
   h_hashtable_put(g->follow[k], x, ret);
@@ -587,27 +860,26 @@ const HStringMap *h_follow(size_t k, HCFGrammar *g, const HCFChoice *x)
   size_t i;
   HHashTableEntry *hte;
   for (i=0; i < g->nts->capacity; i++) {
-    for (hte = &g->nts->contents[i]; hte; hte = hte->next) {
-      if (hte->key == NULL) {
-        continue;
-      }
-      HCFChoice *a = (void *)hte->key;      // production's left-hand symbol
-      assert(a->type == HCF_CHOICE);
+    hte = &g->nts->contents[i];
+    if (hte->key == NULL) {
+      continue;
+    }
+    HCFChoice *a = (void *)hte->key;      // production's left-hand symbol
+    assert(a->type == HCF_CHOICE);
 
-      // iterate over the productions for A
-      HCFSequence **p;
-      for (p=a->seq; *p; p++) {
-        HCFChoice **s = (*p)->items;        // production's right-hand side
-        
-        for (; *s; s++) {
-          if (*s == x) { // occurance found
-            HCFChoice **tail = s+1;
+    // iterate over the productions for A
+    HCFSequence **p;
+    for (p=a->seq; *p; p++) {
+      HCFChoice **s = (*p)->items;        // production's right-hand side
+      
+      for (; *s; s++) {
+        if (*s == x) { // occurance found
+          HCFChoice **tail = s+1;
 
-            const HStringMap *first_tail = h_first_seq(k, g, tail);
+          const HStringMap *first_tail = h_first_seq(k, g, tail);
 
-            // extend the elems of first_k(tail) up to length k from follow(A)
-            stringset_extend(g, ret, k, first_tail, h_follow_, &a);
-          }
+          // extend the elems of first_k(tail) up to length k from follow(A)
+          stringset_extend(g, ret, k, first_tail, h_follow_, &a);
         }
       }
     }
@@ -656,23 +928,26 @@ static void stringset_extend(HCFGrammar *g, HStringMap *ret,
   // iterate over as->char_branches
   const HHashTable *ht = as->char_branches;
   for(size_t i=0; i < ht->capacity; i++) {
-    for(HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-      if (hte->key == NULL) {
-        continue;
-      }
-      uint8_t c = key_char((HCharKey)hte->key);
-      
-      // follow the branch to find the set { a' | t a' <- as }
-      HStringMap *as_ = (HStringMap *)hte->value;
-
-      // now the elements of ret that begin with t are given by
-      // t { a b | a <- as_, b <- f_l(tail), l=k-|a|-1 }
-      // so we can use recursion over k
-      HStringMap *ret_ = h_stringmap_new(g->arena);
+    HHashTableEntry *hte = &ht->contents[i];
+    if (hte->key == NULL) {
+      continue;
+    }
+    uint8_t c = key_char((HCharKey)hte->key);
+    
+    // follow the branch to find the set { a' | t a' <- as }
+    HStringMap *as_ = (HStringMap *)hte->value;
+
+    // now the elements of ret that begin with t are given by
+    // t { a b | a <- as_, b <- f_l(tail), l=k-|a|-1 }
+    // so we can use recursion over k. ret may already have some of them,
+    // from another occurrence or an earlier round of follow_fixpoint.
+    HStringMap *ret_ = h_hashtable_get(ret->char_branches, (void *)char_key(c));
+    if (!ret_) {
+      ret_ = h_stringmap_new(g->arena);
       h_stringmap_put_after(ret, c, ret_);
-
-      stringset_extend(g, ret_, k-1, as_, f, tail);
     }
+
+    stringset_extend(g, ret_, k-1, as_, f, tail);
   }
 }
 
@@ -848,15 +1123,14 @@ void h_pprint_grammar(FILE *file, const HCFGrammar *g, int indent)
   size_t i;
   HHashTableEntry *hte;
   for(i=0; i < g->nts->capacity; i++) {
-    for(hte = &g->nts->contents[i]; hte; hte = hte->next) {
-      if (hte->key == NULL) {
-        continue;
-      }
-      const HCFChoice *a = hte->key;        // production's left-hand symbol
-      assert(a->type == HCF_CHOICE);
-
-      pprint_ntrules(file, g, a, indent, len);
+    hte = &g->nts->contents[i];
+    if (hte->key == NULL) {
+      continue;
     }
+    const HCFChoice *a = hte->key;        // production's left-hand symbol
+    assert(a->type == HCF_CHOICE);
+
+    pprint_ntrules(file, g, a, indent, len);
   }
 }
 
@@ -872,18 +1146,17 @@ void h_pprint_symbolset(FILE *file, const HCFGrammar *g, const HHashSet *set, in
   HHashTableEntry *hte;
   const HCFChoice *a = NULL;
   for(i=0; i < set->capacity; i++) {
-    for(hte = &set->contents[i]; hte; hte = hte->next) {
-      if (hte->key == NULL) {
-        continue;
-      }
-      if(a != NULL) { // we're not on the first element
-          fputc(',', file);
-      }
+    hte = &set->contents[i];
+    if (hte->key == NULL) {
+      continue;
+    }
+    if(a != NULL) { // we're not on the first element
+        fputc(',', file);
+    }
 
-      a = hte->key;        // production's left-hand symbol
+    a = hte->key;        // production's left-hand symbol
 
-      h_pprint_symbol(file, g, a);
-    }
+    h_pprint_symbol(file, g, a);
   }
 
   fputs("}\n", file);
@@ -942,33 +1215,32 @@ pprint_stringmap_elems(FILE *file, bool first, char *prefix, size_t n, char sep,
   size_t i;
   HHashTableEntry *hte;
   for(i=0; i < ht->capacity; i++) {
-    for(hte = &ht->contents[i]; hte; hte = hte->next) {
-      if (hte->key == NULL) {
-        continue;
-      }
-      uint8_t c = key_char((HCharKey)hte->key);
-      HStringMap *ends = hte->value;
-
-      size_t n_ = n;
-      switch(c) {
-      case '$':  prefix[n_++] = '\\'; prefix[n_++] = '$'; break;
-      case '"':  prefix[n_++] = '\\'; prefix[n_++] = '"'; break;
-      case '\\': prefix[n_++] = '\\'; prefix[n_++] = '\\'; break;
-      case '\b': prefix[n_++] = '\\'; prefix[n_++] = 'b'; break;
-      case '\t': prefix[n_++] = '\\'; prefix[n_++] = 't'; break;
-      case '\n': prefix[n_++] = '\\'; prefix[n_++] = 'n'; break;
-      case '\r': prefix[n_++] = '\\'; prefix[n_++] = 'r'; break;
-      default:
-        if (isprint(c)) {
-          prefix[n_++] = c;
-	} else {
-          n_ += sprintf(prefix+n_, "\\x%.2X", c);
-	}
+    hte = &ht->contents[i];
+    if (hte->key == NULL) {
+      continue;
+    }
+    uint8_t c = key_char((HCharKey)hte->key);
+    HStringMap *ends = hte->value;
+
+    size_t n_ = n;
+    switch(c) {
+    case '$':  prefix[n_++] = '\\'; prefix[n_++] = '$'; break;
+    case '"':  prefix[n_++] = '\\'; prefix[n_++] = '"'; break;
+    case '\\': prefix[n_++] = '\\'; prefix[n_++] = '\\'; break;
+    case '\b': prefix[n_++] = '\\'; prefix[n_++] = 'b'; break;
+    case '\t': prefix[n_++] = '\\'; prefix[n_++] = 't'; break;
+    case '\n': prefix[n_++] = '\\'; prefix[n_++] = 'n'; break;
+    case '\r': prefix[n_++] = '\\'; prefix[n_++] = 'r'; break;
+    default:
+      if (isprint(c)) {
+        prefix[n_++] = c;
+      } else {
+        n_ += sprintf(prefix+n_, "\\x%.2X", c);
       }
-
-      first = pprint_stringmap_elems(file, first, prefix, n_,
-                                     sep, valprint, env, ends);
     }
+
+    first = pprint_stringmap_elems(file, first, prefix, n_,
+                                   sep, valprint, env, ends);
   }
 
   return first;
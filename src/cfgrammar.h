@@ -62,6 +62,70 @@ static inline HStringMap *h_stringmap_get_char(const HStringMap *m, const uint8_
 // dummy return value used by h_stringmap_get_lookahead when out of input
 #define NEED_INPUT ((void *)-1)
 
+/* Byte equivalence classes: bytes that no terminal of a grammar tells
+ * apart get the same class, so tables over input bytes can have one entry
+ * per class instead of 256.
+ */
+void h_byte_classes_init(uint8_t classes[256]);
+// split classes so that none has bytes both inside and outside of set.
+// returns the new number of classes.
+size_t h_byte_classes_refine(uint8_t classes[256], size_t nclasses,
+                             const HCharset set);
+// compute the classes of g's terminals; returns their number
+size_t h_cfgrammar_byte_classes(const HCFGrammar *g, uint8_t classes[256]);
+
+/* Flat form of (a set of) HStringMaps for use by the parse loops.
+ * Each trie node becomes an array indexed by the equivalence class of the
+ * next input byte, so a lookup costs two loads per byte instead of a hash
+ * table probe. Nodes are referred to by index; index 0 means "no branch".
+ */
+typedef struct HLookaheadTable_ {
+  uint8_t classes[256];         // equivalence class of each byte
+  size_t nclasses;
+  void **values;                // epsilon and end branch, two per node
+  uint32_t *next;               // nclasses successors per node
+  size_t used;                  // nodes
+  size_t capacity;
+  HHashTable *done;             // HStringMaps already lowered -> node index
+  HHashTable *leaves;           // epsilon-only nodes, by value -> node index
+  HArena *arena;
+} HLookaheadTable;
+
+/* The maps added to the table must not distinguish between bytes of the
+ * same class. If classes is NULL, every byte is its own class.
+ */
+HLookaheadTable *h_lookahead_new(HArena *a, const uint8_t *classes,
+                                 size_t nclasses);
+// lower m into the table, returning the index of its root node
+uint32_t h_lookahead_add(HLookaheadTable *t, const HStringMap *m);
+
+/* Equivalent to h_stringmap_get_lookahead on the map that was lowered into
+ * node 'root'.
+ */
+static inline
+void *h_lookahead_get(const HLookaheadTable *t, uint32_t root,
+                      HInputStream lookahead)
+{
+  uint32_t i = root;
+  while(i) {
+    void *eps = t->values[2*i];
+    if(eps)
+      return eps;
+
+    uint8_t c;
+    if(lookahead.bit_offset == 0 && lookahead.margin == 0
+       && lookahead.index < lookahead.length) {
+      c = lookahead.input[lookahead.index++];   // whole byte, aligned
+    } else {
+      c = h_read_byte(&lookahead);
+      if(lookahead.overrun)
+        return lookahead.last_chunk? t->values[2*i+1] : NEED_INPUT;
+    }
+    i = t->next[i * t->nclasses + t->classes[c]];
+  }
+  return NULL;
+}
+
 
 /* Convert 'parser' into CFG representation by desugaring and compiling the set
  * of nonterminals.
@@ -89,6 +153,12 @@ const HStringMap *h_first(size_t k, HCFGrammar *g, const HCFChoice *x);
 /* Compute first_k set of sentential form s. s NULL-terminated. */
 const HStringMap *h_first_seq(size_t k, HCFGrammar *g, HCFChoice **s);
 
+/* Add the bytes a context-free parser can start with to set, from the
+ * first_1 set of its grammar. False if it isn't context-free, or can match
+ * without reading a byte.
+ */
+bool h_cfgrammar_first_bytes(HAllocator *mm__, const HParser *parser, HCharset set);
+
 /* Compute follow_k set of symbol x. Memoized. */
 const HStringMap *h_follow(size_t k, HCFGrammar *g, const HCFChoice *x);
 
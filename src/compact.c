@@ -0,0 +1,320 @@
+#include <assert.h>
+#include <string.h>
+#include "hammer.h"
+#include "internal.h"
+
+// Compact parse results: the tree is laid out in two passes. The first
+// counts tokens and bytes so that everything fits in one allocation, the
+// second fills it in, reserving room for all elements of a sequence
+// before descending into any of them so that they end up adjacent.
+
+typedef struct {
+  size_t ntokens;
+  size_t nbytes;
+  bool user;     // some token has a user-defined type
+  bool overflow; // something doesn't fit in 32 bits
+} HCompactCount;
+
+typedef struct {
+  HCompactToken *tokens;
+  uint8_t *bytes;
+  size_t ntokens;
+  size_t nbytes;
+} HCompactFill;
+
+static void count_token(HCompactCount *c, const HParsedToken *tok) {
+  c->ntokens++;
+  if (!tok)
+    return;
+  if (tok->index > UINT32_MAX || tok->bit_length > UINT32_MAX
+      || tok->token_type > UINT16_MAX)
+    c->overflow = true;
+  switch (tok->token_type) {
+  case TT_BYTES:
+    c->nbytes += tok->bytes.len;
+    break;
+  case TT_SEQUENCE:
+    for (size_t i = 0; i < tok->seq->used; i++)
+      count_token(c, tok->seq->elements[i]);
+    break;
+  default:
+    if (tok->token_type >= TT_USER)
+      c->user = true;
+    break;
+  }
+}
+
+static void fill_token(HCompactFill *f, HCompactToken *ct, const HParsedToken *tok) {
+  memset(ct, 0, sizeof(*ct));
+  if (!tok) {
+    ct->token_type = TT_INVALID;
+    return;
+  }
+  ct->index = tok->index;
+  ct->bit_length = tok->bit_length;
+  ct->bit_offset = tok->bit_offset;
+  ct->token_type = tok->token_type;
+  switch (tok->token_type) {
+  case TT_BYTES:
+    ct->len = tok->bytes.len;
+    ct->data.first = f->nbytes;
+    if (tok->bytes.len)
+      memcpy(f->bytes + f->nbytes, tok->bytes.token, tok->bytes.len);
+    f->nbytes += tok->bytes.len;
+    break;
+  case TT_SEQUENCE: {
+    size_t first = f->ntokens;
+    ct->len = tok->seq->used;
+    ct->data.first = first;
+    f->ntokens += tok->seq->used;
+    for (size_t i = 0; i < tok->seq->used; i++)
+      fill_token(f, &f->tokens[first + i], tok->seq->elements[i]);
+    break;
+  }
+  default:
+    ct->data.uint = tok->uint;
+    break;
+  }
+}
+
+static HCompactResult *compact(HAllocator *mm__, const HParseResult *result, HCompactCount *c) {
+  memset(c, 0, sizeof(*c));
+  if (result->ast)
+    count_token(c, result->ast);
+  // leave the top of the range free, so that first+len can't wrap
+  if (c->overflow || c->ntokens >= UINT32_MAX || c->nbytes >= UINT32_MAX)
+    return NULL;
+
+  HCompactResult *res = h_alloc(mm__, sizeof(HCompactResult)
+                                + c->ntokens * sizeof(HCompactToken) + c->nbytes);
+  HCompactFill f = {
+    .tokens = (HCompactToken *)(res + 1),
+    .bytes = (uint8_t *)(res + 1) + c->ntokens * sizeof(HCompactToken),
+    .ntokens = 0,
+    .nbytes = 0
+  };
+  if (result->ast) {
+    f.ntokens = 1;
+    fill_token(&f, f.tokens, result->ast);
+  }
+  assert(f.ntokens == c->ntokens && f.nbytes == c->nbytes);
+
+  res->tokens = f.tokens;
+  res->ntokens = c->ntokens;
+  res->bytes = f.bytes;
+  res->nbytes = c->nbytes;
+  res->bit_length = result->bit_length;
+  res->arena = NULL;
+  res->mm__ = mm__;
+  return res;
+}
+
+HCompactResult* h_compact_result(const HParseResult *result) {
+  return h_compact_result__m(&system_allocator, result);
+}
+HCompactResult* h_compact_result__m(HAllocator* mm__, const HParseResult *result) {
+  HCompactCount c;
+  if (!result)
+    return NULL;
+  return compact(mm__, result, &c);
+}
+
+HCompactResult* h_parse_compact(const HParser* parser, const uint8_t* input, size_t length) {
+  return h_parse_compact__m(&system_allocator, parser, input, length);
+}
+HCompactResult* h_parse_compact__m(HAllocator* mm__, const HParser* parser, const uint8_t* input, size_t length) {
+  HParseResult *result = h_parse__m(mm__, parser, input, length);
+  HCompactCount c;
+  if (!result)
+    return NULL;
+  HCompactResult *res = compact(mm__, result, &c);
+  if (res && c.user) {
+    // user payloads may point anywhere into the arena; keep all of it
+    res->arena = result->arena;
+    return res;
+  }
+  h_parse_result_free(result);
+  return res;
+}
+
+void h_compact_result_free(HCompactResult *result) {
+  if (!result)
+    return;
+  HAllocator *mm__ = result->mm__;
+  if (result->arena)
+    h_delete_arena(result->arena);
+  h_free(result);
+}
+
+/* Serialization
+ *
+ * A header, then the tokens as they are in memory, then the bytes. The
+ * tokens are in the host's byte order; the header says which that is, so
+ * a reader on another kind of machine can tell it can't use them.
+ */
+
+#define H_COMPACT_MAGIC "HCR"
+#define H_COMPACT_VERSION 1
+
+typedef struct {
+  char magic[4];
+  uint16_t version;
+  uint8_t little_endian;
+  uint8_t token_size;
+  uint8_t reserved[8];
+  uint64_t ntokens;
+  uint64_t nbytes;
+  int64_t bit_length;
+} HCompactHeader;
+
+uint8_t* h_compact_result_serialize(const HCompactResult *result, size_t *length) {
+  return h_compact_result_serialize__m(&system_allocator, result, length);
+}
+uint8_t* h_compact_result_serialize__m(HAllocator* mm__, const HCompactResult *result, size_t *length) {
+  // user payloads are pointers, which mean nothing anywhere else
+  for (size_t i = 0; i < result->ntokens; i++) {
+    if (result->tokens[i].token_type >= TT_USER)
+      return NULL;
+  }
+
+  size_t tokens_size = result->ntokens * sizeof(HCompactToken);
+  *length = sizeof(HCompactHeader) + tokens_size + result->nbytes;
+  uint8_t *out = h_alloc(mm__, *length);
+  HCompactHeader *h = (HCompactHeader *)out;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, H_COMPACT_MAGIC, 4);
+  h->version = H_COMPACT_VERSION;
+  h->little_endian = H_HOST_LITTLE_ENDIAN;
+  h->token_size = sizeof(HCompactToken);
+  h->ntokens = result->ntokens;
+  h->nbytes = result->nbytes;
+  h->bit_length = result->bit_length;
+  if (tokens_size)
+    memcpy(out + sizeof(HCompactHeader), result->tokens, tokens_size);
+  if (result->nbytes)
+    memcpy(out + sizeof(HCompactHeader) + tokens_size, result->bytes, result->nbytes);
+  return out;
+}
+
+// everything the accessors will follow has to stay inside the buffer
+static bool valid_token(const HCompactToken *ct, size_t pos, uint64_t ntokens, uint64_t nbytes) {
+  switch (ct->token_type) {
+  case TT_INVALID:
+  case TT_NONE:
+  case TT_SINT:
+  case TT_UINT:
+  case TT_ERR:
+    return true;
+  case TT_BYTES:
+    return (uint64_t)ct->data.first + ct->len <= nbytes;
+  case TT_SEQUENCE:
+    // elements always come after their sequence, so there are no cycles
+    return ct->data.first > pos && (uint64_t)ct->data.first + ct->len <= ntokens;
+  default:
+    return false;
+  }
+}
+
+bool h_compact_result_view(HCompactResult *view, const uint8_t *data, size_t length) {
+  const HCompactHeader *h = (const HCompactHeader *)data;
+  if (length < sizeof(HCompactHeader) || ((uintptr_t)data & 7) != 0
+      || memcmp(h->magic, H_COMPACT_MAGIC, 4) != 0
+      || h->version != H_COMPACT_VERSION
+      || h->little_endian != H_HOST_LITTLE_ENDIAN
+      || h->token_size != sizeof(HCompactToken))
+    return false;
+  size_t rest = length - sizeof(HCompactHeader);
+  if (h->ntokens >= UINT32_MAX || h->ntokens > rest / sizeof(HCompactToken)
+      || h->nbytes != rest - h->ntokens * sizeof(HCompactToken))
+    return false;
+
+  const HCompactToken *tokens = (const HCompactToken *)(data + sizeof(HCompactHeader));
+  for (size_t i = 0; i < h->ntokens; i++) {
+    if (!valid_token(&tokens[i], i, h->ntokens, h->nbytes))
+      return false;
+  }
+
+  view->tokens = tokens;
+  view->ntokens = h->ntokens;
+  view->bytes = (const uint8_t *)(tokens + h->ntokens);
+  view->nbytes = h->nbytes;
+  view->bit_length = h->bit_length;
+  view->arena = NULL;
+  view->mm__ = NULL;
+  return true;
+}
+
+/* Accessors */
+
+static inline const HCompactToken *compact_token(HNode node) {
+  return &node.compact->tokens[node.pos];
+}
+
+HNode h_node(const HParsedToken *token) {
+  HNode node = { token, NULL, 0 };
+  return node;
+}
+
+HNode h_compact_root(const HCompactResult *result) {
+  HNode node = { NULL, NULL, 0 };
+  if (result && result->ntokens)
+    node.compact = result;
+  return node;
+}
+
+HTokenType h_node_type(HNode node) {
+  if (node.compact)
+    return compact_token(node)->token_type;
+  return node.token ? node.token->token_type : TT_INVALID;
+}
+
+size_t h_node_index(HNode node) {
+  return node.compact ? compact_token(node)->index : node.token->index;
+}
+
+size_t h_node_bit_length(HNode node) {
+  return node.compact ? compact_token(node)->bit_length : node.token->bit_length;
+}
+
+char h_node_bit_offset(HNode node) {
+  return node.compact ? compact_token(node)->bit_offset : node.token->bit_offset;
+}
+
+size_t h_node_seq_len(HNode node) {
+  assert(h_node_type(node) == TT_SEQUENCE);
+  return node.compact ? compact_token(node)->len : node.token->seq->used;
+}
+
+HNode h_node_seq_index(HNode node, size_t i) {
+  assert(i < h_node_seq_len(node));
+  if (node.compact) {
+    HNode elem = { NULL, node.compact, compact_token(node)->data.first + i };
+    return elem;
+  }
+  return h_node(node.token->seq->elements[i]);
+}
+
+HBytes h_node_bytes(HNode node) {
+  assert(h_node_type(node) == TT_BYTES);
+  if (node.compact) {
+    const HCompactToken *ct = compact_token(node);
+    HBytes bytes = { node.compact->bytes + ct->data.first, ct->len };
+    return bytes;
+  }
+  return node.token->bytes;
+}
+
+int64_t h_node_sint(HNode node) {
+  assert(h_node_type(node) == TT_SINT);
+  return node.compact ? compact_token(node)->data.sint : node.token->sint;
+}
+
+uint64_t h_node_uint(HNode node) {
+  assert(h_node_type(node) == TT_UINT);
+  return node.compact ? compact_token(node)->data.uint : node.token->uint;
+}
+
+void *h_node_user(HNode node) {
+  assert(h_node_type(node) >= TT_USER);
+  return node.compact ? compact_token(node)->data.user : node.token->user;
+}
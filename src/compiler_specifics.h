@@ -13,4 +13,70 @@
 #define H_MSVC_DECLSPEC(x)
 #endif
 
+/* Labels as values, for `goto *p`. */
+#if defined(__clang__) || defined(__GNUC__)
+#define H_HAVE_COMPUTED_GOTO 1
+#endif
+
+/* Atomically replace *p with v, returning the previous value. */
+#if defined(__clang__) || defined(__GNUC__)
+#define H_ATOMIC_XCHG_PTR(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define H_ATOMIC_XCHG_PTR(p, v) \
+  _InterlockedExchangePointer((void *volatile *)(p), (v))
+#endif
+
+/* Load a pointer (acquire) / store a pointer (release), for publishing
+ * data to other threads. */
+#if defined(__clang__) || defined(__GNUC__)
+#define H_ATOMIC_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define H_ATOMIC_STORE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#elif defined(_MSC_VER)
+#define H_ATOMIC_LOAD_PTR(p) \
+  _InterlockedCompareExchangePointer((void *volatile *)(p), NULL, NULL)
+#define H_ATOMIC_STORE_PTR(p, v) \
+  ((void)_InterlockedExchangePointer((void *volatile *)(p), (v)))
+#endif
+
+/* Atomically replace *p with v if it is still old; true if it was. */
+#if defined(__clang__) || defined(__GNUC__)
+#define H_ATOMIC_CAS_PTR(p, old, v) __sync_bool_compare_and_swap((p), (old), (v))
+#elif defined(_MSC_VER)
+#define H_ATOMIC_CAS_PTR(p, old, v) \
+  (_InterlockedCompareExchangePointer((void *volatile *)(p), (v), (old)) == (old))
+#endif
+
+/* Atomically add v to the size_t at p, returning the previous value. */
+#if defined(__clang__) || defined(__GNUC__)
+#define H_ATOMIC_FETCH_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#elif defined(_MSC_VER) && defined(_WIN64)
+#define H_ATOMIC_FETCH_ADD(p, v) \
+  (size_t)_InterlockedExchangeAdd64((volatile __int64 *)(p), (__int64)(v))
+#elif defined(_MSC_VER)
+#define H_ATOMIC_FETCH_ADD(p, v) \
+  (size_t)_InterlockedExchangeAdd((volatile long *)(p), (long)(v))
+#endif
+
+/* Byte swaps, and the byte order of the host. */
+#if defined(__clang__) || defined(__GNUC__)
+#define H_BSWAP16(x) __builtin_bswap16(x)
+#define H_BSWAP32(x) __builtin_bswap32(x)
+#define H_BSWAP64(x) __builtin_bswap64(x)
+#define H_HOST_LITTLE_ENDIAN (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#elif defined(_MSC_VER)
+#include <stdlib.h>
+#define H_BSWAP16(x) _byteswap_ushort(x)
+#define H_BSWAP32(x) _byteswap_ulong(x)
+#define H_BSWAP64(x) _byteswap_uint64(x)
+#define H_HOST_LITTLE_ENDIAN 1
+#endif
+
+/* x86 vector kernels, compiled per function for the instruction set they
+ * need and picked at run time. */
+#if (defined(__clang__) || defined(__GNUC__)) && (defined(__x86_64__) || defined(__i386__))
+#define H_HAVE_X86_KERNELS 1
+#define H_TARGET(isa) __attribute__((target(isa)))
+#endif
+
 #endif
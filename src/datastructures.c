@@ -25,13 +25,15 @@ HCountedArray *h_carray_new(HArena * arena) {
 
 void h_carray_append(HCountedArray *array, void* item) {
   if (array->used >= array->capacity) {
-    HParsedToken **elements = h_arena_malloc(array->arena, (array->capacity *= 2) * sizeof(void*));
+    size_t capacity = array->capacity * 2;
+    HParsedToken **elements = h_arena_malloc(array->arena, capacity * sizeof(void*));
     for (size_t i = 0; i < array->used; i++)
       elements[i] = array->elements[i];
-    for (size_t i = array->used; i < array->capacity; i++)
+    for (size_t i = array->used; i < capacity; i++)
       elements[i] = 0;
-    h_arena_free(array->arena, array->elements);
+    h_arena_free_sized(array->arena, array->elements, array->capacity * sizeof(void*));
     array->elements = elements;
+    array->capacity = capacity;
   }
   array->elements[array->used++] = item;
 }
@@ -80,7 +82,7 @@ void* h_slist_pop(HSlist *slist) {
     return NULL;
   void* ret = head->elem;
   slist->head = head->next;
-  h_arena_free(slist->arena, head);
+  h_arena_free_sized(slist->arena, head, sizeof(HSlistNode));
   return ret;
 }
 
@@ -114,7 +116,7 @@ HSlist* h_slist_remove_all(HSlist *slist, const void* item) {
 	prev->next = next;
       else
 	slist->head = next;
-      // FIXME free the removed node! this leaks.
+      h_arena_free_sized(slist->arena, node, sizeof(HSlistNode));
       node = next;
     }
     else {
@@ -128,51 +130,65 @@ HSlist* h_slist_remove_all(HSlist *slist, const void* item) {
 void h_slist_free(HSlist *slist) {
   while (slist->head != NULL)
     h_slist_pop(slist);
-  h_arena_free(slist->arena, slist);
+  h_arena_free_sized(slist->arena, slist, sizeof(HSlist));
 }
 
+/* HHashTable is an open-addressing table with linear probing, kept in
+ * Robin Hood order: every entry sits at or after its home slot, and is never
+ * further from home than the entries it had to pass on the way. A lookup can
+ * therefore stop at the first slot whose occupant is closer to its own home
+ * than the key would be, and deletion shifts the rest of the run back by one
+ * instead of leaving tombstones behind.
+ */
+
 HHashTable* h_hashtable_new(HArena *arena, HEqualFunc equalFunc, HHashFunc hashFunc) {
+  return h_hashtable_new_sized(arena, 0, equalFunc, hashFunc);
+}
+
+HHashTable* h_hashtable_new_sized(HArena *arena, size_t capacity,
+                                  HEqualFunc equalFunc, HHashFunc hashFunc) {
+  if (capacity == 0)
+    capacity = 64; // to start; should be tuned later...
+  assert((capacity & (capacity - 1)) == 0); // capacity is a power of 2
   HHashTable *ht = h_arena_malloc(arena, sizeof(HHashTable));
   ht->hashFunc = hashFunc;
   ht->equalFunc = equalFunc;
-  ht->capacity = 64; // to start; should be tuned later...
+  ht->capacity = capacity;
   ht->used = 0;
   ht->arena = arena;
   ht->contents = h_arena_malloc(arena, sizeof(HHashTableEntry) * ht->capacity);
-  for (size_t i = 0; i < ht->capacity; i++) {
-    ht->contents[i].key = NULL;
-    ht->contents[i].value = NULL;
-    ht->contents[i].next = NULL;
-    ht->contents[i].hashval = 0;
-  }
-  //memset(ht->contents, 0, sizeof(HHashTableEntry) * ht->capacity);
+  memset(ht->contents, 0, sizeof(HHashTableEntry) * ht->capacity);
   return ht;
 }
 
-void* h_hashtable_get(const HHashTable* ht, const void* key) {
-  HHashValue hashval = ht->hashFunc(key);
+// distance of the entry in the given slot from its home slot
+static inline size_t hte_dist(const HHashTable *ht, size_t slot, HHashValue hashval) {
+  return (slot - hashval) & (ht->capacity - 1);
+}
+
+static HHashTableEntry *hte_find(const HHashTable *ht, const void *key, HHashValue hashval) {
 #ifdef CONSISTENCY_CHECK
   assert((ht->capacity & (ht->capacity - 1)) == 0); // capacity is a power of 2
 #endif
-
-  HHashTableEntry *hte = NULL;
-  for (hte = &ht->contents[hashval & (ht->capacity - 1)];
-       hte != NULL;
-       hte = hte->next) {
-    if (hte->key == NULL) {
-      continue;
-    }
-    if (hte->hashval != hashval) {
-      continue;
-    }
-    if (ht->equalFunc(key, hte->key)) {
-      return hte->value;
-    }
+  size_t mask = ht->capacity - 1;
+  size_t i = hashval & mask;
+
+  // the table is never full, so this hits an empty slot eventually
+  for (size_t dist = 0; ; dist++, i = (i + 1) & mask) {
+    HHashTableEntry *hte = &ht->contents[i];
+    if (hte->key == NULL || hte_dist(ht, i, hte->hashval) < dist)
+      return NULL;
+    if (hte->hashval == hashval && ht->equalFunc(key, hte->key))
+      return hte;
   }
-  return NULL;
 }
 
-void h_hashtable_put_raw(HHashTable* ht, HHashTableEntry* new_entry);
+void* h_hashtable_get(const HHashTable* ht, const void* key) {
+  HHashTableEntry *hte = hte_find(ht, key, ht->hashFunc(key));
+  return hte ? hte->value : NULL;
+}
+
+static void h_hashtable_put_raw(HHashTable* ht, HHashTableEntry entry);
 
 void h_hashtable_ensure_capacity(HHashTable* ht, size_t n) {
   bool do_resize = false;
@@ -189,66 +205,68 @@ void h_hashtable_ensure_capacity(HHashTable* ht, size_t n) {
   ht->used = 0;
   memset(new_contents, 0, sizeof(HHashTableEntry) * ht->capacity);
   for (size_t i = 0; i < old_capacity; ++i)
-    for (HHashTableEntry *entry = &old_contents[i];
-	 entry;
-	 entry = entry->next)
-      if (entry->key)
-	h_hashtable_put_raw(ht, entry);
-  //h_arena_free(ht->arena, old_contents);
+    if (old_contents[i].key)
+      h_hashtable_put_raw(ht, old_contents[i]);
+  h_arena_free_sized(ht->arena, old_contents, sizeof(HHashTableEntry) * old_capacity);
 }
 
 void h_hashtable_put(HHashTable* ht, const void* key, void* value) {
   // # Start with a rebalancing
   h_hashtable_ensure_capacity(ht, ht->used + 1);
 
-  HHashValue hashval = ht->hashFunc(key);
   HHashTableEntry entry = {
     .key = key,
     .value = value,
-    .hashval = hashval
+    .hashval = ht->hashFunc(key)
   };
-  h_hashtable_put_raw(ht, &entry);
+  h_hashtable_put_raw(ht, entry);
 }
  
-void h_hashtable_put_raw(HHashTable* ht, HHashTableEntry *new_entry) {
+static void h_hashtable_put_raw(HHashTable* ht, HHashTableEntry entry) {
 #ifdef CONSISTENCY_CHECK
   assert((ht->capacity & (ht->capacity - 1)) == 0); // capacity is a power of 2
 #endif
+  size_t mask = ht->capacity - 1;
+  size_t i = entry.hashval & mask;
+  size_t dist = 0;
+  bool displaced = false;   // carrying an entry evicted from its slot?
 
-  HHashTableEntry *hte = &ht->contents[new_entry->hashval & (ht->capacity - 1)];
-  if (hte->key != NULL) {
-    for(;;) {
-      // check each link, stay on last if not found
-      if (hte->hashval == new_entry->hashval && ht->equalFunc(new_entry->key, hte->key))
-	goto insert_here;
-      if (hte->next == NULL)
-        break;
-      hte = hte->next;
+  for (;;) {
+    HHashTableEntry *hte = &ht->contents[i];
+    if (hte->key == NULL) {
+      *hte = entry;
+      ht->used++;
+      return;
     }
-    // Add a new link...
-    assert (hte->next == NULL);
-    hte->next = h_arena_malloc(ht->arena, sizeof(HHashTableEntry));
-    hte = hte->next;
-    hte->next = NULL;
-    ht->used++;
-  } else
-    ht->used++;
-
- insert_here:
-  hte->key = new_entry->key;
-  hte->value = new_entry->value;
-  hte->hashval = new_entry->hashval;
+    // a present key is always met before the probe could pass it, and an
+    // evicted entry is known not to be in the table twice.
+    if (!displaced && hte->hashval == entry.hashval
+        && ht->equalFunc(entry.key, hte->key)) {
+      *hte = entry;
+      return;
+    }
+    size_t d = hte_dist(ht, i, hte->hashval);
+    if (d < dist) {
+      // the occupant is closer to home; take its place and carry it along
+      HHashTableEntry tmp = *hte;
+      *hte = entry;
+      entry = tmp;
+      dist = d;
+      displaced = true;
+    }
+    i = (i + 1) & mask;
+    dist++;
+  }
 }
 
 void h_hashtable_update(HHashTable *dst, const HHashTable *src) {
   size_t i;
   HHashTableEntry *hte;
   for(i=0; i < src->capacity; i++) {
-    for(hte = &src->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      h_hashtable_put(dst, hte->key, hte->value);
-    }
+    hte = &src->contents[i];
+    if(hte->key == NULL)
+      continue;
+    h_hashtable_put(dst, hte->key, hte->value);
   }
 }
 
@@ -257,106 +275,44 @@ void h_hashtable_merge(void *(*combine)(void *v1, const void *v2),
   size_t i;
   HHashTableEntry *hte;
   for(i=0; i < src->capacity; i++) {
-    for(hte = &src->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      void *dstvalue = h_hashtable_get(dst, hte->key);
-      void *srcvalue = hte->value;
-      h_hashtable_put(dst, hte->key, combine(dstvalue, srcvalue));
-    }
+    hte = &src->contents[i];
+    if(hte->key == NULL)
+      continue;
+    void *dstvalue = h_hashtable_get(dst, hte->key);
+    void *srcvalue = hte->value;
+    h_hashtable_put(dst, hte->key, combine(dstvalue, srcvalue));
   }
 }
 
 int   h_hashtable_present(const HHashTable* ht, const void* key) {
-  HHashValue hashval = ht->hashFunc(key);
-#ifdef CONSISTENCY_CHECK
-  assert((ht->capacity & (ht->capacity - 1)) == 0); // capacity is a power of 2
-#endif
-
-  for (HHashTableEntry *hte = &ht->contents[hashval & (ht->capacity - 1)];
-       hte != NULL;
-       hte = hte->next) {
-    if (hte->hashval != hashval)
-      continue;
-    if (ht->equalFunc(key, hte->key))
-      return true;
-  }
-  return false;
+  return hte_find(ht, key, ht->hashFunc(key)) != NULL;
 }
 
 void  h_hashtable_del(HHashTable* ht, const void* key) {
-  HHashValue hashval = ht->hashFunc(key);
-#ifdef CONSISTENCY_CHECK
-  assert((ht->capacity & (ht->capacity - 1)) == 0); // capacity is a power of 2
-#endif
+  HHashTableEntry *hte = hte_find(ht, key, ht->hashFunc(key));
+  if (hte == NULL)
+    return;
 
-  for (HHashTableEntry *hte = &ht->contents[hashval & (ht->capacity - 1)];
-       hte != NULL;
-       hte = hte->next) {
-    if (hte->hashval != hashval)
-      continue;
-    if (ht->equalFunc(key, hte->key)) {
-      // FIXME: Leaks keys and values.
-      HHashTableEntry* hten = hte->next;
-      if (hten != NULL) {
-	*hte = *hten;
-	h_arena_free(ht->arena, hten);
-      } else {
-	hte->key = hte->value = NULL;
-	hte->hashval = 0;
-      }
-      return;
-    }
+  // FIXME: Leaks keys and values.
+  // shift the following entries back until one is already at home
+  size_t mask = ht->capacity - 1;
+  size_t i = hte - ht->contents;
+  for (;;) {
+    size_t j = (i + 1) & mask;
+    HHashTableEntry *next = &ht->contents[j];
+    if (next->key == NULL || hte_dist(ht, j, next->hashval) == 0)
+      break;
+    ht->contents[i] = *next;
+    i = j;
   }
+  ht->contents[i].key = ht->contents[i].value = NULL;
+  ht->contents[i].hashval = 0;
+  ht->used--;
 }
 
 void  h_hashtable_free(HHashTable* ht) {
-  for (size_t i = 0; i < ht->capacity; i++) {
-    HHashTableEntry *hten, *hte = &ht->contents[i];
-    // FIXME: Free key and value
-    hte = hte->next;
-    while (hte != NULL) {
-      // FIXME: leaks keys and values.
-      hten = hte->next;
-      h_arena_free(ht->arena, hte);
-      hte = hten;
-    }
-  }
-  h_arena_free(ht->arena, ht->contents);
-}
-
-// helper for hte_equal
-static bool hte_same_length(HHashTableEntry *xs, HHashTableEntry *ys) {
-  while(xs && ys) {
-    xs=xs->next;
-    ys=ys->next;
-    // skip NULL keys (= element not present)
-    while(xs && xs->key == NULL) xs=xs->next;
-    while(ys && ys->key == NULL) ys=ys->next;
-  }
-  return (xs == ys);    // both NULL
-}
-
-// helper for hte_equal: are all elements of xs present in ys?
-static bool hte_subset(HEqualFunc eq, HHashTableEntry *xs, HHashTableEntry *ys)
-{
-  for(; xs; xs=xs->next) {
-    if(xs->key == NULL) continue;   // element not present
-
-    HHashTableEntry *hte;
-    for(hte=ys; hte; hte=hte->next) {
-      if(hte->key == xs->key) break; // assume an element is equal to itself
-      if(hte->hashval != xs->hashval) continue; // shortcut
-      if(eq(hte->key, xs->key)) break;
-    }
-    if(hte == NULL) return false;   // element not found
-  }
-  return true;                      // all found
-}
-
-// compare two lists of HHashTableEntries
-static inline bool hte_equal(HEqualFunc eq, HHashTableEntry *xs, HHashTableEntry *ys) {
-  return (hte_same_length(xs, ys) && hte_subset(eq, xs, ys));
+  // FIXME: Free key and value
+  h_arena_free_sized(ht->arena, ht->contents, sizeof(HHashTableEntry) * ht->capacity);
 }
 
 /* Set equality of HHashSets.
@@ -364,15 +320,14 @@ static inline bool hte_equal(HEqualFunc eq, HHashTableEntry *xs, HHashTableEntry
  * Not strictly necessary, but we also assume the same hash function.
  */
 bool h_hashset_equal(const HHashSet *a, const HHashSet *b) {
-  if(a->capacity == b->capacity) {
-    // iterate over the buckets in parallel
-    for(size_t i=0; i < a->capacity; i++) {
-      if(!hte_equal(a->equalFunc, &a->contents[i], &b->contents[i]))
-        return false;
-    }
-  } else {
-    assert_message(0, "h_hashset_equal called on sets of different capacity");
-    // TODO implement general case
+  if(a->used != b->used)
+    return false;
+  for(size_t i=0; i < a->capacity; i++) {
+    const HHashTableEntry *hte = &a->contents[i];
+    if(hte->key == NULL)
+      continue;
+    if(!hte_find(b, hte->key, hte->hashval))
+      return false;
   }
   return true;
 }
@@ -405,6 +360,7 @@ void h_symbol_put(HParseState *state, const char* key, void *value) {
   HHashTable *head = h_slist_top(state->symbol_table);
   assert(!h_hashtable_present(head, key));
   h_hashtable_put(head, key, value);
+  state->retained++;
 }
 
 void* h_symbol_get(HParseState *state, const char* key) {
@@ -2,7 +2,12 @@
 #include "internal.h"
 #include "backends/contextfree.h"
 
-HCFChoice *h_desugar(HAllocator *mm__, HCFStack *stk__, const HParser *parser) {
+// desugaring memoizes into the parsers, which may be shared between
+// grammars being compiled in different threads. so only one thread at a
+// time gets to do it.
+static struct HMutex desugar_lock = H_MUTEX_INIT;
+
+static HCFChoice *desugar(HAllocator *mm__, HCFStack *stk__, const HParser *parser) {
   HCFStack *nstk__ = stk__;
   if(parser->desugared == NULL) {
     if (nstk__ == NULL) {
@@ -24,3 +29,14 @@ HCFChoice *h_desugar(HAllocator *mm__, HCFStack *stk__, const HParser *parser) {
 
   return parser->desugared;
 }
+
+HCFChoice *h_desugar(HAllocator *mm__, HCFStack *stk__, const HParser *parser) {
+  // nested calls come from within desugar, which holds the lock
+  if (stk__ != NULL)
+    return desugar(mm__, stk__, parser);
+
+  h_platform_mutex_lock(&desugar_lock);
+  HCFChoice *ret = desugar(mm__, NULL, parser);
+  h_platform_mutex_unlock(&desugar_lock);
+  return ret;
+}
@@ -24,6 +24,7 @@
 #include "internal.h"
 #include "allocator.h"
 #include "parsers/parser_internal.h"
+#include "platform.h"
 
 static HParserBackendVTable *backends[PB_MAX + 1] = {
   &h__packrat_backend_vtable,
@@ -31,6 +32,7 @@ static HParserBackendVTable *backends[PB_MAX + 1] = {
   &h__llk_backend_vtable,
   &h__lalr_backend_vtable,
   &h__glr_backend_vtable,
+  &h__generated_backend_vtable,
 };
 
 
@@ -57,6 +59,189 @@ HParseResult* h_parse__m(HAllocator* mm__, const HParser* parser, const uint8_t*
   return backends[parser->backend]->parse(mm__, parser, &input_stream);
 }
 
+HParseContext* h_parse_context_new(const HParser* parser) {
+  return h_parse_context_new__m(&system_allocator, parser);
+}
+HParseContext* h_parse_context_new__m(HAllocator* mm__, const HParser* parser) {
+  HParseContext *ctx = h_new(HParseContext, 1);
+  ctx->mm__ = mm__;
+  ctx->parser = parser;
+  ctx->arena = h_new_arena(mm__, 0);
+  ctx->tarena = h_new_arena(mm__, 0);
+  ctx->result = NULL;
+  return ctx;
+}
+
+void h_parse_context_reset(HParseContext* ctx) {
+  h_parse_result_free(ctx->result);
+  ctx->result = NULL;
+  h_arena_reset(ctx->arena);
+  h_arena_reset(ctx->tarena);
+}
+
+HParseResult* h_parse_with_context(HParseContext* ctx, const uint8_t* input, size_t length) {
+  const HParser *parser = ctx->parser;
+  HParserBackendVTable *backend = backends[parser->backend];
+
+  h_parse_context_reset(ctx);
+
+  HInputStream input_stream = {
+    .pos = 0,
+    .index = 0,
+    .bit_offset = 0,
+    .overrun = 0,
+    .endianness = DEFAULT_ENDIANNESS,
+    .length = length,
+    .input = input,
+    .last_chunk = true
+  };
+
+  if(backend->parse_context)
+    return backend->parse_context(ctx, &input_stream);
+
+  // no support from the backend; hold on to the result so that it is freed
+  // like the others on the next reset.
+  ctx->result = backend->parse(ctx->mm__, parser, &input_stream);
+  return ctx->result;
+}
+
+void h_parse_context_free(HParseContext* ctx) {
+  HAllocator *mm__ = ctx->mm__;
+  h_parse_result_free(ctx->result);
+  h_delete_arena(ctx->arena);
+  h_delete_arena(ctx->tarena);
+  h_free(ctx);
+}
+
+/* Batch parsing */
+
+typedef struct HParseBatch_ {
+  const HParser *parser;
+  const uint8_t *const *inputs;
+  const size_t *lengths;
+  size_t n;
+  HParseResult **results;
+  size_t next;                  // index of the next input to parse
+} HParseBatch;
+
+typedef struct HBatchWorker_ {
+  HParseBatch *batch;
+  HParseContext *ctx;
+  HThread *thread;
+  size_t nparsed, nbytes, nsucceeded;
+  int64_t parse_time;           // thread cpu time, in nsec
+} HBatchWorker;
+
+// like h_parse_with_context, but the result is the caller's to free
+static HParseResult *parse_detached(HParseContext *ctx,
+                                    const uint8_t *input, size_t length) {
+  HParseResult *res = h_parse_with_context(ctx, input, length);
+  if(res == NULL)
+    return NULL;
+
+  if(res == ctx->result) {
+    // the backend has no parse_context; the result has an arena of its own
+    ctx->result = NULL;
+  } else {
+    // hand over the context's arena with the result and take a new one
+    assert(res->arena == ctx->arena);
+    ctx->arena = h_new_arena(ctx->mm__, 0);
+  }
+  return res;
+}
+
+static void batch_worker(void *arg) {
+  HBatchWorker *w = arg;
+  HParseBatch *b = w->batch;
+  struct HStopWatch stopwatch;
+  size_t i;
+
+  h_platform_stopwatch_reset(&stopwatch);
+  while((i = H_ATOMIC_FETCH_ADD(&b->next, 1)) < b->n) {
+    b->results[i] = parse_detached(w->ctx, b->inputs[i], b->lengths[i]);
+    w->nparsed++;
+    w->nbytes += b->lengths[i];
+    w->nsucceeded += (b->results[i] != NULL);
+  }
+  w->parse_time = h_platform_stopwatch_ns(&stopwatch);
+}
+
+static HBenchmarkResults *batch_stats(HAllocator *mm__, HParserBackend backend,
+                                      const HBatchWorker *workers, size_t nworkers) {
+  HBenchmarkResults *ret = h_new(HBenchmarkResults, 1);
+  ret->len = 1;
+  ret->parser = NULL;
+  ret->results = h_new(HBackendResults, 1);
+  ret->results->backend = backend;
+  ret->results->compile_success = true;
+  ret->results->n_testcases = nworkers;
+  ret->results->failed_testcases = 0;
+  ret->results->cases = h_new(HCaseResult, nworkers);
+
+  for(size_t i=0; i<nworkers; i++) {
+    const HBatchWorker *w = &workers[i];
+    HCaseResult *c = &ret->results->cases[i];
+    c->success = true;
+    c->parse_time = w->nparsed ? w->parse_time / w->nparsed : 0;
+    c->length = w->nparsed ? w->nbytes / w->nparsed : 0;
+  }
+  return ret;
+}
+
+size_t h_parse_batch(const HParser* parser,
+                     const uint8_t *const inputs[], const size_t lengths[], size_t n,
+                     HParseResult *results[], const HParseBatchParams *params) {
+  return h_parse_batch__m(&system_allocator, parser, inputs, lengths, n, results, params);
+}
+size_t h_parse_batch__m(HAllocator* mm__, const HParser* parser,
+                        const uint8_t *const inputs[], const size_t lengths[], size_t n,
+                        HParseResult *results[], const HParseBatchParams *params) {
+  HParseBatch batch = {
+    .parser = parser,
+    .inputs = inputs,
+    .lengths = lengths,
+    .n = n,
+    .results = results,
+    .next = 0
+  };
+
+  size_t nworkers = (params && params->threads) ? params->threads
+                                                : h_platform_ncpus();
+  if(nworkers > n)
+    nworkers = n;
+  if(nworkers == 0)
+    nworkers = 1;
+
+  HBatchWorker *workers = h_new(HBatchWorker, nworkers);
+  memset(workers, 0, nworkers * sizeof(HBatchWorker));
+  for(size_t i=0; i<nworkers; i++) {
+    workers[i].batch = &batch;
+    workers[i].ctx = h_parse_context_new__m(mm__, parser);
+  }
+
+  // the calling thread is the first worker. if a thread fails to start,
+  // the others take over its share.
+  for(size_t i=1; i<nworkers; i++)
+    workers[i].thread = h_platform_thread_start(batch_worker, &workers[i]);
+  batch_worker(&workers[0]);
+
+  size_t nsucceeded = workers[0].nsucceeded;
+  for(size_t i=1; i<nworkers; i++) {
+    if(workers[i].thread)
+      h_platform_thread_join(workers[i].thread);
+    nsucceeded += workers[i].nsucceeded;
+  }
+
+  if(params && params->stats)
+    *params->stats = batch_stats(mm__, parser->backend, workers, nworkers);
+
+  for(size_t i=0; i<nworkers; i++)
+    h_parse_context_free(workers[i].ctx);
+  h_free(workers);
+
+  return nsucceeded;
+}
+
 void h_parse_result_free__m(HAllocator *alloc, HParseResult *result) {
   h_parse_result_free(result);
 }
@@ -85,11 +270,52 @@ int h_compile(HParser* parser, HParserBackend backend, const void* params) {
   return h_compile__m(&system_allocator, parser, backend, params);
 }
 
+static struct HMutex compile_lock = H_MUTEX_INIT;
+
+void h_compile_lock(void) {
+  h_platform_mutex_lock(&compile_lock);
+}
+
+void h_compile_unlock(void) {
+  h_platform_mutex_unlock(&compile_lock);
+}
+
+// compiling again with the defaults, for a grammar that hasn't changed
+// since, changes nothing; the tables are left alone, as other threads may
+// be parsing with them. with the compile lock held.
+static bool compiled_current(const HParser *parser, HParserBackend backend, const void *params) {
+  const HParserBackendVTable *be = backends[backend];
+  return params == NULL && parser->backend == backend && be->generation
+    && be->generation(parser) == h_grammar_generation();
+}
+
 int h_compile__m(HAllocator* mm__, HParser* parser, HParserBackend backend, const void* params) {
-  backends[parser->backend]->free(parser);
-  int ret = backends[backend]->compile(mm__, parser, params);
-  if (!ret)
-    parser->backend = backend;
+  const HParserBackendVTable *be = backends[backend];
+  int ret = 0;
+
+  void *prepared = NULL;
+  if (be->prepare) {
+    h_platform_mutex_lock(&compile_lock);
+    bool current = compiled_current(parser, backend, params);
+    h_platform_mutex_unlock(&compile_lock);
+    if (current)
+      return 0;
+    prepared = be->prepare(mm__, parser, params);
+    if (!prepared)
+      return -1;
+  }
+
+  h_platform_mutex_lock(&compile_lock);
+  if (prepared || !compiled_current(parser, backend, params)) {
+    backends[parser->backend]->free(parser);
+    ret = be->compile(mm__, parser, prepared ? prepared : params);
+    if (!ret)
+      parser->backend = backend;
+    else if (parser->backend_data)
+      be->free(parser);  // e.g. the table of a conflicted LALR grammar
+  }
+  h_platform_mutex_unlock(&compile_lock);
+
   return ret;
 }
 
@@ -46,9 +46,108 @@ typedef enum HParserBackend_ {
   PB_LLk,
   PB_LALR,
   PB_GLR,
-  PB_MAX = PB_GLR
+  PB_GENERATED,
+  PB_MAX = PB_GENERATED
 } HParserBackend;
 
+/**
+ * Which parsers the packrat backend remembers results for.
+ *
+ * H_PACKRAT_MEMO_RECURSIVE still remembers whatever turns out to be part
+ * of a left recursion, so it is safe for any grammar and gives up only the
+ * linear time guarantee. Its results are those of H_PACKRAT_MEMO_ALL,
+ * except that a left-recursive rule that can match the empty string may
+ * come out differently: growing it can run into a parser that was tried
+ * at the same place from outside the rule, which H_PACKRAT_MEMO_ALL
+ * reuses and this mode takes as failed. With H_PACKRAT_MEMO_NONE,
+ * left-recursive grammars will not terminate.
+ */
+typedef enum HPackratMemo_ {
+  H_PACKRAT_MEMO_ALL = 0,   // every combinator (the default)
+  H_PACKRAT_MEMO_RECURSIVE, // h_indirect, and left recursion
+  H_PACKRAT_MEMO_NONE
+} HPackratMemo;
+
+/**
+ * Counts of semantic actions, for HPackratParams.stats.
+ * actions_deferred - h_action results the parse asked for
+ * actions_run - actions actually called; the difference is the number of
+ *   calls saved by not running actions inside alternatives that failed.
+ */
+typedef struct HPackratStats_ {
+  size_t actions_deferred;
+  size_t actions_run;
+} HPackratStats;
+
+/**
+ * Options for h_compile(parser, PB_PACKRAT, &params).
+ *
+ * If memo_window is nonzero, memo entries more than memo_window bytes
+ * behind the furthest point the parse has reached are forgotten, and
+ * their memory reused. Backtracking past the window just parses the
+ * input again, so results are unaffected.
+ *
+ * With defer_actions set, h_action only records what it would do, and the
+ * actions are run once the parse is over, on the tree that won, children
+ * before parents. Parsers that look at results while parsing (h_attr_bool,
+ * h_int_range, h_bind, h_length_value, h_permutation) run the actions
+ * below them first. Actions must then not depend on the order in which
+ * they are called relative to those. If stats is set, the parse adds its
+ * counts to it (atomically, so it may be shared between threads).
+ */
+typedef struct HPackratParams_ {
+  HPackratMemo memo;
+  size_t memo_window;
+  bool defer_actions;
+  HPackratStats *stats;
+} HPackratParams;
+
+/**
+ * Options for h_compile(parser, PB_REGULAR, &params).
+ *
+ * The regular backend first runs the input through a DFA that it builds
+ * as needed, which finds out whether and where the parse ends. Only then
+ * does it run the program to build the AST. dfa_states bounds the number
+ * of DFA states kept (0 picks a default); inputs that need more are
+ * parsed without the DFA.
+ *
+ * With recognize set, parsing stops after the DFA: results only carry the
+ * length of the match and a NULL AST. Semantic actions, and so also
+ * validations like h_attr_bool, are not run.
+ */
+typedef struct HRegexParams_ {
+  bool recognize;
+  size_t dfa_states;
+} HRegexParams;
+
+/**
+ * A parser compiled from the C that h_emit_c writes, for
+ * h_compile(parser, PB_GENERATED, &generated). Compile the emitted file
+ * into your program, declare
+ *
+ *   extern const HGeneratedParser name;
+ *
+ * with the name given to h_emit_c, and pass &name. It only fits the
+ * parser it was emitted for; h_compile checks that it has the same shape.
+ *
+ * With params == NULL, h_compile(parser, PB_GENERATED, NULL) emits the C,
+ * builds it with the system's C compiler ($HAMMER_CC, a program name or
+ * path, or else cc) and loads it; that fails where there is no compiler or
+ * no dynamic loading. Running a compiler is left to those who ask for it:
+ * h_benchmark doesn't try this backend.
+ *
+ * Input that doesn't start on a byte boundary, or is read in another
+ * byte order, and left-recursive rules are handed to packrat.
+ */
+struct HGeneratedRuntime_;
+typedef struct HGeneratedParser_ {
+  uint32_t version;
+  uint64_t fingerprint;
+  size_t nrefs;
+  size_t (*parse)(const struct HGeneratedRuntime_ *rt, void *arena, const void *const *refs,
+                  const uint8_t *input, size_t length, void **ast);
+} HGeneratedParser;
+
 typedef enum HTokenType_ {
   // Before you change the explicit values of these, think of the poor bindings ;_;
   TT_INVALID = 0,
@@ -121,9 +220,61 @@ typedef struct HParseResult_ {
   HArena * arena;
 } HParseResult;
 
+/**
+ * A token of a compact parse result (see h_compact_result). Positions are
+ * 32 bits wide, and the elements of a sequence are stored next to each
+ * other in the result's token array instead of being pointed to one by
+ * one.
+ *
+ * For TT_SEQUENCE, len elements start at tokens[data.first]; for
+ * TT_BYTES, len bytes start at bytes[data.first]. Other token types keep
+ * their payload as it was. A missing (NULL) sequence element becomes a
+ * token of type TT_INVALID.
+ */
+typedef struct HCompactToken_ {
+  uint32_t index;
+  uint32_t bit_length;
+  uint32_t len;
+  uint16_t token_type;
+  uint8_t bit_offset;
+  union {
+    uint32_t first;
+    int64_t sint;
+    uint64_t uint;
+    double dbl;
+    float flt;
+    void *user;
+  } data;
+} HCompactToken;
+
+/**
+ * A parse result flattened into a single buffer. tokens[0] is the root,
+ * unless the parse produced no AST, in which case ntokens is 0.
+ */
+typedef struct HCompactResult_ {
+  const HCompactToken *tokens;
+  size_t ntokens;
+  const uint8_t *bytes;
+  size_t nbytes;
+  int64_t bit_length;
+  HArena *arena; // keeps the payloads of user tokens alive, or NULL
+  HAllocator *mm__;
+} HCompactResult;
+
+/**
+ * A token of either representation, for code that walks both plain and
+ * compact results. Make one with h_node or h_compact_root and inspect it
+ * with the h_node_* functions.
+ */
+typedef struct HNode_ {
+  const HParsedToken *token;
+  const HCompactResult *compact; // if set, the token is compact->tokens[pos]
+  size_t pos;
+} HNode;
+
 /**
  * TODO: document me.
- * Relevant functions: h_bit_writer_new, h_bit_writer_put, h_bit_writer_get_buffer, h_bit_writer_free
+ * Relevant functions: h_bit_writer_new, h_bit_writer_new_buffer, h_bit_writer_put, h_bit_writer_put_bytes, h_bit_writer_get_buffer, h_bit_writer_free
  */
 typedef struct HBitWriter_ HBitWriter;
 
@@ -141,6 +292,7 @@ typedef struct HParser_ {
 } HParser;
 
 typedef struct HSuspendedParser_ HSuspendedParser;
+typedef struct HParseContext_ HParseContext;
 
 /**
  * Type of an action to apply to an AST, used in the action() parser. 
@@ -211,6 +363,7 @@ typedef struct HBackendResults_ {
 typedef struct HBenchmarkResults_ {
   size_t len;
   HBackendResults *results;
+  const HParser *parser; // what h_benchmark ran; NULL for h_parse_batch
 } HBenchmarkResults;
 // }}}
 
@@ -284,10 +437,120 @@ bool h_parse_chunk(HSuspendedParser* s, const uint8_t* input, size_t length);
 
 /**
  * Finish an iterative parse. Signals the end of input to the backend and
- * returns the parse result.
+ * returns the parse result. Its bit_length says how much of the input the
+ * parse took, which may end before the last chunk passed in.
  */
 HParseResult* h_parse_finish(HSuspendedParser* s);
 
+/**
+ * A source of input, read one window of bytes at a time (see
+ * h_parse_source). Sources stack: a decoding layer reads windows from the
+ * source below it and hands out decoded ones, so nothing has to be
+ * decoded into memory all at once.
+ *
+ * read makes the next window available in *window and returns its
+ * length. It returns 0 when the input is over, or when it could not be
+ * read, in which case error is set. A window stays valid until the next
+ * call to read. free releases the source, but not the one below it.
+ *
+ * Other layers (say, one that strips record framing) can be written by
+ * filling in read, free and below, and zeroing error.
+ */
+typedef struct HInputSource_ {
+  size_t (*read)(struct HInputSource_ *src, const uint8_t **window);
+  void (*free)(struct HInputSource_ *src);
+  struct HInputSource_ *below;
+  bool error;
+} HInputSource;
+
+/**
+ * A source reading from memory. Its windows point into the buffer itself.
+ */
+HAMMER_FN_DECL(HInputSource*, h_input_buffer, const uint8_t* input, size_t length);
+
+/**
+ * A layer decoding base64 from the source below. Whitespace is skipped.
+ */
+HAMMER_FN_DECL(HInputSource*, h_input_base64, HInputSource *below);
+
+/**
+ * A layer inflating zlib or gzip data from the source below.
+ *
+ * Returns NULL if hammer was built without zlib.
+ */
+HAMMER_FN_DECL(HInputSource*, h_input_inflate, HInputSource *below);
+
+/**
+ * Free a source along with all the layers below it.
+ */
+void h_input_source_free(HInputSource *src);
+
+/**
+ * Parse the input of a source. A buffer source is parsed like h_parse
+ * would; others are fed to the backend window by window, as with
+ * h_parse_chunk, so this needs a backend that supports that.
+ *
+ * Returns NULL if the parse fails, if the source could not be read to the
+ * point the parse needed, or if the backend does not parse in chunks.
+ */
+HAMMER_FN_DECL(HParseResult*, h_parse_source, const HParser* parser, HInputSource *src);
+
+/**
+ * Create a context for repeatedly running a parser over many inputs.
+ * The context keeps its memory between parses and rewinds it instead of
+ * allocating anew for every call.
+ */
+HAMMER_FN_DECL(HParseContext*, h_parse_context_new, const HParser* parser);
+
+/**
+ * Like h_parse, but uses the memory held by the given context.
+ *
+ * The result belongs to the context and remains valid only until the next
+ * call to h_parse_with_context, h_parse_context_reset, or
+ * h_parse_context_free on the same context. Do not pass it to
+ * h_parse_result_free.
+ */
+HParseResult* h_parse_with_context(HParseContext* ctx, const uint8_t* input, size_t length);
+
+/**
+ * Discard the last result of a context, keeping its memory for reuse.
+ */
+void h_parse_context_reset(HParseContext* ctx);
+
+/**
+ * Free a parse context along with its last result.
+ */
+void h_parse_context_free(HParseContext* ctx);
+
+/**
+ * Options for h_parse_batch.
+ *
+ * threads is the number of workers to parse with (0 picks one per
+ * processor). If stats is not NULL, it receives the timings of the batch
+ * in the form of h_benchmark's results, with one case per worker giving
+ * its mean parse time and mean input length; print them with
+ * h_benchmark_report.
+ */
+typedef struct HParseBatchParams_ {
+  size_t threads;
+  HBenchmarkResults **stats;
+} HParseBatchParams;
+
+/**
+ * Parse n independent inputs with the same (compiled) parser, spread over
+ * a pool of worker threads. Each worker keeps a parse context, and so its
+ * memory, from one input to the next.
+ *
+ * results[i] receives the result of parsing inputs[i], or NULL. Free them
+ * with h_parse_result_free. params may be NULL. The allocator must be safe
+ * to call from several threads at once.
+ *
+ * Returns the number of inputs that parsed.
+ */
+HAMMER_FN_DECL(size_t, h_parse_batch, const HParser* parser,
+               const uint8_t *const inputs[], const size_t lengths[], size_t n,
+               HParseResult *results[], const HParseBatchParams *params);
+
 /**
  * Given a string, returns a parser that parses that string value. 
  * 
@@ -721,12 +984,76 @@ HAMMER_FN_DECL(HParser*, h_bind, const HParser *p, HContinuation k, void *env);
  */
 HAMMER_FN_DECL(void, h_parse_result_free, HParseResult *result);
 
+/**
+ * Flatten a parse result into a compact one. The result is left alone;
+ * bytes are copied out of it, but the payloads of user tokens are not,
+ * so they are only good as long as it is.
+ *
+ * Returns NULL if result is NULL or does not fit in 32-bit positions.
+ */
+HAMMER_FN_DECL(HCompactResult*, h_compact_result, const HParseResult *result);
+
+/**
+ * Like h_parse, but returns the result in compact form. The tokens built
+ * along the way are freed, except when user tokens need them.
+ */
+HAMMER_FN_DECL(HCompactResult*, h_parse_compact, const HParser* parser, const uint8_t* input, size_t length);
+
+/**
+ * Free a compact parse result.
+ */
+void h_compact_result_free(HCompactResult *result);
+
+/**
+ * Serialize a compact result, for h_compact_result_view to read back,
+ * possibly in another process. Sets *length to the size of the returned
+ * buffer. Returns NULL if there are user tokens, whose payloads can't be
+ * carried over.
+ */
+HAMMER_FN_DECL(uint8_t*, h_compact_result_serialize, const HCompactResult *result, size_t *length);
+
+/**
+ * Read a serialized compact result in place: view's tokens and bytes
+ * point into data, which must be 8-byte aligned and outlive it. Don't
+ * h_compact_result_free a view. Returns false if data is malformed, or
+ * came from a machine of the other byte order.
+ */
+bool h_compact_result_view(HCompactResult *view, const uint8_t *data, size_t length);
+
+/**
+ * Accessors for tokens of either representation. A NULL token has type
+ * TT_INVALID. The payload accessors expect a token of the right type.
+ */
+HNode h_node(const HParsedToken *token);
+HNode h_compact_root(const HCompactResult *result);
+HTokenType h_node_type(HNode node);
+size_t h_node_index(HNode node);
+size_t h_node_bit_length(HNode node);
+char h_node_bit_offset(HNode node);
+size_t h_node_seq_len(HNode node);
+HNode h_node_seq_index(HNode node, size_t i);
+HBytes h_node_bytes(HNode node);
+int64_t h_node_sint(HNode node);
+uint64_t h_node_uint(HNode node);
+void *h_node_user(HNode node);
+
 // Some debugging aids
 /**
  * Format token into a compact unambiguous form. Useful for parser test cases.
  * Caller is responsible for freeing the result.
  */
 char* h_write_result_unamb(const HParsedToken* tok);
+struct result_buf;
+/**
+ * Append the unambiguous form of token to buf (see struct result_buf
+ * below), without allocating unless buf has to grow.
+ */
+bool h_append_result_unamb(struct result_buf *buf, const HParsedToken* tok);
+/**
+ * Write the unambiguous form of token to the given output stream.
+ * Returns false on a write error.
+ */
+bool h_fprint_result_unamb(FILE* stream, const HParsedToken* tok);
 /**
  * Format token to the given output stream. Indent starting at
  * [indent] spaces, with [delta] spaces between levels.
@@ -738,24 +1065,58 @@ void h_pprint(FILE* stream, const HParsedToken* tok, int indent, int delta);
  * documentation for the parser backend in question for information
  * about the [params] parameter, or just pass in NULL for the defaults.
  *
+ * Compiling is serialized between threads, also for parsers that share
+ * parts. A parser that is already compiled for the backend with the
+ * defaults is left as it is when compiled again with the defaults, so
+ * threads may each compile a shared parser before using it. Otherwise,
+ * the parser must not be in use while it is being compiled.
+ *
  * Returns -1 if grammar cannot be compiled with the specified options; 0 otherwise.
  */
 HAMMER_FN_DECL(int, h_compile, HParser* parser, HParserBackend backend, const void* params);
 
+/**
+ * Write C source for a parser equivalent to [parser], as a file of its
+ * own that needs nothing but the C library: a function per combinator,
+ * with literals and charsets inlined, sequences as straight-line code
+ * and choices as a switch on the next byte. The result is exported as
+ * the HGeneratedParser [name]; see there for how to use it.
+ *
+ * Not every parser can be written out: h_permutation, h_bind,
+ * h_put_value, h_get_value and h_with_endianness can't, nor h_bits of
+ * anything but whole bytes, nor an unbound h_indirect. Returns -1
+ * (having written nothing) if the parser uses them; 0 otherwise.
+ */
+HAMMER_FN_DECL(int, h_emit_c, FILE *out, const HParser* parser, const char *name);
+
 /**
  * TODO: Document me
  */
 HBitWriter *h_bit_writer_new(HAllocator* mm__);
 
+/**
+ * A bit writer that writes into the caller's [buf], of [capacity]
+ * bytes, rather than a buffer of its own; it never grows it, and
+ * h_bit_writer_get_buffer returns NULL if the output didn't fit.
+ */
+HBitWriter *h_bit_writer_new_buffer(HAllocator* mm__, uint8_t *buf, size_t capacity);
+
 /**
  * TODO: Document me
  */
 void h_bit_writer_put(HBitWriter* w, uint64_t data, size_t nbits);
 
+/**
+ * Write [len] whole bytes, as h_bit_writer_put(w, data[i], 8) would;
+ * a straight copy when the writer is at a byte boundary.
+ */
+void h_bit_writer_put_bytes(HBitWriter* w, const uint8_t *data, size_t len);
+
 /**
  * TODO: Document me
  * Must not free [w] until you're done with the result.
- * [len] is in bytes.
+ * [len] is in bytes. NULL if the buffer couldn't be allocated, or a
+ * caller's buffer was too small.
  */
 const uint8_t* h_bit_writer_get_buffer(HBitWriter* w, size_t *len);
 
@@ -775,12 +1136,33 @@ HParsedToken *h_act_ignore(const HParseResult *p, void* userdata);
 // {{{ Benchmark functions
 HAMMER_FN_DECL(HBenchmarkResults *, h_benchmark, HParser* parser, HParserTestcase* testcases);
 void h_benchmark_report(FILE* stream, HBenchmarkResults* results);
-//void h_benchmark_dump_optimized_code(FILE* stream, HBenchmarkResults* results);
+/**
+ * Write C for the benchmarked parser (see h_emit_c), headed by a comment
+ * ranking the backends. If the parser can't be written as C, only the
+ * comment is written.
+ */
+void h_benchmark_dump_optimized_code(FILE* stream, HBenchmarkResults* results);
 // }}}
 
 // {{{ result_buf printers (used by token type registry)
 
-struct result_buf;
+/**
+ * Where the unambiguous form is written. To collect it, zero one and
+ * keep reusing it; output grows as needed (with the system allocator, so
+ * free it with system_allocator.free) and is NUL-terminated after
+ * h_append_result_unamb. With stream set, output can be any memory of
+ * capacity bytes: it is written to stream whenever it fills up, and
+ * never grows; what's left in it at the end is the caller's to write.
+ * error is set, and stays set, once something couldn't be
+ * written or output couldn't grow; h_append_result_unamb then fails.
+ */
+struct result_buf {
+  char* output;
+  size_t len;
+  size_t capacity;
+  FILE* stream;
+  bool error;
+};
 
 bool h_append_buf(struct result_buf *buf, const char* input, int len);
 bool h_append_buf_c(struct result_buf *buf, char v);
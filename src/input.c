@@ -0,0 +1,272 @@
+#include <limits.h>
+#include <string.h>
+#include "hammer.h"
+#include "internal.h"
+
+#ifdef HAMMER_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Input sources. Decoding layers hand out windows of this many bytes.
+#define H_INPUT_WINDOW 16384
+
+// every source type starts with its HInputSource, and remembers how it
+// was allocated
+typedef struct HInputLayer_ {
+  HInputSource src;
+  HAllocator *mm__;
+} HInputLayer;
+
+static void layer_free(HInputSource *src) {
+  HAllocator *mm__ = ((HInputLayer *)src)->mm__;
+  h_free(src);
+}
+
+void h_input_source_free(HInputSource *src) {
+  while (src) {
+    HInputSource *below = src->below;
+    src->free(src);
+    src = below;
+  }
+}
+
+/* Buffers */
+
+typedef struct HBufferSource_ {
+  HInputLayer layer;
+  const uint8_t *input;
+  size_t length;
+} HBufferSource;
+
+static size_t buffer_read(HInputSource *src, const uint8_t **window) {
+  HBufferSource *b = (HBufferSource *)src;
+  size_t length = b->length;
+  *window = b->input;
+  b->input += length;
+  b->length = 0;
+  return length;
+}
+
+HInputSource* h_input_buffer(const uint8_t* input, size_t length) {
+  return h_input_buffer__m(&system_allocator, input, length);
+}
+HInputSource* h_input_buffer__m(HAllocator* mm__, const uint8_t* input, size_t length) {
+  HBufferSource *b = h_new(HBufferSource, 1);
+  b->layer.src.read = buffer_read;
+  b->layer.src.free = layer_free;
+  b->layer.src.below = NULL;
+  b->layer.src.error = false;
+  b->layer.mm__ = mm__;
+  b->input = input;
+  b->length = length;
+  return &b->layer.src;
+}
+
+/* Base64 */
+
+typedef struct HBase64Source_ {
+  HInputLayer layer;
+  const uint8_t *in;            // what's left of the window below
+  size_t in_len;
+  uint32_t bits;                // decoded, but not yet a whole byte
+  int nbits;
+  bool padded;                  // saw '='; only more of it may follow
+  bool eof;
+  uint8_t out[H_INPUT_WINDOW];
+} HBase64Source;
+
+#define B64_SKIP -1
+#define B64_PAD -2
+#define B64_BAD -3
+
+static inline int base64_value(uint8_t c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  switch (c) {
+  case '+': return 62;
+  case '/': return 63;
+  case '=': return B64_PAD;
+  case ' ': case '\t': case '\r': case '\n': return B64_SKIP;
+  default: return B64_BAD;
+  }
+}
+
+static size_t base64_read(HInputSource *src, const uint8_t **window) {
+  HBase64Source *b = (HBase64Source *)src;
+  HInputSource *below = src->below;
+  size_t n = 0;
+
+  while (n < H_INPUT_WINDOW && !src->error) {
+    if (!b->in_len) {
+      if (b->eof)
+        break;
+      b->in_len = below->read(below, &b->in);
+      if (!b->in_len) {
+        b->eof = true;
+        src->error = below->error;
+      }
+      continue;
+    }
+    int v = base64_value(*b->in);
+    b->in++;
+    b->in_len--;
+    if (v == B64_SKIP)
+      continue;
+    if (v == B64_PAD) {
+      b->padded = true;
+      continue;
+    }
+    if (v == B64_BAD || b->padded) {
+      src->error = true;
+      break;
+    }
+    b->bits = b->bits << 6 | v;
+    b->nbits += 6;
+    if (b->nbits >= 8) {
+      b->nbits -= 8;
+      b->out[n++] = b->bits >> b->nbits;
+    }
+  }
+  *window = b->out;
+  return src->error ? 0 : n;
+}
+
+HInputSource* h_input_base64(HInputSource *below) {
+  return h_input_base64__m(&system_allocator, below);
+}
+HInputSource* h_input_base64__m(HAllocator* mm__, HInputSource *below) {
+  HBase64Source *b = h_new(HBase64Source, 1);
+  memset(b, 0, sizeof(*b));
+  b->layer.src.read = base64_read;
+  b->layer.src.free = layer_free;
+  b->layer.src.below = below;
+  b->layer.mm__ = mm__;
+  return &b->layer.src;
+}
+
+/* zlib */
+
+#ifdef HAMMER_HAVE_ZLIB
+
+typedef struct HInflateSource_ {
+  HInputLayer layer;
+  z_stream z;
+  const uint8_t *in;            // what zlib hasn't been given of the window below
+  size_t in_len;
+  bool eof;
+  bool done;                    // the compressed stream ended
+  uint8_t out[H_INPUT_WINDOW];
+} HInflateSource;
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+  HAllocator *mm__ = opaque;
+  return mm__->alloc(mm__, (size_t)items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf ptr) {
+  HAllocator *mm__ = opaque;
+  h_free(ptr);
+}
+
+static size_t inflate_read(HInputSource *src, const uint8_t **window) {
+  HInflateSource *f = (HInflateSource *)src;
+  HInputSource *below = src->below;
+
+  f->z.next_out = f->out;
+  f->z.avail_out = H_INPUT_WINDOW;
+  while (!f->done && !src->error && f->z.avail_out == H_INPUT_WINDOW) {
+    if (!f->z.avail_in) {
+      if (!f->in_len && !f->eof) {
+        f->in_len = below->read(below, &f->in);
+        if (!f->in_len) {
+          f->eof = true;
+          src->error = below->error;
+          continue;
+        }
+      }
+      size_t len = f->in_len < UINT_MAX ? f->in_len : UINT_MAX;
+      f->z.next_in = (Bytef *)f->in;
+      f->z.avail_in = len;
+      f->in += len;
+      f->in_len -= len;
+    }
+    int ret = inflate(&f->z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END)
+      f->done = true;
+    else if (ret != Z_OK && (ret != Z_BUF_ERROR || f->eof))
+      src->error = true;        // corrupt or truncated
+  }
+  *window = f->out;
+  return src->error ? 0 : H_INPUT_WINDOW - f->z.avail_out;
+}
+
+static void inflate_free(HInputSource *src) {
+  HInflateSource *f = (HInflateSource *)src;
+  inflateEnd(&f->z);
+  layer_free(src);
+}
+
+HInputSource* h_input_inflate(HInputSource *below) {
+  return h_input_inflate__m(&system_allocator, below);
+}
+HInputSource* h_input_inflate__m(HAllocator* mm__, HInputSource *below) {
+  HInflateSource *f = h_new(HInflateSource, 1);
+  memset(f, 0, sizeof(*f));
+  f->z.zalloc = zlib_alloc;
+  f->z.zfree = zlib_free;
+  f->z.opaque = mm__;
+  // 32 lets zlib tell zlib and gzip headers apart
+  if (inflateInit2(&f->z, 15 + 32) != Z_OK) {
+    h_free(f);
+    return NULL;
+  }
+  f->layer.src.read = inflate_read;
+  f->layer.src.free = inflate_free;
+  f->layer.src.below = below;
+  f->layer.mm__ = mm__;
+  return &f->layer.src;
+}
+
+#else
+
+HInputSource* h_input_inflate(HInputSource *below) {
+  return NULL;
+}
+HInputSource* h_input_inflate__m(HAllocator* mm__, HInputSource *below) {
+  return NULL;
+}
+
+#endif
+
+/* Parsing */
+
+HParseResult* h_parse_source(const HParser* parser, HInputSource *src) {
+  return h_parse_source__m(&system_allocator, parser, src);
+}
+HParseResult* h_parse_source__m(HAllocator* mm__, const HParser* parser, HInputSource *src) {
+  const uint8_t *window;
+
+  // nothing to gain from chunks when it's all there already
+  if (src->read == buffer_read) {
+    size_t length = src->read(src, &window);
+    return h_parse__m(mm__, parser, window, length);
+  }
+
+  HSuspendedParser *s = h_parse_start__m(mm__, parser);
+  if (!s)
+    return NULL;
+  bool done = false;
+  while (!done) {
+    size_t length = src->read(src, &window);
+    if (!length)
+      break;
+    done = h_parse_chunk(s, window, length);
+  }
+  HParseResult *res = h_parse_finish(s);
+  if (src->error) {
+    h_parse_result_free(res);
+    return NULL;
+  }
+  return res;
+}
@@ -142,9 +142,11 @@ static inline void h_sarray_clear(HSArray *arr) {
 #define H__INTVAR(pfx) H__APPEND(intvar__##pfx##__,__COUNTER__)
 
 #define H_SARRAY_FOREACH_KV_(var,idx,arr,intvar)			\
-  for (size_t intvar = 0, idx = (var = (arr)->nodes[(arr)->nodes[intvar].elem].content,(arr)->nodes[intvar].elem); \
-       intvar < (arr)->used;						\
-       idx = (arr)->nodes[intvar].elem, var = (arr)->nodes[(arr)->nodes[intvar].elem].content, intvar=intvar+1)
+  for (size_t intvar = 0, idx = 0;					\
+       intvar < (arr)->used						\
+	 && (idx = (arr)->nodes[intvar].elem,				\
+	     var = (arr)->nodes[idx].content, true);			\
+       intvar++)
 
 #define H_SARRAY_FOREACH_KV(var,index,arr) H_SARRAY_FOREACH_KV_(var,index,arr,H__INTVAR(idx))
 #define H_SARRAY_FOREACH_V(var,arr) H_SARRAY_FOREACH_KV_(var,H__INTVAR(elem),arr,H__INTVAR(idx))
@@ -171,17 +173,31 @@ static inline void charset_set(HCharset cs, uint8_t pos, int val) {
     : cs[pos / (sizeof(*cs)*8)] & ~(1 << (pos % (sizeof(*cs)*8)));
 }
 
+// For scanning a whole run of bytes from one charset at once. The set is
+// kept both as a byte table and in whatever form span's kernel wants.
+#define H_SCAN_RANGES 4
+typedef struct HCharsetScan_ {
+  size_t (*span)(const struct HCharsetScan_ *scan, const uint8_t *buf, size_t len);
+  uint8_t member[256];
+  uint8_t lo_nibble[16], hi_nibble[16];
+  uint8_t range_lo[H_SCAN_RANGES], range_width[H_SCAN_RANGES];
+  int nranges;
+} HCharsetScan;
+
+HCharsetScan *h_charset_scan_new(HAllocator *mm__, HCharset cs);
+
 typedef unsigned int HHashValue;
 typedef HHashValue (*HHashFunc)(const void* key);
 typedef bool (*HEqualFunc)(const void* key1, const void* key2);
 
 typedef struct HHashTableEntry_ {
-  struct HHashTableEntry_ *next;
-  const void* key;
+  const void* key;              // NULL marks an empty slot
   void* value;
   HHashValue hashval;
 } HHashTableEntry;
 
+// Open addressing with linear probing. Every slot of contents is an entry;
+// to iterate, scan all capacity slots and skip those with a NULL key.
 typedef struct HHashTable_ {
   HHashTableEntry *contents;
   HHashFunc hashFunc;
@@ -191,27 +207,95 @@ typedef struct HHashTable_ {
   HArena *arena;
 } HHashTable;
 
+/* The packrat memo table.
+ *
+ * Entries are filed under the byte index they were made at. Each
+ * position has a small vector of entries which is searched linearly;
+ * in practice only a handful of parsers are ever tried at any one
+ * position, so this beats hashing the whole (HInputStream, HParser)
+ * key. Positions are grouped into pages of H_MEMO_PAGE_SIZE slabs,
+ * which are allocated the first time something is stored there.
+ *
+ * subpos packs the parts of the input stream that can differ between
+ * two entries at the same index: bit_offset, margin, endianness and
+ * overrun.
+ */
+#define H_MEMO_PAGE_SIZE 256
+
+typedef struct HMemoEntry_ {
+  const HParser *parser; // NULL for the recursion head at this position
+  uint32_t subpos;
+  void *value; // HParserCacheValue*, or HRecursionHead* if parser is NULL
+} HMemoEntry;
+
+typedef struct HMemoSlab_ {
+  HMemoEntry *entries;
+  uint32_t used;
+  uint32_t capacity;
+} HMemoSlab;
+
+typedef struct HMemoTable_ {
+  HMemoSlab **pages;
+  size_t npages;
+  size_t nheads; // recursion heads currently in the table
+  bool recursed; // left recursion has been set up at some point
+  HArena *arena;
+
+  // policy, from HPackratParams
+  HPackratMemo select;
+  size_t window_pages;      // 0 to keep everything
+
+  // eviction state
+  size_t lo_page;           // pages below this have been swept
+  size_t hi_page;           // furthest page stored to
+  HSlist *spare_pages;
+  struct HParserCacheValue_t *spare_values;
+} HMemoTable;
+
 /* The state of the parser.
  *
  * Members:
- *   cache - a hash table describing the state of the parse, including partial HParseResult's. It's a hash table from HParserCacheKey to HParserCacheValue. 
+ *   memo - the packrat memo table, describing the state of the parse, including partial HParseResult's. It maps (position, parser) to HParserCacheValue, and holds the recursion heads, which are keyed by position alone.
  *   input_stream - the input stream at this state.
  *   arena - the arena that has been allocated for the parse this state is in.
  *   lr_stack - a stack of HLeftRec's, used in Warth's recursion
- *   recursion_heads - table of recursion heads. Keys are HParserCacheKey's with only an HInputStream (parser can be NULL), values are HRecursionHead's.
  *   symbol_table - stack of tables of values that have been stashed in the context of this parse.
+ *   starved - set when the parse ran into the end of a chunk that is not the last, so its outcome may change with more input.
+ *   attempt - counts the tries of a chunked parse; memo entries that starved in an earlier one are stale.
+ *   retained - bumped whenever something is stored that must outlive the sub-parse storing it, or the memo table changes at all (memo entries, recursion heads, resolved deferred actions, symbols); a failed sub-parse that didn't bump it can have its allocations rewound.
+ *   defer_actions - h_action leaves TT_DEFERRED tokens, to be resolved by h_resolve_deferred.
+ *   actions_deferred, actions_run - counts for HPackratStats.
  *
  */
   
 struct HParseState_ {
-  HHashTable *cache; 
+  HMemoTable *memo;
   HInputStream input_stream;
   HArena * arena;
   HSlist *lr_stack;
-  HHashTable *recursion_heads;
   HSlist *symbol_table; // its contents are HHashTables
+  bool starved;
+  unsigned attempt;
+  size_t retained;
+  bool defer_actions;
+  size_t actions_deferred;
+  size_t actions_run;
 };
 
+/* A semantic action that has not been run yet. In a parse with deferred
+ * actions, h_action returns a token of type TT_DEFERRED whose user field
+ * points to one of these. Resolving it runs the action and overwrites
+ * the token with the action's result.
+ */
+#define TT_DEFERRED TT_RESERVED_1
+
+typedef struct HDeferredAction_ {
+  HAction action;
+  void *user_data;
+  HParseResult inner;       // what the wrapped parser returned
+  bool dropped;             // the action ran and returned NULL
+} HDeferredAction;
+
 struct HSuspendedParser_ {
   HAllocator *mm__;
   const HParser *parser;
@@ -224,7 +308,20 @@ struct HSuspendedParser_ {
   uint8_t endianness;
 };
 
+struct HParseContext_ {
+  HAllocator *mm__;
+  const HParser *parser;
+  HArena *arena;            // holds results; rewound on every parse
+  HArena *tarena;           // backend scratch space; rewound likewise
+  HParseResult *result;     // result of a backend without parse_context
+};
+
 typedef struct HParserBackendVTable_ {
+  void *(*prepare)(HAllocator *mm__, const HParser* parser, const void* params);
+    // optional. the slow part of compiling, that doesn't change the parser,
+    // run before h_compile takes its lock so other compiles needn't wait.
+    // NULL if it failed; else compile gets it in place of params, and
+    // frees it whether it succeeds or not.
   int (*compile)(HAllocator *mm__, HParser* parser, const void* params);
   HParseResult* (*parse)(HAllocator *mm__, const HParser* parser, HInputStream* stream);
   void (*free)(HParser* parser);
@@ -238,6 +335,19 @@ typedef struct HParserBackendVTable_ {
   HParseResult *(*parse_finish)(HSuspendedParser *s);
     // parse_finish must free s->backend_state.
     // parse_finish will not be called before parse_chunk reports done.
+    // if the parse ended before the input taken in did, parse_finish sets
+    // s->pos and s->bit_offset to where.
+
+  HParseResult *(*parse_context)(HParseContext *ctx, HInputStream *stream);
+    // optional. like parse, but allocates from ctx->arena and ctx->tarena,
+    // which are rewound rather than freed between parses. the result must
+    // live in ctx->arena. backends without it fall back to parse.
+
+  unsigned (*generation)(const HParser *parser);
+    // optional. if the parser's data was compiled with params == NULL, the
+    // h_grammar_generation it was compiled in; else 0. h_compile with NULL
+    // params leaves data that is up to date alone, as other threads may be
+    // parsing with it. backends without it always compile again.
 } HParserBackendVTable;
 
 
@@ -281,11 +391,14 @@ typedef struct HRecursionHead_ {
  *   seed - the HResult yielded by rule
  *   rule - the HParser that produces seed
  *   head - the 
+ *   index, subpos - where rule started, as in its memo entry
  */
 typedef struct HLeftRec_ {
   HParseResult *seed;
   const HParser *rule;
   HRecursionHead *head;
+  size_t index;
+  uint32_t subpos;
 } HLeftRec;
 
 /* Tagged union for values in the cache: either HLeftRec's (Left) or 
@@ -297,8 +410,10 @@ typedef struct HParserCacheValue_t {
   union {
     HLeftRec *left;
     HParseResult *right;
+    struct HParserCacheValue_t *next; // evicted: link in spare_values
   };
   HInputStream input_stream;
+  unsigned starved_in; // the attempt that ran out of input computing it, or 0
 } HParserCacheValue;
 
 // This file provides the logical inverse of bitreader.c
@@ -307,11 +422,16 @@ struct HBitWriter_ {
   HAllocator *mm__;
   size_t index;
   size_t capacity;
+  uint64_t acc;    // when the flags agree on an order, bits not yet in
+		   // buf; then bit_offset is 0
+  char acc_bits;
+  char acc_flags;  // the flags acc was filled under
   char bit_offset; // unlike in bit_reader, this is always the number
 		   // of used bits in the current byte. i.e., 0 always
 		   // means that 8 bits are available for use.
   char flags;
   char error;
+  char fixed;      // buf belongs to the caller, and can't grow
 };
 
 // }}}
@@ -322,16 +442,37 @@ extern HParserBackendVTable h__packrat_backend_vtable;
 extern HParserBackendVTable h__llk_backend_vtable;
 extern HParserBackendVTable h__lalr_backend_vtable;
 extern HParserBackendVTable h__glr_backend_vtable;
+extern HParserBackendVTable h__generated_backend_vtable;
 // }}}
 
 // TODO(thequux): Set symbol visibility for these functions so that they aren't exported.
 
 int64_t h_read_bits(HInputStream* state, int count, char signed_p);
+// Readers for particular widths, with the signature of h_read_bits so
+// that parsers can pick one when they are made. Each handles the common
+// case (enough input, no margin, and byte-aligned for the fixed widths)
+// with whole-word loads, and leaves everything else to h_read_bits.
+typedef int64_t (*HBitReader)(HInputStream* state, int count, char signed_p);
+int64_t h_read_bits_8(HInputStream* state, int count, char signed_p);
+int64_t h_read_bits_16(HInputStream* state, int count, char signed_p);
+int64_t h_read_bits_32(HInputStream* state, int count, char signed_p);
+int64_t h_read_bits_64(HInputStream* state, int count, char signed_p);
+int64_t h_read_bits_window(HInputStream* state, int count, char signed_p);
+HBitReader h_bit_reader(int count);
+// h_read_bits(state, 8, false), for byte-at-a-time parsers
+static inline uint8_t h_read_byte(HInputStream* state) {
+  if (state->bit_offset == 0 && state->margin == 0 && state->index < state->length)
+    return state->input[state->index++];
+  return (uint8_t)h_read_bits(state, 8, false);
+}
 static inline size_t h_input_stream_pos(HInputStream* state) {
   return state->index * 8 + state->bit_offset + state->margin;
 }
 // need to decide if we want to make this public. 
 HParseResult* h_do_parse(const HParser* parser, HParseState *state);
+HParsedToken *h_defer_action(HParseState *state, HAction action, void *user_data,
+                             const HParseResult *inner);
+const HParsedToken *h_resolve_deferred(HParseState *state, const HParsedToken *tok);
 void put_cached(HParseState *ps, const HParser *p, HParseResult *cached);
 
 static inline
@@ -361,6 +502,8 @@ void h_slist_free(HSlist *slist);
 static inline bool h_slist_empty(const HSlist *sl) { return (sl->head == NULL); }
 
 HHashTable* h_hashtable_new(HArena *arena, HEqualFunc equalFunc, HHashFunc hashFunc);
+HHashTable* h_hashtable_new_sized(HArena *arena, size_t capacity, // pass 0 for default
+                                  HEqualFunc equalFunc, HHashFunc hashFunc);
 void* h_hashtable_get(const HHashTable* ht, const void* key);
 void  h_hashtable_put(HHashTable* ht, const void* key, void* value);
 void  h_hashtable_update(HHashTable* dst, const HHashTable *src);
@@ -413,6 +556,42 @@ struct HCFSequence_ {
   HCFChoice **items; // last one is NULL
 };
 
+// {{{ Generated C (backends/generated.c)
+
+// Writing parsers out as C. Each parser becomes a function
+//
+//   static size_t hg_p<n>(hg_state *s, size_t pos, void **ast)
+//
+// that returns the position after what it matched, or HG_FAIL. On success
+// it sets *ast, to NULL if there's no AST. A parser's emit_c writes the
+// body of its function; the input is s->in[0..s->len), and tokens are
+// made with the functions in s->rt (see backends/generated.c), in
+// s->arena. Anything else the code needs from the process, like an
+// action's user data, it gets from s->refs[h_emit_c_ref(e, ptr)].
+typedef struct HEmitC_ {
+  HAllocator *mm__;
+  HArena *arena;
+  struct result_buf decls;      // tables, ahead of all functions
+  struct result_buf body;       // the functions
+  HHashTable *nodes;            // parser -> its number + 1
+  HSlist *pending;              // parsers numbered but not yet written
+  const void **refs;
+  size_t nrefs, nnodes, ntables, nrules;
+  bool ok;                      // false once something couldn't be written
+} HEmitC;
+
+// the number of p's function, writing it out later if it's new
+size_t h_emit_c_parser(HEmitC *e, const HParser *p);
+// the index of ptr in s->refs
+size_t h_emit_c_ref(HEmitC *e, const void *ptr);
+// the number of a table hg_t<n>, for HG_IN(hg_t<n>, c), holding cs
+size_t h_emit_c_charset(HEmitC *e, HCharset cs);
+// a number of its own for a rule; see indirect.c
+size_t h_emit_c_rule(HEmitC *e);
+void h_emit_c_printf(HEmitC *e, const char *fmt, ...) H_GCC_ATTRIBUTE((format (printf, 2, 3)));
+
+// }}}
+
 struct HParserVtable_ {
   HParseResult* (*parse)(void *env, HParseState *state);
   bool (*isValidRegular)(void *env);
@@ -420,8 +599,32 @@ struct HParserVtable_ {
   bool (*compile_to_rvm)(HRVMProg *prog, void* env); // FIXME: forgot what the bool return value was supposed to mean.
   void (*desugar)(HAllocator *mm__, HCFStack *stk__, void *env);
   bool higher; // false if primitive
+  bool rule; // true if recursion can go through this parser (h_indirect)
+  // add the bytes the parser can start with to set; false if it might
+  // succeed without a byte, or can't tell (then set is left undefined)
+  bool (*first_bytes)(void *env, HCharset set);
+  // write the body of the parser's function in generated C; false if it
+  // can't be done
+  bool (*emit_c)(HEmitC *e, void *env);
 };
 
+// The lock h_compile holds. Walking a grammar with h_first_bytes or
+// isValidCF marks the parsers on the way, so anything else that does, or
+// builds tables into parsers, holds it too.
+void h_compile_lock(void);
+void h_compile_unlock(void);
+
+// Counts changes to grammars after they were built (h_bind_indirect); a
+// parser compiled in an earlier generation may be out of date. With the
+// compile lock held.
+unsigned h_grammar_generation(void);
+
+// true if p, started at a byte boundary, can only succeed when the next
+// byte is one of those it adds to set; with the compile lock held
+static inline bool h_first_bytes(const HParser *p, HCharset set) {
+  return p->vtable->first_bytes && p->vtable->first_bytes(p->env, set);
+}
+
 // {{{ Token type registry internal
 
 typedef struct HTTEntry_ {
@@ -12,7 +12,9 @@ static HParseResult* parse_action(void *env, HParseState *state) {
   if (a->p && a->action) {
     HParseResult *tmp = h_do_parse(a->p, state);
     //HParsedToken *tok = a->action(h_do_parse(a->p, state));
-    if(tmp) {
+    if(tmp && state->defer_actions) {
+      return make_result(state->arena, h_defer_action(state, a->action, a->user_data, tmp));
+    } else if(tmp) {
       HParsedToken *tok = (HParsedToken*)a->action(tmp, a->user_data);
       return make_result(state->arena, tok);
     } else
@@ -75,6 +77,31 @@ static bool action_ctrvm(HRVMProg *prog, void* env) {
   return true;
 }
 
+static bool action_first_bytes(void *env, HCharset set) {
+  HParseAction *a = (HParseAction*)env;
+  return h_first_bytes(a->p, set);
+}
+
+static bool action_emit_c(HEmitC *e, void *env) {
+  HParseAction *a = (HParseAction*)env;
+  if (!a->p || !a->action)
+    return false;
+  h_emit_c_printf(e,
+    "  void *a;\n"
+    "  size_t end = hg_p%zu(s, pos, &a);\n"
+    "  if (end == HG_FAIL)\n"
+    "    return HG_FAIL;\n"
+    "  *ast = s->rt->action(s->arena, s->refs[%zu], a, end - pos);\n"
+    "  return end;\n",
+    h_emit_c_parser(e, a->p), h_emit_c_ref(e, a));
+  return true;
+}
+
+HParsedToken *h_action_apply(const void *env, const HParseResult *res) {
+  const HParseAction *a = (const HParseAction*)env;
+  return (HParsedToken*)a->action(res, a->user_data);
+}
+
 static const HParserVtable action_vt = {
   .parse = parse_action,
   .isValidRegular = action_isValidRegular,
@@ -82,6 +109,8 @@ static const HParserVtable action_vt = {
   .desugar = desugar_action,
   .compile_to_rvm = action_ctrvm,
   .higher = true,
+  .first_bytes = action_first_bytes,
+  .emit_c = action_emit_c,
 };
 
 HParser* h_action(const HParser* p, const HAction a, void* user_data) {
@@ -9,6 +9,16 @@ static HParseResult *parse_and(void* env, HParseState* state) {
   return NULL;
 }
 
+static bool and_emit_c(HEmitC *e, void *env) {
+  h_emit_c_printf(e,
+    "  if (hg_p%zu(s, pos, ast) == HG_FAIL)\n"
+    "    return HG_FAIL;\n"
+    "  *ast = NULL;\n"
+    "  return pos;\n",
+    h_emit_c_parser(e, (HParser*)env));
+  return true;
+}
+
 static const HParserVtable and_vt = {
   .parse = parse_and,
   .isValidRegular = h_false, /* TODO: strictly speaking this should be regular,
@@ -18,6 +28,7 @@ static const HParserVtable and_vt = {
   .isValidCF = h_false,      /* despite TODO above, this remains false. */
   .compile_to_rvm = h_not_regular,
   .higher = true,
+  .emit_c = and_emit_c,
 };
 
 
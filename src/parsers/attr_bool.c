@@ -10,6 +10,8 @@ typedef struct {
 static HParseResult* parse_attr_bool(void *env, HParseState *state) {
   HAttrBool *a = (HAttrBool*)env;
   HParseResult *res = h_do_parse(a->p, state);
+  if (res)
+    res->ast = h_resolve_deferred(state, res->ast);
   if (res && res->ast) {
     if (a->pred(res, a->user_data))
       return res;
@@ -73,6 +75,27 @@ static bool ab_ctrvm(HRVMProg *prog, void *env) {
   return true;
 }
 
+static bool ab_first_bytes(void *env, HCharset set) {
+  HAttrBool *ab = (HAttrBool*)env;
+  return h_first_bytes(ab->p, set);
+}
+
+static bool ab_emit_c(HEmitC *e, void *env) {
+  HAttrBool *ab = (HAttrBool*)env;
+  h_emit_c_printf(e,
+    "  size_t end = hg_p%zu(s, pos, ast);\n"
+    "  if (end == HG_FAIL || !s->rt->predicate(s->arena, s->refs[%zu], *ast, end - pos))\n"
+    "    return HG_FAIL;\n"
+    "  return end;\n",
+    h_emit_c_parser(e, ab->p), h_emit_c_ref(e, ab));
+  return true;
+}
+
+bool h_attr_bool_apply(const void *env, HParseResult *res) {
+  const HAttrBool *ab = (const HAttrBool*)env;
+  return res->ast && ab->pred(res, ab->user_data);
+}
+
 static const HParserVtable attr_bool_vt = {
   .parse = parse_attr_bool,
   .isValidRegular = ab_isValidRegular,
@@ -80,6 +103,8 @@ static const HParserVtable attr_bool_vt = {
   .desugar = desugar_ab,
   .compile_to_rvm = ab_ctrvm,
   .higher = true,
+  .first_bytes = ab_first_bytes,
+  .emit_c = ab_emit_c,
 };
 
 
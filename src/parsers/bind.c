@@ -38,6 +38,7 @@ static HParseResult *parse_bind(void *be_, HParseState *state) {
     HParseResult *res = h_do_parse(be->p, state);
     if(!res)
         return NULL;
+    res->ast = h_resolve_deferred(state, res->ast);
 
     // create a wrapper arena allocator for the continuation
     ArenaAllocator aa = {{aa_alloc, aa_realloc, aa_free}, state->arena};
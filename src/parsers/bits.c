@@ -3,12 +3,12 @@
 
 static HParseResult* parse_bits(void* env, HParseState *state) {
   struct bits_env *env_ = env;
-  HParsedToken *result = a_new(HParsedToken, 1);
+  HParsedToken *result = a_new0(HParsedToken, 1);
   result->token_type = (env_->signedp ? TT_SINT : TT_UINT);
   if (env_->signedp)
-    result->sint = h_read_bits(&state->input_stream, env_->length, true);
+    result->sint = env_->read(&state->input_stream, env_->length, true);
   else
-    result->uint = h_read_bits(&state->input_stream, env_->length, false);
+    result->uint = env_->read(&state->input_stream, env_->length, false);
   return make_result(state->arena, result);
 }
 
@@ -21,7 +21,7 @@ static HParsedToken *reshape_bits(const HParseResult *p, void* signedp_p) {
   assert(p->ast->token_type == TT_SEQUENCE);
 
   HCountedArray *seq = p->ast->seq;
-  HParsedToken *ret = h_arena_malloc(p->arena, sizeof(HParsedToken));
+  HParsedToken *ret = h_arena_malloc0(p->arena, sizeof(HParsedToken));
   ret->token_type = TT_UINT;
 
   if(signedp && (seq->elements[0]->uint & 128))
@@ -91,13 +91,53 @@ static bool bits_ctrvm(HRVMProg *prog, void* env) {
   return true;
 }
 
+static bool bits_first_bytes(void *env, HCharset set) {
+  struct bits_env *env_ = (struct bits_env*)env;
+  if (env_->length == 0)
+    return false;
+  for (int i = 0; i < 256; i++)
+    charset_set(set, i, 1);
+  return true;
+}
+
+// the grammar only has whole bytes
+static bool bits_isValidCF(void *env) {
+  struct bits_env *env_ = (struct bits_env*)env;
+  return env_->length % 8 == 0;
+}
+
+// whole bytes only, read most significant first as h_parse reads them
+static bool bits_emit_c(HEmitC *e, void *env) {
+  struct bits_env *env_ = (struct bits_env*)env;
+  int n = env_->length / 8;
+  if (env_->length % 8 != 0 || n == 0)
+    return false;
+  h_emit_c_printf(e,
+    "  if (s->len - pos < %d)\n"
+    "    return HG_FAIL;\n"
+    "  uint64_t v = 0;\n", n);
+  for (int i = 0; i < n; i++)
+    h_emit_c_printf(e, "  v |= (uint64_t)s->in[pos + %d] << %d;\n", i, 8 * (n - 1 - i));
+  if (env_->signedp && n < 8)
+    h_emit_c_printf(e, "  v = (v ^ UINT64_C(0x%llx)) - UINT64_C(0x%llx);\n",
+                    1ULL << (8 * n - 1), 1ULL << (8 * n - 1));
+  if (env_->signedp)
+    h_emit_c_printf(e, "  *ast = s->rt->sint(s->arena, (int64_t)v);\n");
+  else
+    h_emit_c_printf(e, "  *ast = s->rt->uint(s->arena, v);\n");
+  h_emit_c_printf(e, "  return pos + %d;\n", n);
+  return true;
+}
+
 static const HParserVtable bits_vt = {
   .parse = parse_bits,
   .isValidRegular = h_true,
-  .isValidCF = h_true,
+  .isValidCF = bits_isValidCF,
   .desugar = desugar_bits,
   .compile_to_rvm = bits_ctrvm,
   .higher = false,
+  .first_bytes = bits_first_bytes,
+  .emit_c = bits_emit_c,
 };
 
 HParser* h_bits(size_t len, bool sign) {
@@ -107,6 +147,7 @@ HParser* h_bits__m(HAllocator* mm__, size_t len, bool sign) {
   struct bits_env *env = h_new(struct bits_env, 1);
   env->length = len;
   env->signedp = sign;
+  env->read = h_bit_reader(len);
   return h_new_parser(mm__, &bits_vt, env);
 }
 
@@ -4,9 +4,9 @@
 
 static HParseResult* parse_ch(void* env, HParseState *state) {
   uint8_t c = (uint8_t)(uintptr_t)(env);
-  uint8_t r = (uint8_t)h_read_bits(&state->input_stream, 8, false);
+  uint8_t r = h_read_byte(&state->input_stream);
   if (c == r) {
-    HParsedToken *tok = a_new(HParsedToken, 1);    
+    HParsedToken *tok = a_new0(HParsedToken, 1);    
     tok->token_type = TT_UINT; tok->uint = r;
     return make_result(state->arena, tok);
   } else {
@@ -42,6 +42,21 @@ static bool ch_ctrvm(HRVMProg *prog, void* env) {
   return true;
 }
 
+static bool ch_first_bytes(void *env, HCharset set) {
+  charset_set(set, (uint8_t)(uintptr_t)env, 1);
+  return true;
+}
+
+static bool ch_emit_c(HEmitC *e, void *env) {
+  h_emit_c_printf(e,
+    "  if (pos >= s->len || s->in[pos] != 0x%02x)\n"
+    "    return HG_FAIL;\n"
+    "  *ast = s->rt->uint(s->arena, 0x%02x);\n"
+    "  return pos + 1;\n",
+    (uint8_t)(uintptr_t)env, (uint8_t)(uintptr_t)env);
+  return true;
+}
+
 static const HParserVtable ch_vt = {
   .parse = parse_ch,
   .isValidRegular = h_true,
@@ -49,6 +64,8 @@ static const HParserVtable ch_vt = {
   .desugar = desugar_ch,
   .compile_to_rvm = ch_ctrvm,
   .higher = false,
+  .first_bytes = ch_first_bytes,
+  .emit_c = ch_emit_c,
 };
 
 HParser* h_ch(const uint8_t c) {
@@ -4,11 +4,11 @@
 #include "parser_internal.h"
 
 static HParseResult* parse_charset(void *env, HParseState *state) {
-  uint8_t in = h_read_bits(&state->input_stream, 8, false);
+  uint8_t in = h_read_byte(&state->input_stream);
   HCharset cs = (HCharset)env;
 
   if (charset_isset(cs, in)) {
-    HParsedToken *tok = a_new(HParsedToken, 1);
+    HParsedToken *tok = a_new0(HParsedToken, 1);
     tok->token_type = TT_UINT; tok->uint = in;
     return make_result(state->arena, tok);    
   } else
@@ -70,6 +70,24 @@ static bool cs_ctrvm(HRVMProg *prog, void *env) {
   return true;
 }
 
+static bool cs_first_bytes(void *env, HCharset set) {
+  HCharset cs = (HCharset)env;
+  for (size_t i = 0; i < 256 / (sizeof(*cs) * 8); i++)
+    set[i] |= cs[i];
+  return true;
+}
+
+static bool cs_emit_c(HEmitC *e, void *env) {
+  size_t t = h_emit_c_charset(e, (HCharset)env);
+  h_emit_c_printf(e,
+    "  if (pos >= s->len || !HG_IN(hg_t%zu, s->in[pos]))\n"
+    "    return HG_FAIL;\n"
+    "  *ast = s->rt->uint(s->arena, s->in[pos]);\n"
+    "  return pos + 1;\n",
+    t);
+  return true;
+}
+
 static const HParserVtable charset_vt = {
   .parse = parse_charset,
   .isValidRegular = h_true,
@@ -77,8 +95,14 @@ static const HParserVtable charset_vt = {
   .desugar = desugar_charset,
   .compile_to_rvm = cs_ctrvm,
   .higher = false,
+  .first_bytes = cs_first_bytes,
+  .emit_c = cs_emit_c,
 };
 
+HCharset h_parser_charset(const HParser *p) {
+  return p->vtable == &charset_vt ? (HCharset)p->env : NULL;
+}
+
 HParser* h_ch_range(const uint8_t lower, const uint8_t upper) {
   return h_ch_range__m(&system_allocator, lower, upper);
 }
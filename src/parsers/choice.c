@@ -1,5 +1,7 @@
 #include <stdarg.h>
+#include <string.h>
 #include "parser_internal.h"
+#include "../cfgrammar.h"
 
 #if defined(__STDC_VERSION__) && (                                  \
       (__STDC_VERSION__ >= 201112L && !defined(__STDC_NO_VLA__)) ||   \
@@ -15,9 +17,103 @@
 #  endif
 #endif
 
+// Which alternatives may start with each byte, in their original order:
+// those for byte c are alts[offset[c]] up to alts[offset[c+1]].
+// Alternatives whose first bytes aren't known are listed under every byte.
+typedef struct {
+  bool all;                     // nothing is known; just try them all
+  size_t offset[257];
+  size_t alts[];
+} HChoiceDispatch;
+
+typedef struct {
+  HSequence s;
+  HAllocator *mm__;
+  HChoiceDispatch *dispatch;    // worked out on first use, with the compile lock held
+} HChoice;
+
+// an alternative's first bytes, from the parsers themselves or else from
+// their grammar; all bytes if neither can tell
+static void alternative_first_bytes(HAllocator *mm__, const HParser *p, HCharset cs, bool *known) {
+  memset(cs, 0, 32);
+  if (h_first_bytes(p, cs))
+    return;
+  memset(cs, 0, 32);
+  if (h_cfgrammar_first_bytes(mm__, p, cs))
+    return;
+  memset(cs, 0xFF, 32);
+  *known = false;
+}
+
+static HChoiceDispatch *choice_dispatch(HChoice *choice) {
+  HAllocator *mm__ = choice->mm__;
+  const HSequence *s = &choice->s;
+  HCharset *first = h_new(HCharset, s->len);
+  size_t total = 0;
+  bool any = false;
+  for (size_t i=0; i<s->len; ++i) {
+    bool known = true;
+    first[i] = new_charset(mm__);
+    alternative_first_bytes(mm__, s->p_array[i], first[i], &known);
+    any |= known;
+    for (int c=0; c<256; c++)
+      total += charset_isset(first[i], c);
+  }
+
+  HChoiceDispatch *d = h_alloc(mm__, sizeof(HChoiceDispatch) + (any ? total : 0) * sizeof(size_t));
+  d->all = !any;
+  if (any) {
+    size_t n = 0;
+    for (int c=0; c<256; c++) {
+      d->offset[c] = n;
+      for (size_t i=0; i<s->len; ++i) {
+        if (charset_isset(first[i], c))
+          d->alts[n++] = i;
+      }
+    }
+    d->offset[256] = n;
+  }
+  for (size_t i=0; i<s->len; ++i)
+    h_free(first[i]);
+  h_free(first);
+  return d;
+}
+
+// the dispatch table, worked out if it hasn't been; with the compile lock held
+static HChoiceDispatch *dispatch_locked(HChoice *choice) {
+  HChoiceDispatch *d = choice->dispatch;
+  if (!d) {
+    d = choice_dispatch(choice);
+    H_ATOMIC_STORE_PTR(&choice->dispatch, d);
+  }
+  return d;
+}
+
 static HParseResult* parse_choice(void *env, HParseState *state) {
-  HSequence *s = (HSequence*)env;
+  HChoice *choice = (HChoice*)env;
+  HSequence *s = &choice->s;
   HInputStream backup = state->input_stream;
+
+  // once it's there, the table is only read
+  HChoiceDispatch *d = H_ATOMIC_LOAD_PTR(&choice->dispatch);
+  if (!d) {
+    h_compile_lock();
+    d = dispatch_locked(choice);
+    h_compile_unlock();
+  }
+  // at the end of the input, all are tried, to see which ask for more
+  if (!d->all && backup.bit_offset == 0 && backup.margin == 0
+      && backup.index < backup.length) {
+    uint8_t c = backup.input[backup.index];
+    for (size_t j=d->offset[c]; j<d->offset[c+1]; ++j) {
+      state->input_stream = backup;
+      HParseResult *tmp = h_do_parse(s->p_array[d->alts[j]], state);
+      if (NULL != tmp)
+	return tmp;
+    }
+    return NULL;
+  }
+
   for (size_t i=0; i<s->len; ++i) {
     if (i != 0)
       state->input_stream = backup;
@@ -80,6 +176,74 @@ static bool choice_ctrvm(HRVMProg *prog, void* env) {
   return true;
 }
 
+static bool choice_first_bytes(void *env, HCharset set) {
+  HSequence *s = (HSequence*)env;
+  for (size_t i=0; i<s->len; ++i) {
+    if (!h_first_bytes(s->p_array[i], set))
+      return false;
+  }
+  return s->len > 0;
+}
+
+static void emit_alternatives(HEmitC *e, const HSequence *s, const size_t *alts, size_t n,
+                              const char *indent) {
+  for (size_t j=0; j<n; ++j)
+    h_emit_c_printf(e, "%sif ((r = hg_p%zu(s, pos, ast)) != HG_FAIL)\n"
+                    "%s  return r;\n",
+                    indent, h_emit_c_parser(e, s->p_array[alts ? alts[j] : j]), indent);
+  h_emit_c_printf(e, "%sreturn HG_FAIL;\n", indent);
+}
+
+static bool same_alternatives(const HChoiceDispatch *d, int a, int b) {
+  size_t n = d->offset[a+1] - d->offset[a];
+  return n == d->offset[b+1] - d->offset[b]
+    && memcmp(&d->alts[d->offset[a]], &d->alts[d->offset[b]], n * sizeof(size_t)) == 0;
+}
+
+// a switch on the next byte, with a case for each set of bytes that share
+// the same alternatives; the biggest set is the default. At the end of the
+// input all are tried, as parse_choice does.
+static bool choice_emit_c(HEmitC *e, void *env) {
+  HChoice *choice = (HChoice*)env;
+  const HSequence *s = &choice->s;
+  HChoiceDispatch *d = dispatch_locked(choice);
+  h_emit_c_printf(e, "  size_t r;\n");
+  if (!d->all) {
+    int group[256], size[256] = {0}, dflt = 0;
+    for (int c=0; c<256; c++) {
+      group[c] = c;
+      for (int g=0; g<c; g++) {
+        if (group[g] == g && same_alternatives(d, g, c)) {
+          group[c] = g;
+          break;
+        }
+      }
+      if (++size[group[c]] > size[dflt])
+        dflt = group[c];
+    }
+    h_emit_c_printf(e, "  if (pos < s->len) {\n    switch (s->in[pos]) {\n");
+    for (int g=0; g<256; g++) {
+      if (group[g] != g || g == dflt)
+        continue;
+      int n = 0;
+      for (int c=g; c<256; c++) {
+        if (group[c] == g)
+          h_emit_c_printf(e, "%scase 0x%02x:", n++ % 8 ? " " : "    ", c);
+        if (group[c] == g && n % 8 == 0)
+          h_emit_c_printf(e, "\n");
+      }
+      if (n % 8)
+        h_emit_c_printf(e, "\n");
+      emit_alternatives(e, s, &d->alts[d->offset[g]], d->offset[g+1] - d->offset[g], "      ");
+    }
+    h_emit_c_printf(e, "    default:\n");
+    emit_alternatives(e, s, &d->alts[d->offset[dflt]], d->offset[dflt+1] - d->offset[dflt], "      ");
+    h_emit_c_printf(e, "    }\n  }\n");
+  }
+  emit_alternatives(e, s, NULL, s->len, "  ");
+  return true;
+}
+
 static const HParserVtable choice_vt = {
   .parse = parse_choice,
   .isValidRegular = choice_isValidRegular,
@@ -87,6 +251,8 @@ static const HParserVtable choice_vt = {
   .desugar = desugar_choice,
   .compile_to_rvm = choice_ctrvm,
   .higher = true,
+  .first_bytes = choice_first_bytes,
+  .emit_c = choice_emit_c,
 };
 
 HParser* h_choice(HParser* p, ...) {
@@ -112,7 +278,8 @@ HParser* h_choice__v(HParser* p, va_list ap) {
 HParser* h_choice__mv(HAllocator* mm__, HParser* p, va_list ap_) {
   va_list ap;
   size_t len = 0;
-  HSequence *s = h_new(HSequence, 1);
+  HChoice *choice = h_new(HChoice, 1);
+  HSequence *s = &choice->s;
 
   HParser *arg;
   va_copy(ap, ap_);
@@ -131,7 +298,9 @@ HParser* h_choice__mv(HAllocator* mm__, HParser* p, va_list ap_) {
   va_end(ap);
 
   s->len = len;
-  return h_new_parser(mm__, &choice_vt, s);
+  choice->mm__ = mm__;
+  choice->dispatch = NULL;
+  return h_new_parser(mm__, &choice_vt, choice);
 }
 
 HParser* h_choice__a(void *args[]) {
@@ -146,7 +315,8 @@ HParser* h_choice__ma(HAllocator* mm__, void *args[]) {
     arg=((HParser **)args)[++len];
   } while(arg);
 
-  HSequence *s = h_new(HSequence, 1);
+  HChoice *choice = h_new(HChoice, 1);
+  HSequence *s = &choice->s;
   s->p_array = h_new(HParser *, len);
 
   for (size_t i = 0; i < len; i++) {
@@ -154,9 +324,7 @@ HParser* h_choice__ma(HAllocator* mm__, void *args[]) {
   }
 
   s->len = len;
-  HParser *ret = h_new(HParser, 1);
-  ret->vtable = &choice_vt; 
-  ret->env = (void*)s;
-  ret->backend = PB_MIN;
-  return ret;
+  choice->mm__ = mm__;
+  choice->dispatch = NULL;
+  return h_new_parser(mm__, &choice_vt, choice);
 }
@@ -29,12 +29,35 @@ static HParseResult* parse_difference(void *env, HParseState *state) {
   }
 }
 
+static bool difference_first_bytes(void *env, HCharset set) {
+  HTwoParsers *parsers = (HTwoParsers*)env;
+  return h_first_bytes(parsers->p1, set);
+}
+
+static bool difference_emit_c(HEmitC *e, void *env) {
+  HTwoParsers *parsers = (HTwoParsers*)env;
+  // fails if p2 matches too, and longer
+  h_emit_c_printf(e,
+    "  size_t r1 = hg_p%zu(s, pos, ast);\n"
+    "  if (r1 == HG_FAIL)\n"
+    "    return HG_FAIL;\n"
+    "  void *a;\n"
+    "  size_t r2 = hg_p%zu(s, pos, &a);\n"
+    "  if (r2 != HG_FAIL && r1 - pos < r2 - pos)\n"
+    "    return HG_FAIL;\n"
+    "  return r1;\n",
+    h_emit_c_parser(e, parsers->p1), h_emit_c_parser(e, parsers->p2));
+  return true;
+}
+
 static HParserVtable difference_vt = {
   .parse = parse_difference,
   .isValidRegular = h_false,
   .isValidCF = h_false, // XXX should this be true if both p1 and p2 are CF?
   .compile_to_rvm = h_not_regular,
   .higher = true,
+  .first_bytes = difference_first_bytes,
+  .emit_c = difference_emit_c,
 };
 
 HParser* h_difference(const HParser* p1, const HParser* p2) {
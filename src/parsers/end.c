@@ -2,9 +2,12 @@
 
 static HParseResult* parse_end(void *env, HParseState *state) {
   if (state->input_stream.index == state->input_stream.length) {
-    HParseResult *ret = a_new(HParseResult, 1);
-    ret->ast = NULL;
-    return ret;
+    if (!state->input_stream.last_chunk) {
+      // more input may follow; we can't tell yet
+      state->input_stream.overrun = true;
+      return NULL;
+    }
+    return make_result(state->arena, NULL);
   } else {
     return NULL;
   }
@@ -19,6 +22,16 @@ static bool end_ctrvm(HRVMProg *prog, void *env) {
   return true;
 }
 
+// the generated code always has all of the input
+static bool end_emit_c(HEmitC *e, void *env) {
+  h_emit_c_printf(e,
+    "  if (pos != s->len)\n"
+    "    return HG_FAIL;\n"
+    "  *ast = NULL;\n"
+    "  return pos;\n");
+  return true;
+}
+
 static const HParserVtable end_vt = {
   .parse = parse_end,
   .isValidRegular = h_true,
@@ -26,6 +39,7 @@ static const HParserVtable end_vt = {
   .desugar = desugar_end,
   .compile_to_rvm = end_ctrvm,
   .higher = false,
+  .emit_c = end_emit_c,
 };
 
 HParser* h_end_p() {
@@ -2,16 +2,18 @@
 
 static HParseResult* parse_epsilon(void* env, HParseState* state) {
   (void)env;
-  HParseResult* res = a_new(HParseResult, 1);
-  res->ast = NULL;
-  res->arena = state->arena;
-  return res;
+  return make_result(state->arena, NULL);
 }
 
 static bool epsilon_ctrvm(HRVMProg *prog, void* env) {
   return true;
 }
 
+static bool epsilon_emit_c(HEmitC *e, void *env) {
+  h_emit_c_printf(e, "  (void)s;\n  *ast = NULL;\n  return pos;\n");
+  return true;
+}
+
 static const HParserVtable epsilon_vt = {
   .parse = parse_epsilon,
   .isValidRegular = h_true,
@@ -19,16 +21,12 @@ static const HParserVtable epsilon_vt = {
   .desugar = desugar_epsilon,
   .compile_to_rvm = epsilon_ctrvm,
   .higher = false,
+  .emit_c = epsilon_emit_c,
 };
 
 HParser* h_epsilon_p() {
   return h_epsilon_p__m(&system_allocator);
 }
 HParser* h_epsilon_p__m(HAllocator* mm__) {
-  HParser *epsilon_p = h_new(HParser, 1);
-  epsilon_p->desugared = NULL;
-  epsilon_p->backend_data = NULL;
-  epsilon_p->backend = 0;
-  epsilon_p->vtable = &epsilon_vt;
-  return epsilon_p;
+  return h_new_parser(mm__, &epsilon_vt, NULL);
 }
@@ -5,10 +5,7 @@ static HParseResult* parse_ignore(void* env, HParseState* state) {
   HParseResult *res0 = h_do_parse((HParser*)env, state);
   if (!res0)
     return NULL;
-  HParseResult *res = a_new(HParseResult, 1);
-  res->ast = NULL;
-  res->arena = state->arena;
-  return res;
+  return make_result(state->arena, NULL);
 }
 
 static bool ignore_isValidRegular(void *env) {
@@ -43,6 +40,20 @@ static bool ignore_ctrvm(HRVMProg *prog, void *env) {
   return true;
 }
 
+static bool ignore_first_bytes(void *env, HCharset set) {
+  return h_first_bytes((HParser*)env, set);
+}
+
+static bool ignore_emit_c(HEmitC *e, void *env) {
+  h_emit_c_printf(e,
+    "  if ((pos = hg_p%zu(s, pos, ast)) == HG_FAIL)\n"
+    "    return HG_FAIL;\n"
+    "  *ast = NULL;\n"
+    "  return pos;\n",
+    h_emit_c_parser(e, (HParser*)env));
+  return true;
+}
+
 static const HParserVtable ignore_vt = {
   .parse = parse_ignore,
   .isValidRegular = ignore_isValidRegular,
@@ -50,6 +61,8 @@ static const HParserVtable ignore_vt = {
   .desugar = desugar_ignore,
   .compile_to_rvm = ignore_ctrvm,
   .higher = true,
+  .first_bytes = ignore_first_bytes,
+  .emit_c = ignore_emit_c,
 };
 
 HParser* h_ignore(const HParser* p) {
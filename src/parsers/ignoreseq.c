@@ -71,6 +71,11 @@ static bool is_isValidCF(void *env) {
   return true;
 }
 
+static bool is_first_bytes(void *env, HCharset set) {
+  HIgnoreSeq *seq = (HIgnoreSeq*)env;
+  return seq->len > 0 && h_first_bytes(seq->parsers[0], set);
+}
+
 static bool h_svm_action_ignoreseq(HArena *arena, HSVMContext *ctx, void* env) {
   HIgnoreSeq *seq = (HIgnoreSeq*)env;
   HParsedToken* save = NULL;
@@ -99,6 +104,17 @@ static bool is_ctrvm(HRVMProg *prog, void* env) {
   return true;
 }
 
+static bool is_emit_c(HEmitC *e, void *env) {
+  const HIgnoreSeq *seq = (HIgnoreSeq*)env;
+  h_emit_c_printf(e, "  void *a;\n");
+  for (size_t i=0; i < seq->len; ++i)
+    h_emit_c_printf(e, "  if ((pos = hg_p%zu(s, pos, %s)) == HG_FAIL)\n"
+                    "    return HG_FAIL;\n",
+                    h_emit_c_parser(e, seq->parsers[i]), i == seq->which ? "ast" : "&a");
+  h_emit_c_printf(e, "  return pos;\n");
+  return true;
+}
+
 static const HParserVtable ignoreseq_vt = {
   .parse = parse_ignoreseq,
   .isValidRegular = is_isValidRegular,
@@ -106,6 +122,8 @@ static const HParserVtable ignoreseq_vt = {
   .desugar = desugar_ignoreseq,
   .compile_to_rvm = is_ctrvm,
   .higher = true,
+  .first_bytes = is_first_bytes,
+  .emit_c = is_emit_c,
 };
 
 
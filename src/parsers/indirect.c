@@ -25,6 +25,52 @@ static void desugar_indirect(HAllocator *mm__, HCFStack *stk__, void *env) {
   HCFS_DESUGAR( ((HIndirectEnv *)env)->parser );
 }
 
+static bool indirect_first_bytes(void *env, HCharset set) {
+  HIndirectEnv *ie = (HIndirectEnv*)env;
+  if (ie->touched || !ie->parser)
+    return false;               // left-recursive, or not bound yet
+  ie->touched = true;
+  bool ret = h_first_bytes(ie->parser, set);
+  ie->touched = false;
+  return ret;
+}
+
+// The only memoization in generated code: a rule remembers its last
+// result, which is what a choice between alternatives starting with the
+// same rule needs. Meeting itself again at the same position, the rule is
+// left-recursive, which is left to packrat.
+static bool indirect_emit_c(HEmitC *e, void *env) {
+  HIndirectEnv *ie = (HIndirectEnv*)env;
+  if (!ie->parser)
+    return false;
+  h_emit_c_printf(e,
+    "  hg_memo *m = &s->memo[%zu];\n"
+    "  if (m->pos == pos) {\n"
+    "    if (m->busy) {\n"
+    "      s->bail = 1;\n"
+    "      return HG_FAIL;\n"
+    "    }\n"
+    "    *ast = m->ast;\n"
+    "    return m->end;\n"
+    "  }\n"
+    "  hg_memo outer = *m;\n"
+    "  m->pos = pos;\n"
+    "  m->busy = 1;\n"
+    "  void *a = NULL;\n"
+    "  size_t end = hg_p%zu(s, pos, &a);\n"
+    "  if (outer.busy) {\n"
+    "    *m = outer;\n"
+    "  } else {\n"
+    "    m->end = end;\n"
+    "    m->ast = a;\n"
+    "    m->busy = 0;\n"
+    "  }\n"
+    "  *ast = a;\n"
+    "  return end;\n",
+    h_emit_c_rule(e), h_emit_c_parser(e, ie->parser));
+  return true;
+}
+
 static const HParserVtable indirect_vt = {
   .parse = parse_indirect,
   .isValidRegular = h_false,
@@ -32,15 +78,28 @@ static const HParserVtable indirect_vt = {
   .desugar = desugar_indirect,
   .compile_to_rvm = h_not_regular,
   .higher = true,
+  .rule = true,
+  .first_bytes = indirect_first_bytes,
+  .emit_c = indirect_emit_c,
 };
 
 void h_bind_indirect__m(HAllocator *mm__, HParser* indirect, const HParser* inner) {
   h_bind_indirect(indirect, inner);
 }
 
+// bumped by each binding
+static unsigned generation = 1;
+
+unsigned h_grammar_generation(void) {
+  return generation;
+}
+
 void h_bind_indirect(HParser* indirect, const HParser* inner) {
   assert_message(indirect->vtable == &indirect_vt, "You can only bind an indirect parser");
+  h_compile_lock();
   ((HIndirectEnv*)indirect->env)->parser = inner;
+  generation++;
+  h_compile_unlock();
 }
 
 HParser* h_indirect() {
@@ -10,6 +10,8 @@ typedef struct {
 static HParseResult* parse_int_range(void *env, HParseState *state) {
   HRange *r_env = (HRange*)env;
   HParseResult *ret = h_do_parse(r_env->p, state);
+  if (ret)
+    ret->ast = h_resolve_deferred(state, ret->ast);
   if (!ret || !ret->ast)
     return NULL;
   switch(ret->ast->token_type) {
@@ -106,6 +108,24 @@ static bool ir_ctrvm(HRVMProg *prog, void *env) {
   return false;
 }
 
+static bool ir_first_bytes(void *env, HCharset set) {
+  HRange *r_env = (HRange*)env;
+  return h_first_bytes(r_env->p, set);
+}
+
+static bool ir_emit_c(HEmitC *e, void *env) {
+  HRange *r_env = (HRange*)env;
+  // as bit patterns, since INT64_MIN can't be written as a literal
+  h_emit_c_printf(e,
+    "  if ((pos = hg_p%zu(s, pos, ast)) == HG_FAIL\n"
+    "      || !s->rt->in_range(*ast, (int64_t)UINT64_C(0x%llx), (int64_t)UINT64_C(0x%llx)))\n"
+    "    return HG_FAIL;\n"
+    "  return pos;\n",
+    h_emit_c_parser(e, r_env->p),
+    (unsigned long long)r_env->lower, (unsigned long long)r_env->upper);
+  return true;
+}
+
 static const HParserVtable int_range_vt = {
   .parse = parse_int_range,
   .isValidRegular = h_true,
@@ -113,6 +133,8 @@ static const HParserVtable int_range_vt = {
   .desugar = desugar_int_range,
   .compile_to_rvm = ir_ctrvm,
   .higher = false,
+  .first_bytes = ir_first_bytes,
+  .emit_c = ir_emit_c,
 };
 
 HParser* h_int_range(const HParser *p, const int64_t lower, const int64_t upper) {
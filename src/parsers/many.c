@@ -6,10 +6,52 @@ typedef struct {
   const HParser *p, *sep;
   size_t count;
   bool min_p;
+  HCharsetScan *scan; // for p, if it is a charset and there's no sep
 } HRepeat;
 
+static HCharsetScan *repeat_scan(HAllocator *mm__, const HParser *p, const HParser *sep) {
+  HCharset cs = h_parser_charset(p);
+  if (!cs || sep)
+    return NULL;
+  return h_charset_scan_new(mm__, cs);
+}
+
+// Byte-aligned runs of a charset are consumed in one go, producing the
+// same tokens one parse_charset per byte would.
+static HParseResult *scan_many(HRepeat *env_, HParseState *state) {
+  HInputStream *in = &state->input_stream;
+  size_t avail = in->length - in->index;
+  size_t max = avail;
+  if (!env_->min_p && env_->count < max)
+    max = env_->count;
+  size_t count = env_->scan->span(env_->scan, in->input + in->index, max);
+  if (count == avail && (env_->min_p || count < env_->count)) {
+    // the next element would have run out of input
+    if (!in->last_chunk)
+      state->starved = true;
+  }
+  in->index += count;
+  if (count < env_->count)
+    return NULL;
+
+  HCountedArray *seq = h_carray_new_sized(state->arena, count);
+  HParsedToken *elems = a_new0(HParsedToken, count);
+  for (size_t i = 0; i < count; i++) {
+    elems[i].token_type = TT_UINT;
+    elems[i].uint = in->input[in->index - count + i];
+    seq->elements[i] = &elems[i];
+  }
+  seq->used = count;
+  HParsedToken *res = a_new0(HParsedToken, 1);
+  res->token_type = TT_SEQUENCE;
+  res->seq = seq;
+  return make_result(state->arena, res);
+}
+
 static HParseResult *parse_many(void* env, HParseState *state) {
   HRepeat *env_ = (HRepeat*) env;
+  if (env_->scan && state->input_stream.bit_offset == 0 && state->input_stream.margin == 0)
+    return scan_many(env_, state);
   size_t size = env_->count;
   if(size <= 0) size = 4;
   if(size > 1024) size = 1024;  // let's try parsing some elements first...
@@ -34,7 +76,7 @@ static HParseResult *parse_many(void* env, HParseState *state) {
     goto err;
  succ:
   ; // necessary for the label to be here...
-  HParsedToken *res = a_new(HParsedToken, 1);
+  HParsedToken *res = a_new0(HParsedToken, 1);
   res->token_type = TT_SEQUENCE;
   res->seq = seq;
   return make_result(state->arena, res);
@@ -80,7 +122,7 @@ static HParsedToken *reshape_many(const HParseResult *p, void *user)
     }
   }
 
-  HParsedToken *res = a_new_(p->arena, HParsedToken, 1);
+  HParsedToken *res = a_new0_(p->arena, HParsedToken, 1);
   res->token_type = TT_SEQUENCE;
   res->seq = seq;
   res->index = p->ast->index;
@@ -196,6 +238,71 @@ static bool many_ctrvm(HRVMProg *prog, void *env) {
   }
 }
 
+static bool many_first_bytes(void *env, HCharset set) {
+  HRepeat *repeat = (HRepeat*)env;
+  return repeat->count > 0 && h_first_bytes(repeat->p, set);
+}
+
+// count is a C expression, a constant or a variable the code has set
+// before; NULL for none
+static void emit_repeat(HEmitC *e, const HParser *p, const HParser *sep, bool min_p,
+                        const char *count) {
+  if (!min_p && !count) {
+    h_emit_c_printf(e, "  *ast = s->rt->seq(s->arena, 0);\n  return pos;\n");
+    return;
+  }
+  HCharset cs = sep ? NULL : h_parser_charset(p);
+  if (cs) {
+    // a charset in a tight loop, as scan_many does it
+    h_emit_c_printf(e, "  size_t max = s->len - pos;\n");
+    if (!min_p)
+      h_emit_c_printf(e, "  if (%s < max)\n    max = %s;\n", count, count);
+    h_emit_c_printf(e,
+      "  size_t n = 0;\n"
+      "  while (n < max && HG_IN(hg_t%zu, s->in[pos + n]))\n"
+      "    n++;\n", h_emit_c_charset(e, cs));
+    if (count)
+      h_emit_c_printf(e, "  if (n < %s)\n    return HG_FAIL;\n", count);
+    h_emit_c_printf(e,
+      "  *ast = s->rt->uints(s->arena, s->in + pos, n);\n"
+      "  return pos + n;\n");
+    return;
+  }
+  if (count)
+    h_emit_c_printf(e, "  void *seq = s->rt->seq(s->arena, %s < 1024 ? %s : 1024);\n", count, count);
+  else
+    h_emit_c_printf(e, "  void *seq = s->rt->seq(s->arena, 0);\n");
+  h_emit_c_printf(e,
+    "  size_t n = 0;\n"
+    "  while (%s%s) {\n"
+    "    size_t at = pos;\n"
+    "    void *a;\n",
+    min_p ? "1" : "n < ", min_p ? "" : count);
+  if (sep)
+    h_emit_c_printf(e,
+      "    if (n > 0 && (at = hg_p%zu(s, at, &a)) == HG_FAIL)\n"
+      "      break;\n", h_emit_c_parser(e, sep));
+  h_emit_c_printf(e,
+    "    if ((at = hg_p%zu(s, at, &a)) == HG_FAIL)\n"
+    "      break;\n"
+    "    if (a)\n"
+    "      s->rt->append(seq, a);\n"
+    "    n++;\n"
+    "    pos = at;\n"
+    "  }\n", h_emit_c_parser(e, p));
+  if (count)
+    h_emit_c_printf(e, "  if (n < %s)\n    return HG_FAIL;\n", count);
+  h_emit_c_printf(e, "  *ast = seq;\n  return pos;\n");
+}
+
+static bool many_emit_c(HEmitC *e, void *env) {
+  HRepeat *repeat = (HRepeat*)env;
+  char count[32];
+  snprintf(count, sizeof(count), "%zu", repeat->count);
+  emit_repeat(e, repeat->p, repeat->sep, repeat->min_p, repeat->count ? count : NULL);
+  return true;
+}
+
 static const HParserVtable many_vt = {
   .parse = parse_many,
   .isValidRegular = many_isValidRegular,
@@ -203,6 +310,8 @@ static const HParserVtable many_vt = {
   .desugar = desugar_many,
   .compile_to_rvm = many_ctrvm,
   .higher = true,
+  .first_bytes = many_first_bytes,
+  .emit_c = many_emit_c,
 };
 
 HParser* h_many(const HParser* p) {
@@ -214,6 +323,7 @@ HParser* h_many__m(HAllocator* mm__, const HParser* p) {
   env->sep = NULL;
   env->count = 0;
   env->min_p = true;
+  env->scan = repeat_scan(mm__, p, NULL);
   return h_new_parser(mm__, &many_vt, env);
 }
 
@@ -226,6 +336,7 @@ HParser* h_many1__m(HAllocator* mm__, const HParser* p) {
   env->sep = NULL;
   env->count = 1;
   env->min_p = true;
+  env->scan = repeat_scan(mm__, p, NULL);
   return h_new_parser(mm__, &many_vt, env);
 }
 
@@ -238,6 +349,7 @@ HParser* h_repeat_n__m(HAllocator* mm__, const HParser* p, const size_t n) {
   env->sep = NULL;
   env->count = n;
   env->min_p = false;
+  env->scan = repeat_scan(mm__, p, NULL);
   return h_new_parser(mm__, &many_vt, env);
 }
 
@@ -250,6 +362,7 @@ HParser* h_sepBy__m(HAllocator* mm__, const HParser* p, const HParser* sep) {
   env->sep = sep;
   env->count = 0;
   env->min_p = true;
+  env->scan = repeat_scan(mm__, p, sep);
   return h_new_parser(mm__, &many_vt, env);
 }
 
@@ -262,6 +375,7 @@ HParser* h_sepBy1__m(HAllocator* mm__, const HParser* p, const HParser* sep) {
   env->sep = sep;
   env->count = 1;
   env->min_p = true;
+  env->scan = repeat_scan(mm__, p, sep);
   return h_new_parser(mm__, &many_vt, env);
 }
 
@@ -275,22 +389,48 @@ static HParseResult* parse_length_value(void *env, HParseState *state) {
   HParseResult *len = h_do_parse(lv->length, state);
   if (!len)
     return NULL;
-  if (len->ast->token_type != TT_UINT)
+  len->ast = h_resolve_deferred(state, len->ast);
+  if (!len->ast || len->ast->token_type != TT_UINT)
     h_platform_errx(1, "Length parser must return an unsigned integer");
   // TODO: allocate this using public functions
   HRepeat repeat = {
     .p = lv->value,
     .sep = NULL,
     .count = len->ast->uint,
-    .min_p = false
+    .min_p = false,
+    .scan = NULL
   };
   return parse_many(&repeat, state);
 }
 
+static bool lv_first_bytes(void *env, HCharset set) {
+  HLenVal *lv = (HLenVal*)env;
+  return h_first_bytes(lv->length, set);
+}
+
+// a length that isn't a TT_UINT is left to packrat, to complain about
+static bool lv_emit_c(HEmitC *e, void *env) {
+  HLenVal *lv = (HLenVal*)env;
+  h_emit_c_printf(e,
+    "  void *len;\n"
+    "  uint64_t count;\n"
+    "  if ((pos = hg_p%zu(s, pos, &len)) == HG_FAIL)\n"
+    "    return HG_FAIL;\n"
+    "  if (!s->rt->uint_value(len, &count)) {\n"
+    "    s->bail = 1;\n"
+    "    return HG_FAIL;\n"
+    "  }\n",
+    h_emit_c_parser(e, lv->length));
+  emit_repeat(e, lv->value, NULL, false, "count");
+  return true;
+}
+
 static const HParserVtable length_value_vt = {
   .parse = parse_length_value,
   .isValidRegular = h_false,
   .isValidCF = h_false,
+  .first_bytes = lv_first_bytes,
+  .emit_c = lv_emit_c,
 };
 
 HParser* h_length_value(const HParser* length, const HParser* value) {
@@ -10,12 +10,23 @@ static HParseResult* parse_not(void* env, HParseState* state) {
   }
 }
 
+static bool not_emit_c(HEmitC *e, void *env) {
+  h_emit_c_printf(e,
+    "  if (hg_p%zu(s, pos, ast) != HG_FAIL)\n"
+    "    return HG_FAIL;\n"
+    "  *ast = NULL;\n"
+    "  return pos;\n",
+    h_emit_c_parser(e, (HParser*)env));
+  return true;
+}
+
 static const HParserVtable not_vt = {
   .parse = parse_not,
   .isValidRegular = h_false,  /* see and.c for why */
   .isValidCF = h_false,
   .compile_to_rvm = h_not_regular, // Is actually regular, but the generation step is currently unable to handle it. TODO: fix this.
   .higher = true,
+  .emit_c = not_emit_c,
 };
 
 HParser* h_not(const HParser* p) {
@@ -18,6 +18,11 @@ static bool nothing_ctrvm(HRVMProg *prog, void* env) {
   return true;
 }
 
+static bool nothing_emit_c(HEmitC *e, void *env) {
+  h_emit_c_printf(e, "  (void)s, (void)pos, (void)ast;\n  return HG_FAIL;\n");
+  return true;
+}
+
 static const HParserVtable nothing_vt = {
   .parse = parse_nothing,
   .isValidRegular = h_true,
@@ -25,6 +30,7 @@ static const HParserVtable nothing_vt = {
   .desugar = desugar_nothing,
   .compile_to_rvm = nothing_ctrvm,
   .higher = false,
+  .emit_c = nothing_emit_c,
 };
 
 HParser* h_nothing_p() {
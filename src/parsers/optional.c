@@ -7,7 +7,7 @@ static HParseResult* parse_optional(void* env, HParseState* state) {
   if (res0)
     return res0;
   state->input_stream = bak;
-  HParsedToken *ast = a_new(HParsedToken, 1);
+  HParsedToken *ast = a_new0(HParsedToken, 1);
   ast->token_type = TT_NONE;
   return make_result(state->arena, ast);
 }
@@ -32,7 +32,7 @@ static HParsedToken* reshape_optional(const HParseResult *p, void* user_data) {
       return res;
   }
 
-  HParsedToken *ret = h_arena_malloc(p->arena, sizeof(HParsedToken));
+  HParsedToken *ret = h_arena_malloc0(p->arena, sizeof(HParsedToken));
   ret->token_type = TT_NONE;
   return ret;
 }
@@ -78,6 +78,17 @@ static bool opt_ctrvm(HRVMProg *prog, void* env) {
   return true;
 }
 
+static bool opt_emit_c(HEmitC *e, void *env) {
+  h_emit_c_printf(e,
+    "  size_t r = hg_p%zu(s, pos, ast);\n"
+    "  if (r != HG_FAIL)\n"
+    "    return r;\n"
+    "  *ast = s->rt->none(s->arena);\n"
+    "  return pos;\n",
+    h_emit_c_parser(e, (HParser*)env));
+  return true;
+}
+
 static const HParserVtable optional_vt = {
   .parse = parse_optional,
   .isValidRegular = opt_isValidRegular,
@@ -85,6 +96,7 @@ static const HParserVtable optional_vt = {
   .desugar = desugar_optional,
   .compile_to_rvm = opt_ctrvm,
   .higher = true,
+  .emit_c = opt_emit_c,
 };
 
 HParser* h_optional(const HParser* p) {
@@ -23,11 +23,22 @@ typedef struct {
 struct bits_env {
   uint8_t length;
   uint8_t signedp;
+  HBitReader read;              // h_bit_reader(length)
 };
 
+// the set a charset parser (h_ch_range, h_in, h_not_in) matches, or NULL
+// for any other parser
+HCharset h_parser_charset(const HParser *p);
+
+// what an h_action or h_attr_bool does with res, given the parser's env;
+// for generated code, which only has the env
+HParsedToken *h_action_apply(const void *env, const HParseResult *res);
+bool h_attr_bool_apply(const void *env, HParseResult *res);
+
 #define a_new_(arena, typ, count) ((typ*)h_arena_malloc((arena), sizeof(typ)*(count)))
 #define a_new(typ, count) a_new_(state->arena, typ, count)
-// we can create a_new0 if necessary. It would allocate some memory and immediately zero it out.
+#define a_new0_(arena, typ, count) ((typ*)h_arena_malloc0((arena), sizeof(typ)*(count)))
+#define a_new0(typ, count) a_new0_(state->arena, typ, count)
 
 static inline HParseResult* make_result(HArena *arena, HParsedToken *tok) {
   HParseResult *ret = h_arena_malloc(arena, sizeof(HParseResult));
@@ -1,7 +1,21 @@
 #include <stdarg.h>
 #include "parser_internal.h"
 
-// main recursion, used by parse_permutation below
+// which members may start with each byte; members whose first bytes
+// aren't known are in all of them
+typedef struct {
+  uint64_t start[256];
+} HPermDispatch;
+
+typedef struct {
+  HSequence s;
+  HAllocator *mm__;
+  HPermDispatch *dispatch;      // worked out on first use, if len <= 64,
+                                // with the compile lock held
+} HPermutation;
+
+// main recursion, used by parse_permutation below for more than 64
+// members, where the set of those left doesn't fit in a bitmask
 static int parse_permutation_tail(const HSequence *s,
                                   HCountedArray *seq,
 				  const size_t k, char *set,
@@ -25,8 +39,10 @@ static int parse_permutation_tail(const HSequence *s,
       match = h_do_parse(ps[i], state);
 
       // save result
-      if(match)
+      if(match) {
+	match->ast = h_resolve_deferred(state, match->ast);
 	seq->elements[i] = (void *)match->ast;
+      }
 
       // treat empty optionals (TT_NONE) like failure here
       if(match && match->ast && match->ast->token_type == TT_NONE)
@@ -65,23 +81,151 @@ static int parse_permutation_tail(const HSequence *s,
   return 0;
 }
 
+// The same search, with the members left as a bitmask. Whether the rest
+// of the phrase can be parsed only depends on which members are left and
+// where, so each (left, position) that fails is remembered and not tried
+// again; and at a byte boundary, only members that can start with the
+// next byte are tried.
+typedef struct {
+  uint64_t left;
+  size_t pos;
+} HPermKey;
+
+static HHashValue perm_key_hash(const void *p) {
+  return h_djbhash(p, sizeof(HPermKey));
+}
+
+static bool perm_key_equal(const void *a, const void *b) {
+  const HPermKey *x = a, *y = b;
+  return x->left == y->left && x->pos == y->pos;
+}
+
+typedef struct {
+  const HSequence *s;
+  const HPermDispatch *dispatch;
+  HCountedArray *seq;
+  HHashSet *failed;             // of HPermKey; made on the first failure
+  HParseState *state;
+} HPermSearch;
+
+static bool permutation_search(HPermSearch *ps, uint64_t left) {
+  if(!left)
+    return true;
+
+  HParseState *state = ps->state;
+  HInputStream bak = state->input_stream;
+  HPermKey key = { left, h_input_stream_pos(&bak) };
+  if(ps->failed && h_hashset_present(ps->failed, &key))
+    return false;
+
+  uint64_t tries = left;
+  if(bak.bit_offset == 0 && bak.margin == 0 && bak.index < bak.length)
+    tries &= ps->dispatch->start[bak.input[bak.index]];
+
+  // members that only matched as empty optionals (TT_NONE) here
+  uint64_t empty = 0;
+  for(size_t i=0; i<ps->s->len; i++) {
+    uint64_t bit = (uint64_t)1 << i;
+    if(!(tries & bit))
+      continue;
+    state->input_stream = bak;
+    HParseResult *match = h_do_parse(ps->s->p_array[i], state);
+    if(!match)
+      continue;
+    match->ast = h_resolve_deferred(state, match->ast);
+    if(match->ast && match->ast->token_type == TT_NONE) {
+      empty |= bit;
+      continue;
+    }
+    ps->seq->elements[i] = (void *)match->ast;
+    if(permutation_search(ps, left & ~bit))
+      return true;
+  }
+  state->input_stream = bak;
+
+  // if all that's left are empty optionals, still succeed
+  if(empty == left) {
+    for(size_t i=0; i<ps->s->len; i++) {
+      if(left & ((uint64_t)1 << i)) {
+        HParseResult *match = h_do_parse(ps->s->p_array[i], state);
+        ps->seq->elements[i] = (void *)h_resolve_deferred(state, match->ast);
+        state->input_stream = bak;
+      }
+    }
+    return true;
+  }
+
+  if(!ps->failed)
+    ps->failed = h_hashset_new(state->arena, perm_key_equal, perm_key_hash);
+  HPermKey *k = a_new(HPermKey, 1);
+  *k = key;
+  h_hashset_put(ps->failed, k);
+  return false;
+}
+
+static HPermDispatch *permutation_dispatch(HPermutation *perm) {
+  HAllocator *mm__ = perm->mm__;
+  HPermDispatch *d = h_new(HPermDispatch, 1);
+  HCharset cs = new_charset(mm__);
+  for(int c=0; c<256; c++)
+    d->start[c] = 0;
+  for(size_t i=0; i<perm->s.len; i++) {
+    uint64_t bit = (uint64_t)1 << i;
+    memset(cs, 0, 32);
+    if(!h_first_bytes(perm->s.p_array[i], cs))
+      memset(cs, 0xFF, 32);
+    for(int c=0; c<256; c++)
+      if(charset_isset(cs, c))
+        d->start[c] |= bit;
+  }
+  h_free(cs);
+  return d;
+}
+
 static HParseResult *parse_permutation(void *env, HParseState *state)
 {
-  const HSequence *s = env;
+  HPermutation *perm = env;
+  const HSequence *s = &perm->s;
   const size_t n = s->len;
 
-  // current set of available (not yet matched) parsers 
-  char *set = h_arena_malloc(state->arena, sizeof(char) * n);
-  memset(set, 1, sizeof(char) * n);
-
   // parse result
   HCountedArray *seq = h_carray_new_sized(state->arena, n);
+  memset(seq->elements, 0, sizeof(HParsedToken *) * n);
 
-  if(parse_permutation_tail(s, seq, 0, set, state)) {
+  bool ok;
+  if(n <= 64) {
+    // h_first_bytes marks the parsers it walks, so the table is worked
+    // out with the compile lock held; once it's there, it's only read
+    HPermDispatch *d = H_ATOMIC_LOAD_PTR(&perm->dispatch);
+    if(!d) {
+      h_compile_lock();
+      d = perm->dispatch;
+      if(!d) {
+        d = permutation_dispatch(perm);
+        H_ATOMIC_STORE_PTR(&perm->dispatch, d);
+      }
+      h_compile_unlock();
+    }
+    HPermSearch ps = {
+      .s = s,
+      .dispatch = d,
+      .seq = seq,
+      .failed = NULL,
+      .state = state
+    };
+    ok = permutation_search(&ps, n < 64 ? ((uint64_t)1 << n) - 1 : ~(uint64_t)0);
+  } else {
+    // current set of available (not yet matched) parsers
+    char *set = h_arena_malloc(state->arena, sizeof(char) * n);
+    memset(set, 1, sizeof(char) * n);
+    ok = parse_permutation_tail(s, seq, 0, set, state);
+  }
+
+  if(ok) {
     // success
     // return the sequence of results
     seq->used = n;
-    HParsedToken *tok = a_new(HParsedToken, 1);
+    HParsedToken *tok = a_new0(HParsedToken, 1);
     tok->token_type  = TT_SEQUENCE;
     tok->seq = seq;
     return make_result(state->arena, tok);
@@ -92,6 +236,14 @@ static HParseResult *parse_permutation(void *env, HParseState *state)
   }
 }
 
+static bool permutation_first_bytes(void *env, HCharset set) {
+  HPermutation *perm = env;
+  for(size_t i=0; i<perm->s.len; i++) {
+    if(!h_first_bytes(perm->s.p_array[i], set))
+      return false;
+  }
+  return perm->s.len > 0;
+}
 
 static const HParserVtable permutation_vt = {
   .parse = parse_permutation,
@@ -100,6 +252,7 @@ static const HParserVtable permutation_vt = {
   .desugar = NULL,
   .compile_to_rvm = h_not_regular,
   .higher = true,
+  .first_bytes = permutation_first_bytes,
 };
 
 HParser* h_permutation(HParser* p, ...) {
@@ -125,7 +278,8 @@ HParser* h_permutation__v(HParser* p, va_list ap) {
 HParser* h_permutation__mv(HAllocator* mm__, HParser* p, va_list ap_) {
   va_list ap;
   size_t len = 0;
-  HSequence *s = h_new(HSequence, 1);
+  HPermutation *perm = h_new(HPermutation, 1);
+  HSequence *s = &perm->s;
 
   HParser *arg;
   va_copy(ap, ap_);
@@ -144,7 +298,9 @@ HParser* h_permutation__mv(HAllocator* mm__, HParser* p, va_list ap_) {
   va_end(ap);
 
   s->len = len;
-  return h_new_parser(mm__, &permutation_vt, s);
+  perm->mm__ = mm__;
+  perm->dispatch = NULL;
+  return h_new_parser(mm__, &permutation_vt, perm);
 }
 
 HParser* h_permutation__a(void *args[]) {
@@ -159,7 +315,8 @@ HParser* h_permutation__ma(HAllocator* mm__, void *args[]) {
     arg=((HParser **)args)[++len];
   } while(arg);
 
-  HSequence *s = h_new(HSequence, 1);
+  HPermutation *perm = h_new(HPermutation, 1);
+  HSequence *s = &perm->s;
   s->p_array = h_new(HParser *, len);
 
   for (size_t i = 0; i < len; i++) {
@@ -167,9 +324,7 @@ HParser* h_permutation__ma(HAllocator* mm__, void *args[]) {
   }
 
   s->len = len;
-  HParser *ret = h_new(HParser, 1);
-  ret->vtable = &permutation_vt; 
-  ret->env = (void*)s;
-  ret->backend = PB_MIN;
-  return ret;
+  perm->mm__ = mm__;
+  perm->dispatch = NULL;
+  return h_new_parser(mm__, &permutation_vt, perm);
 }
@@ -15,7 +15,7 @@ static HParseResult* parse_sequence(void *env, HParseState *state) {
 	h_carray_append(seq, (void*)tmp->ast);
     }
   }
-  HParsedToken *tok = a_new(HParsedToken, 1);
+  HParsedToken *tok = a_new0(HParsedToken, 1);
   tok->token_type = TT_SEQUENCE; tok->seq = seq;
   return make_result(state->arena, tok);
 }
@@ -50,7 +50,7 @@ static HParsedToken *reshape_sequence(const HParseResult *p, void* user_data) {
       h_carray_append(seq, p->ast->seq->elements[i]);
   }
 
-  HParsedToken *res = a_new_(p->arena, HParsedToken, 1);
+  HParsedToken *res = a_new0_(p->arena, HParsedToken, 1);
   res->token_type = TT_SEQUENCE;
   res->seq = seq;
   res->index = p->ast->index;
@@ -82,6 +82,34 @@ static bool sequence_ctrvm(HRVMProg *prog, void *env) {
   return true;
 }
 
+static bool sequence_first_bytes(void *env, HCharset set) {
+  HSequence *s = (HSequence*)env;
+  return s->len > 0 && h_first_bytes(s->p_array[0], set);
+}
+
+// straight-line: the elements one after the other, and the sequence made
+// only once they have all matched
+static bool sequence_emit_c(HEmitC *e, void *env) {
+  HSequence *s = (HSequence*)env;
+  if (s->len == 0) {
+    h_emit_c_printf(e, "  *ast = s->rt->seq(s->arena, 0);\n  return pos;\n");
+    return true;
+  }
+  h_emit_c_printf(e, "  void *a[%zu];\n", s->len);
+  for (size_t i=0; i<s->len; ++i)
+    h_emit_c_printf(e, "  if ((pos = hg_p%zu(s, pos, &a[%zu])) == HG_FAIL)\n"
+                    "    return HG_FAIL;\n",
+                    h_emit_c_parser(e, s->p_array[i]), i);
+  h_emit_c_printf(e,
+    "  void *seq = s->rt->seq(s->arena, %zu);\n"
+    "  for (size_t i = 0; i < %zu; i++)\n"
+    "    if (a[i])\n"
+    "      s->rt->append(seq, a[i]);\n"
+    "  *ast = seq;\n"
+    "  return pos;\n", s->len, s->len);
+  return true;
+}
+
 static const HParserVtable sequence_vt = {
   .parse = parse_sequence,
   .isValidRegular = sequence_isValidRegular,
@@ -89,6 +117,8 @@ static const HParserVtable sequence_vt = {
   .desugar = desugar_sequence,
   .compile_to_rvm = sequence_ctrvm,
   .higher = true,
+  .first_bytes = sequence_first_bytes,
+  .emit_c = sequence_emit_c,
 };
 
 HParser* h_sequence(HParser* p, ...) {
@@ -162,9 +192,5 @@ HParser* h_sequence__ma(HAllocator* mm__, void *args[]) {
   }
 
   s->len = len;
-  HParser *ret = h_new(HParser, 1);
-  ret->vtable = &sequence_vt; 
-  ret->env = (void*)s; 
-  ret->backend = PB_MIN;
-  return ret;
+  return h_new_parser(mm__, &sequence_vt, s);
 }
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <string.h>
 #include "parser_internal.h"
 
 typedef struct {
@@ -8,13 +9,20 @@ typedef struct {
 
 static HParseResult* parse_token(void *env, HParseState *state) {
   HToken *t = (HToken*)env;
-  for (int i=0; i<t->len; ++i) {
-    uint8_t chr = (uint8_t)h_read_bits(&state->input_stream, 8, false);
-    if (t->str[i] != chr) {
+  HInputStream *in = &state->input_stream;
+  if (in->bit_offset == 0 && in->margin == 0 && in->length - in->index >= t->len) {
+    if (memcmp(in->input + in->index, t->str, t->len) != 0)
       return NULL;
+    in->index += t->len;
+  } else {
+    for (int i=0; i<t->len; ++i) {
+      uint8_t chr = h_read_byte(&state->input_stream);
+      if (t->str[i] != chr) {
+	return NULL;
+      }
     }
   }
-  HParsedToken *tok = a_new(HParsedToken, 1);
+  HParsedToken *tok = a_new0(HParsedToken, 1);
   tok->token_type = TT_BYTES; tok->bytes.token = t->str; tok->bytes.len = t->len;
   return make_result(state->arena, tok);
 }
@@ -36,7 +44,7 @@ static HParsedToken *reshape_token(const HParseResult *p, void* user_data) {
   }
 
   // create result token
-  HParsedToken *tok = h_arena_malloc(p->arena, sizeof(HParsedToken));
+  HParsedToken *tok = h_arena_malloc0(p->arena, sizeof(HParsedToken));
   tok->token_type = TT_BYTES;
   tok->bytes.len = seq->used;
   tok->bytes.token = arr;
@@ -67,6 +75,32 @@ static bool token_ctrvm(HRVMProg *prog, void *env) {
   return true;
 }
 
+static bool token_first_bytes(void *env, HCharset set) {
+  HToken *t = (HToken*)env;
+  if (t->len == 0)
+    return false;
+  charset_set(set, t->str[0], 1);
+  return true;
+}
+
+// compared against a literal in the code; the AST's bytes are still t->str
+static bool token_emit_c(HEmitC *e, void *env) {
+  HToken *t = (HToken*)env;
+  if (t->len > 0) {
+    h_emit_c_printf(e, "  if (s->len - pos < %u\n"
+                    "      || memcmp(s->in + pos, \"", (unsigned)t->len);
+    for (int i=0; i<t->len; ++i)
+      h_emit_c_printf(e, "\\x%02x", t->str[i]);
+    h_emit_c_printf(e, "\", %u) != 0)\n"
+                    "    return HG_FAIL;\n", (unsigned)t->len);
+  }
+  h_emit_c_printf(e,
+    "  *ast = s->rt->bytes(s->arena, s->refs[%zu], %u);\n"
+    "  return pos + %u;\n",
+    h_emit_c_ref(e, t->str), (unsigned)t->len, (unsigned)t->len);
+  return true;
+}
+
 const HParserVtable token_vt = {
   .parse = parse_token,
   .isValidRegular = h_true,
@@ -74,6 +108,8 @@ const HParserVtable token_vt = {
   .desugar = desugar_token,
   .compile_to_rvm = token_ctrvm,
   .higher = false,
+  .first_bytes = token_first_bytes,
+  .emit_c = token_emit_c,
 };
 
 HParser* h_token(const uint8_t *str, const size_t len) {
@@ -7,7 +7,7 @@ static HParseResult* parse_whitespace(void* env, HParseState *state) {
   HInputStream bak;
   do {
     bak = state->input_stream;
-    c = h_read_bits(&state->input_stream, 8, false);
+    c = h_read_byte(&state->input_stream);
     if (state->input_stream.overrun)
       break;
   } while (isspace((int)c));
@@ -69,6 +69,25 @@ static bool ws_ctrvm(HRVMProg *prog, void *env) {
   return h_compile_regex(prog, p);
 }
 
+static bool ws_first_bytes(void *env, HCharset set) {
+  if (!h_first_bytes((HParser*)env, set))
+    return false;
+  for (int i = 0; i < 256; i++)
+    if (isspace(i))
+      charset_set(set, i, 1);
+  return true;
+}
+
+// '\t' to '\r' are the other five of SPACE_CHRS
+static bool ws_emit_c(HEmitC *e, void *env) {
+  h_emit_c_printf(e,
+    "  while (pos < s->len && (s->in[pos] == ' ' || (s->in[pos] >= '\\t' && s->in[pos] <= '\\r')))\n"
+    "    pos++;\n"
+    "  return hg_p%zu(s, pos, ast);\n",
+    h_emit_c_parser(e, (HParser*)env));
+  return true;
+}
+
 static const HParserVtable whitespace_vt = {
   .parse = parse_whitespace,
   .isValidRegular = ws_isValidRegular,
@@ -76,6 +95,8 @@ static const HParserVtable whitespace_vt = {
   .desugar = desugar_whitespace,
   .compile_to_rvm = ws_ctrvm,
   .higher = false,
+  .first_bytes = ws_first_bytes,
+  .emit_c = ws_emit_c,
 };
 
 HParser* h_whitespace(const HParser* p) {
@@ -25,12 +25,27 @@ static HParseResult* parse_xor(void *env, HParseState *state) {
   }
 }
 
+static bool xor_emit_c(HEmitC *e, void *env) {
+  HTwoParsers *parsers = (HTwoParsers*)env;
+  h_emit_c_printf(e,
+    "  void *a;\n"
+    "  size_t r1 = hg_p%zu(s, pos, ast);\n"
+    "  size_t r2 = hg_p%zu(s, pos, &a);\n"
+    "  if (r1 != HG_FAIL)\n"
+    "    return r2 == HG_FAIL ? r1 : HG_FAIL;\n"
+    "  *ast = a;\n"
+    "  return r2;\n",
+    h_emit_c_parser(e, parsers->p1), h_emit_c_parser(e, parsers->p2));
+  return true;
+}
+
 static const HParserVtable xor_vt = {
   .parse = parse_xor,
   .isValidRegular = h_false,
   .isValidCF = h_false, // XXX should this be true if both p1 and p2 are CF?
   .compile_to_rvm = h_not_regular,
   .higher = true,
+  .emit_c = xor_emit_c,
 };
 
 HParser* h_xor(const HParser* p1, const HParser* p2) {
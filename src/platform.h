@@ -9,6 +9,7 @@
 #include "compiler_specifics.h"
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /* String Formatting */
@@ -36,7 +37,35 @@ void h_platform_stopwatch_reset(struct HStopWatch* stopwatch);
 /* return difference between last reset point and now */
 int64_t h_platform_stopwatch_ns(struct HStopWatch* stopwatch);
 
-/* Platform dependent definitions for HStopWatch */
+/* Threads */
+
+typedef struct HThread_ HThread; /* opaque */
+
+/* start running fn(arg) in a new thread; NULL on failure */
+HThread *h_platform_thread_start(void (*fn)(void *arg), void *arg);
+
+/* wait for a thread to finish and release it */
+void h_platform_thread_join(HThread *thread);
+
+/* number of processors online, at least 1 */
+unsigned int h_platform_ncpus(void);
+
+/* Compiling C at run time */
+
+/* compile source with the system's C compiler ($HAMMER_CC, or cc), load
+ * the result and look up symbol in it; NULL if any of that fails. The
+ * code stays loaded until *handle is given to h_platform_unload_c. */
+void *h_platform_load_c(const char *source, size_t len, const char *symbol, void **handle);
+void h_platform_unload_c(void *handle);
+
+/* Mutexes */
+
+struct HMutex; /* forward definition; initialize with H_MUTEX_INIT */
+
+void h_platform_mutex_lock(struct HMutex *mutex);
+void h_platform_mutex_unlock(struct HMutex *mutex);
+
+/* Platform dependent definitions for HStopWatch and HMutex */
 #if defined(_MSC_VER)
 
 #ifndef WIN32_LEAN_AND_MEAN
@@ -50,15 +79,26 @@ struct HStopWatch {
   LARGE_INTEGER start;
 };
 
+struct HMutex {
+  SRWLOCK lock;
+};
+#define H_MUTEX_INIT { SRWLOCK_INIT }
+
 #else
 /* Unix like platforms */
 
+#include <pthread.h>
 #include <time.h>
 
 struct HStopWatch {
   struct timespec start;
 };
 
+struct HMutex {
+  pthread_mutex_t lock;
+};
+#define H_MUTEX_INIT { PTHREAD_MUTEX_INITIALIZER }
+
 #endif
 
 #endif
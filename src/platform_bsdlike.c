@@ -6,8 +6,17 @@
 
 #include <stdio.h>
 
+#include <dlfcn.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #ifdef __MACH__
 #include <mach/clock.h>
@@ -84,3 +93,115 @@ int64_t h_platform_stopwatch_ns(struct HStopWatch* stopwatch) {
   return (ts_now.tv_sec - stopwatch->start.tv_sec) * 1000000000
           + (ts_now.tv_nsec - stopwatch->start.tv_nsec);
 }
+
+struct HThread_ {
+  pthread_t thread;
+  void (*fn)(void *arg);
+  void *arg;
+};
+
+static void *thread_main(void *p) {
+  HThread *thread = p;
+  thread->fn(thread->arg);
+  return NULL;
+}
+
+HThread *h_platform_thread_start(void (*fn)(void *arg), void *arg) {
+  HThread *thread = malloc(sizeof(HThread));
+  if (thread == NULL)
+    return NULL;
+  thread->fn = fn;
+  thread->arg = arg;
+  if (pthread_create(&thread->thread, NULL, thread_main, thread) != 0) {
+    free(thread);
+    return NULL;
+  }
+  return thread;
+}
+
+void h_platform_thread_join(HThread *thread) {
+  pthread_join(thread->thread, NULL);
+  free(thread);
+}
+
+unsigned int h_platform_ncpus(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (unsigned int)n : 1;
+}
+
+void h_platform_mutex_lock(struct HMutex *mutex) {
+  pthread_mutex_lock(&mutex->lock);
+}
+
+void h_platform_mutex_unlock(struct HMutex *mutex) {
+  pthread_mutex_unlock(&mutex->lock);
+}
+
+extern char **environ;
+
+// run the compiler, with no shell in between to make anything of the
+// paths or $HAMMER_CC. failing is an expected outcome, so what it has to
+// say goes nowhere.
+static bool run_cc(const char *cc, const char *lib, const char *src) {
+  char *argv[] = { (char *)cc, "-O2", "-fPIC", "-shared", "-o", (char *)lib, (char *)src, NULL };
+  posix_spawn_file_actions_t actions;
+  if (posix_spawn_file_actions_init(&actions) != 0)
+    return false;
+  pid_t pid;
+  int status;
+  bool ok = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0) == 0
+    && posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0) == 0
+    && posix_spawnp(&pid, cc, &actions, NULL, argv, environ) == 0;
+  posix_spawn_file_actions_destroy(&actions);
+  if (!ok)
+    return false;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      return false;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void *h_platform_load_c(const char *source, size_t len, const char *symbol, void **handle) {
+  const char *tmp = getenv("TMPDIR");
+  const char *cc = getenv("HAMMER_CC");
+  char *dir = NULL, *src = NULL, *lib = NULL;
+  void *sym = NULL;
+  *handle = NULL;
+  if (h_platform_asprintf(&dir, "%s/hammer-XXXXXX", tmp && *tmp ? tmp : "/tmp") < 0)
+    return NULL;
+  if (!mkdtemp(dir))
+    goto out;
+  if (h_platform_asprintf(&src, "%s/parser.c", dir) < 0
+      || h_platform_asprintf(&lib, "%s/parser.so", dir) < 0)
+    goto clean;
+  FILE *f = fopen(src, "w");
+  if (!f)
+    goto clean;
+  int written = fwrite(source, 1, len, f) == len;
+  if (fclose(f) != 0 || !written)
+    goto clean;
+  if (run_cc(cc && *cc ? cc : "cc", lib, src)) {
+    void *h = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+    if (h && (sym = dlsym(h, symbol)))
+      *handle = h;
+    else if (h)
+      dlclose(h);
+  }
+ clean:
+  if (src)
+    unlink(src);
+  if (lib)
+    unlink(lib);
+  rmdir(dir);
+ out:
+  free(lib);
+  free(src);
+  free(dir);
+  return sym;
+}
+
+void h_platform_unload_c(void *handle) {
+  if (handle)
+    dlclose(handle);
+}
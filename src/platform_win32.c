@@ -59,3 +59,58 @@ int64_t h_platform_stopwatch_ns(struct HStopWatch* stopwatch) {
 
   return 1000000000 * (now.QuadPart - stopwatch->start.QuadPart) / stopwatch->qpf.QuadPart;
 }
+
+struct HThread_ {
+  HANDLE handle;
+  void (*fn)(void *arg);
+  void *arg;
+};
+
+static DWORD WINAPI thread_main(LPVOID p) {
+  HThread *thread = p;
+  thread->fn(thread->arg);
+  return 0;
+}
+
+HThread *h_platform_thread_start(void (*fn)(void *arg), void *arg) {
+  HThread *thread = malloc(sizeof(HThread));
+  if (thread == NULL)
+    return NULL;
+  thread->fn = fn;
+  thread->arg = arg;
+  thread->handle = CreateThread(NULL, 0, thread_main, thread, 0, NULL);
+  if (thread->handle == NULL) {
+    free(thread);
+    return NULL;
+  }
+  return thread;
+}
+
+void h_platform_thread_join(HThread *thread) {
+  WaitForSingleObject(thread->handle, INFINITE);
+  CloseHandle(thread->handle);
+  free(thread);
+}
+
+unsigned int h_platform_ncpus(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
+void h_platform_mutex_lock(struct HMutex *mutex) {
+  AcquireSRWLockExclusive(&mutex->lock);
+}
+
+void h_platform_mutex_unlock(struct HMutex *mutex) {
+  ReleaseSRWLockExclusive(&mutex->lock);
+}
+
+void *h_platform_load_c(const char *source, size_t len, const char *symbol, void **handle) {
+  // no compiler to count on; use h_emit_c and link the code in instead
+  *handle = NULL;
+  return NULL;
+}
+
+void h_platform_unload_c(void *handle) {
+}
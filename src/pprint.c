@@ -80,23 +80,43 @@ void h_pprint(FILE* stream, const HParsedToken* tok, int indent, int delta) {
 }
 
 
-struct result_buf {
-  char* output;
-  size_t len;
-  size_t capacity;
-};
-
-static inline bool ensure_capacity(struct result_buf *buf, int amt) {
-  while (buf->len + amt >= buf->capacity) {
-    buf->output = (&system_allocator)->realloc(&system_allocator, buf->output, buf->capacity *= 2);
-    if (!buf->output) {
-      return false;
-    }
-  }
+// note that something couldn't be written
+static bool fail(struct result_buf *buf) {
+  buf->error = true;
+  return false;
+}
+
+static bool flush(struct result_buf *buf) {
+  size_t len = buf->len;
+  buf->len = 0;
+  return fwrite(buf->output, 1, len, buf->stream) == len || fail(buf);
+}
+
+// make room for amt more bytes, plus the terminating NUL. A streaming
+// buffer is written out instead, and never grows.
+static bool ensure_capacity(struct result_buf *buf, size_t amt) {
+  if (buf->len + amt < buf->capacity)
+    return true;
+  if (buf->stream)
+    return flush(buf) && (amt < buf->capacity || fail(buf));
+  size_t capacity = buf->capacity ? buf->capacity : 64;
+  while (buf->len + amt >= capacity)
+    capacity *= 2;
+  char *output = (&system_allocator)->realloc(&system_allocator, buf->output, capacity);
+  if (!output)
+    return fail(buf);
+  buf->output = output;
+  buf->capacity = capacity;
   return true;
 }
 
 bool h_append_buf(struct result_buf *buf, const char* input, int len) {
+  if (buf->stream && buf->len + len >= buf->capacity) {
+    if (!flush(buf))
+      return false;
+    if ((size_t)len >= buf->capacity) // doesn't fit at all
+      return fwrite(input, 1, len, buf->stream) == (size_t)len || fail(buf);
+  }
   if (ensure_capacity(buf, len)) {
     memcpy(buf->output + buf->len, input, len);
     buf->len += len;
@@ -107,12 +127,11 @@ bool h_append_buf(struct result_buf *buf, const char* input, int len) {
 }
 
 bool h_append_buf_c(struct result_buf *buf, char v) {
-  if (ensure_capacity(buf, 1)) {
+  if (buf->len + 1 < buf->capacity) {
     buf->output[buf->len++] = v;
     return true;
-  } else {
-    return false;
   }
+  return h_append_buf(buf, &v, 1);
 }
 
 /** append a formatted string to the result buffer */
@@ -125,81 +144,128 @@ bool h_append_buf_formatted(struct result_buf *buf, char* format, ...)
 
   va_start(ap, format);
   len = h_platform_vasprintf(&tmpbuf, format, ap);
+  va_end(ap);
+  if (len < 0)
+    return fail(buf);
   result = h_append_buf(buf, tmpbuf, len);
   free(tmpbuf);
-  va_end(ap);
 
   return result;
 }
 
-static void unamb_sub(const HParsedToken* tok, struct result_buf *buf) {
-  if (!tok) {
-    h_append_buf(buf, "NULL", 4);
-    return;
+static const char HEX[] = "0123456789abcdef";
+
+// what "%#" PRIx64 would print, after the given prefix
+static bool append_hex(struct result_buf *buf, const char *prefix, uint64_t v) {
+  char tmp[24];
+  size_t n = 0;
+  do {
+    tmp[sizeof(tmp) - ++n] = HEX[v & 0xf];
+    v >>= 4;
+  } while (v);
+  if (n > 1 || tmp[sizeof(tmp) - 1] != '0') {
+    tmp[sizeof(tmp) - ++n] = 'x';
+    tmp[sizeof(tmp) - ++n] = '0';
   }
+  size_t plen = strlen(prefix);
+  memcpy(tmp + sizeof(tmp) - n - plen, prefix, plen);
+  n += plen;
+  return h_append_buf(buf, tmp + sizeof(tmp) - n, n);
+}
+
+// <xx.xx.xx>, a few bytes at a time; h_append_buf sees that each piece
+// gets out, even past a streaming buffer smaller than it
+static bool append_bytes(struct result_buf *buf, const uint8_t *bytes, size_t len) {
+  if (len == 0)
+    return h_append_buf(buf, "<>", 2);
+  char tmp[3 * 64 + 1];
+  for (size_t i = 0; i < len; ) {
+    size_t n = len - i < 64 ? len - i : 64;
+    char *out = tmp;
+    for (size_t j = 0; j < n; j++, i++) {
+      *out++ = (i == 0) ? '<': '.';
+      *out++ = HEX[bytes[i] >> 4];
+      *out++ = HEX[bytes[i] & 0xf];
+    }
+    if (i == len)
+      *out++ = '>';
+    if (!h_append_buf(buf, tmp, out - tmp))
+      return false;
+  }
+  return true;
+}
+
+// false as soon as something couldn't be written
+static bool unamb_sub(const HParsedToken* tok, struct result_buf *buf) {
+  if (!tok)
+    return h_append_buf(buf, "NULL", 4);
   switch (tok->token_type) {
   case TT_NONE:
-    h_append_buf(buf, "null", 4);
-    break;
+    return h_append_buf(buf, "null", 4);
   case TT_BYTES:
-    if (tok->bytes.len == 0)
-      h_append_buf(buf, "<>", 2);
-    else {
-      for (size_t i = 0; i < tok->bytes.len; i++) {
-        const char *HEX = "0123456789abcdef";
-        h_append_buf_c(buf, (i == 0) ? '<': '.');
-        char c = tok->bytes.token[i];
-        h_append_buf_c(buf, HEX[(c >> 4) & 0xf]);
-        h_append_buf_c(buf, HEX[(c >> 0) & 0xf]);
-      }
-      h_append_buf_c(buf, '>');
-    }
-    break;
+    return append_bytes(buf, tok->bytes.token, tok->bytes.len);
   case TT_SINT:
     if (tok->sint < 0)
-      h_append_buf_formatted(buf, "s-%#" PRIx64, -tok->sint);
+      return append_hex(buf, "s-", (uint64_t)0 - (uint64_t)tok->sint);
     else
-      h_append_buf_formatted(buf, "s%#" PRIx64, tok->sint);
-    break;
+      return append_hex(buf, "s", tok->sint);
   case TT_UINT:
-    h_append_buf_formatted(buf, "u%#" PRIx64, tok->uint);
-    break;
+    return append_hex(buf, "u", tok->uint);
   case TT_ERR:
-    h_append_buf(buf, "ERR", 3);
-    break;
+    return h_append_buf(buf, "ERR", 3);
   case TT_SEQUENCE: {
-    h_append_buf_c(buf, '(');
+    if (!h_append_buf_c(buf, '('))
+      return false;
     for (size_t i = 0; i < tok->seq->used; i++) {
-      if (i > 0)
-        h_append_buf_c(buf, ' ');
-      unamb_sub(tok->seq->elements[i], buf);
+      if (i > 0 && !h_append_buf_c(buf, ' '))
+        return false;
+      if (!unamb_sub(tok->seq->elements[i], buf))
+        return false;
     }
-    h_append_buf_c(buf, ')');
+    return h_append_buf_c(buf, ')');
   }
-    break;
   default: {
     const HTTEntry *e = h_get_token_type_entry(tok->token_type);
     if (e) {
-      h_append_buf_c(buf, '{');
-      e->unamb_sub(tok, buf);
-      h_append_buf_c(buf, '}');
+      if (!h_append_buf_c(buf, '{'))
+        return false;
+      e->unamb_sub(tok, buf);   // tells us only through buf->error
+      return !buf->error && h_append_buf_c(buf, '}');
     } else {
       assert_message(0, "Bogus token type.");
+      return false;
     }
   }
   }
 }
-  
+
+bool h_append_result_unamb(struct result_buf *buf, const HParsedToken* tok) {
+  if (buf->error || !unamb_sub(tok, buf) || !ensure_capacity(buf, 0))
+    return false;
+  buf->output[buf->len] = 0;
+  return true;
+}
+
+bool h_fprint_result_unamb(FILE* stream, const HParsedToken* tok) {
+  char tmp[4096];
+  struct result_buf buf = {
+    .output = tmp,
+    .len = 0,
+    .capacity = sizeof(tmp),
+    .stream = stream
+  };
+  return unamb_sub(tok, &buf) && flush(&buf) && !ferror(stream);
+}
 
 char* h_write_result_unamb(const HParsedToken* tok) {
   struct result_buf buf = {
     .output = h_alloc(&system_allocator, 16),
     .len = 0,
-    .capacity = 16
+    .capacity = 16,
+    .stream = NULL
   };
   assert(buf.output != NULL);
-  unamb_sub(tok, &buf);
-  h_append_buf_c(&buf, 0);
+  h_append_result_unamb(&buf, tok);
   return buf.output;
 }
   
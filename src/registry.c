@@ -20,7 +20,6 @@
 
 #include "hammer.h"
 #include "internal.h"
-#include "tsearch.h"
 
 #if defined(_MSC_VER)
 #define h_strdup _strdup
@@ -28,9 +27,24 @@
 #define h_strdup strdup
 #endif
 
-static void *tt_registry = NULL;
-static HTTEntry** tt_by_id = NULL;
-static unsigned int tt_by_id_sz = 0;
+/*
+ * Lookups in the registry take no lock. They go through tt_table, whose
+ * slots are only ever filled in, never changed; when it runs full, it is
+ * copied into one twice the size, which is then published in its place
+ * (copy-on-write). Readers may still be looking at the old table, so it is
+ * kept; all old tables together are smaller than the current one.
+ *
+ * Registrations are serialized by tt_lock.
+ */
+typedef struct HTTTable_ {
+  size_t size;              // number of token types that fit
+  HTTEntry **by_id;         // [size], indexed by token type - TT_START
+  HTTEntry **by_name;       // [2*size], hash of the names, linear probing
+  struct HTTTable_ *prev;   // the table this one replaced
+} HTTTable;
+
+static HTTTable *tt_table = NULL;
+static struct HMutex tt_lock = H_MUTEX_INIT;
 #define TT_START TT_USER
 static HTokenType tt_next = TT_START;
 
@@ -43,9 +57,61 @@ static int ext_next = 0;
 */
 
 
-static int compare_entries(const void* v1, const void* v2) {
-  const HTTEntry *e1 = (HTTEntry*)v1, *e2 = (HTTEntry*)v2;
-  return strcmp(e1->name, e2->name);
+static size_t name_hash(const char *name) {
+  return h_djbhash((const uint8_t *)name, strlen(name));
+}
+
+static HTTEntry *find_entry(HTTTable *t, const char *name) {
+  if (t == NULL)
+    return NULL;
+
+  // the table is at most half full, so this finds an empty slot eventually
+  size_t mask = 2 * t->size - 1;
+  for (size_t i = name_hash(name) & mask; ; i = (i + 1) & mask) {
+    HTTEntry *e = H_ATOMIC_LOAD_PTR(&t->by_name[i]);
+    if (e == NULL)
+      return NULL;
+    if (strcmp(e->name, name) == 0)
+      return e;
+  }
+}
+
+// only called with tt_lock held
+static void insert_entry(HTTTable *t, HTTEntry *e) {
+  size_t mask = 2 * t->size - 1;
+  size_t i = name_hash(e->name) & mask;
+  while (t->by_name[i] != NULL)
+    i = (i + 1) & mask;
+  H_ATOMIC_STORE_PTR(&t->by_name[i], e);
+  H_ATOMIC_STORE_PTR(&t->by_id[e->value - TT_START], e);
+}
+
+// only called with tt_lock held
+static HTTTable *grow_table(HTTTable *old) {
+  HTTTable *t = malloc(sizeof(HTTTable));
+  if (!t)
+    return NULL;
+  t->size = old ? old->size * 2 : 64;
+  t->by_id = calloc(t->size, sizeof(HTTEntry *));
+  t->by_name = calloc(2 * t->size, sizeof(HTTEntry *));
+  if (!t->by_id || !t->by_name) {
+    free(t->by_id);
+    free(t->by_name);
+    free(t);
+    return NULL;
+  }
+  t->prev = old;
+
+  if (old) {
+    for (size_t i = 0; i < old->size; i++) {
+      if (old->by_id[i])
+        insert_entry(t, old->by_id[i]);
+    }
+  }
+
+  // the new table is complete before anyone gets to see it
+  H_ATOMIC_STORE_PTR(&tt_table, t);
+  return t;
 }
 
 static void default_unamb_sub(const HParsedToken* tok,
@@ -56,57 +122,53 @@ static void default_unamb_sub(const HParsedToken* tok,
 HTokenType h_allocate_token_new(
     const char* name,
     void (*unamb_sub)(const HParsedToken *tok, struct result_buf *buf)) {
-  HTTEntry* new_entry = h_alloc(&system_allocator, sizeof(*new_entry));
-  assert(new_entry != NULL);
-  new_entry->name = name;
-  new_entry->value = 0;
-  new_entry->unamb_sub = unamb_sub;
-  HTTEntry* probe = *(HTTEntry**)tsearch(new_entry, &tt_registry, compare_entries);
-  if (probe->value != 0) {
+  HTokenType value;
+
+  h_platform_mutex_lock(&tt_lock);
+  HTTTable *t = tt_table;
+  HTTEntry *probe = find_entry(t, name);
+  if (probe != NULL) {
     // Token type already exists...
     // TODO: treat this as a bug?
-    (&system_allocator)->free(&system_allocator, new_entry);
-    return probe->value;
+    value = probe->value;
+  } else if ((t == NULL || (size_t)(tt_next - TT_START) >= t->size)
+             && (t = grow_table(t)) == NULL) {
+    value = TT_INVALID;
   } else {
     // new value
-    probe->name = h_strdup(probe->name); // drop ownership of name
-    probe->value = tt_next++;
-    if ((probe->value - TT_START) >= tt_by_id_sz) {
-      if (tt_by_id_sz == 0) {
-	tt_by_id = malloc(sizeof(*tt_by_id) * ((tt_by_id_sz = (tt_next - TT_START) * 16)));
-      } else {
-	tt_by_id = realloc(tt_by_id, sizeof(*tt_by_id) * ((tt_by_id_sz *= 2)));
-      }
-      if (!tt_by_id) {
-	return TT_INVALID;
-      }
-    }
-    assert(probe->value - TT_START < tt_by_id_sz);
-    tt_by_id[probe->value - TT_START] = probe;
-    return probe->value;
+    HTTEntry* new_entry = h_alloc(&system_allocator, sizeof(*new_entry));
+    assert(new_entry != NULL);
+    new_entry->name = h_strdup(name); // drop ownership of name
+    new_entry->value = tt_next++;
+    new_entry->unamb_sub = unamb_sub;
+    insert_entry(t, new_entry);
+    value = new_entry->value;
   }
+  h_platform_mutex_unlock(&tt_lock);
+
+  return value;
 }
 HTokenType h_allocate_token_type(const char* name) {
   return h_allocate_token_new(name, default_unamb_sub);
 }
 HTokenType h_get_token_type_number(const char* name) {
-  HTTEntry e;
-  e.name = name;
-  HTTEntry **ret = (HTTEntry**)tfind(&e, &tt_registry, compare_entries);
-  if (ret == NULL)
+  HTTEntry *e = find_entry(H_ATOMIC_LOAD_PTR(&tt_table), name);
+  if (e == NULL)
     return 0;
   else
-    return (*ret)->value;
+    return e->value;
 }
 const char* h_get_token_type_name(HTokenType token_type) {
-  if (token_type >= tt_next || token_type < TT_START)
+  const HTTEntry *e = h_get_token_type_entry(token_type);
+  if (e == NULL)
     return NULL;
   else
-    return tt_by_id[token_type - TT_START]->name;
+    return e->name;
 }
 const HTTEntry* h_get_token_type_entry(HTokenType token_type) {
-  if (token_type >= tt_next || token_type < TT_START)
+  HTTTable *t = H_ATOMIC_LOAD_PTR(&tt_table);
+  if (t == NULL || token_type < TT_START || (size_t)(token_type - TT_START) >= t->size)
     return NULL;
   else
-    return tt_by_id[token_type - TT_START];
+    return H_ATOMIC_LOAD_PTR(&t->by_id[token_type - TT_START]);
 }
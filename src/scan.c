@@ -0,0 +1,161 @@
+#include <string.h>
+#include "internal.h"
+
+#ifdef H_HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// Scanning runs of bytes that belong to a charset. Every kernel returns
+// the length of the longest prefix of buf[0..len) that is in the set; the
+// vector kernels only ever load whole blocks, and leave the tail to the
+// scalar loop.
+
+static size_t span_scalar(const HCharsetScan *scan, const uint8_t *buf, size_t len) {
+  size_t i = 0;
+  while (i < len && scan->member[buf[i]])
+    i++;
+  return i;
+}
+
+#ifdef H_HAVE_X86_KERNELS
+
+// a charset made of a few ranges: t = x - lo is in the range exactly
+// when min(t, hi - lo) == t, in unsigned bytes
+H_TARGET("sse2")
+static size_t span_sse2(const HCharsetScan *scan, const uint8_t *buf, size_t len) {
+  __m128i lo[H_SCAN_RANGES], width[H_SCAN_RANGES];
+  for (int r = 0; r < scan->nranges; r++) {
+    lo[r] = _mm_set1_epi8((char)scan->range_lo[r]);
+    width[r] = _mm_set1_epi8((char)scan->range_width[r]);
+  }
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+    __m128i in = _mm_setzero_si128();
+    for (int r = 0; r < scan->nranges; r++) {
+      __m128i t = _mm_sub_epi8(x, lo[r]);
+      in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(t, width[r]), t));
+    }
+    unsigned out = ~_mm_movemask_epi8(in) & 0xFFFF;
+    if (out)
+      return i + __builtin_ctz(out);
+  }
+  return i + span_scalar(scan, buf + i, len - i);
+}
+
+// nibble lookup: a byte is in the set when the masks looked up by its low
+// and by its high nibble have a bit in common
+H_TARGET("ssse3")
+static size_t span_ssse3(const HCharsetScan *scan, const uint8_t *buf, size_t len) {
+  const __m128i lo_tab = _mm_loadu_si128((const __m128i *)scan->lo_nibble);
+  const __m128i hi_tab = _mm_loadu_si128((const __m128i *)scan->hi_nibble);
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+    __m128i lo = _mm_shuffle_epi8(lo_tab, _mm_and_si128(x, nibble));
+    __m128i hi = _mm_shuffle_epi8(hi_tab, _mm_and_si128(_mm_srli_epi16(x, 4), nibble));
+    __m128i out = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+    unsigned mask = _mm_movemask_epi8(out);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + span_scalar(scan, buf + i, len - i);
+}
+
+H_TARGET("avx2")
+static size_t span_avx2(const HCharsetScan *scan, const uint8_t *buf, size_t len) {
+  // vpshufb looks up within each 128-bit lane, so both get the tables
+  const __m256i lo_tab = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)scan->lo_nibble));
+  const __m256i hi_tab = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)scan->hi_nibble));
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(buf + i));
+    __m256i lo = _mm256_shuffle_epi8(lo_tab, _mm256_and_si256(x, nibble));
+    __m256i hi = _mm256_shuffle_epi8(hi_tab, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+    __m256i out = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+    unsigned mask = _mm256_movemask_epi8(out);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + span_ssse3(scan, buf + i, len - i);
+}
+
+#endif
+
+// The nibble tables give each distinct row of the set (the low nibbles
+// present under one high nibble) a bit of its own; that works for up to
+// eight distinct rows, which covers ranges, digits, letters and the like.
+static bool build_nibble_tables(HCharsetScan *scan) {
+  uint16_t rows[16], distinct[8];
+  int ndistinct = 0;
+  memset(scan->lo_nibble, 0, sizeof(scan->lo_nibble));
+  memset(scan->hi_nibble, 0, sizeof(scan->hi_nibble));
+  for (int h = 0; h < 16; h++) {
+    rows[h] = 0;
+    for (int l = 0; l < 16; l++)
+      if (scan->member[h << 4 | l])
+        rows[h] |= 1 << l;
+  }
+  for (int h = 0; h < 16; h++) {
+    if (!rows[h])
+      continue;
+    int d;
+    for (d = 0; d < ndistinct; d++)
+      if (distinct[d] == rows[h])
+        break;
+    if (d == ndistinct) {
+      if (ndistinct == 8)
+        return false;
+      distinct[ndistinct++] = rows[h];
+    }
+    scan->hi_nibble[h] = 1 << d;
+  }
+  for (int d = 0; d < ndistinct; d++)
+    for (int l = 0; l < 16; l++)
+      if (distinct[d] & 1 << l)
+        scan->lo_nibble[l] |= 1 << d;
+  return true;
+}
+
+// false if the set takes more than H_SCAN_RANGES ranges
+static bool build_ranges(HCharsetScan *scan) {
+  scan->nranges = 0;
+  for (int c = 0; c < 256; ) {
+    if (!scan->member[c]) {
+      c++;
+      continue;
+    }
+    int lo = c;
+    while (c < 256 && scan->member[c])
+      c++;
+    if (scan->nranges == H_SCAN_RANGES)
+      return false;
+    scan->range_lo[scan->nranges] = lo;
+    scan->range_width[scan->nranges] = c - 1 - lo;
+    scan->nranges++;
+  }
+  return true;
+}
+
+HCharsetScan *h_charset_scan_new(HAllocator *mm__, HCharset cs) {
+  HCharsetScan *scan = h_new(HCharsetScan, 1);
+  for (int c = 0; c < 256; c++)
+    scan->member[c] = charset_isset(cs, c);
+  bool nibbles = build_nibble_tables(scan);
+  bool ranges = build_ranges(scan);
+  scan->span = span_scalar;
+#ifdef H_HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (nibbles && __builtin_cpu_supports("avx2"))
+    scan->span = span_avx2;
+  else if (nibbles && __builtin_cpu_supports("ssse3"))
+    scan->span = span_ssse3;
+  else if (ranges && __builtin_cpu_supports("sse2"))
+    scan->span = span_sse2;
+#else
+  (void)nibbles; (void)ranges;
+#endif
+  return scan;
+}
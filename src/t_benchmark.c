@@ -1,5 +1,8 @@
 #include <glib.h>
+#include <string.h>
 #include "hammer.h"
+#include "internal.h"
+#include "platform.h"
 #include "test_suite.h"
 
 HParserTestcase testcases[] = {
@@ -17,6 +20,181 @@ static void test_benchmark_1() {
   h_benchmark_report(stderr, res);
 }
 
+// the packrat memo: keyed by (input position, parser), hashed bytewise
+static HHashValue cache_key_hash(const void* key) {
+  return h_djbhash(key, sizeof(HParserCacheKey));
+}
+static bool cache_key_equal(const void* key1, const void* key2) {
+  return memcmp(key1, key2, sizeof(HParserCacheKey)) == 0;
+}
+
+#define BENCH_NPARSERS 16
+#define BENCH_NPOS 4096
+
+static void test_benchmark_hashtable() {
+  HArena *arena = h_new_arena(&system_allocator, 0);
+  HParser parsers[BENCH_NPARSERS];
+  size_t n = BENCH_NPARSERS * BENCH_NPOS;
+  HParserCacheKey *keys = h_arena_malloc(arena, 2 * n * sizeof(HParserCacheKey));
+  memset(keys, 0, 2 * n * sizeof(HParserCacheKey));
+
+  // the second half of the keys are never inserted; they make up the misses
+  for(size_t i=0; i<2*n; i++) {
+    keys[i].input_pos.index = i / BENCH_NPARSERS;
+    keys[i].input_pos.length = BENCH_NPOS;
+    keys[i].parser = &parsers[i % BENCH_NPARSERS];
+  }
+
+  struct HStopWatch stopwatch;
+  int64_t insert_ns = 0, hit_ns = 0, miss_ns = 0;
+  size_t rounds = 0, wrong = 0;
+  do {
+    HHashTable *ht = h_hashtable_new(arena, cache_key_equal, cache_key_hash);
+
+    h_platform_stopwatch_reset(&stopwatch);
+    for(size_t i=0; i<n; i++)
+      h_hashtable_put(ht, &keys[i], &keys[i]);
+    insert_ns += h_platform_stopwatch_ns(&stopwatch);
+
+    h_platform_stopwatch_reset(&stopwatch);
+    for(size_t i=0; i<n; i++)
+      wrong += (h_hashtable_get(ht, &keys[i]) != &keys[i]);
+    hit_ns += h_platform_stopwatch_ns(&stopwatch);
+
+    h_platform_stopwatch_reset(&stopwatch);
+    for(size_t i=n; i<2*n; i++)
+      wrong += (h_hashtable_get(ht, &keys[i]) != NULL);
+    miss_ns += h_platform_stopwatch_ns(&stopwatch);
+
+    g_check_cmp_uint64(ht->used, ==, n);
+    h_hashtable_free(ht);
+    rounds++;
+  } while(insert_ns + hit_ns + miss_ns < 100000000);
+  g_check_cmp_uint64(wrong, ==, 0);
+
+  fprintf(stderr, "Hashtable, %zd cache keys: %.1f ns/insert, "
+          "%.1f ns/lookup (hit), %.1f ns/lookup (miss)\n", n,
+          (double)insert_ns / (rounds * n),
+          (double)hit_ns / (rounds * n),
+          (double)miss_ns / (rounds * n));
+  h_delete_arena(arena);
+}
+
+static void test_benchmark_rvm() {
+  // key=value pairs; one DFA state is too few for any input, so this
+  // times the RVM alone
+  HParser *word = h_many1(h_ch_range('a', 'z'));
+  HParser *value = h_choice(word, h_many1(h_ch_range('0', '9')), NULL);
+  HParser *pair = h_sequence(word, h_ch('='), value, NULL);
+  HParser *p = h_sepBy1(pair, h_in((uint8_t*)",; ", 3));
+  HRegexParams params = { false, 1 };
+  g_check_cmp_int(h_compile(p, PB_REGULAR, &params), ==, 0);
+
+  size_t len = 4096;
+  uint8_t *input = malloc(len);
+  for (size_t i = 0; i < len; i += 16)
+    memcpy(input + i, "name=value;n=42,", 16);
+  len--;
+
+  struct HStopWatch stopwatch;
+  int64_t ns = 0;
+  size_t rounds = 0;
+  h_platform_stopwatch_reset(&stopwatch);
+  do {
+    HParseResult *res = h_parse(p, input, len);
+    g_check_cmp_int64(res->bit_length, ==, len * 8);
+    h_parse_result_free(res);
+    rounds++;
+    ns = h_platform_stopwatch_ns(&stopwatch);
+  } while(ns < 100000000);
+
+  fprintf(stderr, "RVM, %zd bytes: %.1f ns/byte\n", len,
+          (double)ns / (rounds * len));
+  free(input);
+}
+
+static void test_benchmark_batch() {
+  HParser *word = h_many1(h_ch_range('a', 'z'));
+  HParser *pair = h_sequence(word, h_ch('='), h_many1(h_ch_range('0', '9')), NULL);
+  HParser *p = h_sepBy1(pair, h_ch(','));
+  g_check_cmp_int(h_compile(p, PB_LALR, NULL), ==, 0);
+
+  size_t n = 20000;
+  const uint8_t *msg = (uint8_t*)"alpha=1,beta=22,gamma=333,delta=4444";
+  const uint8_t **inputs = malloc(n * sizeof(uint8_t *));
+  size_t *lengths = malloc(n * sizeof(size_t));
+  HParseResult **results = malloc(n * sizeof(HParseResult *));
+  for(size_t i=0; i<n; i++) {
+    inputs[i] = msg;
+    lengths[i] = strlen((char*)msg);
+  }
+
+  for(size_t threads=1; threads<=4; threads*=4) {
+    HBenchmarkResults *stats = NULL;
+    HParseBatchParams params = { threads, &stats };
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    g_check_cmp_uint64(h_parse_batch(p, inputs, lengths, n, results, &params), ==, n);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for(size_t i=0; i<n; i++)
+      h_parse_result_free(results[i]);
+
+    fprintf(stderr, "Batch, %zd messages, %zd threads: %.0f messages/s\n", n, threads,
+            n / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9));
+    h_benchmark_report(stderr, stats);
+  }
+
+  free(inputs);
+  free(lengths);
+  free(results);
+}
+
+static void test_benchmark_bitwriter() {
+  // re-serializing a message: a header of odd-sized fields, then a payload
+  uint8_t payload[64];
+  for (size_t i = 0; i < sizeof(payload); i++)
+    payload[i] = i;
+  size_t nmsgs = 4096;
+  size_t msg_bytes = 12 + sizeof(payload);
+  uint8_t *out = malloc(nmsgs * msg_bytes);
+
+  for (int fixed = 0; fixed <= 1; fixed++) {
+    struct HStopWatch stopwatch;
+    int64_t ns = 0;
+    size_t rounds = 0;
+    h_platform_stopwatch_reset(&stopwatch);
+    do {
+      HBitWriter *w = fixed ? h_bit_writer_new_buffer(&system_allocator, out, nmsgs * msg_bytes)
+                            : h_bit_writer_new(&system_allocator);
+      for (size_t i = 0; i < nmsgs; i++) {
+        h_bit_writer_put(w, 4, 3);
+        h_bit_writer_put(w, i, 5);
+        h_bit_writer_put(w, i * 7, 12);
+        h_bit_writer_put(w, 0xA, 4);
+        h_bit_writer_put(w, i, 32);
+        h_bit_writer_put(w, i * 0x9E3779B97F4A7C15, 40);
+        h_bit_writer_put_bytes(w, payload, sizeof(payload));
+      }
+      size_t len;
+      h_bit_writer_get_buffer(w, &len);
+      g_check_cmp_uint64(len, ==, nmsgs * msg_bytes);
+      h_bit_writer_free(w);
+      rounds++;
+      ns = h_platform_stopwatch_ns(&stopwatch);
+    } while(ns < 100000000);
+
+    fprintf(stderr, "Bit writer, %zd %zd-byte messages%s: %.1f ns/message, %.0f MB/s\n",
+            nmsgs, msg_bytes, fixed ? " into a given buffer" : "",
+            (double)ns / (rounds * nmsgs),
+            (double)(rounds * nmsgs * msg_bytes) * 1000 / ns);
+  }
+  free(out);
+}
+
 void register_benchmark_tests(void) {
   g_test_add_func("/core/benchmark/1", test_benchmark_1);
+  g_test_add_func("/core/benchmark/hashtable", test_benchmark_hashtable);
+  g_test_add_func("/core/benchmark/rvm", test_benchmark_rvm);
+  g_test_add_func("/core/benchmark/batch", test_benchmark_batch);
+  g_test_add_func("/core/benchmark/bitwriter", test_benchmark_bitwriter);
 }
@@ -56,6 +56,53 @@ static void test_offset_largebits_le(void) {
   g_check_cmp_int32(h_read_bits(&is, 11, false), ==, 0x2D3);
 }
 
+// one bit at a time, straight from the definitions
+static uint64_t naive_read_bits(const uint8_t *buf, size_t *pos, int count, bool big) {
+  uint64_t out = 0;
+  for (int i = 0; i < count; i++, (*pos)++) {
+    uint8_t byte = buf[*pos / 8];
+    int bit = big ? (byte >> (7 - *pos % 8)) & 1 : (byte >> (*pos % 8)) & 1;
+    if (big)
+      out = out << 1 | bit;
+    else
+      out |= (uint64_t)bit << i;
+  }
+  return out;
+}
+
+static void test_bitreader_words(void) {
+  uint8_t buf[256];
+  for (size_t i = 0; i < sizeof(buf); i++)
+    buf[i] = (uint8_t)(i * 167 + 13);
+
+  for (int big = 0; big < 2; big++) {
+    HInputStream is = MK_INPUT_STREAM(buf, sizeof(buf),
+                                      big ? BIT_BIG_ENDIAN | BYTE_BIG_ENDIAN
+                                          : BIT_LITTLE_ENDIAN | BYTE_LITTLE_ENDIAN);
+    size_t pos = 0;
+    int count = 1;
+    // every width, at every bit offset, up to and past the end
+    while (!is.overrun) {
+      uint64_t expected = pos + count <= sizeof(buf) * 8
+        ? naive_read_bits(buf, &pos, count, big) : 0;
+      uint64_t got = h_read_bits(&is, count, false);
+      if (!is.overrun) {
+        g_check_cmp_uint64(got, ==, expected);
+        g_check_cmp_uint64(h_input_stream_pos(&is), ==, pos);
+      }
+      count = count % 64 + 1;
+    }
+  }
+
+  // aligned words, in both byte orders
+  HInputStream be = MK_INPUT_STREAM("\x81\x02\x03\x04\x05\x06\x07\x08", 8, BIT_BIG_ENDIAN | BYTE_BIG_ENDIAN);
+  g_check_cmp_int64(h_read_bits(&be, 16, true), ==, (int16_t)0x8102);
+  g_check_cmp_uint64(h_read_bits(&be, 16, false), ==, 0x0304);
+  g_check_cmp_uint64(h_read_bits(&be, 32, false), ==, 0x05060708);
+  HInputStream le = MK_INPUT_STREAM("\x01\x02\x03\x04\x05\x06\x07\x88", 8, BIT_BIG_ENDIAN | BYTE_LITTLE_ENDIAN);
+  g_check_cmp_int64(h_read_bits(&le, 64, true), ==, (int64_t)0x8807060504030201);
+}
+
 void register_bitreader_tests(void)  {
   g_test_add_func("/core/bitreader/be", test_bitreader_be);
   g_test_add_func("/core/bitreader/le", test_bitreader_le);
@@ -64,4 +111,5 @@ void register_bitreader_tests(void)  {
   g_test_add_func("/core/bitreader/offset-largebits-be", test_offset_largebits_be);
   g_test_add_func("/core/bitreader/offset-largebits-le", test_offset_largebits_le);
   g_test_add_func("/core/bitreader/ints", test_bitreader_ints);
+  g_test_add_func("/core/bitreader/words", test_bitreader_words);
 }
@@ -98,6 +98,65 @@ static void test_offset_largebits_le(void) {
   run_bitwriter_test(data, BIT_LITTLE_ENDIAN | BYTE_LITTLE_ENDIAN);
 }
 
+// every width, at every offset, and runs of bytes in between; enough
+// to fill the accumulator many times over
+static void run_bitwriter_mixed(char flags) {
+  HBitWriter *w = h_bit_writer_new(&system_allocator);
+  w->flags = flags;
+  uint64_t x = 0x9E3779B97F4A7C15;
+  const uint8_t run[] = "a run of bytes";
+  for (size_t n = 1; n <= 64; n++) {
+    h_bit_writer_put(w, x * n, n);
+    if (n % 8 == 0)
+      h_bit_writer_put_bytes(w, run, sizeof(run));
+  }
+  h_bit_writer_put(w, 0, 8 - (64 * 65 / 2) % 8);
+
+  size_t len;
+  const uint8_t *buf = h_bit_writer_get_buffer(w, &len);
+  HInputStream input = {
+    .input = buf,
+    .index = 0,
+    .length = len,
+    .bit_offset = 0,
+    .endianness = flags,
+    .overrun = 0
+  };
+  for (size_t n = 1; n <= 64; n++) {
+    uint64_t expect = n < 64 ? (x * n) & ((UINT64_C(1) << n) - 1) : x * n;
+    g_check_cmp_uint64((uint64_t)h_read_bits(&input, n, FALSE), ==, expect);
+    if (n % 8 == 0) {
+      for (size_t i = 0; i < sizeof(run); i++)
+        g_check_cmp_uint64((uint64_t)h_read_bits(&input, 8, FALSE), ==, run[i]);
+    }
+  }
+  h_bit_writer_free(w);
+}
+
+static void test_bitwriter_mixed_be(void) {
+  run_bitwriter_mixed(BIT_BIG_ENDIAN | BYTE_BIG_ENDIAN);
+}
+
+static void test_bitwriter_mixed_le(void) {
+  run_bitwriter_mixed(BIT_LITTLE_ENDIAN | BYTE_LITTLE_ENDIAN);
+}
+
+static void test_bitwriter_buffer(void) {
+  uint8_t buf[6];
+  size_t len;
+  HBitWriter *w = h_bit_writer_new_buffer(&system_allocator, buf, sizeof(buf));
+  h_bit_writer_put(w, 0x3, 4);
+  h_bit_writer_put(w, 0xA, 4);
+  h_bit_writer_put_bytes(w, (uint8_t *)"bcde", 4);
+  h_bit_writer_put(w, 0xFF, 8);
+  g_check_cmp_int(h_bit_writer_get_buffer(w, &len) == buf, ==, 1);
+  g_check_cmp_uint64(len, ==, 6);
+  g_check_bytes(6, buf, ==, (uint8_t *)"\x3a" "bcde\xff");
+  h_bit_writer_put(w, 1, 8);
+  g_check_cmp_int(h_bit_writer_get_buffer(w, &len) == NULL, ==, 1);
+  h_bit_writer_free(w);
+}
+
 void register_bitwriter_tests(void) {
   g_test_add_func("/core/bitwriter/be", test_bitwriter_be);
   g_test_add_func("/core/bitwriter/le", test_bitwriter_le);
@@ -106,4 +165,7 @@ void register_bitwriter_tests(void) {
   g_test_add_func("/core/bitwriter/offset-largebits-be", test_offset_largebits_be);
   g_test_add_func("/core/bitwriter/offset-largebits-le", test_offset_largebits_le);
   g_test_add_func("/core/bitwriter/ints", test_bitwriter_ints);
+  g_test_add_func("/core/bitwriter/mixed-be", test_bitwriter_mixed_be);
+  g_test_add_func("/core/bitwriter/mixed-le", test_bitwriter_mixed_le);
+  g_test_add_func("/core/bitwriter/buffer", test_bitwriter_buffer);
 }
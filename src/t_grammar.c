@@ -1,4 +1,5 @@
 #include <glib.h>
+#include <string.h>
 #include "hammer.h"
 #include "internal.h"
 #include "cfgrammar.h"
@@ -37,7 +38,105 @@ static void test_example_1(void) {
   g_check_followset_present(1, g, c, "y");
 }
 
+static void test_follow_2(void) {
+  // two uses of x whose followers start alike; neither may hide the other
+  HParser *x = h_optional(h_sequence(h_ch('a'), h_ch('b'), NULL));
+  HParser *p = h_choice(h_sequence(h_ch('x'), x, h_ch('a'), h_ch('b'), NULL),
+                        h_sequence(h_ch('y'), x, h_ch('a'), h_ch('c'), NULL),
+                        NULL);
+  HCFGrammar *g = h_cfgrammar(&system_allocator, p);
+
+  g_check_followset_present(2, g, x, "ab");
+  g_check_followset_present(2, g, x, "ac");
+  g_check_followset_absent(2, g, x, "aa");
+
+  // so the choice inside x can't be made on two characters
+  g_check_cmp_int(h_compile(p, PB_LLk, (void *)2), ==, -1);
+  g_check_cmp_int(h_compile(p, PB_LLk, (void *)3), ==, 0);
+  HParseResult *res = h_parse(p, (const uint8_t *)"xab", 3);
+  g_check_cmp_int(res != NULL, ==, 1);
+  if (res)
+    h_parse_result_free(res);
+}
+
+static void lookahead_check(const HLookaheadTable *t, uint32_t root,
+                            const HStringMap *m, const char *str, size_t len,
+                            bool last) {
+  HInputStream input = {
+    .input = (const uint8_t *)str,
+    .length = len,
+    .endianness = BIT_BIG_ENDIAN | BYTE_BIG_ENDIAN,
+    .last_chunk = last
+  };
+  g_check_inttype("%p", void *, h_lookahead_get(t, root, input), ==,
+                  h_stringmap_get_lookahead(m, input));
+}
+
+static void test_lookahead(void) {
+  HArena *arena = h_new_arena(&system_allocator, 0);
+  int v[4];
+
+  // {"ab" -> v0, "ac" -> v1, "b" -> v2, "a$" -> v3}
+  HStringMap *m = h_stringmap_new(arena);
+  HStringMap *a = h_stringmap_new(arena);
+  h_stringmap_put_char(a, 'b', &v[0]);
+  h_stringmap_put_char(a, 'c', &v[1]);
+  h_stringmap_put_end(a, &v[3]);
+  h_stringmap_put_after(m, 'a', a);
+  h_stringmap_put_char(m, 'b', &v[2]);
+
+  // once with a node per byte, once with classes {a}, {b}, {c}, rest
+  uint8_t classes[256];
+  unsigned int set[256 / (sizeof(unsigned int) * 8)];
+  size_t n = 1;
+  h_byte_classes_init(classes);
+  for(const char *c = "abc"; *c; c++) {
+    memset(set, 0, sizeof(set));
+    charset_set(set, *c, 1);
+    n = h_byte_classes_refine(classes, n, set);
+  }
+  g_check_cmp_uint32(n, ==, 4);
+
+  for(int i=0; i<2; i++) {
+    HLookaheadTable *t = i? h_lookahead_new(arena, classes, n)
+                          : h_lookahead_new(arena, NULL, 0);
+    uint32_t root = h_lookahead_add(t, m);
+    g_check_cmp_uint32(root, !=, 0);
+    g_check_cmp_uint32(h_lookahead_add(t, m), ==, root);
+
+    lookahead_check(t, root, m, "ab", 2, true);
+    lookahead_check(t, root, m, "acx", 3, true);
+    lookahead_check(t, root, m, "b", 1, true);
+    lookahead_check(t, root, m, "a", 1, true);
+    lookahead_check(t, root, m, "a", 1, false);   // NEED_INPUT
+    lookahead_check(t, root, m, "ad", 2, true);
+    lookahead_check(t, root, m, "", 0, true);
+    lookahead_check(t, root, m, "x", 1, true);
+  }
+
+  h_delete_arena(arena);
+}
+
+static void test_byte_classes(void) {
+  HParser *p = h_many(h_choice(h_ch_range('0', '9'), h_ch('x'),
+                               h_in((uint8_t *)"xyz", 3), NULL));
+  HCFGrammar *g = h_cfgrammar(&system_allocator, p);
+  uint8_t classes[256];
+
+  // digits, 'x', 'y' and 'z', everything else
+  g_check_cmp_uint32(h_cfgrammar_byte_classes(g, classes), ==, 4);
+  g_check_cmp_uint32(classes['0'], ==, classes['9']);
+  g_check_cmp_uint32(classes['y'], ==, classes['z']);
+  g_check_cmp_uint32(classes['x'], !=, classes['y']);
+  g_check_cmp_uint32(classes['a'], ==, classes[0xff]);
+  g_check_cmp_uint32(classes['a'], !=, classes['0']);
+  h_cfgrammar_free(g);
+}
+
 void register_grammar_tests(void) {
   g_test_add_func("/core/grammar/end", test_end);
   g_test_add_func("/core/grammar/example_1", test_example_1);
+  g_test_add_func("/core/grammar/follow_2", test_follow_2);
+  g_test_add_func("/core/grammar/lookahead", test_lookahead);
+  g_test_add_func("/core/grammar/byte_classes", test_byte_classes);
 }
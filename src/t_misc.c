@@ -3,6 +3,11 @@
 #include <sys/resource.h>
 #include "test_suite.h"
 #include "hammer.h"
+#include "glue.h"
+#include "platform.h"
+#ifdef HAMMER_HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 static void test_tt_user(void) {
   g_check_cmp_int32(TT_USER, >, TT_NONE);
@@ -76,8 +81,479 @@ static void test_oom(void) {
   //XXX g_check_parse_chunks_failed__m(mm__, p, PB_GLR, "",0, "x",1);
 }
 
+static void test_hashtable(void) {
+  HArena *arena = h_new_arena(&system_allocator, 0);
+  HHashTable *ht = h_hashtable_new(arena, h_eq_ptr, h_hash_ptr);
+  uintptr_t n = 1000;
+
+  // keys that all collide in their home slot, plus a run of ordinary ones
+  for(uintptr_t i=1; i<=n; i++) {
+    h_hashtable_put(ht, (void *)(i << 20), (void *)i);
+    h_hashtable_put(ht, (void *)(i << 4), (void *)(i+n));
+  }
+  g_check_cmp_uint64(ht->used, ==, 2*n);
+  h_hashtable_put(ht, (void *)(1 << 20), (void *)42);      // overwrite
+  g_check_cmp_uint64(ht->used, ==, 2*n);
+  g_check_cmp_uint64((uintptr_t)h_hashtable_get(ht, (void *)(1 << 20)), ==, 42);
+
+  // delete every other key; the rest must stay reachable
+  for(uintptr_t i=1; i<=n; i+=2) {
+    h_hashtable_del(ht, (void *)(i << 20));
+    h_hashtable_del(ht, (void *)(i << 4));
+  }
+  g_check_cmp_uint64(ht->used, ==, n);
+  for(uintptr_t i=2; i<=n; i+=2) {
+    g_check_cmp_uint64((uintptr_t)h_hashtable_get(ht, (void *)(i << 20)), ==, i);
+    g_check_cmp_uint64((uintptr_t)h_hashtable_get(ht, (void *)(i << 4)), ==, i+n);
+    g_check_cmp_int(h_hashtable_present(ht, (void *)((i-1) << 20)), ==, false);
+    g_check_cmp_int(h_hashtable_present(ht, (void *)((i-1) << 4)), ==, false);
+  }
+
+  h_delete_arena(arena);
+}
+
+// many threads registering token types, compiling parsers with shared
+// parts, and parsing and printing results with user token types, all at once
+#define STRESS_THREADS 8
+#define STRESS_TYPES 64
+
+typedef struct {
+  int n;
+  HParser *common;      // compiled for LALR by every thread
+  HParser *shared;      // part of every thread's own parser
+  HTokenType ids[STRESS_TYPES];
+  int failures;
+} StressThread;
+
+static void unamb_dot(const HParsedToken *tok, struct result_buf *buf) {
+  h_append_buf(buf, "dot", 3);
+}
+
+static HParsedToken *act_dot(const HParseResult *p, void *user_data) {
+  return h_make(p->arena, *(HTokenType *)user_data, NULL);
+}
+
+static void stress_thread(void *arg) {
+  StressThread *t = arg;
+  char name[64];
+
+  // register the same names as all the other threads, in a different order
+  for(int i=0; i<STRESS_TYPES; i++) {
+    int k = (i * 7 + t->n) % STRESS_TYPES;
+    snprintf(name, sizeof(name), "com.upstandinghackers.test.stress_%d", k);
+    t->ids[k] = h_allocate_token_new(name, unamb_dot);
+    t->failures += (h_get_token_type_number(name) != t->ids[k]);
+    t->failures += (strcmp(h_get_token_type_name(t->ids[k]), name) != 0);
+  }
+
+  HParser *p = h_sequence(t->shared, h_action(h_ch('.'), act_dot, &t->ids[t->n]), NULL);
+  HParserBackend backend = t->n % 2 ? PB_LALR : PB_LLk;
+  t->failures += (h_compile(p, backend, NULL) != 0);
+  t->failures += (h_compile(t->common, PB_LALR, NULL) != 0);
+
+  for(int i=0; i<200; i++) {
+    HParseResult *r = h_parse(p, (uint8_t*)"abcaa.", 6);
+    char *s = r ? h_write_result_unamb(r->ast) : NULL;
+    t->failures += (s == NULL || strcmp(s, "((u0x61 (u0x62 u0x63) u0x61 u0x61) {dot})") != 0);
+    free(s);
+    h_parse_result_free(r);
+
+    r = h_parse(t->common, (uint8_t*)"1+2+3", 5);
+    t->failures += (r == NULL || r->bit_length != 40);
+    h_parse_result_free(r);
+  }
+}
+
+static void test_threads(void) {
+  HParser *d = h_ch_range('0', '9');
+  HParser *sum = h_indirect();
+  h_bind_indirect(sum, h_choice(h_sequence(sum, h_ch('+'), d, NULL), d, NULL));
+  HParser *shared = h_many1(h_choice(h_ch('a'),
+                                     h_sequence(h_ch('b'), h_ch('c'), NULL), NULL));
+
+  StressThread threads[STRESS_THREADS];
+  HThread *handles[STRESS_THREADS];
+  memset(threads, 0, sizeof(threads));
+  for(int i=0; i<STRESS_THREADS; i++) {
+    threads[i].n = i;
+    threads[i].common = sum;
+    threads[i].shared = shared;
+    handles[i] = h_platform_thread_start(stress_thread, &threads[i]);
+    g_check_cmp_int(handles[i] != NULL, ==, 1);
+  }
+  for(int i=0; i<STRESS_THREADS; i++)
+    h_platform_thread_join(handles[i]);
+
+  for(int i=0; i<STRESS_THREADS; i++) {
+    g_check_cmp_int(threads[i].failures, ==, 0);
+    for(int k=0; k<STRESS_TYPES; k++)
+      g_check_cmp_int32(threads[i].ids[k], ==, threads[0].ids[k]);
+  }
+}
+
+static void test_arena(void) {
+  HArena *arena = h_new_arena(&system_allocator, 0);
+  HArenaStats stats;
+
+  // freed small objects are handed out again
+  HParsedToken *a = h_arena_malloc(arena, sizeof(HParsedToken));
+  HParsedToken *b = h_arena_malloc(arena, sizeof(HParsedToken));
+  h_arena_free_sized(arena, a, sizeof(HParsedToken));
+  g_check_cmp_int(h_arena_malloc(arena, sizeof(HParsedToken)) == a, ==, 1);
+
+  // so is the latest allocation, whatever its size
+  void *c = h_arena_malloc(arena, 300);
+  h_arena_free_sized(arena, c, 300);
+  g_check_cmp_int(h_arena_malloc(arena, 200) == c, ==, 1);
+  h_arena_free_sized(arena, b, sizeof(HParsedToken));
+
+  // oversized allocations go back to the system
+  h_allocator_stats(arena, &stats);
+  size_t used = stats.used;
+  size_t wasted = stats.wasted;
+  void *big = h_arena_malloc(arena, 100000);
+  h_allocator_stats(arena, &stats);
+  g_check_cmp_uint64(stats.used, >=, used + 100000);
+  h_arena_free_sized(arena, big, 100000);
+  h_allocator_stats(arena, &stats);
+  g_check_cmp_uint64(stats.used, ==, used);
+  g_check_cmp_uint64(stats.wasted, ==, wasted);
+
+  // blocks grow, and all of them stay usable after a reset
+  for(int i=0; i<100000; i++)
+    h_slist_push(h_slist_new(arena), NULL);
+  h_arena_reset(arena);
+  h_allocator_stats(arena, &stats);
+  g_check_cmp_uint64(stats.used, ==, 0);
+  uint8_t *z = h_arena_malloc0(arena, 1000);
+  for(int i=0; i<1000; i++)
+    g_check_cmp_int(z[i], ==, 0);
+  h_delete_arena(arena);
+}
+
+static void test_arena_rewind(void) {
+  HArena *arena = h_new_arena(&system_allocator, 0);
+  HArenaStats stats;
+  HArenaMark outer, inner;
+
+  void *keep = h_arena_malloc(arena, 100);
+  h_arena_mark(arena, &outer);
+  void *first = h_arena_malloc(arena, 100);
+  h_allocator_stats(arena, &stats);
+  size_t used = stats.used;
+
+  // everything since the mark goes: bump space, grown blocks, large blocks
+  h_arena_mark(arena, &inner);
+  for(int i=0; i<10000; i++)
+    h_arena_malloc(arena, 40);
+  h_arena_malloc(arena, 100000);
+  h_arena_free_sized(arena, first, 100);
+  h_arena_rewind(arena, &inner);
+  h_allocator_stats(arena, &stats);
+  g_check_cmp_uint64(stats.used, ==, used);
+
+  // the freed chunk went with it; older allocations stay put
+  h_arena_rewind(arena, &outer);
+  g_check_cmp_int(h_arena_malloc(arena, 100) == first, ==, 1);
+  g_check_cmp_int(first > keep, ==, 1);
+  h_delete_arena(arena);
+}
+
+static void check_same_node(HNode a, HNode b) {
+  g_check_cmp_int(h_node_type(a), ==, h_node_type(b));
+  if (h_node_type(a) == TT_INVALID)
+    return;
+  g_check_cmp_uint64(h_node_index(a), ==, h_node_index(b));
+  g_check_cmp_uint64(h_node_bit_length(a), ==, h_node_bit_length(b));
+  g_check_cmp_int(h_node_bit_offset(a), ==, h_node_bit_offset(b));
+  switch (h_node_type(a)) {
+  case TT_BYTES:
+    g_check_cmp_uint64(h_node_bytes(a).len, ==, h_node_bytes(b).len);
+    g_check_cmp_int(memcmp(h_node_bytes(a).token, h_node_bytes(b).token, h_node_bytes(a).len), ==, 0);
+    break;
+  case TT_SINT:
+    g_check_cmp_int64(h_node_sint(a), ==, h_node_sint(b));
+    break;
+  case TT_UINT:
+    g_check_cmp_uint64(h_node_uint(a), ==, h_node_uint(b));
+    break;
+  case TT_SEQUENCE:
+    g_check_cmp_uint64(h_node_seq_len(a), ==, h_node_seq_len(b));
+    for (size_t i = 0; i < h_node_seq_len(a); i++)
+      check_same_node(h_node_seq_index(a, i), h_node_seq_index(b, i));
+    break;
+  default:
+    if (h_node_type(a) >= TT_USER)
+      g_check_cmp_int(*(int *)h_node_user(a), ==, *(int *)h_node_user(b));
+    break;
+  }
+}
+
+static HParsedToken *act_compact_user(const HParseResult *p, void *user_data) {
+  int *v = h_arena_malloc(p->arena, sizeof(int));
+  *v = p->ast->uint;
+  return h_make(p->arena, *(HTokenType *)user_data, v);
+}
+
+static void test_compact(void) {
+  HTokenType tt = h_allocate_token_type("com.upstandinghackers.test.compact");
+  HParser *item = h_choice(h_token((uint8_t *)"ab", 2),
+                           h_ch_range('0', '9'),
+                           h_sequence(h_ch('-'), h_int8(), NULL),
+                           h_action(h_ch('u'), act_compact_user, &tt),
+                           NULL);
+  HParser *p = h_sequence(h_many(item), h_optional(h_ch('!')), h_end_p(), NULL);
+
+  const uint8_t *input = (uint8_t *)"ab1-\xffu-\x05" "ab9u";
+  size_t len = strlen((char *)input);
+  HParseResult *res = h_parse(p, input, len);
+  HCompactResult *cres = h_compact_result(res);
+  g_check_cmp_uint64(cres->ntokens, ==, 15);
+  g_check_cmp_int64(cres->bit_length, ==, res->bit_length);
+  check_same_node(h_node(res->ast), h_compact_root(cres));
+
+  // elements of a sequence are adjacent
+  const HCompactToken *items = &cres->tokens[cres->tokens[0].data.first];
+  g_check_cmp_int(items->token_type, ==, TT_SEQUENCE);
+  g_check_cmp_uint64(items->len, ==, 8);
+  g_check_cmp_int(cres->tokens[items->data.first + 2].token_type, ==, TT_SEQUENCE);
+  g_check_cmp_int(cres->tokens[items->data.first + 3].token_type, ==, tt);
+
+  // without the tree, user payloads are still there
+  HCompactResult *cres2 = h_parse_compact(p, input, len);
+  check_same_node(h_compact_root(cres2), h_compact_root(cres));
+  h_compact_result_free(cres2);
+  h_compact_result_free(cres);
+  h_parse_result_free(res);
+
+  g_check_cmp_int(h_compact_root(h_parse_compact(p, (uint8_t *)"ab!!", 4)).compact == NULL, ==, 1);
+  cres = h_parse_compact(h_end_p(), input, 0);
+  g_check_cmp_uint64(cres->ntokens, ==, 0);
+  g_check_cmp_int(h_node_type(h_compact_root(cres)), ==, TT_INVALID);
+  h_compact_result_free(cres);
+
+  // a long flat result takes much less room than its tree
+  HParser *digits = h_many(h_sequence(h_ch_range('0', '9'), h_ch(','), NULL));
+  size_t n = 20000;
+  uint8_t *buf = malloc(2 * n);
+  for (size_t i = 0; i < n; i++)
+    memcpy(buf + 2 * i, "7,", 2);
+  res = h_parse(digits, buf, 2 * n);
+  HArenaStats stats;
+  h_allocator_stats(res->arena, &stats);
+  cres = h_compact_result(res);
+  g_check_cmp_uint64(cres->ntokens, ==, 3 * n + 1);
+  g_check_cmp_uint64(cres->ntokens * sizeof(HCompactToken) * 3, <, stats.used);
+  h_compact_result_free(cres);
+  h_parse_result_free(res);
+  free(buf);
+}
+
+static void test_compact_serialize(void) {
+  HParser *item = h_choice(h_token((uint8_t *)"ab", 2),
+                           h_ch_range('0', '9'),
+                           h_sequence(h_ch('-'), h_int8(), NULL),
+                           NULL);
+  HParser *p = h_sequence(h_many(item), h_optional(h_ch('!')), NULL);
+  const uint8_t *input = (uint8_t *)"ab1-\xff-\x05" "ab9";
+  size_t len = strlen((char *)input);
+
+  HParseResult *res = h_parse(p, input, len);
+  HCompactResult *cres = h_compact_result(res);
+  size_t slen;
+  uint8_t *data = h_compact_result_serialize(cres, &slen);
+  HCompactResult view;
+  g_check_cmp_int(h_compact_result_view(&view, data, slen), ==, true);
+  g_check_cmp_uint64(view.ntokens, ==, cres->ntokens);
+  g_check_cmp_int64(view.bit_length, ==, res->bit_length);
+  check_same_node(h_node(res->ast), h_compact_root(&view));
+
+  // anything that doesn't add up is turned away
+  g_check_cmp_int(h_compact_result_view(&view, data, slen - 1), ==, false);
+  uint64_t *copy = malloc(slen + 8);
+  memcpy((uint8_t *)copy + 1, data, slen);
+  g_check_cmp_int(h_compact_result_view(&view, (uint8_t *)copy + 1, slen), ==, false);
+  memcpy(copy, data, slen);
+  HCompactToken *tokens = (HCompactToken *)((uint8_t *)copy + slen - cres->nbytes) - cres->ntokens;
+  tokens[0].data.first = 0;     // the root, inside itself
+  g_check_cmp_int(h_compact_result_view(&view, (uint8_t *)copy, slen), ==, false);
+  memcpy(copy, data, slen);
+  ((uint8_t *)copy)[0] ^= 1;
+  g_check_cmp_int(h_compact_result_view(&view, (uint8_t *)copy, slen), ==, false);
+  free(copy);
+  free(data);
+  h_compact_result_free(cres);
+  h_parse_result_free(res);
+
+  // user payloads can't be serialized
+  HTokenType tt = h_allocate_token_type("com.upstandinghackers.test.compact");
+  cres = h_parse_compact(h_action(h_ch('u'), act_compact_user, &tt), (uint8_t *)"u", 1);
+  g_check_cmp_int(h_compact_result_serialize(cres, &slen) == NULL, ==, 1);
+  h_compact_result_free(cres);
+}
+
+static void unamb_big(const HParsedToken *tok, struct result_buf *buf) {
+  for (int i = 0; i < 1000; i++)
+    h_append_buf(buf, "0123456789", 10);
+}
+
+static void test_unamb_writer(void) {
+  HArena *arena = h_new_arena(&system_allocator, 0);
+  HParsedToken *seq = h_make_seq(arena);
+  h_seq_snoc(seq, h_make_uint(arena, 0));
+  h_seq_snoc(seq, h_make_uint(arena, UINT64_MAX));
+  h_seq_snoc(seq, h_make_sint(arena, INT64_MIN));
+  h_seq_snoc(seq, h_make_sint(arena, 26));
+  h_seq_snoc(seq, h_make_bytes(arena, (uint8_t *)"\x00\xfe", 2));
+  h_seq_snoc(seq, h_make_bytes(arena, NULL, 0));
+  HParsedToken *none = h_make_uint(arena, 0);
+  none->token_type = TT_NONE;
+  h_seq_snoc(seq, none);
+  h_seq_snoc(seq, NULL);
+  char *s = h_write_result_unamb(seq);
+  g_check_string(s, ==, "(u0 u0xffffffffffffffff s-0x8000000000000000 s0x1a <00.fe> <> null NULL)");
+  free(s);
+
+  // a reused buffer, and a stream, give the same text, however big
+  uint8_t *bytes = h_arena_malloc(arena, 3000);
+  for (int i = 0; i < 3000; i++)
+    bytes[i] = i;
+  h_seq_snoc(seq, h_make_bytes(arena, bytes, 3000));
+  HTokenType tt = h_allocate_token_new("com.upstandinghackers.test.unamb_big", unamb_big);
+  h_seq_snoc(seq, h_make(arena, tt, NULL));
+  s = h_write_result_unamb(seq);
+  g_check_cmp_uint64(strlen(s), >, 19000);
+  struct result_buf buf = { NULL, 0, 0, NULL, false };
+  for (int i = 0; i < 2; i++) {
+    buf.len = 0;
+    g_check_cmp_int(h_append_result_unamb(&buf, seq), ==, true);
+    g_check_string(buf.output, ==, s);
+  }
+  free(buf.output);
+  FILE *f = tmpfile();
+  g_check_cmp_int(h_fprint_result_unamb(f, seq), ==, true);
+  size_t n = ftell(f);
+  g_check_cmp_uint64(n, ==, strlen(s));
+  char *back = malloc(n + 1);
+  rewind(f);
+  back[fread(back, 1, n, f)] = 0;
+  g_check_string(back, ==, s);
+  fclose(f);
+
+  // a caller's streaming buffer, smaller than most of what goes through it
+  char small[32];
+  size_t sizes[] = { sizeof(small), 1 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    f = tmpfile();
+    struct result_buf sbuf = { small, 0, sizes[i], f, false };
+    g_check_cmp_int(h_append_result_unamb(&sbuf, seq), ==, true);
+    fwrite(small, 1, sbuf.len, f);
+    g_check_cmp_uint64(ftell(f), ==, n);
+    rewind(f);
+    back[fread(back, 1, n, f)] = 0;
+    g_check_string(back, ==, s);
+    fclose(f);
+  }
+
+  // a stream that can't be written to fails the call, even when the
+  // user's printer is the one that runs into it
+  f = fopen("/dev/null", "r");
+  HParsedToken *big = h_make(arena, tt, NULL);
+  struct result_buf sbuf = { small, 0, sizeof(small), f, false };
+  g_check_cmp_int(h_append_result_unamb(&sbuf, big), ==, false);
+  g_check_cmp_int(sbuf.error, ==, true);
+  g_check_cmp_int(h_fprint_result_unamb(f, seq), ==, false);
+  fclose(f);
+  free(back);
+  free(s);
+  h_delete_arena(arena);
+}
+
+static char *base64_encode(const uint8_t *data, size_t len) {
+  static const char digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char *out = malloc(len / 3 * 4 + len / 54 + 8);
+  char *o = out;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t v = data[i] << 16 | (i+1 < len ? data[i+1] << 8 : 0) | (i+2 < len ? data[i+2] : 0);
+    *o++ = digits[v >> 18];
+    *o++ = digits[(v >> 12) & 63];
+    *o++ = i+1 < len ? digits[(v >> 6) & 63] : '=';
+    *o++ = i+2 < len ? digits[v & 63] : '=';
+    if (i % 54 == 51)
+      *o++ = '\n';
+  }
+  *o = 0;
+  return out;
+}
+
+static void test_input_source(void) {
+  size_t len = 100000;
+  uint8_t *plain = malloc(len);
+  for (size_t i = 0; i < len; i++)
+    plain[i] = '0' + i % 10;
+  char *encoded = base64_encode(plain, len);
+  HParser *p = h_sequence(h_many(h_ch_range('0', '9')), h_end_p(), NULL);
+
+  HParserBackend backends[] = { PB_PACKRAT, PB_REGULAR, PB_LLk, PB_LALR };
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    g_check_cmp_int(h_compile(p, backends[i], NULL), ==, 0);
+    HInputSource *src = h_input_base64(h_input_buffer((uint8_t *)encoded, strlen(encoded)));
+    HParseResult *res = h_parse_source(p, src);
+    h_input_source_free(src);
+    g_check_cmp_int64(res->bit_length, ==, len * 8);
+    g_check_cmp_uint64(res->ast->seq->elements[0]->seq->used, ==, len);
+    h_parse_result_free(res);
+  }
+
+  // buffers go to h_parse directly, so any backend will do
+  g_check_cmp_int(h_compile(p, PB_GLR, NULL), ==, 0);
+  HInputSource *src = h_input_buffer(plain, len);
+  HParseResult *res = h_parse_source(p, src);
+  h_input_source_free(src);
+  g_check_cmp_int64(res->bit_length, ==, len * 8);
+  h_parse_result_free(res);
+  h_compile(p, PB_PACKRAT, NULL);
+
+  encoded[1000] = '*';
+  src = h_input_base64(h_input_buffer((uint8_t *)encoded, strlen(encoded)));
+  g_check_cmp_int(h_parse_source(p, src) == NULL, ==, 1);
+  h_input_source_free(src);
+
+#ifdef HAMMER_HAVE_ZLIB
+  // base64 of zlib, two layers
+  uLongf zlen = compressBound(len);
+  uint8_t *z = malloc(zlen);
+  g_check_cmp_int(compress(z, &zlen, plain, len), ==, Z_OK);
+  free(encoded);
+  encoded = base64_encode(z, zlen);
+  src = h_input_inflate(h_input_base64(h_input_buffer((uint8_t *)encoded, strlen(encoded))));
+  res = h_parse_source(p, src);
+  h_input_source_free(src);
+  g_check_cmp_int64(res->bit_length, ==, len * 8);
+  h_parse_result_free(res);
+
+  // cut short
+  src = h_input_inflate(h_input_buffer(z, zlen / 2));
+  g_check_cmp_int(h_parse_source(p, src) == NULL, ==, 1);
+  h_input_source_free(src);
+  free(z);
+#endif
+
+  free(encoded);
+  free(plain);
+}
+
 void register_misc_tests(void) {
   g_test_add_func("/core/misc/tt_user", test_tt_user);
   g_test_add_func("/core/misc/tt_registry", test_tt_registry);
   g_test_add_func("/core/misc/oom", test_oom);
+  g_test_add_func("/core/misc/hashtable", test_hashtable);
+  g_test_add_func("/core/misc/threads", test_threads);
+  g_test_add_func("/core/misc/arena", test_arena);
+  g_test_add_func("/core/misc/arena_rewind", test_arena_rewind);
+  g_test_add_func("/core/misc/compact", test_compact);
+  g_test_add_func("/core/misc/compact_serialize", test_compact_serialize);
+  g_test_add_func("/core/misc/unamb_writer", test_unamb_writer);
+  g_test_add_func("/core/misc/input_source", test_input_source);
 }
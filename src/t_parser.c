@@ -1,10 +1,12 @@
 #include <glib.h>
 #include <string.h>
+#include <unistd.h>
 #include "hammer.h"
 #include "glue.h"
 #include "internal.h"
 #include "test_suite.h"
 #include "parsers/parser_internal.h"
+#include "cfgrammar.h"
 
 static void test_token(gconstpointer backend) {
   const HParser *token_ = h_token((const uint8_t*)"95\xa2", 3);
@@ -435,6 +437,61 @@ static void test_leftrec_ne(gconstpointer backend) {
   g_check_parse_failed(lr_, (HParserBackend)GPOINTER_TO_INT(backend), "", 0);
 }
 
+static void test_llk_transform(void) {
+  HParser *d = h_ch_range('0', '9');
+  HParser *e = h_indirect();
+  HParser *t = h_indirect();
+  HParser *f = h_choice(h_sequence(h_ch('('), e, h_ch(')'), NULL), d, NULL);
+  h_bind_indirect(e, h_choice(h_sequence(e, h_ch('+'), t, NULL), t, NULL));
+  h_bind_indirect(t, h_choice(h_sequence(t, h_ch('*'), f, NULL), f, NULL));
+  HParser *expr = h_sequence(e, h_end_p(), NULL);
+
+  g_check_parse_match(expr, PB_LLk, "1", 1, "(u0x31)");
+  g_check_parse_match(expr, PB_LLk, "1+2*3+4", 7, "(((u0x31 u0x2b (u0x32 u0x2a u0x33)) u0x2b u0x34))");
+  g_check_parse_match(expr, PB_LLk, "(1+2)*3", 7, "(((u0x28 (u0x31 u0x2b u0x32) u0x29) u0x2a u0x33))");
+  g_check_parse_failed(expr, PB_LLk, "1+", 2);
+
+  // common prefixes, factored out internally
+  HParser *kv = h_choice(h_sequence(h_ch('k'), h_ch('='), d, NULL),
+                         h_sequence(h_ch('k'), h_ch(':'), d, NULL), NULL);
+  g_check_parse_match(h_many(kv), PB_LLk, "k=1k:2", 6, "((u0x6b u0x3d u0x31) (u0x6b u0x3a u0x32))");
+}
+
+static void test_llk_leftrec_ops(void) {
+  // several left recursive alternatives, each its own sequence
+  HParser *e = h_indirect();
+  HParser *t = h_choice(h_sequence(h_ch('('), e, h_ch(')'), NULL), h_ch_range('0', '9'), NULL);
+  h_bind_indirect(e, h_choice(h_sequence(e, h_ch('+'), t, NULL),
+                              h_sequence(e, h_ch('*'), t, NULL),
+                              h_sequence(e, h_ch('!'), NULL),
+                              t, NULL));
+  HParser *expr = h_sequence(e, h_end_p(), NULL);
+  const char *inputs[] = { "1", "1+2", "1*2!+3", "(1+2)*(3*4!)!!", "1!*(2+(3))+4" };
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    const uint8_t *input = (const uint8_t*)inputs[i];
+    size_t len = strlen(inputs[i]);
+    h_compile(expr, PB_PACKRAT, NULL);
+    HParseResult *res = h_parse(expr, input, len);
+    char *expected = h_write_result_unamb(res->ast);
+    h_parse_result_free(res);
+    for (uintptr_t k = 1; k <= 2; k++) {
+      g_check_cmp_int(h_compile(expr, PB_LLk, (void *)k), ==, 0);
+      res = h_parse(expr, input, len);
+      if (!res) {
+        g_test_message("LL(%d) parse of %s failed", (int)k, inputs[i]);
+        g_test_fail();
+        continue;
+      }
+      char *actual = h_write_result_unamb(res->ast);
+      g_check_string(actual, ==, expected);
+      free(actual);
+      h_parse_result_free(res);
+    }
+    free(expected);
+  }
+  g_check_parse_failed(expr, PB_LLk, "1+*2", 4);
+}
+
 static void test_rightrec(gconstpointer backend) {
   HParser *a_ = h_ch('a');
 
@@ -535,6 +592,30 @@ static void test_iterative_result_length(gconstpointer backend) {
   g_check_cmp_int64(r->bit_length, ==, 48);
 }
 
+static void test_iterative_end(gconstpointer backend) {
+  // the parse can end before the last chunk, even before the one that
+  // shows it has ended
+  HParserBackend be = (HParserBackend)GPOINTER_TO_INT(backend);
+  HParser *p;
+
+  p = h_many(h_ch('a'));
+  g_check_parse_chunks_match(p, be, "aa",2, "ab",2, "(u0x61 u0x61 u0x61)");
+
+  p = h_choice(h_token((uint8_t*)"abcd", 4), h_ch('a'), NULL);
+  g_check_parse_chunks_match(p, be, "ab",2, "cd",2, "<61.62.63.64>");
+  g_check_parse_chunks_match(p, be, "ab",2, "cx",2, "u0x61");
+  HSuspendedParser *s = h_parse_start(p);
+  g_check_cmp_int(h_parse_chunk(s, (uint8_t*)"ab", 2), ==, 0);
+  g_check_cmp_int(h_parse_chunk(s, (uint8_t*)"cx", 2), ==, 1);
+  HParseResult *r = h_parse_finish(s);
+  g_check_cmp_int64(r->bit_length, ==, 8);
+  h_parse_result_free(r);
+
+  p = h_sequence(h_many(h_ch('a')), h_end_p(), NULL);
+  g_check_parse_chunks_match(p, be, "aa",2, "aa",2, "((u0x61 u0x61 u0x61 u0x61))");
+  g_check_parse_chunks_failed(p, be, "aa",2, "ab",2);
+}
+
 static void test_result_length(gconstpointer backend) {
   HParserBackend be = (HParserBackend)GPOINTER_TO_INT(backend);
   HParser *p = h_token((uint8_t*)"foo", 3);
@@ -583,6 +664,451 @@ static void test_token_position(gconstpointer backend) {
   g_check_cmp_uint64(bar->bit_offset, ==, 0);
 }
 
+static void test_parse_context(gconstpointer backend) {
+  HParserBackend be = (HParserBackend)GPOINTER_TO_INT(backend);
+  HParser *p = h_sequence(h_token((uint8_t*)"foo",3),
+                          h_many(h_ch('x')), NULL);
+
+  if(h_compile(p, be, NULL) != 0) {
+    g_test_message("Compile failed");
+    g_test_fail();
+    return;
+  }
+
+  HParseContext *ctx = h_parse_context_new(p);
+  for(int i=0; i<100; i++) {
+    HParseResult *r = h_parse_with_context(ctx, (uint8_t*)"fooxxx", 3 + i%4);
+    if(!r) {
+      g_test_message("Parse failed on iteration %d", i);
+      g_test_fail();
+      break;
+    }
+    g_check_cmp_int64(r->bit_length, ==, (3 + i%4) * 8);
+    g_check_cmp_int64(H_INDEX_TOKEN(r->ast, 1)->seq->used, ==, i%4);
+    g_check_cmp_int(h_parse_with_context(ctx, (uint8_t*)"fox", 3) == NULL, ==, 1);
+  }
+  h_parse_context_reset(ctx);
+  h_parse_context_free(ctx);
+}
+
+static void test_parse_batch(gconstpointer backend) {
+  HParserBackend be = (HParserBackend)GPOINTER_TO_INT(backend);
+  HParser *p = h_sequence(h_token((uint8_t*)"foo",3),
+                          h_many(h_ch('x')), NULL);
+
+  if(h_compile(p, be, NULL) != 0) {
+    g_test_message("Compile failed");
+    g_test_fail();
+    return;
+  }
+
+  // every third input fails
+  const char *strs[] = {"foo", "fox", "fooxx", "foox", "fx", "fooxxx"};
+  const uint8_t *inputs[300];
+  size_t lengths[300];
+  HParseResult *results[300];
+  for(int i=0; i<300; i++) {
+    inputs[i] = (uint8_t*)strs[i%6];
+    lengths[i] = strlen(strs[i%6]);
+  }
+
+  HBenchmarkResults *stats = NULL;
+  HParseBatchParams params = { 4, &stats };
+  g_check_cmp_int64(h_parse_batch(p, inputs, lengths, 300, results, &params), ==, 200);
+  for(int i=0; i<300; i++) {
+    if(i%3 == 1) {
+      g_check_cmp_int(results[i] == NULL, ==, 1);
+      continue;
+    }
+    g_check_cmp_int(results[i] != NULL, ==, 1);
+    g_check_cmp_int64(results[i]->bit_length, ==, lengths[i] * 8);
+    g_check_cmp_int64(H_INDEX_TOKEN(results[i]->ast, 1)->seq->used, ==, lengths[i] - 3);
+    h_parse_result_free(results[i]);
+  }
+
+  g_check_cmp_int(stats->len, ==, 1);
+  g_check_cmp_int(stats->results[0].backend, ==, be);
+  g_check_cmp_int(stats->results[0].n_testcases, ==, 4);
+}
+
+static HParsedToken *act_count_digit(const HParseResult *p, void *user_data) {
+  (*(int *)user_data)++;
+  return H_MAKE_UINT(p->ast->uint - '0');
+}
+
+static bool validate_small(HParseResult *p, void *user_data) {
+  return p->ast->uint < 5;
+}
+
+// parse with p, and with the same parser in a shape that isn't scanned,
+// and compare
+static void check_charset_run(HParser *p, HParser *slow, const uint8_t *input, size_t len) {
+  HParseResult *r1 = h_parse(p, input, len);
+  HParseResult *r2 = h_parse(slow, input, len);
+  g_check_cmp_int(!r1, ==, !r2);
+  if (!r1 || !r2)
+    return;
+  char *s1 = h_write_result_unamb(r1->ast);
+  char *s2 = h_write_result_unamb(r2->ast);
+  g_check_string(s1, ==, s2);
+  g_check_cmp_int64(r1->bit_length, ==, r2->bit_length);
+  free(s1);
+  free(s2);
+  h_parse_result_free(r1);
+  h_parse_result_free(r2);
+}
+
+static void test_charset_runs(void) {
+  // one range; five scattered bytes; a set with too many distinct rows
+  // for the nibble tables
+  HParser *sets[3];
+  sets[0] = h_ch_range('a', 'z');
+  sets[1] = h_in((uint8_t *)"\x00\x11\x37\x80\xff", 5);
+  uint8_t scattered[256];
+  size_t n = 0;
+  for (int c = 0; c < 256; c++)
+    if (c * 37 % 11 < 5)
+      scattered[n++] = c;
+  sets[2] = h_not_in(scattered, n);
+
+  uint8_t buf[200];
+  uint32_t x = 1;
+  for (int s = 0; s < 3; s++) {
+    HParser *cs = sets[s];
+    HParser *slow_cs = h_choice(cs, NULL);
+    HParser *ps[] = { h_many(cs), h_many1(cs), h_repeat_n(cs, 37),
+                      h_sequence(h_bits(4, false), h_many(cs), NULL) };
+    HParser *slow[] = { h_many(slow_cs), h_many1(slow_cs), h_repeat_n(slow_cs, 37),
+                        h_sequence(h_bits(4, false), h_many(slow_cs), NULL) };
+    for (int trial = 0; trial < 50; trial++) {
+      // mostly in the set, so that runs get long
+      size_t len = trial * 4 % 150;
+      for (size_t i = 0; i < sizeof(buf); i++) {
+        uint8_t c;
+        do {
+          x = x * 1103515245 + 12345;
+          c = x >> 16;
+        } while ((x >> 8) % 97 != 0 && !charset_isset(h_parser_charset(cs), c));
+        buf[i] = c;
+      }
+      for (int i = 0; i < 4; i++)
+        check_charset_run(ps[i], slow[i], buf + trial % 7, len);
+    }
+  }
+
+  // a run that reaches the end of a chunk carries on into the next
+  HParser *p = h_sequence(h_many(sets[0]), h_ch(';'), NULL);
+  g_check_parse_chunks_match(p, PB_PACKRAT, "abc",3, "de;",3,
+                             "((u0x61 u0x62 u0x63 u0x64 u0x65) u0x3b)");
+  g_check_parse_chunks_failed(p, PB_PACKRAT, "abc",3, "d",1);
+}
+
+static void test_packrat_defer_actions(void) {
+  // each digit is parsed, and its action run, up to three times eagerly
+  int calls = 0;
+  HParser *digit = h_action(h_ch_range('0', '9'), act_count_digit, &calls);
+  HParser *small = h_attr_bool(digit, validate_small, NULL);
+  HParser *item = h_choice(h_sequence(digit, h_ch('x'), NULL),
+                           h_sequence(small, h_ch('y'), NULL),
+                           h_sequence(digit, h_ch('z'), NULL), NULL);
+  HParser *p = h_many(item);
+  const uint8_t *input = (uint8_t *)"1x2y7z3z";
+
+  HPackratParams eager = { H_PACKRAT_MEMO_NONE, 0, false, NULL };
+  g_check_cmp_int(h_compile(p, PB_PACKRAT, &eager), ==, 0);
+  HParseResult *res = h_parse(p, input, 8);
+  char *expected = h_write_result_unamb(res->ast);
+  h_parse_result_free(res);
+  g_check_cmp_int(calls, ==, 9);
+
+  HPackratStats stats = { 0, 0 };
+  HPackratParams deferred = { H_PACKRAT_MEMO_NONE, 0, true, &stats };
+  g_check_cmp_int(h_compile(p, PB_PACKRAT, &deferred), ==, 0);
+  calls = 0;
+  res = h_parse(p, input, 8);
+  char *actual = h_write_result_unamb(res->ast);
+  g_check_string(actual, ==, expected);
+  free(actual);
+  h_parse_result_free(res);
+  // h_attr_bool still needs its digit, on "2y", "7z" and "3z"
+  g_check_cmp_int(calls, ==, 6);
+  g_check_cmp_uint64(stats.actions_deferred, ==, 9);
+  g_check_cmp_uint64(stats.actions_run, ==, calls);
+
+  h_compile(p, PB_PACKRAT, NULL);
+  free(expected);
+}
+
+static HParsedToken *act_pair(const HParseResult *p, void *user_data) {
+  HParsedToken *seq = H_MAKE_SEQN(2);
+  h_seq_snoc(seq, p->ast);
+  h_seq_snoc(seq, p->ast);
+  return seq;
+}
+
+static bool validate_never(HParseResult *p, void *user_data) {
+  return false;
+}
+
+static void test_packrat_defer_actions_memo(void) {
+  // h_attr_bool runs the memoized action in the second alternative,
+  // which then fails; the third finds the token resolved
+  HParser *x = h_action(h_ch('a'), act_pair, NULL);
+  HParser *p = h_choice(h_sequence(x, h_ch('b'), NULL),
+                        h_sequence(h_attr_bool(x, validate_never, NULL), h_ch('c'), NULL),
+                        h_sequence(x, h_many(h_uint64()), NULL), NULL);
+  HPackratParams deferred = { H_PACKRAT_MEMO_ALL, 0, true, NULL };
+  g_check_cmp_int(h_compile(p, PB_PACKRAT, &deferred), ==, 0);
+  HParseResult *res = h_parse(p, (uint8_t *)"aXXXXXXXXYYYYYYYY", 17);
+  char *actual = h_write_result_unamb(res->ast);
+  g_check_string(actual, ==, "((u0x61 u0x61) (u0x5858585858585858 u0x5959595959595959))");
+  free(actual);
+  h_parse_result_free(res);
+  h_compile(p, PB_PACKRAT, NULL);
+}
+
+static void test_packrat_iterative_memo(void) {
+  // fed a byte at a time, each digit is parsed once; the tries after it
+  // find it in the memo table
+  int calls = 0;
+  HParser *p = h_sequence(h_many(h_action(h_ch_range('0', '9'), act_count_digit, &calls)),
+                          h_ch(';'), NULL);
+  const uint8_t *input = (uint8_t *)"31415926535897932384;";
+  size_t len = 21;
+
+  HSuspendedParser *s = h_parse_start(p);
+  for (size_t i = 0; i < len; i++)
+    g_check_cmp_int(h_parse_chunk(s, input + i, 1), ==, i + 1 == len);
+  HParseResult *res = h_parse_finish(s);
+  g_check_cmp_int(calls, ==, 20);
+  g_check_cmp_int64(res->bit_length, ==, len * 8);
+  char *actual = h_write_result_unamb(res->ast);
+  h_parse_result_free(res);
+  g_check_string(actual, ==, "((u0x3 u0x1 u0x4 u0x1 u0x5 u0x9 u0x2 u0x6 u0x5 u0x3 u0x5 u0x8 u0x9 u0x7 u0x9 u0x3 u0x2 u0x3 u0x8 u0x4) u0x3b)");
+  free(actual);
+}
+
+static void test_packrat_memo_leftrec(void) {
+  // the recursion goes through h_many1 and h_choice, which get to be its
+  // head at the position after the first character
+  HParser *r = h_indirect();
+  h_bind_indirect(r, h_many1(h_choice(r, h_in((const uint8_t*)"ac", 2), NULL)));
+  HParser *e = h_indirect();
+  HParser *t = h_choice(h_sequence(h_ch('('), e, h_ch(')'), NULL), h_ch_range('0', '9'), NULL);
+  h_bind_indirect(e, h_choice(h_sequence(e, h_ch('+'), t, NULL), t, NULL));
+  HParser *es = h_many1(h_choice(h_sequence(e, h_ch(';'), NULL), e, NULL));
+  struct { HParser *p; const char *input; } cases[] = {
+    { r, "ca" }, { r, "caac" }, { es, "1+(2+3)+4;(5)+6" },
+  };
+  HPackratParams params[] = {
+    { H_PACKRAT_MEMO_RECURSIVE, 0, false, NULL },
+    { H_PACKRAT_MEMO_RECURSIVE, 1, false, NULL },
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    const uint8_t *input = (const uint8_t*)cases[i].input;
+    size_t len = strlen(cases[i].input);
+    h_compile(cases[i].p, PB_PACKRAT, NULL);
+    HParseResult *res = h_parse(cases[i].p, input, len);
+    g_check_cmp_int64(res->bit_length, ==, len * 8);
+    char *expected = h_write_result_unamb(res->ast);
+    h_parse_result_free(res);
+    for (size_t j = 0; j < sizeof(params) / sizeof(params[0]); j++) {
+      h_compile(cases[i].p, PB_PACKRAT, &params[j]);
+      res = h_parse(cases[i].p, input, len);
+      g_check_cmp_int64(res->bit_length, ==, len * 8);
+      char *actual = h_write_result_unamb(res->ast);
+      g_check_string(actual, ==, expected);
+      free(actual);
+      h_parse_result_free(res);
+    }
+    free(expected);
+    h_compile(cases[i].p, PB_PACKRAT, NULL);
+  }
+}
+
+static void test_compile_failed(void) {
+  // the LALR table of a conflicted grammar must not outlive the failed compile
+  HParser *a = h_ch('a');
+  HParser *p = h_choice(h_sequence(a, a, NULL), h_sequence(a, a, NULL), NULL);
+  g_check_cmp_int(h_compile(p, PB_LALR, NULL), ==, -1);
+  g_check_parse_match(p, PB_PACKRAT, "aa", 2, "(u0x61 u0x61)");
+  g_check_cmp_int(h_compile(p, PB_LALR, NULL), ==, -1);
+  HPackratParams params = { H_PACKRAT_MEMO_RECURSIVE, 0, false, NULL };
+  g_check_cmp_int(h_compile(p, PB_PACKRAT, &params), ==, 0);
+  HParseResult *res = h_parse(p, (const uint8_t*)"aa", 2);
+  g_check_cmp_int64(res->bit_length, ==, 16);
+  h_parse_result_free(res);
+  h_compile(p, PB_PACKRAT, NULL);
+}
+
+static void test_packrat_params(void) {
+  // sums of digits, left-recursive, one per line; the alternatives in
+  // line make the parser backtrack over each one
+  HParser *d = h_ch_range('0', '9');
+  HParser *sum = h_indirect();
+  h_bind_indirect(sum, h_choice(h_sequence(sum, h_ch('+'), d, NULL), d, NULL));
+  HParser *line = h_choice(h_sequence(sum, h_ch('='), d, h_ch('\n'), NULL),
+                           h_sequence(sum, h_ch('\n'), NULL), NULL);
+  HParser *lines = h_many(line);
+
+  size_t len = 20000 * 6;
+  uint8_t *input = malloc(len);
+  for (size_t i = 0; i < len; i += 6)
+    memcpy(input + i, i % 12 ? "1+2+3\n" : "1+2=3\n", 6);
+
+  HParseResult *res = h_parse(lines, input, len);
+  g_check_cmp_int64(res->bit_length, ==, len * 8);
+  HArenaStats stats;
+  h_allocator_stats(res->arena, &stats);
+  size_t used = stats.used;
+  char *expected = h_write_result_unamb(res->ast);
+  h_parse_result_free(res);
+
+  HPackratParams params[] = {
+    { H_PACKRAT_MEMO_ALL, 0, false, NULL },
+    { H_PACKRAT_MEMO_ALL, 1024, false, NULL },
+    { H_PACKRAT_MEMO_RECURSIVE, 0, false, NULL },
+    { H_PACKRAT_MEMO_RECURSIVE, 1, false, NULL },
+  };
+  for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+    h_compile(lines, PB_PACKRAT, &params[i]);
+    res = h_parse(lines, input, len);
+    g_check_cmp_int64(res->bit_length, ==, len * 8);
+    char *actual = h_write_result_unamb(res->ast);
+    g_check_string(actual, ==, expected);
+    free(actual);
+    if (params[i].memo_window || params[i].memo != H_PACKRAT_MEMO_ALL) {
+      h_allocator_stats(res->arena, &stats);
+      g_check_cmp_uint64(stats.used, <, used);
+    }
+    h_parse_result_free(res);
+  }
+  h_compile(lines, PB_PACKRAT, NULL);
+
+  // without memoization, left recursion can't be detected
+  HPackratParams none = { H_PACKRAT_MEMO_NONE, 0, false, NULL };
+  HParser *flat = h_many(h_choice(h_sequence(h_sepBy1(d, h_ch('+')), h_ch('='), d, h_ch('\n'), NULL),
+                                  h_sequence(h_sepBy1(d, h_ch('+')), h_ch('\n'), NULL), NULL));
+  res = h_parse(flat, input, len);
+  g_check_cmp_int64(res->bit_length, ==, len * 8);
+  free(expected);
+  expected = h_write_result_unamb(res->ast);
+  h_parse_result_free(res);
+  h_compile(flat, PB_PACKRAT, &none);
+  res = h_parse(flat, input, len);
+  g_check_cmp_int64(res->bit_length, ==, len * 8);
+  char *actual = h_write_result_unamb(res->ast);
+  g_check_string(actual, ==, expected);
+  free(actual);
+  h_parse_result_free(res);
+
+  // what a failed alternative allocated is given back when it isn't memoized
+  HParser *digits = h_many(d);
+  HParser *retry = h_choice(h_sequence(digits, h_ch('x'), NULL), digits, NULL);
+  h_compile(digits, PB_PACKRAT, &none);
+  h_compile(retry, PB_PACKRAT, &none);
+  memset(input, '7', len);
+  res = h_parse(digits, input, len);
+  h_allocator_stats(res->arena, &stats);
+  used = stats.used;
+  h_parse_result_free(res);
+  res = h_parse(retry, input, len);
+  g_check_cmp_int64(res->bit_length, ==, len * 8);
+  h_allocator_stats(res->arena, &stats);
+  g_check_cmp_uint64(stats.used, <, used + used / 8);
+  h_parse_result_free(res);
+
+  free(expected);
+  free(input);
+}
+
+static void test_regex_params(void) {
+  // key=value pairs separated by ';'
+  HParser *word = h_many1(h_ch_range('a', 'z'));
+  HParser *pair = h_sequence(word, h_ch('='), word, NULL);
+  HParser *pairs = h_sequence(h_sepBy1(pair, h_ch(';')), h_end_p(), NULL);
+
+  size_t len = 1000 * 8;
+  uint8_t *input = malloc(len);
+  for (size_t i = 0; i < len; i += 8)
+    memcpy(input + i, "key=val;", 8);
+  len--;
+
+  g_check_cmp_int(h_compile(pairs, PB_REGULAR, NULL), ==, 0);
+  HParseResult *res = h_parse(pairs, input, len);
+  g_check_cmp_int64(res->bit_length, ==, len * 8);
+  char *expected = h_write_result_unamb(res->ast);
+  h_parse_result_free(res);
+  g_check_cmp_int(h_parse(pairs, (uint8_t*)"key=val;", 8) == NULL, ==, 1);
+
+  // too few DFA states to get through the input: the NFA takes over
+  HRegexParams small = { false, 1 };
+  g_check_cmp_int(h_compile(pairs, PB_REGULAR, &small), ==, 0);
+  res = h_parse(pairs, input, len);
+  g_check_cmp_int64(res->bit_length, ==, len * 8);
+  char *actual = h_write_result_unamb(res->ast);
+  g_check_string(actual, ==, expected);
+  free(actual);
+  h_parse_result_free(res);
+
+  HRegexParams recognize = { true, 0 };
+  g_check_cmp_int(h_compile(pairs, PB_REGULAR, &recognize), ==, 0);
+  res = h_parse(pairs, input, len);
+  g_check_cmp_int64(res->bit_length, ==, len * 8);
+  g_check_cmp_int(res->ast == NULL, ==, 1);
+  h_parse_result_free(res);
+  g_check_cmp_int(h_parse(pairs, (uint8_t*)"key=val;", 8) == NULL, ==, 1);
+  g_check_cmp_int(h_parse(pairs, (uint8_t*)"key=", 4) == NULL, ==, 1);
+
+  // the match ends at the last accept, as it does without the DFA
+  HParser *prefix = h_many(h_ch('a'));
+  g_check_cmp_int(h_compile(prefix, PB_REGULAR, &recognize), ==, 0);
+  res = h_parse(prefix, (uint8_t*)"aaab", 4);
+  g_check_cmp_int64(res->bit_length, ==, 3 * 8);
+  h_parse_result_free(res);
+
+  free(expected);
+  free(input);
+}
+
+static void test_regex_iterative(void) {
+  // lines of words, fed a few bytes at a time
+  HParser *line = h_sequence(h_sepBy1(h_many1(h_ch_range('a', 'z')), h_ch(' ')),
+                             h_ch('\n'), NULL);
+  HParser *p = h_sequence(h_many1(line), h_end_p(), NULL);
+
+  size_t len = 500 * 16;
+  uint8_t *input = malloc(len);
+  for (size_t i = 0; i < len; i += 16)
+    memcpy(input + i, "the quick brown\n", 16);
+
+  HRegexParams params[] = {
+    { false, 0 },
+    { true, 0 },
+    { true, 2 },     // the DFA hands over to the NFA early on
+  };
+  for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+    g_check_cmp_int(h_compile(p, PB_REGULAR, &params[i]), ==, 0);
+    HSuspendedParser *s = h_parse_start(p);
+    for (size_t off = 0; off < len; off += 7)
+      g_check_cmp_int(h_parse_chunk(s, input + off, off + 7 < len ? 7 : len - off), ==, 0);
+    HParseResult *r = h_parse_finish(s);
+    g_check_cmp_int64(r->bit_length, ==, len * 8);
+    if (params[i].recognize)
+      g_check_cmp_int(r->ast == NULL, ==, 1);
+    else
+      g_check_cmp_int64(H_INDEX_TOKEN(r->ast, 0)->seq->used, ==, 500);
+    h_parse_result_free(r);
+
+    s = h_parse_start(p);
+    h_parse_chunk(s, input, 100);
+    h_parse_chunk(s, (uint8_t*)"X", 1);
+    g_check_cmp_int(h_parse_finish(s) == NULL, ==, 1);
+  }
+
+  free(input);
+}
+
 static void test_ambiguous(gconstpointer backend) {
   HParser *d_ = h_ch('d');
   HParser *p_ = h_ch('+');
@@ -593,7 +1119,14 @@ static void test_ambiguous(gconstpointer backend) {
   g_check_parse_match(expr_, (HParserBackend)GPOINTER_TO_INT(backend), "d", 1, "(u0x64)");
   g_check_parse_match(expr_, (HParserBackend)GPOINTER_TO_INT(backend), "d+d", 3, "(u0x64 u0x2b u0x64)");
   g_check_parse_match(expr_, (HParserBackend)GPOINTER_TO_INT(backend), "d+d+d", 5, "(u0x64 u0x2b u0x64 u0x2b u0x64)");
+  g_check_parse_match(expr_, (HParserBackend)GPOINTER_TO_INT(backend), "d+d+d+d+d+d", 11, "(u0x64 u0x2b u0x64 u0x2b u0x64 u0x2b u0x64 u0x2b u0x64 u0x2b u0x64)");
   g_check_parse_failed(expr_, (HParserBackend)GPOINTER_TO_INT(backend), "d+", 2);
+
+  // nullable prefixes: either optional may take the 'a'
+  HParser *a_ = h_optional(h_ch('a'));
+  HParser *ab_ = h_sequence(h_many(h_sequence(a_, a_, h_ch('b'), NULL)), h_end_p(), NULL);
+  g_check_parse_ok(ab_, (HParserBackend)GPOINTER_TO_INT(backend), "abab", 4);
+  g_check_parse_ok(ab_, (HParserBackend)GPOINTER_TO_INT(backend), "babaab", 6);
 }
 
 static void test_endianness(gconstpointer backend) {
@@ -708,6 +1241,175 @@ static void test_permutation(gconstpointer backend) {
   g_check_parse_failed(po2, be, "ccc", 3);
 }
 
+static void test_permutation_large(gconstpointer backend) {
+  HParserBackend be = (HParserBackend)GPOINTER_TO_INT(backend);
+  void *args[17];
+
+  // tag-length-value options, some of them optional
+  for (int i = 0; i < 16; i++) {
+    HParser *opt = h_sequence(h_ch('A' + i), h_length_value(h_uint8(), h_uint8()), NULL);
+    args[i] = i % 4 == 3 ? h_optional(opt) : opt;
+  }
+  args[16] = NULL;
+  HParser *p = h_permutation__a(args);
+  g_check_cmp_int(h_compile(p, be, NULL), ==, 0);
+  uint8_t input[64];
+  size_t len = 0;
+  for (int k = 0; k < 16; k++) {
+    int i = k * 7 % 16;         // a shuffle
+    if (i == 7)
+      continue;                 // leave one optional out
+    input[len++] = 'A' + i;
+    input[len++] = 1;
+    input[len++] = i;
+  }
+  HParseResult *r = h_parse(p, input, len);
+  g_check_cmp_int(r != NULL, ==, 1);
+  if (r) {
+    const HParsedToken *opts = r->ast;
+    g_check_cmp_uint64(h_seq_len(opts), ==, 16);
+    g_check_cmp_int(h_seq_index(opts, 7)->token_type, ==, TT_NONE);
+    g_check_cmp_uint64(h_seq_index_path(opts, 12, 1, 0, -1)->uint, ==, 12);
+    h_parse_result_free(r);
+  }
+  g_check_parse_failed(p, be, input, len - 1);
+
+  // exponentially many orders to try before failing, without memoizing
+  for (int i = 0; i < 14; i++)
+    args[i] = h_ch('a');
+  args[14] = h_ch('b');
+  args[15] = NULL;
+  p = h_permutation__a(args);
+  g_check_parse_failed(p, be, "aaaaaaaaaaaaaac", 15);
+  g_check_parse_ok(p, be, "aaaaaaaaabaaaaa", 15);
+}
+
+static void test_choice_dispatch(gconstpointer backend) {
+  HParserBackend be = (HParserBackend)GPOINTER_TO_INT(backend);
+  HAllocator *mm__ = &system_allocator;
+  HCharset cs = new_charset(mm__);
+
+  // first bytes come from the parsers where they know, else the grammar
+  HParser *num = h_sequence(h_optional(h_ch('-')), h_ch_range('0', '9'), NULL);
+  g_check_cmp_int(h_first_bytes(num, cs), ==, false);
+  memset(cs, 0, 32);
+  g_check_cmp_int(h_cfgrammar_first_bytes(mm__, num, cs), ==, true);
+  g_check_cmp_int(charset_isset(cs, '-') && charset_isset(cs, '5'), ==, 1);
+  g_check_cmp_int(charset_isset(cs, '+'), ==, 0);
+  g_check_cmp_int(h_cfgrammar_first_bytes(mm__, h_optional(num), cs), ==, false);
+  g_check_cmp_int(h_cfgrammar_first_bytes(mm__, h_bits(4, false), cs), ==, false);
+  h_free(cs);
+
+  // opcodes, with an earlier alternative overlapping a later one, one
+  // only the grammar knows about, and a fallback that needs no input
+  void *args[44];
+  for (int i = 0; i < 40; i++)
+    args[i] = h_sequence(h_ch(0x80 + i), h_uint8(), NULL);
+  args[40] = h_sequence(h_ch(0x85), h_ch('!'), h_uint8(), NULL);
+  args[41] = num;
+  args[42] = h_optional(h_ch('?'));
+  args[43] = NULL;
+  args[5] = h_sequence(h_ch(0x85), h_not(h_ch('!')), h_uint8(), NULL);
+  HParser *p = h_choice__a(args);
+  g_check_cmp_int(h_compile(p, be, NULL), ==, 0);
+
+  g_check_parse_match(p, be, "\x80\x01", 2, "(u0x80 u0x1)");
+  g_check_parse_match(p, be, "\xa7\x01", 2, "(u0xa7 u0x1)");
+  g_check_parse_match(p, be, "\x85\x01", 2, "(u0x85 u0x1)");
+  g_check_parse_match(p, be, "\x85!\x01", 3, "(u0x85 u0x21 u0x1)");
+  g_check_parse_match(p, be, "-7", 2, "(u0x2d u0x37)");
+  g_check_parse_match(p, be, "?", 1, "u0x3f");
+  g_check_parse_match(p, be, "\xff", 1, "null");
+  g_check_parse_match(p, be, "", 0, "null");
+
+  // off a byte boundary, every alternative is tried
+  HParser *q = h_sequence(h_bits(4, false), h_choice(h_bits(4, false), h_ch('x'), NULL), NULL);
+  g_check_parse_match(q, be, "\x12", 1, "(u0x1 u0x2)");
+}
+
+// the C h_emit_c writes, read back
+static char *emit_c(const HParser *p) {
+  FILE *f = tmpfile();
+  if (h_emit_c(f, p, "hg_test") != 0) {
+    fclose(f);
+    return NULL;
+  }
+  size_t n = ftell(f);
+  char *src = malloc(n + 1);
+  rewind(f);
+  src[fread(src, 1, n, f)] = 0;
+  fclose(f);
+  return src;
+}
+
+static void test_generated(void) {
+  // a choice over distinct first bytes is a switch; many of a charset a loop
+  HParser *p = h_choice(h_token((const uint8_t*)"ab", 2), h_ch('c'),
+                        h_many1(h_ch_range('0', '9')), NULL);
+  char *src = emit_c(p);
+  g_check_cmp_int(src != NULL, ==, 1);
+  g_check_cmp_int(strstr(src, "switch (s->in[pos])") != NULL, ==, 1);
+  g_check_cmp_int(strstr(src, "const struct HGeneratedParser_ hg_test") != NULL, ==, 1);
+  free(src);
+  g_check_parse_match(p, PB_GENERATED, "0123x", 5, "(u0x30 u0x31 u0x32 u0x33)");
+  g_check_parse_match(p, PB_GENERATED, "ab", 2, "<61.62>");
+  g_check_parse_failed(p, PB_GENERATED, "x", 1);
+
+  // no C for some combinators, and so no backend
+  HParser *perm = h_permutation(h_ch('a'), h_ch('b'), NULL);
+  g_check_cmp_int(emit_c(perm) == NULL, ==, 1);
+  g_check_cmp_int(h_compile(perm, PB_GENERATED, NULL), ==, -1);
+  g_check_cmp_int(emit_c(h_with_endianness(BIT_LITTLE_ENDIAN, h_uint16())) == NULL, ==, 1);
+  g_check_cmp_int(emit_c(h_bits(4, false)) == NULL, ==, 1);
+
+  // code compiled for some other grammar is turned down
+  HGeneratedParser other = { 1, 0, 0, NULL };
+  g_check_cmp_int(h_compile(p, PB_GENERATED, &other), ==, -1);
+
+  // left recursion goes to packrat
+  HParser *lr = h_indirect();
+  h_bind_indirect(lr, h_choice(h_sequence(lr, h_ch('a'), NULL), h_ch('a'), NULL));
+  g_check_parse_match(lr, PB_GENERATED, "aaa", 3, "((u0x61 u0x61) u0x61)");
+}
+
+static void test_generated_rebind(void) {
+  // compiling again with the defaults keeps the code there, unless the
+  // grammar has changed since
+  HParser *r = h_indirect();
+  h_bind_indirect(r, h_ch('a'));
+  HParser *p = h_sequence(r, h_end_p(), NULL);
+  g_check_cmp_int(h_compile(p, PB_GENERATED, NULL), ==, 0);
+  void *data = p->backend_data;
+  g_check_cmp_int(h_compile(p, PB_GENERATED, NULL), ==, 0);
+  g_check_cmp_int(p->backend_data == data, ==, 1);
+
+  h_bind_indirect(r, h_ch('b'));
+  g_check_cmp_int(h_compile(p, PB_GENERATED, NULL), ==, 0);
+  HParseResult *res = h_parse(p, (const uint8_t *)"b", 1);
+  g_check_cmp_int(res != NULL, ==, 1);
+  h_parse_result_free(res);
+  g_check_cmp_int(h_parse(p, (const uint8_t *)"a", 1) == NULL, ==, 1);
+}
+
+static void test_generated_cc(void) {
+  // $HAMMER_CC names the compiler; it doesn't go through a shell
+  char mark[64], cc[128];
+  snprintf(mark, sizeof(mark), "/tmp/hammer-cc-test-%d", (int)getpid());
+  snprintf(cc, sizeof(cc), "touch %s; cc", mark);
+  const char *old = getenv("HAMMER_CC");
+  char *saved = old ? strdup(old) : NULL;
+  setenv("HAMMER_CC", cc, 1);
+  HParser *p = h_sequence(h_ch('x'), h_ch('y'), NULL);
+  g_check_cmp_int(h_compile(p, PB_GENERATED, NULL), ==, -1);
+  g_check_cmp_int(access(mark, F_OK), ==, -1);
+  unlink(mark);
+  if (saved)
+    setenv("HAMMER_CC", saved, 1);
+  else
+    unsetenv("HAMMER_CC");
+  free(saved);
+}
+
 static HParser *k_test_bind(HAllocator *mm__, const HParsedToken *p, void *env) {
   uint8_t one = (uintptr_t)env;
   
@@ -792,9 +1494,69 @@ void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/packrat/endianness", GINT_TO_POINTER(PB_PACKRAT), test_endianness);
   g_test_add_data_func("/core/parser/packrat/putget", GINT_TO_POINTER(PB_PACKRAT), test_put_get);
   g_test_add_data_func("/core/parser/packrat/permutation", GINT_TO_POINTER(PB_PACKRAT), test_permutation);
+  g_test_add_data_func("/core/parser/packrat/permutation_large", GINT_TO_POINTER(PB_PACKRAT), test_permutation_large);
+  g_test_add_data_func("/core/parser/packrat/choice_dispatch", GINT_TO_POINTER(PB_PACKRAT), test_choice_dispatch);
   g_test_add_data_func("/core/parser/packrat/bind", GINT_TO_POINTER(PB_PACKRAT), test_bind);
   g_test_add_data_func("/core/parser/packrat/result_length", GINT_TO_POINTER(PB_PACKRAT), test_result_length);
   //g_test_add_data_func("/core/parser/packrat/token_position", GINT_TO_POINTER(PB_PACKRAT), test_token_position);
+  g_test_add_data_func("/core/parser/packrat/parse_context", GINT_TO_POINTER(PB_PACKRAT), test_parse_context);
+  g_test_add_data_func("/core/parser/packrat/batch", GINT_TO_POINTER(PB_PACKRAT), test_parse_batch);
+  g_test_add_func("/core/parser/packrat/params", test_packrat_params);
+  g_test_add_func("/core/parser/packrat/memo_leftrec", test_packrat_memo_leftrec);
+  g_test_add_func("/core/parser/packrat/compile_failed", test_compile_failed);
+  g_test_add_func("/core/parser/packrat/defer_actions", test_packrat_defer_actions);
+  g_test_add_func("/core/parser/packrat/defer_actions/memo", test_packrat_defer_actions_memo);
+  g_test_add_func("/core/parser/packrat/iterative/memo", test_packrat_iterative_memo);
+  g_test_add_func("/core/parser/packrat/charset_runs", test_charset_runs);
+  g_test_add_data_func("/core/parser/packrat/iterative", GINT_TO_POINTER(PB_PACKRAT), test_iterative);
+  g_test_add_data_func("/core/parser/packrat/iterative/result_length", GINT_TO_POINTER(PB_PACKRAT), test_iterative_result_length);
+  g_test_add_data_func("/core/parser/packrat/iterative/end", GINT_TO_POINTER(PB_PACKRAT), test_iterative_end);
+  g_test_add_data_func("/core/parser/generated/token", GINT_TO_POINTER(PB_GENERATED), test_token);
+  g_test_add_data_func("/core/parser/generated/ch", GINT_TO_POINTER(PB_GENERATED), test_ch);
+  g_test_add_data_func("/core/parser/generated/ch_range", GINT_TO_POINTER(PB_GENERATED), test_ch_range);
+  g_test_add_data_func("/core/parser/generated/int64", GINT_TO_POINTER(PB_GENERATED), test_int64);
+  g_test_add_data_func("/core/parser/generated/int32", GINT_TO_POINTER(PB_GENERATED), test_int32);
+  g_test_add_data_func("/core/parser/generated/int16", GINT_TO_POINTER(PB_GENERATED), test_int16);
+  g_test_add_data_func("/core/parser/generated/int8", GINT_TO_POINTER(PB_GENERATED), test_int8);
+  g_test_add_data_func("/core/parser/generated/uint64", GINT_TO_POINTER(PB_GENERATED), test_uint64);
+  g_test_add_data_func("/core/parser/generated/uint32", GINT_TO_POINTER(PB_GENERATED), test_uint32);
+  g_test_add_data_func("/core/parser/generated/uint16", GINT_TO_POINTER(PB_GENERATED), test_uint16);
+  g_test_add_data_func("/core/parser/generated/uint8", GINT_TO_POINTER(PB_GENERATED), test_uint8);
+  g_test_add_data_func("/core/parser/generated/int_range", GINT_TO_POINTER(PB_GENERATED), test_int_range);
+  g_test_add_data_func("/core/parser/generated/whitespace", GINT_TO_POINTER(PB_GENERATED), test_whitespace);
+  g_test_add_data_func("/core/parser/generated/left", GINT_TO_POINTER(PB_GENERATED), test_left);
+  g_test_add_data_func("/core/parser/generated/right", GINT_TO_POINTER(PB_GENERATED), test_right);
+  g_test_add_data_func("/core/parser/generated/middle", GINT_TO_POINTER(PB_GENERATED), test_middle);
+  g_test_add_data_func("/core/parser/generated/action", GINT_TO_POINTER(PB_GENERATED), test_action);
+  g_test_add_data_func("/core/parser/generated/in", GINT_TO_POINTER(PB_GENERATED), test_in);
+  g_test_add_data_func("/core/parser/generated/not_in", GINT_TO_POINTER(PB_GENERATED), test_not_in);
+  g_test_add_data_func("/core/parser/generated/end_p", GINT_TO_POINTER(PB_GENERATED), test_end_p);
+  g_test_add_data_func("/core/parser/generated/nothing_p", GINT_TO_POINTER(PB_GENERATED), test_nothing_p);
+  g_test_add_data_func("/core/parser/generated/sequence", GINT_TO_POINTER(PB_GENERATED), test_sequence);
+  g_test_add_data_func("/core/parser/generated/choice", GINT_TO_POINTER(PB_GENERATED), test_choice);
+  g_test_add_data_func("/core/parser/generated/butnot", GINT_TO_POINTER(PB_GENERATED), test_butnot);
+  g_test_add_data_func("/core/parser/generated/difference", GINT_TO_POINTER(PB_GENERATED), test_difference);
+  g_test_add_data_func("/core/parser/generated/xor", GINT_TO_POINTER(PB_GENERATED), test_xor);
+  g_test_add_data_func("/core/parser/generated/many", GINT_TO_POINTER(PB_GENERATED), test_many);
+  g_test_add_data_func("/core/parser/generated/many1", GINT_TO_POINTER(PB_GENERATED), test_many1);
+  g_test_add_data_func("/core/parser/generated/repeat_n", GINT_TO_POINTER(PB_GENERATED), test_repeat_n);
+  g_test_add_data_func("/core/parser/generated/optional", GINT_TO_POINTER(PB_GENERATED), test_optional);
+  g_test_add_data_func("/core/parser/generated/sepBy", GINT_TO_POINTER(PB_GENERATED), test_sepBy);
+  g_test_add_data_func("/core/parser/generated/sepBy1", GINT_TO_POINTER(PB_GENERATED), test_sepBy1);
+  g_test_add_data_func("/core/parser/generated/epsilon_p", GINT_TO_POINTER(PB_GENERATED), test_epsilon_p);
+  g_test_add_data_func("/core/parser/generated/attr_bool", GINT_TO_POINTER(PB_GENERATED), test_attr_bool);
+  g_test_add_data_func("/core/parser/generated/and", GINT_TO_POINTER(PB_GENERATED), test_and);
+  g_test_add_data_func("/core/parser/generated/not", GINT_TO_POINTER(PB_GENERATED), test_not);
+  g_test_add_data_func("/core/parser/generated/ignore", GINT_TO_POINTER(PB_GENERATED), test_ignore);
+  //g_test_add_data_func("/core/parser/generated/leftrec", GINT_TO_POINTER(PB_GENERATED), test_leftrec);
+  g_test_add_data_func("/core/parser/generated/leftrec-ne", GINT_TO_POINTER(PB_GENERATED), test_leftrec_ne);
+  g_test_add_data_func("/core/parser/generated/rightrec", GINT_TO_POINTER(PB_GENERATED), test_rightrec);
+  g_test_add_data_func("/core/parser/generated/result_length", GINT_TO_POINTER(PB_GENERATED), test_result_length);
+  g_test_add_data_func("/core/parser/generated/parse_context", GINT_TO_POINTER(PB_GENERATED), test_parse_context);
+  g_test_add_data_func("/core/parser/generated/batch", GINT_TO_POINTER(PB_GENERATED), test_parse_batch);
+  g_test_add_func("/core/parser/generated/emit_c", test_generated);
+  g_test_add_func("/core/parser/generated/rebind", test_generated_rebind);
+  g_test_add_func("/core/parser/generated/cc", test_generated_cc);
 
   g_test_add_data_func("/core/parser/llk/token", GINT_TO_POINTER(PB_LLk), test_token);
   g_test_add_data_func("/core/parser/llk/ch", GINT_TO_POINTER(PB_LLk), test_ch);
@@ -831,10 +1593,15 @@ void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/llk/epsilon_p", GINT_TO_POINTER(PB_LLk), test_epsilon_p);
   g_test_add_data_func("/core/parser/llk/attr_bool", GINT_TO_POINTER(PB_LLk), test_attr_bool);
   g_test_add_data_func("/core/parser/llk/ignore", GINT_TO_POINTER(PB_LLk), test_ignore);
-  //g_test_add_data_func("/core/parser/llk/leftrec", GINT_TO_POINTER(PB_LLk), test_leftrec);
+  g_test_add_data_func("/core/parser/llk/leftrec", GINT_TO_POINTER(PB_LLk), test_leftrec);
+  g_test_add_data_func("/core/parser/llk/leftrec-ne", GINT_TO_POINTER(PB_LLk), test_leftrec_ne);
+  g_test_add_func("/core/parser/llk/transform", test_llk_transform);
+  g_test_add_func("/core/parser/llk/leftrec_ops", test_llk_leftrec_ops);
   g_test_add_data_func("/core/parser/llk/rightrec", GINT_TO_POINTER(PB_LLk), test_rightrec);
  g_test_add_data_func("/core/parser/llk/result_length", GINT_TO_POINTER(PB_LLk), test_result_length);
   //g_test_add_data_func("/core/parser/llk/token_position", GINT_TO_POINTER(PB_LLk), test_token_position);
+  g_test_add_data_func("/core/parser/llk/parse_context", GINT_TO_POINTER(PB_LLk), test_parse_context);
+  g_test_add_data_func("/core/parser/llk/batch", GINT_TO_POINTER(PB_LLk), test_parse_batch);
   g_test_add_data_func("/core/parser/llk/iterative", GINT_TO_POINTER(PB_LLk), test_iterative);
   g_test_add_data_func("/core/parser/llk/iterative/lookahead", GINT_TO_POINTER(PB_LLk), test_iterative_lookahead);
   g_test_add_data_func("/core/parser/llk/iterative/result_length", GINT_TO_POINTER(PB_LLk), test_iterative_result_length);
@@ -877,6 +1644,13 @@ void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/regex/ignore", GINT_TO_POINTER(PB_REGULAR), test_ignore);
   g_test_add_data_func("/core/parser/regex/result_length", GINT_TO_POINTER(PB_REGULAR), test_result_length);
   g_test_add_data_func("/core/parser/regex/token_position", GINT_TO_POINTER(PB_REGULAR), test_token_position);
+  g_test_add_data_func("/core/parser/regex/parse_context", GINT_TO_POINTER(PB_REGULAR), test_parse_context);
+  g_test_add_data_func("/core/parser/regex/batch", GINT_TO_POINTER(PB_REGULAR), test_parse_batch);
+  g_test_add_func("/core/parser/regex/params", test_regex_params);
+  g_test_add_data_func("/core/parser/regex/iterative", GINT_TO_POINTER(PB_REGULAR), test_iterative);
+  g_test_add_data_func("/core/parser/regex/iterative/result_length", GINT_TO_POINTER(PB_REGULAR), test_iterative_result_length);
+  g_test_add_data_func("/core/parser/regex/iterative/end", GINT_TO_POINTER(PB_REGULAR), test_iterative_end);
+  g_test_add_func("/core/parser/regex/iterative/params", test_regex_iterative);
 
   g_test_add_data_func("/core/parser/lalr/token", GINT_TO_POINTER(PB_LALR), test_token);
   g_test_add_data_func("/core/parser/lalr/ch", GINT_TO_POINTER(PB_LALR), test_ch);
@@ -918,6 +1692,8 @@ void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/lalr/rightrec", GINT_TO_POINTER(PB_LALR), test_rightrec);
   g_test_add_data_func("/core/parser/lalr/result_length", GINT_TO_POINTER(PB_LALR), test_result_length);
   g_test_add_data_func("/core/parser/lalr/token_position", GINT_TO_POINTER(PB_LALR), test_token_position);
+  g_test_add_data_func("/core/parser/lalr/parse_context", GINT_TO_POINTER(PB_LALR), test_parse_context);
+  g_test_add_data_func("/core/parser/lalr/batch", GINT_TO_POINTER(PB_LALR), test_parse_batch);
   g_test_add_data_func("/core/parser/lalr/iterative", GINT_TO_POINTER(PB_LALR), test_iterative);
   g_test_add_data_func("/core/parser/lalr/iterative/lookahead", GINT_TO_POINTER(PB_LALR), test_iterative_lookahead);
   g_test_add_data_func("/core/parser/lalr/iterative/result_length", GINT_TO_POINTER(PB_LALR), test_iterative_result_length);
@@ -963,4 +1739,6 @@ void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/glr/ambiguous", GINT_TO_POINTER(PB_GLR), test_ambiguous);
   g_test_add_data_func("/core/parser/glr/result_length", GINT_TO_POINTER(PB_GLR), test_result_length);
   g_test_add_data_func("/core/parser/glr/token_position", GINT_TO_POINTER(PB_GLR), test_token_position);
+  g_test_add_data_func("/core/parser/glr/parse_context", GINT_TO_POINTER(PB_GLR), test_parse_context);
+  g_test_add_data_func("/core/parser/glr/batch", GINT_TO_POINTER(PB_GLR), test_parse_batch);
 }
@@ -193,6 +193,27 @@ static void test_charset_bits(void) {
     g_check_cmp_uint32(test_charset_bits__buf[32], ==, 0xAB);
 }
 
+static void test_packrat_memo_subbyte(void) {
+  // The packrat memo files entries by byte index; two tries of the same
+  // parser at different bit offsets within a byte must not share one.
+  HParser *nibble = h_sequence(h_bits(4, false), NULL);
+  HParser *p = h_choice(h_sequence(nibble, nibble, h_ch('x'), NULL),
+                        h_sequence(h_bits(2, false), nibble, NULL),
+                        NULL);
+
+  g_check_parse_match(p, PB_PACKRAT, "\xa5", 1, "(u0x2 (u0x9))");
+}
+
+static void test_regex_many_choice(void) {
+  // The RVM keeps its threads in an HSArray; iterating over one used to
+  // visit the first thread twice and skip the second, which lost the
+  // thread that accepts "a" here.
+  HParser *p = h_many(h_choice(h_ch('a'), h_token((uint8_t*)"ab", 2), NULL));
+
+  g_check_parse_match(p, PB_REGULAR, "a", 1, "(u0x61)");
+  g_check_parse_match(p, PB_REGULAR, "aab", 3, "(u0x61 <61.62>)");
+}
+
 void register_regression_tests(void) {
   g_test_add_func("/core/regression/bug118", test_bug118);
   g_test_add_func("/core/regression/seq_index_path", test_seq_index_path);
@@ -202,4 +223,6 @@ void register_regression_tests(void) {
   g_test_add_func("/core/regression/lalr_charset_lhs", test_lalr_charset_lhs);
   g_test_add_func("/core/regression/cfg_many_seq", test_cfg_many_seq);
   g_test_add_func("/core/regression/charset_bits", test_charset_bits);
+  g_test_add_func("/core/regression/packrat_memo_subbyte", test_packrat_memo_subbyte);
+  g_test_add_func("/core/regression/regex_many_choice", test_regex_many_choice);
 }